@@ -60,9 +60,12 @@ void on_enter_visual_mode(struct Application_Links *app) {
 void chronal_get_bindings(Bind_Helper *context) {
     // Set the hooks
     set_start_hook(context, chronal_init);
+    set_hook(context, hook_exit, vim_hook_exit_func);
     set_open_file_hook(context, vim_hook_open_file_func);
     set_new_file_hook(context, vim_hook_new_file_func);
+    set_file_edit_range_hook(context, vim_hook_file_edit_range_func);
     set_render_caller(context, vim_render_caller);
+    set_command_caller(context, vim_hook_command_caller);
 
     // Call to set the vim bindings
     vim_get_bindings(context);
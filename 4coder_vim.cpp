@@ -12,9 +12,14 @@
 // 
 // 1. Define and forward 4coder hooks:
 //     - In your start hook, call vim_hook_init_func(app)
+//     - In your exit hook, call vim_hook_exit_func(app)
 //     - In your open file hook, call vim_hook_open_file_func(app, buffer_id)
 //     - In your new file hook, call vim_hook_new_file_func(app, buffer_id)
+//     - In your file edit range hook, call
+//       vim_hook_file_edit_range_func(app, buffer_id, range, text)
 //     - In your get bindings hook, call vim_get_bindings(context)
+//     - Use vim_hook_command_caller as your command caller, or have yours
+//       flush the typeahead the same way before running a command
 //
 // 2. Define the following functions:
 //
@@ -36,24 +41,21 @@ void on_enter_visual_mode(struct Application_Links* app);
 //
 // Personal TODOs:
 //  - Freshly opened files aren't in normal mode?
-//  - * search should delimit with word boundaries
 //  - dw at end of line shouldn't delete newline
 //  - s (equivalent to cl)
 //  - S (delete contents of line and go to insert mode at appropriate indentation)
 //    - equivalent to cc
-//  - Range reformatting gq
-//    - v1: comment wrapping
 //  - Autocomment on new line
-//  - Support some basic vim variables via set
-//  - Visual block mode
 //  - Code folding?
 //
 //=============================================================================
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 //=============================================================================
 // > Types <
@@ -78,9 +80,14 @@ enum Vim_Maps {
     mapid_chord_indent_left,
     mapid_chord_indent_right,
     mapid_chord_format,
+    mapid_chord_reflow,
     mapid_chord_mark,
+    mapid_chord_mark_jump,
+    mapid_chord_mark_jump_line,
     mapid_chord_g,
     mapid_chord_window,
+    mapid_chord_bracket_forward,
+    mapid_chord_bracket_backward,
     mapid_chord_choose_register,
     mapid_chord_move_find,
     mapid_chord_move_til,
@@ -95,8 +102,14 @@ enum Vim_Mode {
     mode_replace,
     mode_visual,
     mode_visual_line,
+    mode_visual_block,
 };
 
+static bool is_visual_mode(Vim_Mode mode) {
+    return (mode == mode_visual || mode == mode_visual_line ||
+            mode == mode_visual_block);
+}
+
 enum Pending_Action {
     vimaction_none,
 
@@ -104,6 +117,7 @@ enum Pending_Action {
     vimaction_change_range,
     vimaction_yank_range,
     vimaction_format_range,
+    vimaction_reflow_range,
     vimaction_indent_left_range,
     vimaction_indent_right_range,
 };
@@ -111,6 +125,9 @@ enum Pending_Action {
 struct Vim_Register {
     String text;
     bool is_line;
+    // Big registers loaded from the session file point into its mapping
+    // until they're changed, so startup never copies them
+    bool is_mapped;
 };
 
 enum Register_Id {
@@ -119,7 +136,9 @@ enum Register_Id {
     reg_a, reg_b, reg_c, reg_d, reg_e, reg_f, reg_g, reg_h, reg_i, 
     reg_j, reg_k, reg_l, reg_m, reg_n, reg_o, reg_p, reg_q, reg_r, 
     reg_s, reg_t, reg_u, reg_v, reg_w, reg_x, reg_y, reg_z,
-    reg_1, reg_2, reg_3, reg_4, reg_5, reg_6, reg_7, reg_8, reg_9, reg_0 
+    reg_1, reg_2, reg_3, reg_4, reg_5, reg_6, reg_7, reg_8, reg_9, reg_0,
+    // ". : the text typed in the last insert session
+    reg_last_insert,
 };
 
 Register_Id regid_from_char(Key_Code C) {
@@ -137,19 +156,96 @@ Register_Id regid_from_char(Key_Code C) {
     if (C == '0') { return reg_0; }
 
     if (C == '*') { return reg_system_clipboard; }
+    if (C == '.') { return reg_last_insert; }
 
     return reg_unnamed;
 }
 
+// A mark set with m{A-Z}, or one of the '0-'9 left behind on exit. These
+// remember the file too, so they still work after the buffer is closed and
+// in the next session.
+struct Vim_Mark {
+    // 0 if the file isn't open
+    Buffer_ID buffer_id;
+    int pos;
+    String file_name;
+};
+
+// Where '0 is in Vim_State::marks; A-Z come first
+constexpr int MARK_0 = 26;
+
+// Lines entered at the : and / prompts, oldest first.
+constexpr int HISTORY_MAX = 100;
+
+struct Vim_History {
+    String entries[HISTORY_MAX];
+    int count;
+};
+
 enum Search_Direction {
     search_backward = -1,
     search_forward = 1,
 };
 
+// Longest pattern / ? * and # will search for
+constexpr int SEARCH_PATTERN_MAX = 256;
+
 struct Search_Context {
     Search_Direction direction;
+    // Only match text with no word characters directly on either side
+    bool whole_word;
+    // Decided from ignorecase and smartcase when the search was made
+    bool ignore_case;
     String text;
-    char text_buffer[100];
+    char text_buffer[SEARCH_PATTERN_MAX];
+};
+
+// A span of history records to be merged into one undo step once it ends.
+struct History_Group {
+    Buffer_ID buffer_id;
+    History_Record_Index first;
+};
+
+// A pending I, A or c on a visual block. The user types on the first line,
+// and the text is copied onto the rest of the block when insert mode ends.
+struct Block_Insert {
+    bool active;
+    Buffer_ID buffer_id;
+    // Lines after the first that still need the text
+    Range lines;
+    int column;
+    // For A, lines too short to reach the column get padded with spaces
+    bool pad_short_lines;
+    int insert_pos;
+    History_Group history;
+};
+
+// The insert or replace session in progress. All of its edits are merged
+// into one undo step when it ends, and the text it types is appended to
+// the ". register as it goes.
+struct Insert_Session {
+    bool active;
+    Buffer_ID buffer_id;
+    History_Group history;
+    // Whether ". has been started over for this session yet
+    bool recorded;
+    // Where the recorded text ends in the buffer. Typing there extends it;
+    // typing anywhere else starts a new run.
+    int end;
+};
+
+// Characters typed in insert or replace mode that haven't gone into the
+// buffer yet. Keys that arrive faster than frames pile up here and go in as
+// one edit when the frame is drawn or any other command runs.
+struct Typeahead {
+    View_ID view_id;
+    Buffer_ID buffer_id;
+    int pos;
+    // Replace mode: each character typed overwrites one, up to the line end
+    bool overwrite;
+    int chars;
+    char text[1024];
+    int size;
 };
 
 struct Vim_Query_Bar {
@@ -159,18 +255,47 @@ struct Vim_Query_Bar {
     int contents_len;
 };
 
+// Where the last search's matches are, for the [k/N] shown after / * and
+// n. Counted a budget's worth at a time so a big file never stalls a key
+// press, and thrown away when the pattern or the buffer changes.
+struct Search_Count {
+    Buffer_ID buffer_id;
+    uint64_t version;
+    char pattern[SEARCH_PATTERN_MAX];
+    int pattern_size;
+    bool whole_word;
+    bool ignore_case;
+    int* matches;
+    int count;
+    int capacity;
+    // Matches starting before this have all been found
+    int scanned_to;
+    bool complete;
+    // Stopped at SEARCH_COUNT_MAX, so count is a lower bound
+    bool capped;
+    // Index of the match under the cursor, or -1
+    int current;
+};
+
 struct Vim_State {
-    // 37 clipboard registers:
+    // 39 clipboard registers:
     //  - 1 unnamed
     //  - 1 sysclipboard
     //  - 26 letters
     //  - 10 numbers
-    Vim_Register registers[38];
+    //  - 1 last inserted text
+    Vim_Register registers[39];
 
-    // 36 Mark offsets:
+    // 36 global marks:
     //  - 26 letters
-    //  - 10 numbers
-    int marks[36];
+    //  - 10 numbers, '0 being where the cursor was on the last exit
+    Vim_Mark marks[36];
+
+    Vim_History search_history;
+    Vim_History command_history;
+    // Bumped whenever a register, global mark or history changes, so the
+    // session file is only rewritten when there's something new
+    uint32_t session_changes;
 
 	// The *current* vim mode. If a chord or action is pending, this will dictate
     // what mode you return to once the action is completed.
@@ -199,6 +324,25 @@ struct Vim_State {
     Vim_Query_Bar chord_bar;
 
     Search_Context last_search;
+    Search_Count search_count;
+    Vim_Query_Bar search_count_bar;
+
+    // The line range (1-based, inclusive) typed in front of the statusbar
+    // command being run, e.g. the 1,10 of :1,10d. Running a command from
+    // visual mode implies the selected lines.
+    Range command_range;
+    bool has_command_range;
+    // A plain number typed in front of the command, as typed: the 3 of
+    // :3next. Commands that count something other than lines use this,
+    // since the range is clamped to the buffer. 0 if there's none.
+    int command_count;
+
+    Block_Insert block_insert;
+    Insert_Session insert_session;
+    Typeahead typeahead;
+
+    // Whether the text object chord was started with a (around) or i (inner)
+    bool text_object_around;
 };
 
 #define VIM_COMMAND_FUNC_SIG(n) void n(struct Application_Links *app,         \
@@ -207,9 +351,18 @@ struct Vim_State {
                                        bool force)
 typedef VIM_COMMAND_FUNC_SIG(Vim_Command_Func);
 
+// What a command takes as its argument, for Tab completion
+enum Ex_Arg_Kind {
+    exarg_none,
+    exarg_file,
+    exarg_buffer,
+    exarg_option,
+};
+
 struct Vim_Command_Defn {
     String command;
     Vim_Command_Func* func;
+    Ex_Arg_Kind arg_kind;
 };
 
 //=============================================================================
@@ -219,6 +372,194 @@ struct Vim_Command_Defn {
 
 static Vim_State state = {};
 
+// Options:                                                         @options
+// Everything :set can change. Each option is declared once in VIM_OPTIONS
+// and becomes a field of Vim_Options, so reading one is a plain load, e.g.
+// get_buffer_options(buffer_id)->tabstop. Global options live in
+// global_options; buffer and view options get a copy of them per buffer
+// or view, indexed by its id. String options must be global, and :set
+// won't take an int option below its minimum.
+//
+//   X(name, abbreviation, type, scope, default, minimum)
+#define VIM_OPTIONS(X)                                                        \
+    X(tabstop,    "ts",  int,  optionscope_buffer, 4, 1)                      \
+    X(shiftwidth, "sw",  int,  optionscope_buffer, 4, 1)                      \
+    X(expandtab,  "et",  bool, optionscope_buffer, true, 0)                   \
+    X(textwidth,  "tw",  int,  optionscope_buffer, 80, 0)                     \
+    X(scroll,     "scr", int,  optionscope_view,   5, 0)                      \
+    X(ignorecase, "ic",  bool, optionscope_global, false, 0)                  \
+    X(smartcase,  "scs", bool, optionscope_global, false, 0)                  \
+    X(hlsearch,   "hls", bool, optionscope_global, false, 0)                  \
+    X(largefile,  "lf",  int,  optionscope_global, 64, 0)                     \
+    X(largefilemode, "lfm", bool, optionscope_buffer, false, 0)               \
+    X(makeprg,    "mp",  text, optionscope_global, "make", 0)
+
+enum Option_Scope {
+    optionscope_global,
+    optionscope_buffer,
+    optionscope_view,
+};
+
+enum Option_Type {
+    optiontype_bool,
+    optiontype_int,
+    optiontype_text,
+};
+
+struct Option_text {
+    char str[256];
+    int size;
+};
+typedef bool Option_bool;
+typedef int Option_int;
+
+struct Vim_Options {
+#define X(name, abbrev, type, scope, value, min) Option_##type name;
+    VIM_OPTIONS(X)
+#undef X
+};
+
+static void init_option(Option_bool* option, bool value) { *option = value; }
+static void init_option(Option_int* option, int value) { *option = value; }
+static void init_option(Option_text* option, const char* value) {
+    option->size = (int)strlen(value);
+    memcpy(option->str, value, option->size);
+}
+
+static Vim_Options make_default_options() {
+    Vim_Options options = {};
+#define X(name, abbrev, type, scope, value, min) init_option(&options.name, value);
+    VIM_OPTIONS(X)
+#undef X
+    return options;
+}
+
+static Vim_Options global_options = make_default_options();
+
+// Per buffer or view copies, indexed by id
+struct Local_Options {
+    bool exists;
+    Vim_Options options;
+};
+
+struct Local_Options_Table {
+    Local_Options* entries;
+    int capacity;
+};
+
+static Local_Options_Table buffer_options = {};
+static Local_Options_Table view_options = {};
+
+static Vim_Options* get_local_options(Local_Options_Table* table, int id) {
+    if (id <= 0) { return &global_options; }
+    if (id >= table->capacity) {
+        int capacity = (id + 1) * 2;
+        table->entries = (Local_Options*)realloc(table->entries,
+                                                 capacity * sizeof(Local_Options));
+        memset(table->entries + table->capacity, 0,
+               (capacity - table->capacity) * sizeof(Local_Options));
+        table->capacity = capacity;
+    }
+    Local_Options* local = table->entries + id;
+    if (!local->exists) {
+        local->options = global_options;
+        local->exists = true;
+    }
+    return &local->options;
+}
+
+static Vim_Options* get_buffer_options(Buffer_ID buffer_id) {
+    return get_local_options(&buffer_options, buffer_id);
+}
+
+static Vim_Options* get_view_options(View_ID view_id) {
+    return get_local_options(&view_options, view_id);
+}
+
+// See @largefile
+static bool buffer_is_large_file(Buffer_ID buffer_id) {
+    return get_buffer_options(buffer_id)->largefilemode;
+}
+
+// Buffer ids get reused, so a new buffer starts again from the globals.
+static void reset_buffer_options(Buffer_ID buffer_id) {
+    if (buffer_id > 0 && buffer_id < buffer_options.capacity) {
+        buffer_options.entries[buffer_id].exists = false;
+    }
+}
+
+// What :set needs to know about each option, in VIM_OPTIONS order.
+struct Option_Info {
+    String name;
+    String abbrev;
+    Option_Type type;
+    Option_Scope scope;
+    // Where the option is in a Vim_Options
+    size_t offset;
+    int min;
+};
+
+static const Option_Info option_infos[] = {
+#define X(name, abbrev, type, scope, value, min)                              \
+    { lit(#name), lit(abbrev), optiontype_##type, scope,                      \
+      offsetof(Vim_Options, name), min },
+    VIM_OPTIONS(X)
+#undef X
+};
+
+constexpr int OPTION_COUNT = sizeof(option_infos) / sizeof(option_infos[0]);
+
+static const Vim_Options default_options = make_default_options();
+
+static void* get_option_field(Vim_Options* options, int index) {
+    return (char*)options + option_infos[index].offset;
+}
+
+// Names and abbreviations both map to the option's index + 1, 0 is empty.
+// A power of two, at least twice the number of keys (two per option).
+constexpr int OPTION_HASH_SIZE = 64;
+static_assert(OPTION_HASH_SIZE >= 4 * OPTION_COUNT, "option hash too small");
+static int option_hash[OPTION_HASH_SIZE] = {};
+static bool option_hash_built = false;
+
+static uint32_t hash_option_name(String name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < name.size; ++i) {
+        hash = (hash ^ (uint8_t)name.str[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void insert_option_name(String name, int index) {
+    uint32_t slot = hash_option_name(name) & (OPTION_HASH_SIZE - 1);
+    while (option_hash[slot] != 0) { slot = (slot + 1) & (OPTION_HASH_SIZE - 1); }
+    option_hash[slot] = index + 1;
+}
+
+// Index of the option called name (or abbreviated to it), or -1.
+static int find_option(String name) {
+    if (!option_hash_built) {
+        for (int i = 0; i < OPTION_COUNT; ++i) {
+            insert_option_name(option_infos[i].name, i);
+            insert_option_name(option_infos[i].abbrev, i);
+        }
+        option_hash_built = true;
+    }
+    for (uint32_t slot = hash_option_name(name) & (OPTION_HASH_SIZE - 1);
+         option_hash[slot] != 0; slot = (slot + 1) & (OPTION_HASH_SIZE - 1)) {
+        const Option_Info* info = option_infos + option_hash[slot] - 1;
+        if (match(info->name, name) || match(info->abbrev, name)) {
+            return option_hash[slot] - 1;
+        }
+    }
+    return -1;
+}
+
+// Bytes of buffer counted per step for the search match counter, and the
+// count it gives up at.
+constexpr int SEARCH_COUNT_BUDGET = 1 << 20;
+constexpr int SEARCH_COUNT_MAX = 99999;
+
 // TODO(chr): Make these be dynamic and be a hashtable
 static Vim_Command_Defn defined_commands[512];
 static int defined_command_count = 0;
@@ -230,16 +571,26 @@ static int defined_command_count = 0;
 
 // Defer:                                                               @defer
 // Run some code when the scope exits, regardless of how it exited.
-// Wah wah C++. Why can't I use a lambda without including this massive header?
-#include <functional>
-
-using defer_func = std::function<void()>;
+// The lambda is stored by value in the guard itself, so a defer never
+// allocates and doesn't need <functional>. The move constructor only exists
+// so pre-C++17 compilers that don't elide the copy out of the + don't run the
+// code twice.
+template <typename Func>
 struct _Defer {
-    defer_func the_func;
-    _Defer(defer_func func) : the_func(func) {}
-    ~_Defer() { the_func(); }
+    Func the_func;
+    bool armed;
+    _Defer(Func func) : the_func(func), armed(true) {}
+    _Defer(_Defer&& other) : the_func(other.the_func), armed(other.armed) {
+        other.armed = false;
+    }
+    ~_Defer() { if (armed) { the_func(); } }
 };
-#define defer(s) _Defer defer##__LINE__([&] { s; })
+struct _Defer_Maker {};
+template <typename Func>
+_Defer<Func> operator+(_Defer_Maker, Func func) { return _Defer<Func>(func); }
+#define _defer_concat2(a, b) a##b
+#define _defer_concat(a, b) _defer_concat2(a, b)
+#define defer(s) auto _defer_concat(defer, __LINE__) = _Defer_Maker() + [&] { s; }
 
 // Iterate over views:                                               @for_views
 #define for_views(view, app)                                                  \
@@ -253,6 +604,78 @@ struct _Defer {
 #include <unistd.h>
 #endif
 
+// Parallel jobs:                                                        @jobs
+// Run job_count independent jobs across the cores and wait for all of them.
+// Jobs only get to touch the memory they're given; the 4coder API must
+// never be called from inside one. Platforms without pthreads run the jobs
+// one after another.
+#if defined(IS_LINUX) || defined(IS_MAC)
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define VIM_HAS_THREADS 1
+#endif
+
+typedef void Parallel_Job_Func(void* data, int job_index);
+
+struct Parallel_Job {
+    Parallel_Job_Func* func;
+    void* data;
+    int job_index;
+};
+
+static void* parallel_job_thread_proc(void* param) {
+    Parallel_Job* job = (Parallel_Job*)param;
+    job->func(job->data, job->job_index);
+    return 0;
+}
+
+static int get_core_count() {
+#if defined(VIM_HAS_THREADS)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) { count = 1; }
+    if (count > 64) { count = 64; }
+    return (int)count;
+#else
+    return 1;
+#endif
+}
+
+static void run_parallel_jobs(Parallel_Job_Func* func, void* data,
+                              int job_count) {
+#if defined(VIM_HAS_THREADS)
+    if (job_count > 1) {
+        Parallel_Job* jobs = (Parallel_Job*)malloc(job_count * sizeof(Parallel_Job));
+        pthread_t* threads = (pthread_t*)malloc(job_count * sizeof(pthread_t));
+        bool* started = (bool*)malloc(job_count * sizeof(bool));
+        for (int i = 1; i < job_count; ++i) {
+            jobs[i].func = func;
+            jobs[i].data = data;
+            jobs[i].job_index = i;
+            started[i] = (pthread_create(threads + i, 0,
+                                         parallel_job_thread_proc,
+                                         jobs + i) == 0);
+            if (!started[i]) { func(data, i); }
+        }
+        func(data, 0);
+        for (int i = 1; i < job_count; ++i) {
+            if (started[i]) { pthread_join(threads[i], 0); }
+        }
+        free(started);
+        free(threads);
+        free(jobs);
+        return;
+    }
+#endif
+    for (int i = 0; i < job_count; ++i) {
+        func(data, i);
+    }
+}
+
 static int32_t get_user_home_dir(char* out, int32_t out_mem_size) {
 #if defined(IS_LINUX)
     uid_t uid = getuid();
@@ -267,14 +690,165 @@ static int32_t get_user_home_dir(char* out, int32_t out_mem_size) {
 #endif
 }
 
+// Map a whole file read-only. Where there's no mmap it's read in instead.
+static const char* map_entire_file(const char* path, size_t* out_size) {
+#if defined(VIM_HAS_THREADS)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return 0; }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void* text = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) { return 0; }
+    *out_size = info.st_size;
+    return (const char*)text;
+#else
+    FILE* handle = fopen(path, "rb");
+    if (!handle) { return 0; }
+    fseek(handle, 0, SEEK_END);
+    long size = ftell(handle);
+    fseek(handle, 0, SEEK_SET);
+    char* text = (size > 0 ? (char*)malloc(size) : 0);
+    if (text && fread(text, 1, size, handle) != (size_t)size) {
+        free(text);
+        text = 0;
+    }
+    fclose(handle);
+    *out_size = (text ? size : 0);
+    return text;
+#endif
+}
+
+static void unmap_entire_file(const char* text, size_t size) {
+    if (!text) { return; }
+#if defined(VIM_HAS_THREADS)
+    munmap((void*)text, size);
+#else
+    free((void*)text);
+#endif
+}
+
+// Write a whole file in place, for when replacing it would lose something.
+static bool write_entire_file_in_place(const char* path, const void* data,
+                                       size_t size) {
+    FILE* file = fopen(path, "wb");
+    if (!file) { return false; }
+    bool ok = (fwrite(data, 1, size, file) == size && fflush(file) == 0);
+#if defined(VIM_HAS_THREADS)
+    ok = ok && (fsync(fileno(file)) == 0);
+#endif
+    ok = (fclose(file) == 0) && ok;
+    return ok;
+}
+
+// Write a whole file so that anyone reading it sees either the old contents
+// or the new, never half of each: write a new file in the same folder, then
+// rename it over the top. A symlink is followed so the file it points at is
+// the one replaced. Files with other hard links, or whose owner we couldn't
+// give the new file, are written in place instead.
+static bool write_entire_file_atomic(const char* path, const void* data,
+                                     size_t size) {
+#if defined(VIM_HAS_THREADS)
+    char* resolved = realpath(path, 0);
+    defer(free(resolved));
+    const char* target = (resolved ? resolved : path);
+    struct stat info;
+    bool exists = (stat(target, &info) == 0);
+    if (exists && (!S_ISREG(info.st_mode) || info.st_nlink > 1)) {
+        return write_entire_file_in_place(target, data, size);
+    }
+
+    // Open the new file exclusively under a name nobody's using. A new
+    // target gets 0666 and the kernel applies the umask; reading the umask
+    // ourselves would mean setting it, which races with other threads.
+    char temp_path[4096];
+    const char* slash = strrchr(target, '/');
+    int dir_size = (slash ? (int)(slash - target) + 1 : 0);
+    const char* name = target + dir_size;
+    int fd = -1;
+    for (int i = 0; fd < 0 && i < 100; ++i) {
+        if (snprintf(temp_path, sizeof(temp_path), "%.*s.%s.%d.%d",
+                     dir_size, target, name, (int)getpid(), i) >=
+            (int)sizeof(temp_path)) {
+            return false;
+        }
+        fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL,
+                  (exists ? 0600 : 0666));
+        if (fd < 0 && errno != EEXIST) { break; }
+    }
+    if (fd < 0) { return write_entire_file_in_place(target, data, size); }
+    if (exists) {
+        bool kept = (fchmod(fd, info.st_mode & 07777) == 0);
+        if (info.st_uid != geteuid() || info.st_gid != getegid()) {
+            kept = kept && (fchown(fd, info.st_uid, info.st_gid) == 0);
+        }
+        if (!kept) {
+            close(fd);
+            unlink(temp_path);
+            return write_entire_file_in_place(target, data, size);
+        }
+    }
+    bool ok = true;
+    for (size_t written = 0; ok && written < size;) {
+        ssize_t result = write(fd, (const char*)data + written, size - written);
+        if (result < 0) { ok = false; }
+        else { written += result; }
+    }
+    ok = ok && (fsync(fd) == 0);
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(temp_path, target) != 0) {
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+#else
+    // Find a name nobody's using, opening it exclusively so a file that
+    // appears meanwhile isn't clobbered either
+    char temp_path[4096];
+    FILE* file = 0;
+    for (int i = 0; !file && i < 100; ++i) {
+        if (snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, i) >=
+            (int)sizeof(temp_path)) {
+            return false;
+        }
+        file = fopen(temp_path, "wbx");
+    }
+    if (!file) { return write_entire_file_in_place(path, data, size); }
+    bool ok = (fwrite(data, 1, size, file) == size && fflush(file) == 0);
+    ok = (fclose(file) == 0) && ok;
+    // Windows won't rename onto a file that exists
+    if (ok) { remove(path); }
+    if (!ok || rename(temp_path, path) != 0) {
+        remove(temp_path);
+        return false;
+    }
+    return true;
+#endif
+}
+
+static void write_undo_log(struct Application_Links* app, Buffer_Summary* buffer);
+
 namespace {
 
 // Forward declare these for ease of use since they call between each other
 static void enter_normal_mode(struct Application_Links *app, int buffer_id);
 static void enter_insert_mode(struct Application_Links *app, int buffer_id);
+static void begin_insert_session(struct Application_Links* app,
+                                 Buffer_ID buffer_id);
+static void end_insert_session(struct Application_Links* app);
 static void update_visual_range(struct Application_Links* app, int end_new);
 static void update_visual_line_range(struct Application_Links* app,
                                      int end_new);
+static void update_visual_block_range(struct Application_Links* app,
+                                      int end_new);
+static void finish_block_insert(struct Application_Links* app);
+static void shift_lines(struct Application_Links* app, Buffer_Summary* buffer,
+                        Range range, int direction);
+static void reflow_lines(struct Application_Links* app, Buffer_Summary* buffer,
+                         Range range);
 static void end_visual_selection(struct Application_Links* app);
 static void copy_into_register(struct Application_Links* app,
                                Buffer_Summary* buffer, Range range,
@@ -285,6 +859,9 @@ static int get_cursor_pos(struct Application_Links* app);
 static char get_cursor_char(struct Application_Links* app, int offset = 0);
 static void push_to_chord_bar(struct Application_Links* app, const String str);
 static void end_chord_bar(struct Application_Links* app);
+static void end_search_count_bar(struct Application_Links* app);
+static void update_search_count(struct Application_Links* app,
+                                View_Summary* view, Search_Direction direction);
 static void clear_register_selection();
 static void vim_exec_action(struct Application_Links* app, Range range,
                             bool is_line = false);
@@ -314,25 +891,33 @@ static void enter_insert_mode(struct Application_Links *app, int buffer_id) {
     unsigned int access = AccessAll;
     Buffer_Summary buffer;
     
-    if (state.mode == mode_visual ||
-        state.mode == mode_visual_line) {
+    if (is_visual_mode(state.mode)) {
         end_visual_selection(app);
     }
 
     state.action = vimaction_none;
     state.mode = mode_insert;
     end_chord_bar(app);
+    end_search_count_bar(app);
 
     buffer = get_buffer(app, buffer_id, access);
     buffer_set_setting(app, &buffer, BufferSetting_MapID, mapid_insert);
+    begin_insert_session(app, buffer_id);
 
     on_enter_insert_mode(app);
 }
 
+static void free_register_text(Vim_Register* reg) {
+    if (!reg->is_mapped) { free(reg->text.str); }
+    reg->text = {};
+    reg->is_mapped = false;
+    ++state.session_changes;
+}
+
 static void copy_into_register(struct Application_Links* app,
                                Buffer_Summary* buffer, Range range,
                                Vim_Register* target_register) {
-    free(target_register->text.str);
+    free_register_text(target_register);
     target_register->text = make_string((char*)malloc(range.end - range.start), range.end - range.start);
     buffer_read_range(app, buffer, range.start, range.end, target_register->text.str);
     if (target_register == &state.registers[reg_system_clipboard]) {
@@ -344,7 +929,7 @@ static void paste_from_register(struct Application_Links* app,
 							    Buffer_Summary* buffer, int paste_pos,
 								Vim_Register* reg) {
 	if (reg == &state.registers[reg_system_clipboard]) {
-		free(reg->text.str);
+		free_register_text(reg);
 		int clipboard_text_size = clipboard_index(app, 0, 0, NULL, 0);
 		reg->text = make_string((char*)malloc(clipboard_text_size), clipboard_text_size);
 		clipboard_index(app, 0, 0, reg->text.str, reg->text.size);
@@ -353,24 +938,106 @@ static void paste_from_register(struct Application_Links* app,
                          reg->text.str, reg->text.size);
 }
 
-static void buffer_search(struct Application_Links* app, String word,
-                          View_Summary view, Search_Direction direction) {
-    const auto& buffer_seek_func =
-        (direction == search_forward ? buffer_seek_string_forward :
-         buffer_seek_string_backward);
+// Searches the buffer a window at a time for the first match of word
+// starting at or after pos (or at or before it, going backward). Whole word
+// boundaries are checked right in the scan loop, so common short words
+// don't pay for a call per substring hit.
+constexpr int SEARCH_WINDOW = 4096;
+
+static bool is_search_match(const char* at, int i, int size, String word,
+                            bool whole_word, bool ignore_case) {
+    if (ignore_case) {
+        if (char_to_lower(at[i]) != char_to_lower(word.str[0])) { return false; }
+        for (int j = 1; j < word.size; ++j) {
+            if (char_to_lower(at[i + j]) != char_to_lower(word.str[j])) {
+                return false;
+            }
+        }
+    } else {
+        if (at[i] != word.str[0]) { return false; }
+        if (memcmp(at + i, word.str, word.size) != 0) { return false; }
+    }
+    if (whole_word) {
+        if (i > 0 && char_is_alpha_numeric(at[i - 1])) { return false; }
+        int after = i + word.size;
+        if (after < size && char_is_alpha_numeric(at[after])) { return false; }
+    }
+    return true;
+}
+
+static bool buffer_seek_match(struct Application_Links* app,
+                              Buffer_Summary* buffer, int pos,
+                              Search_Direction direction, String word,
+                              bool whole_word, bool ignore_case, int* out) {
+    char window[SEARCH_WINDOW + sizeof(state.last_search.text_buffer) + 2];
+    if (word.size == 0 || word.size > (int)sizeof(state.last_search.text_buffer)) {
+        return false;
+    }
+    int size = buffer->size;
+    int last_start = size - word.size;
+    // Only pull pos in from the side the search comes from. Past the end
+    // it's heading for, there's nothing left to find, and the caller wraps.
+    if (direction == search_forward && pos < 0) { pos = 0; }
+    if (direction == search_backward && pos > last_start) { pos = last_start; }
+
+    while (direction == search_forward ? pos <= last_start : pos >= 0) {
+        int lo = (direction == search_forward ? pos : pos - SEARCH_WINDOW + 1);
+        int hi = (direction == search_forward ? pos + SEARCH_WINDOW - 1 : pos);
+        if (lo < 0) { lo = 0; }
+        if (hi > last_start) { hi = last_start; }
+
+        // One extra byte on each side for the boundary checks
+        int read_start = (lo > 0 ? lo - 1 : 0);
+        int read_end = (hi + word.size < size ? hi + word.size + 1 : size);
+        buffer_read_range(app, buffer, read_start, read_end, window);
+        const char* at = window - read_start;
+
+        for (int i = (direction == search_forward ? lo : hi);
+             i >= lo && i <= hi; i += direction) {
+            if (is_search_match(at, i, size, word, whole_word, ignore_case)) {
+                *out = i;
+                return true;
+            }
+        }
+        pos = (direction == search_forward ? hi + 1 : lo - 1);
+    }
+    return false;
+}
+
+// ignorecase, unless smartcase is on and the pattern has a capital in it.
+static bool search_ignores_case(String word) {
+    if (!global_options.ignorecase) { return false; }
+    if (global_options.smartcase) {
+        for (int i = 0; i < word.size; ++i) {
+            if (char_is_upper(word.str[i])) { return false; }
+        }
+    }
+    return true;
+}
+
+// Leave 4coder's mark where the cursor is before a jump, so `` and '' can
+// come back to it.
+static void set_jump_mark(struct Application_Links* app, View_Summary* view) {
+    view_set_mark(app, view, seek_pos(view->cursor.pos));
+}
 
+static void buffer_search(struct Application_Links* app, String word,
+                          View_Summary view, Search_Direction direction,
+                          bool whole_word = false) {
     Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
     int start_pos = view.cursor.pos;
     int new_pos = start_pos;
+    bool ignore_case = search_ignores_case(word);
 
-    buffer_seek_func(app, &buffer, view.cursor.pos + direction, 0, word.str,
-                     word.size, &new_pos);
-    if (new_pos < buffer.size && new_pos >= 0) {
+    if (buffer_seek_match(app, &buffer, start_pos + direction, direction,
+                          word, whole_word, ignore_case, &new_pos)) {
+        set_jump_mark(app, &view);
         view_set_cursor(app, &view, seek_pos(new_pos), true);
     } else {
         int wrap = (direction == search_forward ? 0 : buffer.size - 1);
-        buffer_seek_func(app, &buffer, wrap, 0, word.str, word.size, &new_pos);
-        if (new_pos < buffer.size && new_pos >= 0) {
+        if (buffer_seek_match(app, &buffer, wrap, direction, word,
+                              whole_word, ignore_case, &new_pos)) {
+            set_jump_mark(app, &view);
             view_set_cursor(app, &view, seek_pos(new_pos), true);
         }
     }
@@ -378,9 +1045,12 @@ static void buffer_search(struct Application_Links* app, String word,
     int actual_new_cursor_pos = view.cursor.pos;
     // Update last_search
     state.last_search.direction = direction;
+    state.last_search.whole_word = whole_word;
+    state.last_search.ignore_case = ignore_case;
     state.last_search.text = make_fixed_width_string(
         state.last_search.text_buffer);
     append_checked_ss(&state.last_search.text, word);
+    update_search_count(app, &view, direction);
     // Do the motion
     vim_exec_action(app, make_range(start_pos, actual_new_cursor_pos), false);
 }
@@ -388,6 +1058,7 @@ static void buffer_search(struct Application_Links* app, String word,
 static bool active_view_to_line(struct Application_Links* app, int line) {
     View_Summary view = get_active_view(app, AccessProtected);
     if (!view.exists) return false;
+    set_jump_mark(app, &view);
     if (!view_set_cursor(app, &view, seek_line_char(line, 0), false)) {
         return false;
     }
@@ -469,6 +1140,13 @@ static void update_visual_line_range(struct Application_Links* app, int end_new)
                                        get_line_end(app, normalized.end) + 1);
 }
 
+static void update_visual_block_range(struct Application_Links* app,
+                                      int end_new) {
+    state.selection_cursor.end = end_new;
+    Range normalized = make_range(state.selection_cursor.start, state.selection_cursor.end);
+    state.selection_range = make_range(normalized.start, normalized.end + 1);
+}
+
 static void end_visual_selection(struct Application_Links* app) {
     View_Summary view;
     
@@ -490,6 +1168,7 @@ static int push_to_string(char* str, size_t str_len, size_t str_max,
 }
 
 static void push_to_chord_bar(struct Application_Links* app, const String str) {
+    end_search_count_bar(app);
     if (!state.chord_bar.exists) {
         if (start_query_bar(app, &state.chord_bar.bar, 0) == 0) return;
         state.chord_bar.contents_len = 0;
@@ -515,6 +1194,32 @@ static void end_chord_bar(struct Application_Links* app) {
     }
 }
 
+static void show_search_count(struct Application_Links* app) {
+    if (!state.search_count_bar.exists) {
+        if (start_query_bar(app, &state.search_count_bar.bar, 0) == 0) return;
+        state.search_count_bar.exists = true;
+    }
+    Search_Count* count = &state.search_count;
+    String str = make_fixed_width_string(state.search_count_bar.contents);
+    append(&str, " [");
+    if (count->current >= 0) { append_int_to_str(&str, count->current + 1); }
+    else { append(&str, "?"); }
+    append(&str, "/");
+    if (!count->complete || count->capped) { append(&str, ">"); }
+    append_int_to_str(&str, count->count);
+    append(&str, "]");
+    state.search_count_bar.contents_len = str.size;
+    state.search_count_bar.bar.prompt = state.last_search.text;
+    state.search_count_bar.bar.string = str;
+}
+
+static void end_search_count_bar(struct Application_Links* app) {
+    if (state.search_count_bar.exists) {
+        end_query_bar(app, &state.search_count_bar.bar, 0);
+        state.search_count_bar.exists = false;
+    }
+}
+
 static void clear_register_selection() {
     state.yank_register = state.paste_register = reg_unnamed;
 }
@@ -546,11 +1251,21 @@ static void vim_exec_action(struct Application_Links* app, Range range,
             copy_into_register(app, &buffer, range, target_register);
         } break;
 
-        case vimaction_indent_left_range:  // TODO(chr)
-        case vimaction_indent_right_range:
+        case vimaction_indent_left_range: {
+            shift_lines(app, &buffer, range, -1);
+        } break;
+
+        case vimaction_indent_right_range: {
+            shift_lines(app, &buffer, range, 1);
+        } break;
+
+        case vimaction_reflow_range: {
+            reflow_lines(app, &buffer, range);
+        } break;
+
         case vimaction_format_range: {
-            // TODO(chr) tab width as a user variable
-            buffer_auto_indent(app, &buffer, range.start, range.end - 1, 4, 0);
+            buffer_auto_indent(app, &buffer, range.start, range.end - 1,
+                               get_buffer_options(buffer.buffer_id)->tabstop, 0);
         } break;
     }
 
@@ -568,6 +1283,11 @@ static void vim_exec_action(struct Application_Links* app, Range range,
             update_visual_line_range(app, view.cursor.pos);
             set_current_keymap(app, mapid_visual);
         } break;
+
+        case mode_visual_block: {
+            update_visual_block_range(app, view.cursor.pos);
+            set_current_keymap(app, mapid_visual);
+        } break;
     }
 }
 
@@ -696,1008 +1416,9205 @@ static Range get_word_under_cursor(struct Application_Links* app,
     return make_range(start, end);
 }
 
-static void enter_normal_mode(struct Application_Links *app, int buffer_id) {
-    if (state.mode == mode_visual || state.mode == mode_visual_line) {
-        end_visual_selection(app);
+// Read the whole buffer into one malloc'd block. The caller frees it.
+static char* read_entire_buffer(struct Application_Links* app,
+                                Buffer_Summary* buffer) {
+    char* text = (char*)malloc(buffer->size + 1);
+    buffer_read_range(app, buffer, 0, buffer->size, text);
+    text[buffer->size] = 0;
+    return text;
+}
+
+// Find the first occurrence of needle in text at or after from, or -1.
+// memchr on the first byte does the heavy lifting.
+static int text_find_forward(const char* text, int text_size, int from,
+                             String needle) {
+    if (needle.size == 0) { return -1; }
+    int last_start = text_size - needle.size;
+    while (from <= last_start) {
+        const char* hit = (const char*)memchr(text + from, needle.str[0],
+                                              last_start - from + 1);
+        if (!hit) { break; }
+        int pos = (int)(hit - text);
+        if (memcmp(hit, needle.str, needle.size) == 0) { return pos; }
+        from = pos + 1;
     }
-    state.action = vimaction_none;
-    end_chord_bar(app);
-    Buffer_Summary buffer = get_buffer(app, buffer_id, AccessAll);
-    buffer_set_setting(app, &buffer, BufferSetting_MapID, mapid_normal);
-    if (state.mode != mode_normal) {
-        state.mode = mode_normal;
-        on_enter_normal_mode(app);
+    return -1;
+}
+
+// Growable list of buffer edits plus the string they index into, so that a
+// whole operation can go to buffer_batch_edit as a single undo record.
+struct Edit_Batch {
+    Buffer_Edit* edits;
+    int count;
+    int capacity;
+    char* str;
+    int str_size;
+    int str_capacity;
+};
+
+static int edit_batch_push_string(Edit_Batch* batch, const char* str, int len) {
+    if (batch->str_size + len > batch->str_capacity) {
+        batch->str_capacity = (batch->str_capacity + len) * 2;
+        batch->str = (char*)realloc(batch->str, batch->str_capacity);
     }
+    int str_start = batch->str_size;
+    memcpy(batch->str + str_start, str, len);
+    batch->str_size += len;
+    return str_start;
 }
 
-static void buffer_query_search(struct Application_Links* app,
-                                Search_Direction direction) {
-    View_Summary view = get_active_view(app, AccessAll);
-    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
-    if (!buffer.exists) return;
-    // Start the search query bar
-    Query_Bar bar;
-    if (start_query_bar(app, &bar, 0) == 0) return;
-    defer(end_query_bar(app, &bar, 0));
-    // Bar string
-    char bar_string_space[256];
-    bar.string = make_fixed_width_string(bar_string_space);
-    bar.prompt = make_lit_string(direction == search_forward ? "/" : "?");
-    // Handle the query bar
-    User_Input in;
-    while (true) {
-        in = get_user_input(app, EventOnAnyKey, EventOnEsc);
-        if (in.abort) break;
-        if (in.key.keycode == '\n'){
-            break;
-        }
-        else if (in.key.keycode == '\t') {
-            // Ignore it
-        }
-        else if (in.key.character && key_is_unmodified(&in.key)){
-            append(&bar.string, (char)in.key.character);
-        }
-        else if (in.key.keycode == key_back){
-            if (bar.string.size > 0){
-                --bar.string.size;
-            }
+static void edit_batch_push(Edit_Batch* batch, int start, int end,
+                            int str_start, int len) {
+    // Merge with the previous edit when they touch and insert nothing, so
+    // runs of deleted lines become a single edit.
+    if (batch->count > 0 && len == 0) {
+        Buffer_Edit* last = batch->edits + batch->count - 1;
+        if (last->len == 0 && last->end == start) {
+            last->end = end;
+            return;
         }
     }
-    if (in.abort) return;
-    // Do the search
-    buffer_search(app, bar.string, view, direction);
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+        batch->edits = (Buffer_Edit*)realloc(
+            batch->edits, batch->capacity * sizeof(Buffer_Edit));
+    }
+    Buffer_Edit* edit = batch->edits + batch->count++;
+    edit->str_start = str_start;
+    edit->len = len;
+    edit->start = start;
+    edit->end = end;
 }
 
-void reset_keymap_for_current_mode(struct Application_Links* app) {
-    switch (state.mode) {
-        case mode_normal: {
-            set_current_keymap(app, mapid_normal);
-        } break;
+static void edit_batch_apply(struct Application_Links* app,
+                             Buffer_Summary* buffer, Edit_Batch* batch) {
+    if (batch->count > 0) {
+        buffer_batch_edit(app, buffer, batch->str, batch->str_size,
+                          batch->edits, batch->count, BatchEdit_Normal);
+    }
+}
 
-        case mode_insert: {
-            set_current_keymap(app, mapid_insert);
-        } break;
+static void edit_batch_free(Edit_Batch* batch) {
+    free(batch->edits);
+    free(batch->str);
+    *batch = {};
+}
 
-        case mode_replace: {
-            set_current_keymap(app, mapid_replace);
-        } break;
+// Merge every history record made between begin and end into one undo step.
+static History_Group begin_history_group(struct Application_Links* app,
+                                         Buffer_ID buffer_id) {
+    History_Group group = {};
+    group.buffer_id = buffer_id;
+    group.first = buffer_history_get_current_state_index(app, buffer_id) + 1;
+    return group;
+}
 
-        case mode_visual_line:
-        case mode_visual: {
-            set_current_keymap(app, mapid_visual);
-        } break;
+static void end_history_group(struct Application_Links* app,
+                              History_Group group) {
+    History_Record_Index last =
+        buffer_history_get_current_state_index(app, group.buffer_id);
+    if (last > group.first) {
+        buffer_history_merge_record_range(
+            app, group.buffer_id, group.first, last,
+            RecordMergeFlag_StateInRange_MoveStateForward);
     }
 }
 
-}  // namespace
+// Insert sessions:                                                   @session
+static void begin_insert_session(struct Application_Links* app,
+                                 Buffer_ID buffer_id) {
+    Insert_Session* session = &state.insert_session;
+    if (session->active) { return; }
+    session->active = true;
+    session->buffer_id = buffer_id;
+    session->history = begin_history_group(app, buffer_id);
+    session->recorded = false;
+    session->end = -1;
+}
 
-//=============================================================================
-// > Custom commands <                                                @commands
-// Commands that do things.
-//=============================================================================
+static void end_insert_session(struct Application_Links* app) {
+    Insert_Session* session = &state.insert_session;
+    if (!session->active) { return; }
+    session->active = false;
+    end_history_group(app, session->history);
+}
 
-CUSTOM_COMMAND_SIG(enter_normal_mode_on_current) {
-    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+// Put everything queued by vim_write_character or vim_overwrite_character
+// into the buffer as a single edit.
+static void flush_typeahead(struct Application_Links* app) {
+    Typeahead* typeahead = &state.typeahead;
+    if (typeahead->size == 0) { return; }
+    int size = typeahead->size;
+    typeahead->size = 0;
+    Buffer_Summary buffer = get_buffer(app, typeahead->buffer_id, AccessOpen);
+    if (!buffer.exists) { return; }
+
+    int start = typeahead->pos;
+    int end = start;
+    if (typeahead->overwrite) {
+        char old[sizeof(typeahead->text)];
+        int available = buffer.size - start;
+        if (available > typeahead->chars) { available = typeahead->chars; }
+        buffer_read_range(app, &buffer, start, start + available, old);
+        while (end - start < available && old[end - start] != '\n') { ++end; }
+    }
+    buffer_replace_range(app, &buffer, start, end, typeahead->text, size);
+    // The edit hook has to have treated this as continuing the session's
+    // recorded text, or ". would lose the earlier bursts
+    assert(!state.insert_session.active || !state.insert_session.recorded ||
+           state.insert_session.buffer_id != typeahead->buffer_id ||
+           state.insert_session.end == start + size);
+    View_Summary view = get_view(app, typeahead->view_id, AccessAll);
+    if (view.exists && view.buffer_id == typeahead->buffer_id) {
+        view_set_cursor(app, &view, seek_pos(start + size), true);
+    }
 }
 
-CUSTOM_COMMAND_SIG(enter_replace_mode){
-    state.mode = mode_replace;
-    set_current_keymap(app, mapid_replace);
-    clear_register_selection();
-    on_enter_replace_mode(app);
+static void append_to_register(Vim_Register* reg, const char* text, int size) {
+    if (reg->is_mapped) {
+        String mapped = reg->text;
+        reg->text = make_string((char*)malloc(mapped.size + size), mapped.size,
+                                mapped.size + size);
+        memcpy(reg->text.str, mapped.str, mapped.size);
+        reg->is_mapped = false;
+    }
+    ++state.session_changes;
+    if (reg->text.size + size > reg->text.memory_size) {
+        int capacity = reg->text.memory_size * 2;
+        if (capacity < reg->text.size + size) { capacity = reg->text.size + size; }
+        if (capacity < 64) { capacity = 64; }
+        reg->text.str = (char*)realloc(reg->text.str, capacity);
+        reg->text.memory_size = capacity;
+    }
+    memcpy(reg->text.str + reg->text.size, text, size);
+    reg->text.size += size;
 }
 
-CUSTOM_COMMAND_SIG(enter_visual_mode){
-    state.mode = mode_visual;
-    state.selection_cursor.start = get_cursor_pos(app);
-    state.selection_cursor.end = state.selection_cursor.start;
-    update_visual_range(app, state.selection_cursor.end);
+// Called from the edit hook. Edits that end where the recorded text ends
+// (typing, backspace, a completion) trim and extend it in place, and so do
+// replace mode's overwrites starting there; an insert anywhere else starts
+// a new run, as moving the cursor does in vim.
+static void record_insert_session_edit(Buffer_ID buffer_id, Range range,
+                                       String text) {
+    Insert_Session* session = &state.insert_session;
+    if (!session->active || session->buffer_id != buffer_id) { return; }
+    Vim_Register* reg = state.registers + reg_last_insert;
+    // Deleting forward from the end (replace mode does this) leaves it be
+    if (range.start == session->end && text.size == 0) { return; }
+
+    int removed = range.end - range.start;
+    if (session->recorded && range.end == session->end &&
+        removed <= reg->text.size) {
+        reg->text.size -= removed;
+    } else if (session->recorded && range.start == session->end) {
+        // Overwriting what follows: the old characters were never recorded
+    } else if (text.size > 0) {
+        reg->text.size = 0;
+    } else {
+        return;
+    }
+    reg->is_line = false;
+    append_to_register(reg, text.str, text.size);
+    session->recorded = true;
+    session->end = range.start + text.size;
+}
 
-    set_current_keymap(app, mapid_visual);
-    clear_register_selection();
-    on_enter_visual_mode(app);
+// Indentation:                                                       @indent
+// Shift every line touched by range one shiftwidth left (direction -1) or
+// right (+1). Only the leading whitespace of each line is rewritten, and all
+// of them go in as a single batched edit, so the buffer is relexed once.
+static void shift_lines(struct Application_Links* app, Buffer_Summary* buffer,
+                        Range range, int direction) {
+    int first_line = buffer_get_line_number(app, buffer, range.start);
+    int last_line = buffer_get_line_number(
+        app, buffer, (range.end > range.start ? range.end - 1 : range.start));
+    int span_start = buffer_get_line_start(app, buffer, first_line);
+    int span_end = buffer_get_line_end(app, buffer, last_line);
+    char* text = (char*)malloc(span_end - span_start + 1);
+    defer(free(text));
+    buffer_read_range(app, buffer, span_start, span_end, text);
+
+    Vim_Options* options = get_buffer_options(buffer->buffer_id);
+    int tab_width = (options->tabstop > 0 ? options->tabstop : 1);
+    Edit_Batch batch = {};
+    defer(edit_batch_free(&batch));
+    for (int line_start = span_start; line_start <= span_end;) {
+        const char* line = text + (line_start - span_start);
+        const char* newline = (const char*)memchr(line, '\n', span_end - line_start);
+        int line_size = newline ? (int)(newline - line) : span_end - line_start;
+
+        int indent_size = 0;
+        int indent_width = 0;
+        bool uses_tabs = !options->expandtab;
+        for (; indent_size < line_size; ++indent_size) {
+            if (line[indent_size] == ' ') {
+                ++indent_width;
+            } else if (line[indent_size] == '\t') {
+                indent_width += tab_width - (indent_width % tab_width);
+                uses_tabs = true;
+            } else {
+                break;
+            }
+        }
+
+        // Like vim, blank lines are left alone
+        if (indent_size < line_size && line[indent_size] != '\r') {
+            int new_width = indent_width + direction*options->shiftwidth;
+            if (new_width < 0) { new_width = 0; }
+            int str_start = batch.str_size;
+            int new_size = 0;
+            if (uses_tabs) {
+                for (; new_size < new_width / tab_width; ++new_size) {
+                    edit_batch_push_string(&batch, "\t", 1);
+                }
+                for (int i = 0; i < new_width % tab_width; ++i, ++new_size) {
+                    edit_batch_push_string(&batch, " ", 1);
+                }
+            } else {
+                for (; new_size < new_width; ++new_size) {
+                    edit_batch_push_string(&batch, " ", 1);
+                }
+            }
+            if (new_size != indent_size ||
+                memcmp(batch.str + str_start, line, new_size) != 0) {
+                edit_batch_push(&batch, line_start, line_start + indent_size,
+                                str_start, new_size);
+            } else {
+                batch.str_size = str_start;
+            }
+        }
+        line_start += line_size + 1;
+    }
+    edit_batch_apply(app, buffer, &batch);
 }
 
-CUSTOM_COMMAND_SIG(enter_visual_line_mode){
-    state.mode = mode_visual_line;
-    state.selection_cursor.start = get_cursor_pos(app);
-    state.selection_cursor.end = state.selection_cursor.start;
-    update_visual_line_range(app, state.selection_cursor.end);
+// Reflow:                                                             @reflow
+// gq rewraps paragraphs to textwidth in one pass over the range. Lines
+// belong to the same paragraph while they share a comment leader (the
+// indentation plus any //, #, * or > marker); blank lines, and leaders with
+// nothing after them, end a paragraph and are left as they are. Each
+// paragraph that changes becomes one edit of a single batch.
+static int get_comment_leader_size(const char* line, int size) {
+    int i = 0;
+    while (i < size && (line[i] == ' ' || line[i] == '\t')) { ++i; }
+    if (i + 1 < size && line[i] == '/' && line[i + 1] == '/') {
+        while (i < size && (line[i] == '/' || line[i] == '!')) { ++i; }
+    } else if (i < size && (line[i] == '#' || line[i] == '>')) {
+        char marker = line[i];
+        while (i < size && line[i] == marker) { ++i; }
+    } else if (i < size && line[i] == '*' &&
+               !(i + 1 < size && line[i + 1] == '/')) {
+        ++i;
+    } else {
+        return i;
+    }
+    while (i < size && (line[i] == ' ' || line[i] == '\t')) { ++i; }
+    return i;
+}
 
-    set_current_keymap(app, mapid_visual);
-    clear_register_selection();
-    on_enter_visual_mode(app);
+static int get_display_width(const char* str, int size, int tab_width) {
+    int width = 0;
+    for (int i = 0; i < size; ++i) {
+        if (str[i] == '\t') { width += tab_width - (width % tab_width); }
+        else { ++width; }
+    }
+    return width;
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_replace_single){
-    set_current_keymap(app, mapid_chord_replace_single);
-    clear_register_selection();
+// Leaders match if they're the same once trailing whitespace is dropped,
+// so "// a" and "//   b" continue the same paragraph.
+static bool comment_leaders_match(const char* a, int a_size,
+                                  const char* b, int b_size) {
+    while (a_size > 0 && char_is_whitespace(a[a_size - 1])) { --a_size; }
+    while (b_size > 0 && char_is_whitespace(b[b_size - 1])) { --b_size; }
+    return (a_size == b_size && memcmp(a, b, a_size) == 0);
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_switch_registers){
-    set_current_keymap(app, mapid_chord_choose_register);
+struct Reflow_Paragraph {
+    // Offsets into the text that was read
+    int start;
+    int end;
+    int line_count;
+    const char* leader;
+    int leader_size;
+    // Continuation lines use the second line's leader, like vim
+    const char* next_leader;
+    int next_leader_size;
+};
 
-    push_to_chord_bar(app, lit("\""));
+static void flush_reflow_paragraph(Edit_Batch* batch, const char* text,
+                                   int text_pos, Reflow_Paragraph* para,
+                                   Vim_Options* options) {
+    if (para->line_count == 0) { return; }
+    int tab_width = (options->tabstop > 0 ? options->tabstop : 1);
+    // Like vim, textwidth=0 wraps gq at 79
+    int text_width = (options->textwidth > 0 ? options->textwidth : 79);
+    int str_start = batch->str_size;
+    edit_batch_push_string(batch, para->leader, para->leader_size);
+    int width = get_display_width(para->leader, para->leader_size, tab_width);
+    int leader_width = width;
+    bool line_has_words = false;
+
+    int line_start = para->start;
+    while (line_start < para->end) {
+        const char* newline = (const char*)memchr(text + line_start, '\n',
+                                                  para->end - line_start);
+        int line_end = newline ? (int)(newline - text) : para->end;
+        int pos = line_start + get_comment_leader_size(text + line_start,
+                                                       line_end - line_start);
+        while (pos < line_end) {
+            while (pos < line_end && char_is_whitespace(text[pos])) { ++pos; }
+            int word_start = pos;
+            while (pos < line_end && !char_is_whitespace(text[pos])) { ++pos; }
+            int word_size = pos - word_start;
+            if (word_size == 0) { break; }
+            if (line_has_words && width + 1 + word_size > text_width) {
+                edit_batch_push_string(batch, "\n", 1);
+                edit_batch_push_string(batch, para->next_leader,
+                                       para->next_leader_size);
+                width = get_display_width(para->next_leader,
+                                          para->next_leader_size, tab_width);
+                leader_width = width;
+                line_has_words = false;
+            }
+            if (line_has_words) {
+                edit_batch_push_string(batch, " ", 1);
+                ++width;
+            } else if (width == leader_width && para->leader_size > 0 &&
+                       !char_is_whitespace(batch->str[batch->str_size - 1])) {
+                // A leader like "//" with no space before the text
+                edit_batch_push_string(batch, " ", 1);
+                ++width;
+            }
+            edit_batch_push_string(batch, text + word_start, word_size);
+            width += word_size;
+            line_has_words = true;
+        }
+        line_start = line_end + 1;
+    }
+
+    int new_size = batch->str_size - str_start;
+    int old_size = para->end - para->start;
+    if (new_size == old_size &&
+        memcmp(batch->str + str_start, text + para->start, old_size) == 0) {
+        batch->str_size = str_start;
+    } else {
+        edit_batch_push(batch, text_pos + para->start, text_pos + para->end,
+                        str_start, new_size);
+    }
+    para->line_count = 0;
 }
 
-CUSTOM_COMMAND_SIG(replace_character) {
-    //TODO(chronister): Do something a little more intelligent when at the end of a line
-    if (get_cursor_char(app) != '\n') {
-        delete_char(app);
+static void reflow_lines(struct Application_Links* app, Buffer_Summary* buffer,
+                         Range range) {
+    int first_line = buffer_get_line_number(app, buffer, range.start);
+    int last_line = buffer_get_line_number(
+        app, buffer, (range.end > range.start ? range.end - 1 : range.start));
+    int span_start = buffer_get_line_start(app, buffer, first_line);
+    int span_end = buffer_get_line_end(app, buffer, last_line);
+    int text_size = span_end - span_start;
+    char* text = (char*)malloc(text_size + 1);
+    defer(free(text));
+    buffer_read_range(app, buffer, span_start, span_end, text);
+
+    Vim_Options* options = get_buffer_options(buffer->buffer_id);
+    Edit_Batch batch = {};
+    defer(edit_batch_free(&batch));
+    Reflow_Paragraph para = {};
+    for (int line_start = 0; line_start <= text_size;) {
+        const char* line = text + line_start;
+        const char* newline = (const char*)memchr(line, '\n', text_size - line_start);
+        int line_size = newline ? (int)(newline - line) : text_size - line_start;
+        int leader_size = get_comment_leader_size(line, line_size);
+        bool is_blank = true;
+        for (int i = leader_size; i < line_size; ++i) {
+            if (!char_is_whitespace(line[i])) { is_blank = false; break; }
+        }
+
+        if (is_blank ||
+            (para.line_count > 0 &&
+             !comment_leaders_match(para.leader, para.leader_size,
+                                    line, leader_size))) {
+            flush_reflow_paragraph(&batch, text, span_start, &para, options);
+        }
+        if (!is_blank) {
+            if (para.line_count == 0) {
+                para.start = line_start;
+                para.leader = line;
+                para.leader_size = leader_size;
+                para.next_leader = line;
+                para.next_leader_size = leader_size;
+            } else if (para.line_count == 1) {
+                para.next_leader = line;
+                para.next_leader_size = leader_size;
+            }
+            para.end = line_start + line_size;
+            ++para.line_count;
+        }
+        line_start += line_size + 1;
     }
-    write_character(app);
+    flush_reflow_paragraph(&batch, text, span_start, &para, options);
+    edit_batch_apply(app, buffer, &batch);
 }
 
-CUSTOM_COMMAND_SIG(replace_character_then_normal) {
-    replace_character(app);
-    move_left(app);
-    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+// Buffer structure caches:                                        @structure
+// Things derived from a whole buffer (bracket pairs, paragraphs, ...) are
+// cached and keyed on the buffer's edit version, which
+// vim_hook_file_edit_range_func bumps on every edit.
+static Managed_Variable_ID edit_version_var = 0;
+
+static Managed_Variable_ID get_edit_version_var(struct Application_Links* app) {
+    if (edit_version_var == 0) {
+        edit_version_var = managed_variable_create_or_get_id(
+            app, "vim.edit_version", 0);
+    }
+    return edit_version_var;
 }
 
-CUSTOM_COMMAND_SIG(seek_top_of_file) {
-    unsigned int access = AccessProtected;
-    View_Summary view = get_active_view(app, access);
-    view_set_cursor(app, &view, seek_pos(0), true);
+// Buffer ids are reused once a buffer is killed, so state kept outside the
+// buffer's managed scope also records its generation: a number given to
+// each buffer the first time it's asked for, and never given again. The
+// scope dies with the buffer, so a new buffer on the same id gets a new one.
+static Managed_Variable_ID buffer_generation_var = 0;
+static uint64_t next_buffer_generation = 1;
+
+static uint64_t get_buffer_generation(struct Application_Links* app,
+                                      Buffer_ID buffer_id) {
+    if (buffer_generation_var == 0) {
+        buffer_generation_var = managed_variable_create_or_get_id(
+            app, "vim.generation", 0);
+    }
+    Managed_Scope scope = buffer_get_managed_scope(app, buffer_id);
+    uint64_t generation = 0;
+    managed_variable_get(app, scope, buffer_generation_var, &generation);
+    if (generation == 0) {
+        generation = next_buffer_generation++;
+        managed_variable_set(app, scope, buffer_generation_var, generation);
+    }
+    return generation;
 }
 
-CUSTOM_COMMAND_SIG(seek_bottom_of_file) {
-    unsigned int access = AccessProtected;
-    View_Summary view = get_active_view(app, access);
-    Buffer_Summary buffer = get_buffer(app, view.buffer_id, access);
-    view_set_cursor(app, &view, seek_pos(buffer.size), true);
+static void bump_buffer_edit_version(struct Application_Links* app,
+                                     Buffer_ID buffer_id) {
+    Managed_Scope scope = buffer_get_managed_scope(app, buffer_id);
+    uint64_t version = 0;
+    managed_variable_get(app, scope, get_edit_version_var(app), &version);
+    managed_variable_set(app, scope, get_edit_version_var(app), version + 1);
 }
 
-template <CUSTOM_COMMAND_SIG(command)>
-CUSTOM_COMMAND_SIG(compound_move_command){
-    View_Summary view = get_active_view(app, AccessProtected);
-    int before_pos = view.cursor.pos;
-    command(app);
-    refresh_view(app, &view);
-    int after_pos = view.cursor.pos;
-    vim_exec_action(app, make_range(before_pos, after_pos), false);
+static uint64_t get_buffer_edit_version(struct Application_Links* app,
+                                        Buffer_Summary* buffer) {
+    Managed_Scope scope = buffer_get_managed_scope(app, buffer->buffer_id);
+    uint64_t version = 0;
+    managed_variable_get(app, scope, get_edit_version_var(app), &version);
+    // Fold in the size and undo position too, so a missing edit hook makes
+    // caches go stale less often rather than never refresh.
+    uint64_t history = (uint64_t)buffer_history_get_current_state_index(
+        app, buffer->buffer_id);
+    return (version << 40) ^ (history << 20) ^ (uint64_t)buffer->size;
 }
 
-#define vim_move_left compound_move_command<move_left>
-#define vim_move_right compound_move_command<move_right>
-#define vim_move_end_of_line compound_move_command<seek_end_of_line>
-#define vim_move_beginning_of_line compound_move_command<seek_beginning_of_line>
-#define vim_move_whitespace_up compound_move_command<seek_whitespace_up>
-#define vim_move_whitespace_down compound_move_command<seek_whitespace_down>
-#define vim_move_to_top compound_move_command<seek_top_of_file>
-#define vim_move_to_bottom compound_move_command<seek_bottom_of_file>
-#define vim_move_click compound_move_command<click_set_cursor>
-#define vim_move_scroll compound_move_command<mouse_wheel_scroll>
+// Bracket index:                                                    @brackets
+// Every (), [] and {} in a buffer, with its match and the innermost open
+// bracket around it, built in one pass over the token array (or the raw
+// text for buffers that aren't lexed). Finding the brackets around a
+// position is then a binary search plus a short walk up the parents.
+enum Bracket_Kind {
+    bracket_paren,
+    bracket_square,
+    bracket_brace,
+};
 
-CUSTOM_COMMAND_SIG(move_forward_word_start){
-    View_Summary view;
-    Buffer_Summary buffer;
+struct Bracket {
+    int pos;
+    // Index of the matching bracket, or -1
+    int match;
+    // Innermost open bracket enclosing this one (for a close bracket, the
+    // one enclosing its pair), or -1
+    int parent;
+    uint8_t kind;
+    bool open;
+};
 
-    unsigned int access = AccessAll;
-    view = get_active_view(app, access);
-    buffer = get_buffer(app, view.buffer_id, access);
+struct Bracket_Index {
+    Buffer_ID buffer_id;
+    uint64_t version;
+    Bracket* brackets;
+    int count;
+    int capacity;
+};
 
-    int pos1 = view.cursor.pos;
-    
-    int pos2 = buffer_seek_next_word(app, &buffer, pos1);
+constexpr int BRACKET_INDEX_CACHE_SIZE = 8;
+static Bracket_Index bracket_indices[BRACKET_INDEX_CACHE_SIZE];
+static int bracket_index_next_slot = 0;
 
-    view_set_cursor(app, &view, seek_pos(pos2), true);
-    vim_exec_action(app, make_range(pos1, pos2), false);
+struct Bracket_Builder {
+    Bracket_Index* index;
+    int* stack;
+    int depth;
+    int stack_capacity;
+};
+
+static void push_bracket(Bracket_Builder* builder, int pos, Bracket_Kind kind,
+                         bool open) {
+    Bracket_Index* index = builder->index;
+    if (index->count == index->capacity) {
+        index->capacity = index->capacity ? index->capacity * 2 : 1024;
+        index->brackets = (Bracket*)realloc(
+            index->brackets, index->capacity * sizeof(Bracket));
+    }
+    int self = index->count++;
+    Bracket* bracket = index->brackets + self;
+    bracket->pos = pos;
+    bracket->kind = (uint8_t)kind;
+    bracket->open = open;
+    bracket->match = -1;
+    int top = (builder->depth > 0 ? builder->stack[builder->depth - 1] : -1);
+    bracket->parent = top;
+
+    if (open) {
+        if (builder->depth == builder->stack_capacity) {
+            builder->stack_capacity = builder->stack_capacity ? builder->stack_capacity * 2 : 256;
+            builder->stack = (int*)realloc(builder->stack,
+                                           builder->stack_capacity * sizeof(int));
+        }
+        builder->stack[builder->depth++] = self;
+    } else if (top >= 0 && index->brackets[top].kind == kind) {
+        --builder->depth;
+        bracket->match = top;
+        bracket->parent = index->brackets[top].parent;
+        index->brackets[top].match = self;
+    }
 }
 
-CUSTOM_COMMAND_SIG(move_backward_word_start){
-    View_Summary view;
-    
-    unsigned int access = AccessAll;
-    view = get_active_view(app, access);
+static void build_bracket_index(struct Application_Links* app,
+                                Buffer_Summary* buffer, Bracket_Index* index) {
+    index->count = 0;
+    Bracket_Builder builder = {};
+    builder.index = index;
+    defer(free(builder.stack));
+
+    int token_count = buffer_token_count(app, buffer);
+    if (buffer->tokens_are_ready && token_count > 0) {
+        Cpp_Token tokens[1024];
+        for (int first = 0; first < token_count; first += ArrayCount(tokens)) {
+            int one_past_last = first + ArrayCount(tokens);
+            if (one_past_last > token_count) { one_past_last = token_count; }
+            buffer_read_tokens(app, buffer, first, one_past_last, tokens);
+            for (int i = 0; i < one_past_last - first; ++i) {
+                Cpp_Token* token = tokens + i;
+                switch (token->type) {
+                    case CPP_TOKEN_PARENTHESE_OPEN: push_bracket(&builder, token->start, bracket_paren, true); break;
+                    case CPP_TOKEN_PARENTHESE_CLOSE: push_bracket(&builder, token->start, bracket_paren, false); break;
+                    case CPP_TOKEN_BRACKET_OPEN: push_bracket(&builder, token->start, bracket_square, true); break;
+                    case CPP_TOKEN_BRACKET_CLOSE: push_bracket(&builder, token->start, bracket_square, false); break;
+                    case CPP_TOKEN_BRACE_OPEN: push_bracket(&builder, token->start, bracket_brace, true); break;
+                    case CPP_TOKEN_BRACE_CLOSE: push_bracket(&builder, token->start, bracket_brace, false); break;
+                    default: break;
+                }
+            }
+        }
+    } else {
+        char* text = read_entire_buffer(app, buffer);
+        defer(free(text));
+        for (int pos = 0; pos < buffer->size; ++pos) {
+            switch (text[pos]) {
+                case '(': push_bracket(&builder, pos, bracket_paren, true); break;
+                case ')': push_bracket(&builder, pos, bracket_paren, false); break;
+                case '[': push_bracket(&builder, pos, bracket_square, true); break;
+                case ']': push_bracket(&builder, pos, bracket_square, false); break;
+                case '{': push_bracket(&builder, pos, bracket_brace, true); break;
+                case '}': push_bracket(&builder, pos, bracket_brace, false); break;
+            }
+        }
+    }
+}
 
-    int pos1 = view.cursor.pos;
-    
-    seek_white_or_token_left(app);
-    
-    refresh_view(app, &view);
-    int pos2 = view.cursor.pos;
+static Bracket_Index* get_bracket_index(struct Application_Links* app,
+                                        Buffer_Summary* buffer) {
+    uint64_t version = get_buffer_edit_version(app, buffer);
+    Bracket_Index* index = 0;
+    for (int i = 0; i < BRACKET_INDEX_CACHE_SIZE; ++i) {
+        if (bracket_indices[i].buffer_id == buffer->buffer_id &&
+            bracket_indices[i].brackets != 0) {
+            index = bracket_indices + i;
+            break;
+        }
+    }
+    if (index && index->version == version) { return index; }
+    if (!index) {
+        index = bracket_indices + bracket_index_next_slot;
+        bracket_index_next_slot = (bracket_index_next_slot + 1) % BRACKET_INDEX_CACHE_SIZE;
+    }
+    index->buffer_id = buffer->buffer_id;
+    index->version = version;
+    build_bracket_index(app, buffer, index);
+    return index;
+}
 
-    vim_exec_action(app, make_range(pos1, pos2));
+// Index of the last bracket at or before pos, or -1.
+static int find_bracket_at_or_before(Bracket_Index* index, int pos) {
+    int lo = 0;
+    int hi = index->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        if (index->brackets[mid].pos <= pos) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+    return lo - 1;
 }
 
-CUSTOM_COMMAND_SIG(move_forward_word_end){
-    View_Summary view;
-    
-    unsigned int access = AccessOpen;
-    view = get_active_view(app, access);
+// The innermost matched open bracket of the given kind around pos (a
+// cursor on a bracket counts as inside it), or -1.
+static int find_enclosing_bracket(Bracket_Index* index, int pos,
+                                  Bracket_Kind kind) {
+    int k = find_bracket_at_or_before(index, pos);
+    if (k < 0) { return -1; }
+    Bracket* bracket = index->brackets + k;
+    int enclosing;
+    if (bracket->open) { enclosing = k; }
+    else if (bracket->pos == pos && bracket->match >= 0) { enclosing = bracket->match; }
+    else { enclosing = bracket->parent; }
+    while (enclosing >= 0 &&
+           (index->brackets[enclosing].kind != kind ||
+            index->brackets[enclosing].match < 0)) {
+        enclosing = index->brackets[enclosing].parent;
+    }
+    return enclosing;
+}
 
-    int pos1 = view.cursor.pos;
-    move_right(app);
-    
-    seek_whitespace_right(app);
-    
-    refresh_view(app, &view);
-    int pos2 = view.cursor.pos;
-    move_left(app);
+// Search match counter:                                        @searchcount
+// A search counts the first SEARCH_COUNT_BUDGET bytes straight away. With
+// pthreads, a copy of the rest of the buffer is counted on a worker thread
+// and the render caller picks up the result; without them, the render caller
+// counts another SEARCH_COUNT_BUDGET bytes each time it runs.
+struct Search_Count_Job {
+    // The whole buffer from start - 1 on, for the boundary check
+    char* text;
+    int start;
+    int size;
+    char pattern[SEARCH_PATTERN_MAX];
+    int pattern_size;
+    bool whole_word;
+    bool ignore_case;
+    int max_count;
+    // Only read once done is set
+    int* matches;
+    int count;
+    bool capped;
+    // Set by the main thread when the count it was for is thrown away
+    bool cancelled;
+    bool done;
+    Search_Count_Job* next;
+};
 
-    vim_exec_action(app, make_range(pos1, pos2));
+// Touched only on the main thread, apart from each job's results, done and
+// cancelled. The one that isn't cancelled, if any, is the live count's.
+static Search_Count_Job* search_count_jobs = 0;
+
+static void run_search_count_job(Search_Count_Job* job) {
+    int read_start = (job->start > 0 ? job->start - 1 : 0);
+    const char* at = job->text - read_start;
+    String word = make_string(job->pattern, job->pattern_size);
+    int capacity = 0;
+    int last_start = job->size - word.size;
+    for (int pos = job->start; pos <= last_start; pos += SEARCH_WINDOW) {
+        if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) { break; }
+        int hi = (pos + SEARCH_WINDOW <= last_start ? pos + SEARCH_WINDOW : last_start + 1);
+        for (int i = pos; i < hi; ++i) {
+            if (!is_search_match(at, i, job->size, word, job->whole_word,
+                                 job->ignore_case)) {
+                continue;
+            }
+            if (job->count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                job->matches = (int*)realloc(job->matches, capacity * sizeof(int));
+            }
+            job->matches[job->count++] = i;
+            if (job->count == job->max_count) {
+                job->capped = true;
+                break;
+            }
+        }
+        if (job->capped) { break; }
+    }
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
 }
 
-CUSTOM_COMMAND_SIG(newline_then_insert_before){
-    seek_beginning_of_line(app);
-    write_string(app, make_lit_string("\n"));
-    move_left(app);
-    enter_insert_mode(app, get_current_view_buffer_id(app, AccessAll));
+#if defined(VIM_HAS_THREADS)
+static void* search_count_thread_proc(void* param) {
+    run_search_count_job((Search_Count_Job*)param);
+    return 0;
 }
+#endif
 
-CUSTOM_COMMAND_SIG(insert_at){
-    enter_insert_mode(app, get_current_view_buffer_id(app, AccessAll));
+static void cancel_search_count_job() {
+    for (Search_Count_Job* job = search_count_jobs; job; job = job->next) {
+        __atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+    }
 }
 
-CUSTOM_COMMAND_SIG(insert_after){
-    View_Summary view = get_active_view(app, AccessOpen);
-    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
-    char nextch[2];
-    int pos = view.cursor.pos;
-    buffer_read_range(app, &buffer, pos, pos + 1, nextch);
-    if (nextch[0] != '\n') {
-        move_right(app);
+// Frees the jobs that are done, adding the live one's matches to the count.
+static void drain_search_count_jobs() {
+    Search_Count* count = &state.search_count;
+    for (Search_Count_Job** at = &search_count_jobs; *at;) {
+        Search_Count_Job* job = *at;
+        if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+            at = &job->next;
+            continue;
+        }
+        *at = job->next;
+        if (!__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+            if (count->count + job->count > count->capacity) {
+                count->capacity = count->count + job->count;
+                count->matches = (int*)realloc(count->matches,
+                                               count->capacity * sizeof(int));
+            }
+            if (job->count > 0) {
+                memcpy(count->matches + count->count, job->matches,
+                       job->count * sizeof(int));
+            }
+            count->count += job->count;
+            count->scanned_to = job->size;
+            count->complete = true;
+            count->capped = job->capped;
+        }
+        free(job->matches);
+        free(job->text);
+        free(job);
     }
-    enter_insert_mode(app, view.buffer_id);
 }
 
-CUSTOM_COMMAND_SIG(seek_eol_then_insert){
-    seek_end_of_line(app);
-    enter_insert_mode(app, get_current_view_buffer_id(app, AccessOpen));
+// Hands the rest of the count to a worker thread. False if there isn't one.
+static bool start_search_count_job(struct Application_Links* app,
+                                   Buffer_Summary* buffer) {
+#if defined(VIM_HAS_THREADS)
+    Search_Count* count = &state.search_count;
+    for (Search_Count_Job* job = search_count_jobs; job; job = job->next) {
+        if (!__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) { return true; }
+    }
+    Search_Count_Job* job = (Search_Count_Job*)calloc(1, sizeof(Search_Count_Job));
+    job->start = count->scanned_to;
+    job->size = buffer->size;
+    int read_start = (job->start > 0 ? job->start - 1 : 0);
+    job->text = (char*)malloc(job->size - read_start + 1);
+    buffer_read_range(app, buffer, read_start, job->size, job->text);
+    memcpy(job->pattern, count->pattern, count->pattern_size);
+    job->pattern_size = count->pattern_size;
+    job->whole_word = count->whole_word;
+    job->ignore_case = count->ignore_case;
+    job->max_count = SEARCH_COUNT_MAX - count->count;
+
+    pthread_t thread;
+    if (pthread_create(&thread, 0, search_count_thread_proc, job) != 0) {
+        free(job->text);
+        free(job);
+        return false;
+    }
+    pthread_detach(thread);
+    job->next = search_count_jobs;
+    search_count_jobs = job;
+    return true;
+#else
+    return false;
+#endif
 }
 
-CUSTOM_COMMAND_SIG(newline_then_insert_after){
-    seek_end_of_line(app);
-    write_string(app, make_lit_string("\n"));
-    enter_insert_mode(app, get_current_view_buffer_id(app, AccessOpen));
+// Counts up to budget more bytes' worth of matches of the counted pattern.
+static void advance_search_count(struct Application_Links* app,
+                                 Buffer_Summary* buffer, int budget) {
+    Search_Count* count = &state.search_count;
+    if (count->complete) { return; }
+    char window[SEARCH_WINDOW + sizeof(count->pattern) + 2];
+    String word = make_string(count->pattern, count->pattern_size);
+    if (word.size == 0) {
+        count->complete = true;
+        return;
+    }
+    int size = buffer->size;
+    int last_start = size - word.size;
+    int to = count->scanned_to + budget;
+    if (to > last_start + 1) { to = last_start + 1; }
+
+    int pos = count->scanned_to;
+    while (pos < to) {
+        int hi = (pos + SEARCH_WINDOW < to ? pos + SEARCH_WINDOW : to);
+        int read_start = (pos > 0 ? pos - 1 : 0);
+        int read_end = (hi + word.size < size ? hi + word.size : size);
+        buffer_read_range(app, buffer, read_start, read_end, window);
+        const char* at = window - read_start;
+        for (int i = pos; i < hi; ++i) {
+            if (!is_search_match(at, i, size, word, count->whole_word,
+                                 count->ignore_case)) {
+                continue;
+            }
+            if (count->count == count->capacity) {
+                count->capacity = count->capacity ? count->capacity * 2 : 256;
+                count->matches = (int*)realloc(count->matches,
+                                               count->capacity * sizeof(int));
+            }
+            count->matches[count->count++] = i;
+            if (count->count == SEARCH_COUNT_MAX) {
+                count->scanned_to = i + 1;
+                count->complete = count->capped = true;
+                return;
+            }
+        }
+        pos = hi;
+    }
+    count->scanned_to = pos;
+    count->complete = (pos >= last_start + 1);
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_delete){
-    set_current_keymap(app, mapid_chord_delete);
-
-    state.action = vimaction_delete_range;
-
-    push_to_chord_bar(app, lit("d"));
+// Index of the match at pos, if it has been counted yet, or -1.
+static int find_counted_match(Search_Count* count, int pos) {
+    int lo = 0;
+    int hi = count->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        if (count->matches[mid] < pos) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+    return (lo < count->count && count->matches[lo] == pos ? lo : -1);
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_change){
-    set_current_keymap(app, mapid_chord_delete);
+// Called after every search with the cursor on its result.
+static void update_search_count(struct Application_Links* app,
+                                View_Summary* view, Search_Direction direction) {
+    Buffer_Summary buffer = get_buffer(app, view->buffer_id, AccessAll);
+    Search_Count* count = &state.search_count;
+    String pattern = state.last_search.text;
+    uint64_t version = get_buffer_edit_version(app, &buffer);
+    bool same = (count->buffer_id == buffer.buffer_id &&
+                 count->version == version &&
+                 count->whole_word == state.last_search.whole_word &&
+                 count->ignore_case == state.last_search.ignore_case &&
+                 match(make_string(count->pattern, count->pattern_size), pattern));
+    if (!same) {
+        count->buffer_id = buffer.buffer_id;
+        count->version = version;
+        count->whole_word = state.last_search.whole_word;
+        count->ignore_case = state.last_search.ignore_case;
+        count->pattern_size = (pattern.size < (int)sizeof(count->pattern) ?
+                               pattern.size : (int)sizeof(count->pattern));
+        memcpy(count->pattern, pattern.str, count->pattern_size);
+        count->count = 0;
+        count->scanned_to = 0;
+        count->complete = count->capped = false;
+        count->current = -1;
+        cancel_search_count_job();
+    }
+    advance_search_count(app, &buffer, SEARCH_COUNT_BUDGET);
+    if (!count->complete) { start_search_count_job(app, &buffer); }
 
-    state.action = vimaction_change_range;
+    // n and N land on the neighbouring match, so step the index rather
+    // than look the position up again.
+    int pos = view->cursor.pos;
+    int current = -1;
+    if (same && count->current >= 0) {
+        int next = count->current + direction;
+        if (count->complete && next < 0) { next = count->count - 1; }
+        if (count->complete && next >= count->count) { next = 0; }
+        if (next >= 0 && next < count->count && count->matches[next] == pos) {
+            current = next;
+        }
+    }
+    if (current < 0) { current = find_counted_match(count, pos); }
+    count->current = current;
+    show_search_count(app);
+}
 
-    push_to_chord_bar(app, lit("c"));
+// From the render caller: picks up the worker's count, or without one
+// counts some more, until the total is known.
+static void continue_search_count(struct Application_Links* app,
+                                  View_Summary* view) {
+    Search_Count* count = &state.search_count;
+    Buffer_Summary buffer = get_buffer(app, count->buffer_id, AccessAll);
+    bool up_to_date = (buffer.exists &&
+                       get_buffer_edit_version(app, &buffer) == count->version);
+    // If the buffer changed under the count, the next search starts over
+    if (!up_to_date) { cancel_search_count_job(); }
+    bool was_complete = count->complete;
+    drain_search_count_jobs();
+    if (!up_to_date || was_complete || !state.search_count_bar.exists ||
+        count->buffer_id != view->buffer_id) {
+        return;
+    }
+    if (!count->complete && !start_search_count_job(app, &buffer)) {
+        advance_search_count(app, &buffer, SEARCH_COUNT_BUDGET);
+    }
+    if (count->current < 0) {
+        count->current = find_counted_match(count, view->cursor.pos);
+    }
+    show_search_count(app);
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_yank){
-    set_current_keymap(app, mapid_chord_yank);
+// Paragraph and sentence boundaries:                              @boundaries
+// Sorted positions of every empty line (paragraph boundaries) and every
+// sentence start, kept per buffer. Edits don't throw them away: the edit
+// hook drops the entries the edit touched, shifts the ones after it, and
+// marks the edited span dirty. The next query rescans just that span.
+struct Boundary_Cache {
+    bool built;
+    int* positions;
+    int count;
+    int capacity;
+    // Span edited since the last query, in current buffer coordinates
+    bool has_dirty;
+    Range dirty;
+};
 
-    state.action = vimaction_yank_range;
+struct Structure_Cache {
+    Buffer_ID buffer_id;
+    // See get_buffer_generation
+    uint64_t generation;
+    Boundary_Cache paragraphs;
+    Boundary_Cache sentences;
+};
 
-    push_to_chord_bar(app, lit("y"));
+constexpr int STRUCTURE_CACHE_SIZE = 8;
+static Structure_Cache structure_caches[STRUCTURE_CACHE_SIZE];
+static int structure_cache_next_slot = 0;
+
+// First index whose position is >= pos.
+static int boundary_lower_bound(Boundary_Cache* cache, int pos) {
+    int lo = 0;
+    int hi = cache->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        if (cache->positions[mid] < pos) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+    return lo;
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_indent_left){
-    set_current_keymap(app, mapid_chord_indent_left);
-    state.action = vimaction_indent_left_range;
-    push_to_chord_bar(app, lit("<"));
+// Replace the entries in [range.start, range.end] with new_positions.
+static void boundary_splice(Boundary_Cache* cache, Range range,
+                            int* new_positions, int new_count) {
+    int lo = boundary_lower_bound(cache, range.start);
+    int hi = boundary_lower_bound(cache, range.end + 1);
+    int count = cache->count - (hi - lo) + new_count;
+    if (count > cache->capacity) {
+        cache->capacity = count * 2;
+        cache->positions = (int*)realloc(cache->positions,
+                                         cache->capacity * sizeof(int));
+    }
+    memmove(cache->positions + lo + new_count, cache->positions + hi,
+            (cache->count - hi) * sizeof(int));
+    memcpy(cache->positions + lo, new_positions, new_count * sizeof(int));
+    cache->count = count;
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_indent_right){
-    set_current_keymap(app, mapid_chord_indent_right);
-    state.action = vimaction_indent_right_range;
-    push_to_chord_bar(app, lit(">"));
+// Grow dirty to also cover old, an earlier dirty span, mapped through the
+// edit that replaced range with new_size characters.
+static Range merge_dirty_range(Range dirty, Range old, Range range,
+                               int new_size) {
+    int delta = new_size - (range.end - range.start);
+    int old_start = (old.start < range.start ? old.start :
+                     old.start >= range.end ? old.start + delta : range.start);
+    int old_end = (old.end < range.start ? old.end :
+                   old.end >= range.end ? old.end + delta : range.start + new_size);
+    if (old_start < dirty.start) { dirty.start = old_start; }
+    if (old_end > dirty.end) { dirty.end = old_end; }
+    return dirty;
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_format){
-    set_current_keymap(app, mapid_chord_format);
+static void boundary_cache_apply_edit(Boundary_Cache* cache, Range range,
+                                      int new_size) {
+    if (!cache->built) { return; }
+    int delta = new_size - (range.end - range.start);
+    // Whether a position is a boundary depends on the character before it
+    int lo = boundary_lower_bound(cache, range.start - 1);
+    int hi = boundary_lower_bound(cache, range.end + 1);
+    for (int i = hi; i < cache->count; ++i) {
+        cache->positions[i] += delta;
+    }
+    memmove(cache->positions + lo, cache->positions + hi,
+            (cache->count - hi) * sizeof(int));
+    cache->count -= hi - lo;
 
-    state.action = vimaction_format_range;
-
-    push_to_chord_bar(app, lit("="));
+    Range dirty = make_range(range.start - 1, range.start + new_size + 1);
+    if (cache->has_dirty) {
+        dirty = merge_dirty_range(dirty, cache->dirty, range, new_size);
+    }
+    if (dirty.start < 0) { dirty.start = 0; }
+    cache->dirty = dirty;
+    cache->has_dirty = true;
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_window){
-    set_current_keymap(app, mapid_chord_window);
-    push_to_chord_bar(app, lit("^W"));
+static void apply_edit_to_structure_caches(Buffer_ID buffer_id, Range range,
+                                           int new_size) {
+    for (int i = 0; i < STRUCTURE_CACHE_SIZE; ++i) {
+        Structure_Cache* cache = structure_caches + i;
+        if (cache->buffer_id == buffer_id) {
+            boundary_cache_apply_edit(&cache->paragraphs, range, new_size);
+            boundary_cache_apply_edit(&cache->sentences, range, new_size);
+        }
+    }
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_move_find){
-    set_current_keymap(app, mapid_chord_move_find);
-    push_to_chord_bar(app, lit("f"));
+// Empty lines in [scan.start, scan.end]; text starts at scan.start - 1.
+static int scan_paragraph_boundaries(const char* text, int size, Range scan,
+                                     int** out) {
+    int count = 0;
+    int capacity = 0;
+    for (int pos = scan.start; pos <= scan.end && pos < size; ++pos) {
+        const char* at = text + (pos - scan.start + 1);
+        if (*at == '\n' && (pos == 0 || at[-1] == '\n')) {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                *out = (int*)realloc(*out, capacity * sizeof(int));
+            }
+            (*out)[count++] = pos;
+        }
+    }
+    return count;
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_move_til){
-    set_current_keymap(app, mapid_chord_move_til);
-    push_to_chord_bar(app, lit("t"));
+// Sentence starts in [scan.start, scan.end], which must begin at the buffer
+// start or an empty line. A sentence starts at the first non-blank after a
+// paragraph break, or after .!? (plus any closing )]"') and whitespace.
+static int scan_sentence_boundaries(const char* text, Range scan, int** out) {
+    int count = 0;
+    int capacity = 0;
+    bool start_next = true;
+    bool saw_end = false;
+    for (int pos = scan.start; pos < scan.end; ++pos) {
+        const char* at = text + (pos - scan.start + 1);
+        char c = *at;
+        if (char_is_whitespace(c)) {
+            if (saw_end) { start_next = true; }
+            saw_end = false;
+            if (c == '\n' && (pos == 0 || at[-1] == '\n')) { start_next = true; }
+            continue;
+        }
+        if (start_next) {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                *out = (int*)realloc(*out, capacity * sizeof(int));
+            }
+            (*out)[count++] = pos;
+            start_next = false;
+        }
+        if (c == '.' || c == '!' || c == '?') {
+            saw_end = true;
+        } else if (!(saw_end && (c == ')' || c == ']' || c == '"' || c == '\''))) {
+            saw_end = false;
+        }
+    }
+    return count;
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_move_rfind){
-    set_current_keymap(app, mapid_chord_move_rfind);
-    push_to_chord_bar(app, lit("F"));
+// Read [scan.start - 1, scan.end + 1) so scanners can look one char back.
+static char* read_scan_text(struct Application_Links* app,
+                            Buffer_Summary* buffer, Range scan) {
+    int read_start = (scan.start > 0 ? scan.start - 1 : 0);
+    int read_end = (scan.end + 1 < buffer->size ? scan.end + 1 : buffer->size);
+    char* text = (char*)malloc(scan.end - scan.start + 3);
+    text[0] = '\n';
+    buffer_read_range(app, buffer, read_start, read_end,
+                      text + 1 - (scan.start - read_start));
+    text[read_end - scan.start + 1] = 0;
+    return text;
 }
 
-CUSTOM_COMMAND_SIG(enter_chord_move_rtil){
-    set_current_keymap(app, mapid_chord_move_rtil);
-    push_to_chord_bar(app, lit("T"));
-}
+static Structure_Cache* get_structure_cache(struct Application_Links* app,
+                                            Buffer_Summary* buffer) {
+    uint64_t generation = get_buffer_generation(app, buffer->buffer_id);
+    Structure_Cache* cache = 0;
+    for (int i = 0; i < STRUCTURE_CACHE_SIZE; ++i) {
+        if (structure_caches[i].buffer_id == buffer->buffer_id &&
+            structure_caches[i].paragraphs.built) {
+            cache = structure_caches + i;
+            break;
+        }
+    }
+    // One left by a killed buffer that had this id is rebuilt in place
+    if (!cache || cache->generation != generation) {
+        if (!cache) {
+            cache = structure_caches + structure_cache_next_slot;
+            structure_cache_next_slot = (structure_cache_next_slot + 1) % STRUCTURE_CACHE_SIZE;
+        }
+        free(cache->paragraphs.positions);
+        free(cache->sentences.positions);
+        *cache = {};
+        cache->buffer_id = buffer->buffer_id;
+        cache->generation = generation;
+    }
 
-CUSTOM_COMMAND_SIG(enter_chord_g){
-    set_current_keymap(app, mapid_chord_g);
-    push_to_chord_bar(app, lit("g"));
-}
+    Boundary_Cache* paragraphs = &cache->paragraphs;
+    Boundary_Cache* sentences = &cache->sentences;
+    if (!paragraphs->built) {
+        paragraphs->has_dirty = sentences->has_dirty = true;
+        paragraphs->dirty = sentences->dirty = make_range(0, buffer->size);
+        paragraphs->built = sentences->built = true;
+    }
 
-CUSTOM_COMMAND_SIG(move_line_exec_action){
-    View_Summary view = get_active_view(app, AccessProtected);
-	int initial = view.cursor.pos;
-    seek_beginning_of_line(app);
-    refresh_view(app, &view);
-    int line_begin = view.cursor.pos;
-    seek_end_of_line(app);
-    refresh_view(app, &view);
-    int line_end = view.cursor.pos + 1;
-    vim_exec_action(app, make_range(line_begin, line_end), true);
-    view_set_cursor(app, &view, seek_pos(initial), true);
+    if (paragraphs->has_dirty) {
+        Range scan = paragraphs->dirty;
+        if (scan.end > buffer->size) { scan.end = buffer->size; }
+        char* text = read_scan_text(app, buffer, scan);
+        int* found = 0;
+        int found_count = scan_paragraph_boundaries(text, buffer->size, scan, &found);
+        boundary_splice(paragraphs, scan, found, found_count);
+        free(found);
+        free(text);
+        paragraphs->has_dirty = false;
+    }
+
+    if (sentences->has_dirty) {
+        // Sentences never carry across an empty line, so rescanning whole
+        // paragraphs around the edit is enough.
+        Range scan = sentences->dirty;
+        int before = boundary_lower_bound(paragraphs, scan.start) - 1;
+        int after = boundary_lower_bound(paragraphs, scan.end + 1);
+        scan.start = (before >= 0 ? paragraphs->positions[before] : 0);
+        scan.end = (after < paragraphs->count ? paragraphs->positions[after] : buffer->size);
+        char* text = read_scan_text(app, buffer, scan);
+        int* found = 0;
+        int found_count = scan_sentence_boundaries(text, scan, &found);
+        boundary_splice(sentences, scan, found, found_count);
+        free(found);
+        free(text);
+        sentences->has_dirty = false;
+    }
+    return cache;
 }
 
-CUSTOM_COMMAND_SIG(vim_delete_line){
-    state.action = vimaction_delete_range;
-    move_line_exec_action(app);
+// Text objects:                                                  @textobjects
+static int get_char_class(char c, bool big_word) {
+    if (char_is_whitespace(c)) { return 0; }
+    if (big_word || char_is_alpha_numeric(c)) { return 1; }
+    return 2;
 }
 
-CUSTOM_COMMAND_SIG(yank_line){
-    state.action = vimaction_yank_range;
-    move_line_exec_action(app);
+// iw, aw, iW and aW, worked out within the cursor's line.
+static bool get_word_object(struct Application_Links* app,
+                            Buffer_Summary* buffer, int pos, bool around,
+                            bool big_word, Range* out) {
+    int line_start = seek_line_beginning(app, buffer, pos);
+    int line_end = seek_line_end(app, buffer, pos);
+    if (pos >= line_end) { return false; }
+    int size = line_end - line_start;
+    char* line = (char*)malloc(size);
+    defer(free(line));
+    buffer_read_range(app, buffer, line_start, line_end, line);
+
+    int at = pos - line_start;
+    int cls = get_char_class(line[at], big_word);
+    int start = at;
+    int end = at + 1;
+    while (start > 0 && get_char_class(line[start - 1], big_word) == cls) { --start; }
+    while (end < size && get_char_class(line[end], big_word) == cls) { ++end; }
+
+    if (around) {
+        if (cls != 0) {
+            int trailing = end;
+            while (trailing < size && char_is_whitespace(line[trailing])) { ++trailing; }
+            if (trailing > end) {
+                end = trailing;
+            } else {
+                while (start > 0 && char_is_whitespace(line[start - 1])) { --start; }
+            }
+        } else if (end < size) {
+            int next_cls = get_char_class(line[end], big_word);
+            while (end < size && get_char_class(line[end], big_word) == next_cls) { ++end; }
+        }
+    }
+    *out = make_range(line_start + start, line_start + end);
+    return true;
 }
 
-template <Search_Direction seek_forward, bool include_found>
-CUSTOM_COMMAND_SIG(seek_for_character){
-    Buffer_Summary buffer;
-    View_Summary view;
-    User_Input trigger;
-    int pos1, pos2;
-    
-    unsigned int access = AccessProtected;
-    view = get_active_view(app, access);
-    buffer = get_buffer(app, view.buffer_id, access);
+// i( a( i[ a[ i{ a{, from the bracket index. For a block whose braces sit
+// on their own lines, the inner object is just the lines in between.
+static bool get_bracket_object(struct Application_Links* app,
+                               Buffer_Summary* buffer, int pos, bool around,
+                               Bracket_Kind kind, Range* out) {
+    Bracket_Index* index = get_bracket_index(app, buffer);
+    int open = find_enclosing_bracket(index, pos, kind);
+    if (open < 0) { return false; }
+    int open_pos = index->brackets[open].pos;
+    int close_pos = index->brackets[index->brackets[open].match].pos;
+    if (around) {
+        *out = make_range(open_pos, close_pos + 1);
+        return true;
+    }
 
-    trigger = get_command_input(app);
+    int start = open_pos + 1;
+    int end = close_pos;
+    if (buffer_get_char(app, buffer, start) == '\n') {
+        ++start;
+        int close_line_start = seek_line_beginning(app, buffer, close_pos);
+        bool close_on_own_line = true;
+        for (int p = close_line_start; p < close_pos; ++p) {
+            if (!char_is_whitespace(buffer_get_char(app, buffer, p))) {
+                close_on_own_line = false;
+                break;
+            }
+        }
+        if (close_on_own_line && close_line_start >= start) {
+            end = close_line_start;
+        }
+    }
+    if (end < start) { end = start; }
+    *out = make_range(start, end);
+    return true;
+}
 
-    pos1 = view.cursor.pos;
-    if (seek_forward) {
-        buffer_seek_delimiter_forward(app, &buffer, pos1+1, (char)trigger.key.character, &pos2);
+// i" a" i' a' i` a`. Inside a string or character token the token itself
+// is the answer; otherwise quotes are paired up along the cursor's line.
+static bool get_quote_object(struct Application_Links* app,
+                             Buffer_Summary* buffer, int pos, bool around,
+                             char quote, Range* out) {
+    Cpp_Get_Token_Result result = {};
+    if (buffer->tokens_are_ready &&
+        buffer_get_token_index(app, buffer, pos, &result) &&
+        !result.in_whitespace) {
+        Cpp_Token token = {};
+        buffer_read_tokens(app, buffer, result.token_index,
+                           result.token_index + 1, &token);
+        if ((token.type == CPP_TOKEN_STRING_CONSTANT ||
+             token.type == CPP_TOKEN_CHARACTER_CONSTANT) &&
+            token.size >= 2) {
+            // Skip prefixes like L"" or u8""
+            int open_pos = token.start;
+            int token_end = token.start + token.size;
+            while (open_pos < token_end &&
+                   buffer_get_char(app, buffer, open_pos) != quote) {
+                ++open_pos;
+            }
+            if (open_pos < token_end - 1 &&
+                buffer_get_char(app, buffer, token_end - 1) == quote) {
+                *out = (around ? make_range(open_pos, token_end) :
+                        make_range(open_pos + 1, token_end - 1));
+                return true;
+            }
+        }
     }
-    else {
-        buffer_seek_delimiter_backward(app, &buffer, pos1-1, (char)trigger.key.character, &pos2);
+
+    int line_start = seek_line_beginning(app, buffer, pos);
+    int line_end = seek_line_end(app, buffer, pos);
+    int size = line_end - line_start;
+    char* line = (char*)malloc(size + 1);
+    defer(free(line));
+    buffer_read_range(app, buffer, line_start, line_end, line);
+    int at = pos - line_start;
+    int open = -1;
+    for (int i = 0; i < size; ++i) {
+        if (line[i] == '\\') { ++i; continue; }
+        if (line[i] != quote) { continue; }
+        if (open < 0) { open = i; continue; }
+        if (at <= i) {
+            *out = (around ? make_range(line_start + open, line_start + i + 1) :
+                    make_range(line_start + open + 1, line_start + i));
+            return true;
+        }
+        open = -1;
     }
-    move_left(app);
-    if (!include_found) { 
-        pos2 += seek_forward;
+    return false;
+}
+
+static int get_tag_name_end(const char* text, int size, int pos) {
+    while (pos < size && (char_is_alpha_numeric(text[pos]) || text[pos] == '-' ||
+                          text[pos] == ':' || text[pos] == '.')) {
+        ++pos;
     }
-    view_set_cursor(app, &view, seek_pos(pos2), true);
-    
-    if (pos2 >= 0) {
-        vim_exec_action(app, make_range(pos1, pos2));
+    return pos;
+}
+
+// it and at: the innermost <tag>...</tag> pair around pos. Markup isn't in
+// the C++ token array, so this one does scan the text.
+static bool get_tag_object(struct Application_Links* app,
+                           Buffer_Summary* buffer, int pos, bool around,
+                           Range* out) {
+    char* text = read_entire_buffer(app, buffer);
+    defer(free(text));
+    int size = buffer->size;
+    for (int open = (pos < size ? pos : size - 1); open >= 0; --open) {
+        if (text[open] != '<') { continue; }
+        int name_start = open + 1;
+        int name_end = get_tag_name_end(text, size, name_start);
+        if (name_end == name_start) { continue; }
+        String name = make_string(text + name_start, name_end - name_start);
+        const char* open_end_ptr = (const char*)memchr(text + name_end, '>', size - name_end);
+        if (!open_end_ptr) { continue; }
+        int open_end = (int)(open_end_ptr - text) + 1;
+        if (text[open_end - 2] == '/') { continue; }
+
+        int depth = 1;
+        for (int p = open_end; p < size; ++p) {
+            if (text[p] != '<') { continue; }
+            bool closing = (p + 1 < size && text[p + 1] == '/');
+            int tag_start = p + (closing ? 2 : 1);
+            int tag_end = get_tag_name_end(text, size, tag_start);
+            if (!match(make_string(text + tag_start, tag_end - tag_start), name)) {
+                continue;
+            }
+            const char* end_ptr = (const char*)memchr(text + tag_end, '>', size - tag_end);
+            if (!end_ptr) { break; }
+            int tag_close = (int)(end_ptr - text) + 1;
+            if (!closing) {
+                if (text[tag_close - 2] != '/') { ++depth; }
+                continue;
+            }
+            if (--depth == 0) {
+                if (tag_close <= pos) { break; }
+                *out = (around ? make_range(open, tag_close) :
+                        make_range(open_end, p));
+                return true;
+            }
+        }
     }
-    else {
-        //TODO(chronister): This will not be correct for visual mode!
-        enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+    return false;
+}
+
+static void set_register_text(struct Application_Links* app,
+                              Vim_Register* target_register,
+                              const char* text, int size) {
+    free_register_text(target_register);
+    target_register->text = make_string((char*)malloc(size), size);
+    memcpy(target_register->text.str, text, size);
+    if (target_register == &state.registers[reg_system_clipboard]) {
+        clipboard_post(app, 0, target_register->text.str, target_register->text.size);
     }
 }
 
-#define vim_seek_find_character seek_for_character<search_forward, true>
-#define vim_seek_til_character seek_for_character<search_forward, false>
-#define vim_seek_rfind_character seek_for_character<search_backward, true>
-#define vim_seek_rtil_character seek_for_character<search_backward, false>
+// Keyword completion index:                                          @words
+// Every word (a run of get_char_class 1 characters) in every open buffer,
+// interned once in a shared table that counts its occurrences. Each buffer
+// keeps its occurrences sorted by position; the edit hook drops the ones an
+// edit touched, shifts the rest and marks the span dirty, and the next lookup
+// rescans only the dirty lines. The interned words are kept sorted too, so a
+// prefix lookup is a binary search.
+struct Word_Entry {
+    // Offset into Word_Table::strings
+    int offset;
+    int size;
+    // Occurrences across every indexed buffer
+    int refs;
+};
 
-//TODO(chronister): move_up and move_down both operate on lines, which is not reflected here.
-CUSTOM_COMMAND_SIG(vim_move_up){
-    View_Summary view;
-    int pos1, pos2;
-    
-    unsigned int access = AccessProtected;
-    view = get_active_view(app, access);
+struct Word_Occurrence {
+    int pos;
+    int word;
+};
 
-    pos1 = view.cursor.pos;
+struct Word_Buffer {
+    Buffer_ID buffer_id;
+    Word_Occurrence* occurrences;
+    int count;
+    int capacity;
+    // Span edited since the last lookup, in current buffer coordinates
+    bool has_dirty;
+    Range dirty;
+    bool seen;
+};
 
-    move_up(app);
-    refresh_view(app, &view);
-    pos2 = view.cursor.pos;
-    
-    vim_exec_action(app, make_range(pos1, pos2));
-}
+struct Word_Table {
+    char* strings;
+    int strings_size;
+    int strings_capacity;
 
-CUSTOM_COMMAND_SIG(vim_move_down){
-    View_Summary view;
-    int pos1, pos2;
-    
-    unsigned int access = AccessProtected;
-    view = get_active_view(app, access);
+    Word_Entry* words;
+    int word_count;
+    int word_capacity;
 
-    pos1 = view.cursor.pos;
+    // Open addressed, holds word index + 1
+    int* slots;
+    int slot_capacity;
 
-    move_down(app);
-    refresh_view(app, &view);
-    pos2 = view.cursor.pos;
-    
-    vim_exec_action(app, make_range(pos1, pos2));
-}
+    // Word indices in string order; words past sorted_count are new
+    int* sorted;
+    int sorted_count;
 
-CUSTOM_COMMAND_SIG(cycle_window_focus){
-    // ASSUMPTION: End of a ^W window shortcut presumably
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
+    Word_Buffer* buffers;
+    int buffer_count;
+    int buffer_capacity;
+};
 
-    change_active_panel(app);
-}
+static Word_Table word_table = {};
 
-CUSTOM_COMMAND_SIG(open_window_hsplit){
-    // ASSUMPTION: End of a ^W window shortcut presumably
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
+// Shorter and longer runs aren't worth offering as completions.
+constexpr int WORD_MIN_SIZE = 2;
+constexpr int WORD_MAX_SIZE = 64;
 
-    View_Summary view = get_active_view(app, AccessAll);
-    View_Summary new_view = open_view(app, &view, ViewSplit_Top);
-    set_active_view(app, &view);
+static uint32_t hash_word(const char* str, int size) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < size; ++i) {
+        hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+    }
+    return hash;
 }
 
-CUSTOM_COMMAND_SIG(open_window_dup_hsplit){
-    // ASSUMPTION: End of a ^W window shortcut presumably
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
-
-    View_Summary view = get_active_view(app, AccessAll);
-    View_Summary new_view = open_view(app, &view, ViewSplit_Top);
-    view_set_buffer(app, &new_view, view.buffer_id, 0);
-    set_active_view(app, &view);
+static void insert_word_slot(int word) {
+    Word_Entry* entry = word_table.words + word;
+    int mask = word_table.slot_capacity - 1;
+    int slot = hash_word(word_table.strings + entry->offset, entry->size) & mask;
+    while (word_table.slots[slot]) { slot = (slot + 1) & mask; }
+    word_table.slots[slot] = word + 1;
 }
 
-CUSTOM_COMMAND_SIG(open_window_vsplit){
-    // ASSUMPTION: End of a ^W window shortcut presumably
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
+static int intern_word(const char* str, int size) {
+    Word_Table* table = &word_table;
+    if ((table->word_count + 1) * 2 > table->slot_capacity) {
+        free(table->slots);
+        table->slot_capacity = (table->slot_capacity ? table->slot_capacity * 2 : 4096);
+        table->slots = (int*)calloc(table->slot_capacity, sizeof(int));
+        for (int i = 0; i < table->word_count; ++i) { insert_word_slot(i); }
+    }
 
-    View_Summary view = get_active_view(app, AccessAll);
-    View_Summary new_view = open_view(app, &view, ViewSplit_Right);
-    set_active_view(app, &view);
+    int mask = table->slot_capacity - 1;
+    for (int slot = hash_word(str, size) & mask; table->slots[slot];
+         slot = (slot + 1) & mask) {
+        Word_Entry* entry = table->words + table->slots[slot] - 1;
+        if (entry->size == size &&
+            memcmp(table->strings + entry->offset, str, size) == 0) {
+            return table->slots[slot] - 1;
+        }
+    }
+
+    if (table->strings_size + size > table->strings_capacity) {
+        table->strings_capacity = (table->strings_size + size) * 2;
+        table->strings = (char*)realloc(table->strings, table->strings_capacity);
+    }
+    if (table->word_count == table->word_capacity) {
+        table->word_capacity = (table->word_capacity ? table->word_capacity * 2 : 1024);
+        table->words = (Word_Entry*)realloc(table->words,
+                                            table->word_capacity * sizeof(Word_Entry));
+    }
+    int word = table->word_count++;
+    table->words[word] = { table->strings_size, size, 0 };
+    memcpy(table->strings + table->strings_size, str, size);
+    table->strings_size += size;
+    insert_word_slot(word);
+    return word;
 }
 
-CUSTOM_COMMAND_SIG(open_window_dup_vsplit){
-    // ASSUMPTION: End of a ^W window shortcut presumably
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
+static int compare_word_strings(int a, int b) {
+    Word_Entry* left = word_table.words + a;
+    Word_Entry* right = word_table.words + b;
+    int size = (left->size < right->size ? left->size : right->size);
+    int result = memcmp(word_table.strings + left->offset,
+                        word_table.strings + right->offset, size);
+    return (result ? result : left->size - right->size);
+}
 
-    View_Summary view = get_active_view(app, AccessAll);
-    View_Summary new_view = open_view(app, &view, ViewSplit_Right);
-    view_set_buffer(app, &new_view, view.buffer_id, 0);
-    set_active_view(app, &view);
+static int compare_word_indices(const void* a, const void* b) {
+    return compare_word_strings(*(const int*)a, *(const int*)b);
 }
 
-CUSTOM_COMMAND_SIG(focus_window_left) {
-    View_Summary view = get_active_view(app, AccessAll);
+// Sort the words interned since the last call and merge them in.
+static void sort_word_table() {
+    Word_Table* table = &word_table;
+    int old_count = table->sorted_count;
+    int new_count = table->word_count - old_count;
+    if (new_count == 0) { return; }
+
+    int* added = (int*)malloc(new_count * sizeof(int));
+    defer(free(added));
+    for (int i = 0; i < new_count; ++i) { added[i] = old_count + i; }
+    qsort(added, new_count, sizeof(int), compare_word_indices);
+
+    int* merged = (int*)malloc(table->word_count * sizeof(int));
+    int a = 0, b = 0, out = 0;
+    while (a < old_count && b < new_count) {
+        if (compare_word_strings(table->sorted[a], added[b]) <= 0) {
+            merged[out++] = table->sorted[a++];
+        } else {
+            merged[out++] = added[b++];
+        }
+    }
+    while (a < old_count) { merged[out++] = table->sorted[a++]; }
+    while (b < new_count) { merged[out++] = added[b++]; }
+    free(table->sorted);
+    table->sorted = merged;
+    table->sorted_count = table->word_count;
+}
 
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
+static Word_Buffer* find_word_buffer(Buffer_ID buffer_id) {
+    for (int i = 0; i < word_table.buffer_count; ++i) {
+        if (word_table.buffers[i].buffer_id == buffer_id) {
+            return word_table.buffers + i;
+        }
+    }
+    return 0;
+}
 
-    i32_Rect current = view.view_region;
-    int x = current.x0; //view.cursor.wrapped_x;
-    int y = current.y0; //view.cursor.wrapped_y;
+// First occurrence that ends at or after pos.
+static int word_occurrence_lower_bound(Word_Buffer* words, int pos) {
+    int lo = 0;
+    int hi = words->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        Word_Occurrence* at = words->occurrences + mid;
+        if (at->pos + word_table.words[at->word].size < pos) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+    return lo;
+}
 
-    View_Summary best = view;
+// Drop occurrences [lo, hi) and put new_occurrences in their place.
+static void word_occurrences_splice(Word_Buffer* words, int lo, int hi,
+                                    Word_Occurrence* new_occurrences,
+                                    int new_count) {
+    for (int i = lo; i < hi; ++i) {
+        --word_table.words[words->occurrences[i].word].refs;
+    }
+    for (int i = 0; i < new_count; ++i) {
+        ++word_table.words[new_occurrences[i].word].refs;
+    }
+    int count = words->count - (hi - lo) + new_count;
+    if (count > words->capacity) {
+        words->capacity = count * 2;
+        words->occurrences = (Word_Occurrence*)realloc(
+            words->occurrences, words->capacity * sizeof(Word_Occurrence));
+    }
+    memmove(words->occurrences + lo + new_count, words->occurrences + hi,
+            (words->count - hi) * sizeof(Word_Occurrence));
+    if (new_count > 0) {
+        memcpy(words->occurrences + lo, new_occurrences,
+               new_count * sizeof(Word_Occurrence));
+    }
+    words->count = count;
+}
 
-    for_views(nextview, app) {
-        if (nextview.view_id == view.view_id) continue;
-        i32_Rect next = nextview.view_region;
-        if (y < next.y0 || y > next.y1) continue;
-        if (x < next.x0) continue;
-        if (best.view_id == view.view_id || next.x0 > best.view_region.x0) best = nextview;
+static void apply_edit_to_word_index(Buffer_ID buffer_id, Range range,
+                                     int new_size) {
+    Word_Buffer* words = find_word_buffer(buffer_id);
+    if (!words) { return; }
+    int delta = new_size - (range.end - range.start);
+    // Words touching either end of the edit may have grown or been split
+    int lo = word_occurrence_lower_bound(words, range.start);
+    int hi = lo;
+    while (hi < words->count && words->occurrences[hi].pos <= range.end) { ++hi; }
+    for (int i = hi; i < words->count; ++i) {
+        words->occurrences[i].pos += delta;
     }
 
-    set_active_view(app, &best);
+    Range dirty = make_range(range.start, range.start + new_size);
+    if (lo < hi) {
+        Word_Occurrence* first = words->occurrences + lo;
+        Word_Occurrence* last = words->occurrences + hi - 1;
+        int last_end = last->pos + word_table.words[last->word].size;
+        if (first->pos < dirty.start) { dirty.start = first->pos; }
+        if (last_end + delta > dirty.end) { dirty.end = last_end + delta; }
+    }
+    word_occurrences_splice(words, lo, hi, 0, 0);
+
+    if (words->has_dirty) {
+        dirty = merge_dirty_range(dirty, words->dirty, range, new_size);
+    }
+    words->dirty = dirty;
+    words->has_dirty = true;
 }
 
-CUSTOM_COMMAND_SIG(focus_window_right) {
-    View_Summary view = get_active_view(app, AccessAll);
+// Words in text, which starts at buffer position base.
+static int scan_words(const char* text, int size, int base,
+                      Word_Occurrence** out) {
+    int count = 0;
+    int capacity = 0;
+    for (int at = 0; at < size;) {
+        if (get_char_class(text[at], false) != 1) {
+            ++at;
+            continue;
+        }
+        int start = at;
+        while (at < size && get_char_class(text[at], false) == 1) { ++at; }
+        int word_size = at - start;
+        if (word_size < WORD_MIN_SIZE || word_size > WORD_MAX_SIZE) { continue; }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            *out = (Word_Occurrence*)realloc(*out, capacity * sizeof(Word_Occurrence));
+        }
+        (*out)[count++] = { base + start, intern_word(text + start, word_size) };
+    }
+    return count;
+}
 
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
+static void refresh_word_buffer(struct Application_Links* app,
+                                Buffer_Summary* buffer, Word_Buffer* words) {
+    if (!words->has_dirty) { return; }
+    words->has_dirty = false;
+    Range dirty = words->dirty;
+    if (dirty.start > buffer->size) { dirty.start = buffer->size; }
+    if (dirty.end > buffer->size) { dirty.end = buffer->size; }
+
+    // Words never span lines, so whole lines around the edit are enough
+    Range scan = make_range(seek_line_beginning(app, buffer, dirty.start),
+                            seek_line_end(app, buffer, dirty.end));
+    int size = scan.end - scan.start;
+    char* text = (char*)malloc(size + 1);
+    defer(free(text));
+    buffer_read_range(app, buffer, scan.start, scan.end, text);
+
+    Word_Occurrence* found = 0;
+    defer(free(found));
+    int found_count = scan_words(text, size, scan.start, &found);
+    int lo = word_occurrence_lower_bound(words, scan.start);
+    int hi = lo;
+    while (hi < words->count && words->occurrences[hi].pos <= scan.end) { ++hi; }
+    word_occurrences_splice(words, lo, hi, found, found_count);
+}
 
-    i32_Rect current = view.view_region;
-    int x = current.x0; //view.cursor.wrapped_x;
-    int y = current.y0; //view.cursor.wrapped_y;
+// Bring the index up to date with the open buffers: index new ones, rescan
+// the edited spans of known ones and forget the ones that were closed.
+static void update_word_index(struct Application_Links* app) {
+    Word_Table* table = &word_table;
+    for (int i = 0; i < table->buffer_count; ++i) {
+        table->buffers[i].seen = false;
+    }
 
-    View_Summary best = view;
+    for (Buffer_Summary buffer = get_buffer_first(app, AccessAll);
+         buffer.exists; get_buffer_next(app, &buffer, AccessAll)) {
+        // Skip *messages*, *quickfix* and friends
+        if (buffer.buffer_name_len > 0 && buffer.buffer_name[0] == '*') { continue; }
+        if (buffer_is_large_file(buffer.buffer_id)) { continue; }
+        Word_Buffer* words = find_word_buffer(buffer.buffer_id);
+        if (!words) {
+            if (table->buffer_count == table->buffer_capacity) {
+                table->buffer_capacity = (table->buffer_capacity ? table->buffer_capacity * 2 : 16);
+                table->buffers = (Word_Buffer*)realloc(
+                    table->buffers, table->buffer_capacity * sizeof(Word_Buffer));
+            }
+            words = table->buffers + table->buffer_count++;
+            *words = {};
+            words->buffer_id = buffer.buffer_id;
+            words->has_dirty = true;
+            words->dirty = make_range(0, buffer.size);
+        }
+        words->seen = true;
+        refresh_word_buffer(app, &buffer, words);
+    }
 
-    for_views(nextview, app) {
-        if (nextview.view_id == view.view_id) continue;
-        i32_Rect next = nextview.view_region;
-        if (y < next.y0 || y > next.y1) continue;
-        if (x > next.x0) continue;
-        if (best.view_id == view.view_id || next.x0 < best.view_region.x0) best = nextview;
+    for (int i = 0; i < table->buffer_count;) {
+        Word_Buffer* words = table->buffers + i;
+        if (words->seen) {
+            ++i;
+            continue;
+        }
+        word_occurrences_splice(words, 0, words->count, 0, 0);
+        free(words->occurrences);
+        *words = table->buffers[--table->buffer_count];
     }
+    sort_word_table();
+}
 
-    set_active_view(app, &best);
+static int compare_completions(const void* a, const void* b) {
+    int left = *(const int*)a;
+    int right = *(const int*)b;
+    // Most used first, then alphabetical
+    int refs = word_table.words[right].refs - word_table.words[left].refs;
+    return (refs ? refs : compare_word_strings(left, right));
 }
 
-CUSTOM_COMMAND_SIG(focus_window_down) {
-    View_Summary view = get_active_view(app, AccessAll);
+// Indexed words that start with prefix and are longer than it.
+static int find_word_completions(const char* prefix, int size, int** out) {
+    Word_Table* table = &word_table;
+    int lo = 0;
+    int hi = table->sorted_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        Word_Entry* entry = table->words + table->sorted[mid];
+        int common = (entry->size < size ? entry->size : size);
+        int result = memcmp(table->strings + entry->offset, prefix, common);
+        if (result < 0 || (result == 0 && entry->size < size)) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+
+    int count = 0;
+    int capacity = 0;
+    for (int i = lo; i < table->sorted_count; ++i) {
+        Word_Entry* entry = table->words + table->sorted[i];
+        if (entry->size < size ||
+            memcmp(table->strings + entry->offset, prefix, size) != 0) {
+            break;
+        }
+        if (entry->refs <= 0 || entry->size == size) { continue; }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            *out = (int*)realloc(*out, capacity * sizeof(int));
+        }
+        (*out)[count++] = table->sorted[i];
+    }
+    if (count > 0) {
+        qsort(*out, count, sizeof(int), compare_completions);
+    }
+    return count;
+}
+
+// Visual block:                                                        @block
+// The block is the lines between the selection's two ends, cut to the
+// columns between them. Columns are byte offsets from the line start.
+struct Visual_Block {
+    Range lines;
+    // One past the last column
+    Range columns;
+};
+
+struct Block_Line {
+    int line_start;
+    int line_end;
+    // The part of the line inside the block, empty if the line is too
+    // short to reach it.
+    Range segment;
+};
+
+static Visual_Block get_visual_block(struct Application_Links* app,
+                                     Buffer_Summary* buffer) {
+    int a = state.selection_cursor.start;
+    int b = state.selection_cursor.end;
+    int a_line = buffer_get_line_number(app, buffer, a);
+    int b_line = buffer_get_line_number(app, buffer, b);
+    int a_column = a - buffer_get_line_start(app, buffer, a_line);
+    int b_column = b - buffer_get_line_start(app, buffer, b_line);
+    Visual_Block block;
+    block.lines = make_range(a_line, b_line);
+    block.columns = make_range(a_column, b_column);
+    block.columns.end += 1;
+    return block;
+}
+
+static Range get_block_segment(Visual_Block block, int line_start,
+                               int line_end) {
+    int start = line_start + block.columns.start;
+    int end = line_start + block.columns.end;
+    if (start > line_end) { start = line_end; }
+    if (end > line_end) { end = line_end; }
+    return make_range(start, end);
+}
+
+// Split the block into per-line segments, reading its lines in one go. The
+// caller frees *text_out (which starts at the first line) and the result.
+static Block_Line* read_visual_block(struct Application_Links* app,
+                                     Buffer_Summary* buffer,
+                                     Visual_Block block, char** text_out) {
+    int span_start = buffer_get_line_start(app, buffer, block.lines.start);
+    int span_end = buffer_get_line_end(app, buffer, block.lines.end);
+    char* text = (char*)malloc(span_end - span_start + 1);
+    buffer_read_range(app, buffer, span_start, span_end, text);
+
+    int line_count = block.lines.end - block.lines.start + 1;
+    Block_Line* lines = (Block_Line*)malloc(line_count * sizeof(Block_Line));
+    int line_start = span_start;
+    for (int i = 0; i < line_count; ++i) {
+        const char* newline = (const char*)memchr(
+            text + (line_start - span_start), '\n', span_end - line_start);
+        int line_end = newline ? span_start + (int)(newline - text) : span_end;
+        lines[i].line_start = line_start;
+        lines[i].line_end = line_end;
+        lines[i].segment = get_block_segment(block, line_start, line_end);
+        line_start = line_end + 1;
+    }
+    *text_out = text;
+    return lines;
+}
+
+// Yank, delete or change the active visual block. Deleting is one batched
+// edit; changing leaves a Block_Insert pending for the typed text.
+static void exec_visual_block_action(struct Application_Links* app,
+                                     Pending_Action action) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    if (!buffer.exists) { return; }
+
+    Visual_Block block = get_visual_block(app, &buffer);
+    char* text = 0;
+    Block_Line* lines = read_visual_block(app, &buffer, block, &text);
+    defer(free(text));
+    defer(free(lines));
+    int line_count = block.lines.end - block.lines.start + 1;
+    int text_pos = lines[0].line_start;
+
+    char* yanked = (char*)malloc(buffer_get_line_end(app, &buffer, block.lines.end) -
+                                 text_pos + 1);
+    defer(free(yanked));
+    int yanked_size = 0;
+    for (int i = 0; i < line_count; ++i) {
+        Range segment = lines[i].segment;
+        memcpy(yanked + yanked_size, text + (segment.start - text_pos),
+               segment.end - segment.start);
+        yanked_size += segment.end - segment.start;
+        if (i + 1 < line_count) { yanked[yanked_size++] = '\n'; }
+    }
+    Vim_Register* target_register = state.registers + state.yank_register;
+    target_register->is_line = false;
+    set_register_text(app, target_register, yanked, yanked_size);
+
+    int top_left = lines[0].segment.start;
+    if (action == vimaction_yank_range) {
+        view_set_cursor(app, &view, seek_pos(top_left), true);
+        return;
+    }
+
+    History_Group group = begin_history_group(app, buffer.buffer_id);
+    Edit_Batch batch = {};
+    defer(edit_batch_free(&batch));
+    for (int i = 0; i < line_count; ++i) {
+        if (lines[i].segment.end > lines[i].segment.start) {
+            edit_batch_push(&batch, lines[i].segment.start,
+                            lines[i].segment.end, 0, 0);
+        }
+    }
+    edit_batch_apply(app, &buffer, &batch);
+    view_set_cursor(app, &view, seek_pos(top_left), true);
+
+    if (action == vimaction_change_range) {
+        Block_Insert insert = {};
+        insert.active = true;
+        insert.buffer_id = buffer.buffer_id;
+        insert.lines = make_range(block.lines.start + 1, block.lines.end);
+        insert.column = block.columns.start;
+        insert.insert_pos = top_left;
+        insert.history = group;
+        enter_insert_mode(app, buffer.buffer_id);
+        state.block_insert = insert;
+    }
+}
+
+// I and A on a visual block: type on the first line, copied to the rest
+// when insert mode ends.
+static void start_visual_block_insert(struct Application_Links* app,
+                                      bool append) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    if (!buffer.exists) { return; }
+
+    Visual_Block block = get_visual_block(app, &buffer);
+    int column = (append ? block.columns.end : block.columns.start);
+    int line_start = buffer_get_line_start(app, &buffer, block.lines.start);
+    int line_end = buffer_get_line_end(app, &buffer, block.lines.start);
+
+    History_Group group = begin_history_group(app, buffer.buffer_id);
+    int insert_pos = line_start + column;
+    if (insert_pos > line_end) {
+        if (append) {
+            char spaces[256];
+            int pad = insert_pos - line_end;
+            if (pad > (int)sizeof(spaces)) { pad = sizeof(spaces); }
+            memset(spaces, ' ', pad);
+            buffer_replace_range(app, &buffer, line_end, line_end, spaces, pad);
+            insert_pos = line_end + pad;
+        } else {
+            insert_pos = line_end;
+        }
+    }
+    view_set_cursor(app, &view, seek_pos(insert_pos), true);
+
+    Block_Insert insert = {};
+    insert.active = true;
+    insert.buffer_id = buffer.buffer_id;
+    insert.lines = make_range(block.lines.start + 1, block.lines.end);
+    insert.column = column;
+    insert.pad_short_lines = append;
+    insert.insert_pos = insert_pos;
+    insert.history = group;
+    enter_insert_mode(app, buffer.buffer_id);
+    state.block_insert = insert;
+}
+
+static void finish_block_insert(struct Application_Links* app) {
+    Block_Insert insert = state.block_insert;
+    state.block_insert.active = false;
+
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, insert.buffer_id, AccessOpen);
+    int typed_size = view.cursor.pos - insert.insert_pos;
+    if (buffer.exists && view.buffer_id == insert.buffer_id &&
+        typed_size > 0 && insert.lines.start <= insert.lines.end) {
+        char* typed = (char*)malloc(typed_size);
+        defer(free(typed));
+        buffer_read_range(app, &buffer, insert.insert_pos, view.cursor.pos,
+                          typed);
+        // Like vim, only single-line inserts get copied to the block
+        if (!memchr(typed, '\n', typed_size)) {
+            Edit_Batch batch = {};
+            defer(edit_batch_free(&batch));
+            int typed_start = edit_batch_push_string(&batch, typed, typed_size);
+            for (int line = insert.lines.start; line <= insert.lines.end; ++line) {
+                int line_start = buffer_get_line_start(app, &buffer, line);
+                int line_end = buffer_get_line_end(app, &buffer, line);
+                int line_size = line_end - line_start;
+                if (insert.column <= line_size) {
+                    int pos = line_start + insert.column;
+                    edit_batch_push(&batch, pos, pos, typed_start, typed_size);
+                } else if (insert.pad_short_lines) {
+                    int pad = insert.column - line_size;
+                    int str_start = batch.str_size;
+                    for (int i = 0; i < pad; ++i) {
+                        edit_batch_push_string(&batch, " ", 1);
+                    }
+                    edit_batch_push_string(&batch, typed, typed_size);
+                    edit_batch_push(&batch, line_end, line_end, str_start,
+                                    pad + typed_size);
+                }
+            }
+            edit_batch_apply(app, &buffer, &batch);
+        }
+    }
+    end_history_group(app, insert.history);
+}
+
+static void enter_normal_mode(struct Application_Links *app, int buffer_id) {
+    if (is_visual_mode(state.mode)) {
+        end_visual_selection(app);
+    }
+    flush_typeahead(app);
+    // Before the block insert, whose own history group contains this one
+    end_insert_session(app);
+    if (state.mode == mode_insert && state.block_insert.active) {
+        finish_block_insert(app);
+    }
+    state.action = vimaction_none;
+    end_chord_bar(app);
+    Buffer_Summary buffer = get_buffer(app, buffer_id, AccessAll);
+    buffer_set_setting(app, &buffer, BufferSetting_MapID, mapid_normal);
+    if (state.mode != mode_normal) {
+        state.mode = mode_normal;
+        on_enter_normal_mode(app);
+    }
+}
+
+// Add line as the newest entry, moving it there if it's already in.
+static void push_history(Vim_History* history, String line) {
+    if (line.size == 0) { return; }
+    ++state.session_changes;
+    for (int i = 0; i < history->count; ++i) {
+        if (match(history->entries[i], line)) {
+            String entry = history->entries[i];
+            memmove(history->entries + i, history->entries + i + 1,
+                    (history->count - i - 1) * sizeof(String));
+            history->entries[history->count - 1] = entry;
+            return;
+        }
+    }
+    if (history->count == HISTORY_MAX) {
+        free(history->entries[0].str);
+        memmove(history->entries, history->entries + 1,
+                (HISTORY_MAX - 1) * sizeof(String));
+        --history->count;
+    }
+    String entry = make_string((char*)malloc(line.size), line.size);
+    memcpy(entry.str, line.str, line.size);
+    history->entries[history->count++] = entry;
+}
+
+// Up and Down at a prompt. They step through the entries that start with
+// whatever was typed before the first step, and past the newest one give
+// back what was typed.
+struct History_Browse {
+    Vim_History* history;
+    // history->count while showing what was typed
+    int index;
+    char typed[256];
+    int typed_size;
+};
+
+static History_Browse begin_history_browse(Vim_History* history) {
+    History_Browse browse = {};
+    browse.history = history;
+    browse.index = history->count;
+    return browse;
+}
+
+static void browse_history(History_Browse* browse, String* line,
+                           Search_Direction direction) {
+    Vim_History* history = browse->history;
+    if (browse->index == history->count) {
+        browse->typed_size = (line->size < (int)sizeof(browse->typed)
+                              ? line->size : (int)sizeof(browse->typed));
+        memcpy(browse->typed, line->str, browse->typed_size);
+    }
+    String typed = make_string(browse->typed, browse->typed_size);
+    int index = browse->index;
+    for (;;) {
+        index += direction;
+        if (index < 0) { return; }
+        if (index >= history->count) {
+            index = history->count;
+            break;
+        }
+        if (match_part(history->entries[index], typed)) { break; }
+    }
+    browse->index = index;
+    line->size = 0;
+    append_checked_ss(line, index == history->count ? typed : history->entries[index]);
+}
+
+static void buffer_query_search(struct Application_Links* app,
+                                Search_Direction direction) {
+    View_Summary view = get_active_view(app, AccessAll);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+    if (!buffer.exists) return;
+    // Start the search query bar
+    Query_Bar bar;
+    if (start_query_bar(app, &bar, 0) == 0) return;
+    defer(end_query_bar(app, &bar, 0));
+    // Bar string
+    char bar_string_space[256];
+    bar.string = make_fixed_width_string(bar_string_space);
+    bar.prompt = make_lit_string(direction == search_forward ? "/" : "?");
+    History_Browse browse = begin_history_browse(&state.search_history);
+    // Handle the query bar
+    User_Input in;
+    while (true) {
+        in = get_user_input(app, EventOnAnyKey, EventOnEsc);
+        if (in.abort) break;
+        if (in.key.keycode == '\n'){
+            break;
+        }
+        else if (in.key.keycode == '\t') {
+            // Ignore it
+        }
+        else if (in.key.keycode == key_up) {
+            browse_history(&browse, &bar.string, search_backward);
+            continue;
+        }
+        else if (in.key.keycode == key_down) {
+            browse_history(&browse, &bar.string, search_forward);
+            continue;
+        }
+        else if (in.key.character && key_is_unmodified(&in.key)){
+            append(&bar.string, (char)in.key.character);
+        }
+        else if (in.key.keycode == key_back){
+            if (bar.string.size > 0){
+                --bar.string.size;
+            }
+        }
+        browse.index = state.search_history.count;
+    }
+    if (in.abort) return;
+    push_history(&state.search_history, bar.string);
+    // Do the search
+    buffer_search(app, bar.string, view, direction);
+}
+
+void reset_keymap_for_current_mode(struct Application_Links* app) {
+    switch (state.mode) {
+        case mode_normal: {
+            set_current_keymap(app, mapid_normal);
+        } break;
+
+        case mode_insert: {
+            set_current_keymap(app, mapid_insert);
+        } break;
+
+        case mode_replace: {
+            set_current_keymap(app, mapid_replace);
+        } break;
+
+        case mode_visual_block:
+        case mode_visual_line:
+        case mode_visual: {
+            set_current_keymap(app, mapid_visual);
+        } break;
+    }
+}
+
+}  // namespace
+
+//=============================================================================
+// > Custom commands <                                                @commands
+// Commands that do things.
+//=============================================================================
+
+CUSTOM_COMMAND_SIG(enter_normal_mode_on_current) {
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+CUSTOM_COMMAND_SIG(enter_replace_mode){
+    state.mode = mode_replace;
+    set_current_keymap(app, mapid_replace);
+    begin_insert_session(app, get_current_view_buffer_id(app, AccessAll));
+    clear_register_selection();
+    on_enter_replace_mode(app);
+}
+
+CUSTOM_COMMAND_SIG(enter_visual_mode){
+    state.mode = mode_visual;
+    state.selection_cursor.start = get_cursor_pos(app);
+    state.selection_cursor.end = state.selection_cursor.start;
+    update_visual_range(app, state.selection_cursor.end);
+
+    set_current_keymap(app, mapid_visual);
+    clear_register_selection();
+    on_enter_visual_mode(app);
+}
+
+CUSTOM_COMMAND_SIG(enter_visual_line_mode){
+    state.mode = mode_visual_line;
+    state.selection_cursor.start = get_cursor_pos(app);
+    state.selection_cursor.end = state.selection_cursor.start;
+    update_visual_line_range(app, state.selection_cursor.end);
+
+    set_current_keymap(app, mapid_visual);
+    clear_register_selection();
+    on_enter_visual_mode(app);
+}
+
+CUSTOM_COMMAND_SIG(enter_visual_block_mode){
+    state.mode = mode_visual_block;
+    state.selection_cursor.start = get_cursor_pos(app);
+    state.selection_cursor.end = state.selection_cursor.start;
+    update_visual_block_range(app, state.selection_cursor.end);
+
+    set_current_keymap(app, mapid_visual);
+    clear_register_selection();
+    on_enter_visual_mode(app);
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_replace_single){
+    set_current_keymap(app, mapid_chord_replace_single);
+    clear_register_selection();
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_switch_registers){
+    set_current_keymap(app, mapid_chord_choose_register);
+
+    push_to_chord_bar(app, lit("\""));
+}
+
+CUSTOM_COMMAND_SIG(replace_character) {
+    //TODO(chronister): Do something a little more intelligent when at the end of a line
+    if (get_cursor_char(app) != '\n') {
+        delete_char(app);
+    }
+    write_character(app);
+}
+
+static void queue_typed_character(struct Application_Links* app,
+                                  bool overwrite) {
+    User_Input in = get_command_input(app);
+    uint8_t character[4];
+    uint32_t length = to_writable_character(in, character);
+    if (length == 0) { return; }
+    View_Summary view = get_active_view(app, AccessOpen);
+    if (!view.exists) { return; }
+
+    Typeahead* typeahead = &state.typeahead;
+    if (typeahead->size == 0 || typeahead->view_id != view.view_id ||
+        typeahead->buffer_id != view.buffer_id ||
+        typeahead->overwrite != overwrite ||
+        typeahead->size + length > sizeof(typeahead->text)) {
+        flush_typeahead(app);
+        refresh_view(app, &view);
+        typeahead->view_id = view.view_id;
+        typeahead->buffer_id = view.buffer_id;
+        typeahead->pos = view.cursor.pos;
+        typeahead->overwrite = overwrite;
+        typeahead->chars = 0;
+    }
+    memcpy(typeahead->text + typeahead->size, character, length);
+    typeahead->size += length;
+    ++typeahead->chars;
+}
+
+// Insert and replace mode typing. Nothing is edited until the typeahead is
+// flushed, so a burst of keys costs one edit and one relex.
+CUSTOM_COMMAND_SIG(vim_write_character) {
+    queue_typed_character(app, false);
+}
+
+CUSTOM_COMMAND_SIG(vim_overwrite_character) {
+    queue_typed_character(app, true);
+}
+
+CUSTOM_COMMAND_SIG(replace_character_then_normal) {
+    replace_character(app);
+    move_left(app);
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+// Ctrl-N/Ctrl-P completion in progress. The word being completed starts at
+// start, and end is the end of the text the last step put in.
+struct Completion_State {
+    Buffer_ID buffer_id;
+    // Edit version right after the last step, to tell if anything else
+    // touched the buffer since
+    uint64_t version;
+    int start;
+    int end;
+    char prefix[WORD_MAX_SIZE];
+    int prefix_size;
+    int* candidates;
+    int count;
+    // -1 while the typed prefix is shown
+    int current;
+};
+
+static Completion_State completion = {};
+
+template <Search_Direction direction>
+CUSTOM_COMMAND_SIG(keyword_complete) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    if (!buffer.exists) { return; }
+    int pos = view.cursor.pos;
+
+    bool continuing = (completion.buffer_id == buffer.buffer_id &&
+                       completion.end == pos && completion.count > 0 &&
+                       completion.version == get_buffer_edit_version(app, &buffer));
+    if (!continuing) {
+        char before[WORD_MAX_SIZE];
+        int read_size = (pos < WORD_MAX_SIZE ? pos : WORD_MAX_SIZE);
+        buffer_read_range(app, &buffer, pos - read_size, pos, before);
+        int prefix_size = 0;
+        while (prefix_size < read_size &&
+               get_char_class(before[read_size - prefix_size - 1], false) == 1) {
+            ++prefix_size;
+        }
+        // Already as long as any indexed word can be
+        if (prefix_size == WORD_MAX_SIZE) { return; }
+
+        completion.buffer_id = buffer.buffer_id;
+        completion.start = pos - prefix_size;
+        completion.end = pos;
+        completion.prefix_size = prefix_size;
+        memcpy(completion.prefix, before + read_size - prefix_size, prefix_size);
+        completion.current = -1;
+
+        update_word_index(app);
+        completion.count = find_word_completions(completion.prefix, prefix_size,
+                                                 &completion.candidates);
+        if (completion.count == 0) { return; }
+    }
+
+    // Step through the candidates and then back to what was typed, like vim
+    int next = completion.current + direction;
+    if (next >= completion.count) { next = -1; }
+    if (next < -1) { next = completion.count - 1; }
+    completion.current = next;
+
+    const char* text = completion.prefix;
+    int size = completion.prefix_size;
+    if (next >= 0) {
+        Word_Entry* entry = word_table.words + completion.candidates[next];
+        text = word_table.strings + entry->offset;
+        size = entry->size;
+    }
+    buffer_replace_range(app, &buffer, completion.start, completion.end, text, size);
+    completion.end = completion.start + size;
+    view_set_cursor(app, &view, seek_pos(completion.end), true);
+
+    buffer = get_buffer(app, buffer.buffer_id, AccessOpen);
+    completion.version = get_buffer_edit_version(app, &buffer);
+}
+
+#define keyword_complete_next keyword_complete<search_forward>
+#define keyword_complete_previous keyword_complete<search_backward>
+
+CUSTOM_COMMAND_SIG(seek_top_of_file) {
+    unsigned int access = AccessProtected;
+    View_Summary view = get_active_view(app, access);
+    set_jump_mark(app, &view);
+    view_set_cursor(app, &view, seek_pos(0), true);
+}
+
+CUSTOM_COMMAND_SIG(seek_bottom_of_file) {
+    unsigned int access = AccessProtected;
+    View_Summary view = get_active_view(app, access);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, access);
+    set_jump_mark(app, &view);
+    view_set_cursor(app, &view, seek_pos(buffer.size), true);
+}
+
+template <CUSTOM_COMMAND_SIG(command)>
+CUSTOM_COMMAND_SIG(compound_move_command){
+    View_Summary view = get_active_view(app, AccessProtected);
+    int before_pos = view.cursor.pos;
+    command(app);
+    refresh_view(app, &view);
+    int after_pos = view.cursor.pos;
+    vim_exec_action(app, make_range(before_pos, after_pos), false);
+}
+
+#define vim_move_left compound_move_command<move_left>
+#define vim_move_right compound_move_command<move_right>
+#define vim_move_end_of_line compound_move_command<seek_end_of_line>
+#define vim_move_beginning_of_line compound_move_command<seek_beginning_of_line>
+#define vim_move_whitespace_up compound_move_command<seek_whitespace_up>
+#define vim_move_whitespace_down compound_move_command<seek_whitespace_down>
+#define vim_move_to_top compound_move_command<seek_top_of_file>
+#define vim_move_to_bottom compound_move_command<seek_bottom_of_file>
+#define vim_move_click compound_move_command<click_set_cursor>
+#define vim_move_scroll compound_move_command<mouse_wheel_scroll>
+
+// Jumps to the partner of the bracket under the cursor, or of the first
+// bracket after it on the same line.
+CUSTOM_COMMAND_SIG(vim_move_matching_bracket){
+    View_Summary view = get_active_view(app, AccessProtected);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessProtected);
+    int pos = view.cursor.pos;
+
+    Bracket_Index* index = get_bracket_index(app, &buffer);
+    int k = find_bracket_at_or_before(index, pos);
+    if (k < 0 || index->brackets[k].pos != pos) {
+        ++k;
+        int line_end = seek_line_end(app, &buffer, pos);
+        if (k >= index->count || index->brackets[k].pos > line_end) {
+            reset_keymap_for_current_mode(app);
+            if (!is_visual_mode(state.mode)) {
+                enter_normal_mode(app, buffer.buffer_id);
+            }
+            return;
+        }
+    }
+
+    Bracket* bracket = index->brackets + k;
+    int target = (bracket->match >= 0 ? index->brackets[bracket->match].pos : bracket->pos);
+    view_set_cursor(app, &view, seek_pos(target), true);
+
+    // % is inclusive of the bracket it lands on
+    Range range = make_range(pos, target);
+    ++range.end;
+    vim_exec_action(app, range, false);
+}
+
+CUSTOM_COMMAND_SIG(vim_move_paragraph_up){
+    View_Summary view = get_active_view(app, AccessProtected);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessProtected);
+    int pos = view.cursor.pos;
+
+    // The nearest empty line above that sits right on top of text
+    Boundary_Cache* paragraphs = &get_structure_cache(app, &buffer)->paragraphs;
+    int target = 0;
+    for (int i = boundary_lower_bound(paragraphs, pos) - 1; i >= 0; --i) {
+        int blank = paragraphs->positions[i];
+        if (i + 1 == paragraphs->count || paragraphs->positions[i + 1] != blank + 1) {
+            target = blank;
+            break;
+        }
+    }
+
+    view_set_cursor(app, &view, seek_pos(target), true);
+    vim_exec_action(app, make_range(pos, target), false);
+}
+
+CUSTOM_COMMAND_SIG(vim_move_paragraph_down){
+    View_Summary view = get_active_view(app, AccessProtected);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessProtected);
+    int pos = view.cursor.pos;
+
+    // The nearest empty line below that sits right under text
+    Boundary_Cache* paragraphs = &get_structure_cache(app, &buffer)->paragraphs;
+    int target = buffer.size;
+    for (int i = boundary_lower_bound(paragraphs, pos + 1); i < paragraphs->count; ++i) {
+        int blank = paragraphs->positions[i];
+        if (i == 0 || paragraphs->positions[i - 1] != blank - 1) {
+            target = blank;
+            break;
+        }
+    }
+
+    view_set_cursor(app, &view, seek_pos(target), true);
+    vim_exec_action(app, make_range(pos, target), false);
+}
+
+// Empty lines count as sentence boundaries too.
+CUSTOM_COMMAND_SIG(vim_move_sentence_backward){
+    View_Summary view = get_active_view(app, AccessProtected);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessProtected);
+    int pos = view.cursor.pos;
+
+    Structure_Cache* cache = get_structure_cache(app, &buffer);
+    int target = 0;
+    int i = boundary_lower_bound(&cache->sentences, pos) - 1;
+    if (i >= 0) { target = cache->sentences.positions[i]; }
+    i = boundary_lower_bound(&cache->paragraphs, pos) - 1;
+    if (i >= 0 && cache->paragraphs.positions[i] > target) {
+        target = cache->paragraphs.positions[i];
+    }
+
+    view_set_cursor(app, &view, seek_pos(target), true);
+    vim_exec_action(app, make_range(pos, target), false);
+}
+
+CUSTOM_COMMAND_SIG(vim_move_sentence_forward){
+    View_Summary view = get_active_view(app, AccessProtected);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessProtected);
+    int pos = view.cursor.pos;
+
+    Structure_Cache* cache = get_structure_cache(app, &buffer);
+    int target = buffer.size;
+    int i = boundary_lower_bound(&cache->sentences, pos + 1);
+    if (i < cache->sentences.count) { target = cache->sentences.positions[i]; }
+    i = boundary_lower_bound(&cache->paragraphs, pos + 1);
+    if (i < cache->paragraphs.count && cache->paragraphs.positions[i] < target) {
+        target = cache->paragraphs.positions[i];
+    }
+
+    view_set_cursor(app, &view, seek_pos(target), true);
+    vim_exec_action(app, make_range(pos, target), false);
+}
+
+CUSTOM_COMMAND_SIG(move_forward_word_start){
+    View_Summary view;
+    Buffer_Summary buffer;
+
+    unsigned int access = AccessAll;
+    view = get_active_view(app, access);
+    buffer = get_buffer(app, view.buffer_id, access);
+
+    int pos1 = view.cursor.pos;
+    
+    int pos2 = buffer_seek_next_word(app, &buffer, pos1);
+
+    view_set_cursor(app, &view, seek_pos(pos2), true);
+    vim_exec_action(app, make_range(pos1, pos2), false);
+}
+
+CUSTOM_COMMAND_SIG(move_backward_word_start){
+    View_Summary view;
+    
+    unsigned int access = AccessAll;
+    view = get_active_view(app, access);
+
+    int pos1 = view.cursor.pos;
+    
+    seek_white_or_token_left(app);
+    
+    refresh_view(app, &view);
+    int pos2 = view.cursor.pos;
+
+    vim_exec_action(app, make_range(pos1, pos2));
+}
+
+CUSTOM_COMMAND_SIG(move_forward_word_end){
+    View_Summary view;
+    
+    unsigned int access = AccessOpen;
+    view = get_active_view(app, access);
+
+    int pos1 = view.cursor.pos;
+    move_right(app);
+    
+    seek_whitespace_right(app);
+    
+    refresh_view(app, &view);
+    int pos2 = view.cursor.pos;
+    move_left(app);
+
+    vim_exec_action(app, make_range(pos1, pos2));
+}
+
+CUSTOM_COMMAND_SIG(newline_then_insert_before){
+    seek_beginning_of_line(app);
+    write_string(app, make_lit_string("\n"));
+    move_left(app);
+    enter_insert_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+CUSTOM_COMMAND_SIG(insert_at){
+    enter_insert_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+CUSTOM_COMMAND_SIG(insert_after){
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    char nextch[2];
+    int pos = view.cursor.pos;
+    buffer_read_range(app, &buffer, pos, pos + 1, nextch);
+    if (nextch[0] != '\n') {
+        move_right(app);
+    }
+    enter_insert_mode(app, view.buffer_id);
+}
+
+CUSTOM_COMMAND_SIG(seek_eol_then_insert){
+    seek_end_of_line(app);
+    enter_insert_mode(app, get_current_view_buffer_id(app, AccessOpen));
+}
+
+CUSTOM_COMMAND_SIG(newline_then_insert_after){
+    seek_end_of_line(app);
+    write_string(app, make_lit_string("\n"));
+    enter_insert_mode(app, get_current_view_buffer_id(app, AccessOpen));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_delete){
+    set_current_keymap(app, mapid_chord_delete);
+
+    state.action = vimaction_delete_range;
+
+    push_to_chord_bar(app, lit("d"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_change){
+    set_current_keymap(app, mapid_chord_delete);
+
+    state.action = vimaction_change_range;
+
+    push_to_chord_bar(app, lit("c"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_yank){
+    set_current_keymap(app, mapid_chord_yank);
+
+    state.action = vimaction_yank_range;
+
+    push_to_chord_bar(app, lit("y"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_indent_left){
+    set_current_keymap(app, mapid_chord_indent_left);
+    state.action = vimaction_indent_left_range;
+    push_to_chord_bar(app, lit("<"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_indent_right){
+    set_current_keymap(app, mapid_chord_indent_right);
+    state.action = vimaction_indent_right_range;
+    push_to_chord_bar(app, lit(">"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_format){
+    set_current_keymap(app, mapid_chord_format);
+
+    state.action = vimaction_format_range;
+
+    push_to_chord_bar(app, lit("="));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_window){
+    set_current_keymap(app, mapid_chord_window);
+    push_to_chord_bar(app, lit("^W"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_move_find){
+    set_current_keymap(app, mapid_chord_move_find);
+    push_to_chord_bar(app, lit("f"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_move_til){
+    set_current_keymap(app, mapid_chord_move_til);
+    push_to_chord_bar(app, lit("t"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_move_rfind){
+    set_current_keymap(app, mapid_chord_move_rfind);
+    push_to_chord_bar(app, lit("F"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_move_rtil){
+    set_current_keymap(app, mapid_chord_move_rtil);
+    push_to_chord_bar(app, lit("T"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_reflow){
+    if (is_visual_mode(state.mode)) {
+        state.action = vimaction_reflow_range;
+        vim_exec_action(app, state.selection_range, true);
+        enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+        return;
+    }
+
+    set_current_keymap(app, mapid_chord_reflow);
+
+    state.action = vimaction_reflow_range;
+
+    push_to_chord_bar(app, lit("q"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_text_object_inner){
+    set_current_keymap(app, mapid_chord_move_in);
+    state.text_object_around = false;
+    push_to_chord_bar(app, lit("i"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_text_object_around){
+    set_current_keymap(app, mapid_chord_move_in);
+    state.text_object_around = true;
+    push_to_chord_bar(app, lit("a"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_g){
+    set_current_keymap(app, mapid_chord_g);
+    push_to_chord_bar(app, lit("g"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_bracket_forward){
+    set_current_keymap(app, mapid_chord_bracket_forward);
+    push_to_chord_bar(app, lit("]"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_bracket_backward){
+    set_current_keymap(app, mapid_chord_bracket_backward);
+    push_to_chord_bar(app, lit("["));
+}
+
+CUSTOM_COMMAND_SIG(move_line_exec_action){
+    View_Summary view = get_active_view(app, AccessProtected);
+	int initial = view.cursor.pos;
+    seek_beginning_of_line(app);
+    refresh_view(app, &view);
+    int line_begin = view.cursor.pos;
+    seek_end_of_line(app);
+    refresh_view(app, &view);
+    int line_end = view.cursor.pos + 1;
+    vim_exec_action(app, make_range(line_begin, line_end), true);
+    view_set_cursor(app, &view, seek_pos(initial), true);
+}
+
+CUSTOM_COMMAND_SIG(vim_delete_line){
+    state.action = vimaction_delete_range;
+    move_line_exec_action(app);
+}
+
+CUSTOM_COMMAND_SIG(yank_line){
+    state.action = vimaction_yank_range;
+    move_line_exec_action(app);
+}
+
+template <Search_Direction seek_forward, bool include_found>
+CUSTOM_COMMAND_SIG(seek_for_character){
+    Buffer_Summary buffer;
+    View_Summary view;
+    User_Input trigger;
+    int pos1, pos2;
+    
+    unsigned int access = AccessProtected;
+    view = get_active_view(app, access);
+    buffer = get_buffer(app, view.buffer_id, access);
+
+    trigger = get_command_input(app);
+
+    pos1 = view.cursor.pos;
+    if (seek_forward) {
+        buffer_seek_delimiter_forward(app, &buffer, pos1+1, (char)trigger.key.character, &pos2);
+    }
+    else {
+        buffer_seek_delimiter_backward(app, &buffer, pos1-1, (char)trigger.key.character, &pos2);
+    }
+    move_left(app);
+    if (!include_found) { 
+        pos2 += seek_forward;
+    }
+    view_set_cursor(app, &view, seek_pos(pos2), true);
+    
+    if (pos2 >= 0) {
+        vim_exec_action(app, make_range(pos1, pos2));
+    }
+    else {
+        //TODO(chronister): This will not be correct for visual mode!
+        enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+    }
+}
+
+CUSTOM_COMMAND_SIG(vim_select_text_object){
+    View_Summary view = get_active_view(app, AccessProtected);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessProtected);
+    User_Input trigger = get_command_input(app);
+    int pos = view.cursor.pos;
+    bool around = state.text_object_around;
+
+    Range range = {};
+    bool found = false;
+    switch (trigger.key.character) {
+        case 'w': found = get_word_object(app, &buffer, pos, around, false, &range); break;
+        case 'W': found = get_word_object(app, &buffer, pos, around, true, &range); break;
+        case '(': case ')': case 'b':
+            found = get_bracket_object(app, &buffer, pos, around, bracket_paren, &range); break;
+        case '[': case ']':
+            found = get_bracket_object(app, &buffer, pos, around, bracket_square, &range); break;
+        case '{': case '}': case 'B':
+            found = get_bracket_object(app, &buffer, pos, around, bracket_brace, &range); break;
+        case '"': case '\'': case '`':
+            found = get_quote_object(app, &buffer, pos, around, (char)trigger.key.character, &range); break;
+        case 't': found = get_tag_object(app, &buffer, pos, around, &range); break;
+    }
+
+    if (!found) {
+        reset_keymap_for_current_mode(app);
+        if (!is_visual_mode(state.mode)) {
+            enter_normal_mode(app, buffer.buffer_id);
+        }
+        return;
+    }
+
+    if (is_visual_mode(state.mode)) {
+        state.selection_cursor.start = range.start;
+        int end = (range.end > range.start ? range.end - 1 : range.start);
+        view_set_cursor(app, &view, seek_pos(end), true);
+        vim_exec_action(app, make_range(end, end), false);
+        return;
+    }
+    view_set_cursor(app, &view, seek_pos(range.start), true);
+    vim_exec_action(app, range, false);
+}
+
+#define vim_seek_find_character seek_for_character<search_forward, true>
+#define vim_seek_til_character seek_for_character<search_forward, false>
+#define vim_seek_rfind_character seek_for_character<search_backward, true>
+#define vim_seek_rtil_character seek_for_character<search_backward, false>
+
+//TODO(chronister): move_up and move_down both operate on lines, which is not reflected here.
+CUSTOM_COMMAND_SIG(vim_move_up){
+    View_Summary view;
+    int pos1, pos2;
+    
+    unsigned int access = AccessProtected;
+    view = get_active_view(app, access);
+
+    pos1 = view.cursor.pos;
+
+    move_up(app);
+    refresh_view(app, &view);
+    pos2 = view.cursor.pos;
+    
+    vim_exec_action(app, make_range(pos1, pos2));
+}
+
+CUSTOM_COMMAND_SIG(vim_move_down){
+    View_Summary view;
+    int pos1, pos2;
+    
+    unsigned int access = AccessProtected;
+    view = get_active_view(app, access);
+
+    pos1 = view.cursor.pos;
+
+    move_down(app);
+    refresh_view(app, &view);
+    pos2 = view.cursor.pos;
+    
+    vim_exec_action(app, make_range(pos1, pos2));
+}
+
+CUSTOM_COMMAND_SIG(cycle_window_focus){
+    // ASSUMPTION: End of a ^W window shortcut presumably
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    change_active_panel(app);
+}
+
+CUSTOM_COMMAND_SIG(open_window_hsplit){
+    // ASSUMPTION: End of a ^W window shortcut presumably
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    View_Summary view = get_active_view(app, AccessAll);
+    View_Summary new_view = open_view(app, &view, ViewSplit_Top);
+    set_active_view(app, &view);
+}
+
+CUSTOM_COMMAND_SIG(open_window_dup_hsplit){
+    // ASSUMPTION: End of a ^W window shortcut presumably
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    View_Summary view = get_active_view(app, AccessAll);
+    View_Summary new_view = open_view(app, &view, ViewSplit_Top);
+    view_set_buffer(app, &new_view, view.buffer_id, 0);
+    set_active_view(app, &view);
+}
+
+CUSTOM_COMMAND_SIG(open_window_vsplit){
+    // ASSUMPTION: End of a ^W window shortcut presumably
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    View_Summary view = get_active_view(app, AccessAll);
+    View_Summary new_view = open_view(app, &view, ViewSplit_Right);
+    set_active_view(app, &view);
+}
+
+CUSTOM_COMMAND_SIG(open_window_dup_vsplit){
+    // ASSUMPTION: End of a ^W window shortcut presumably
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    View_Summary view = get_active_view(app, AccessAll);
+    View_Summary new_view = open_view(app, &view, ViewSplit_Right);
+    view_set_buffer(app, &new_view, view.buffer_id, 0);
+    set_active_view(app, &view);
+}
+
+CUSTOM_COMMAND_SIG(focus_window_left) {
+    View_Summary view = get_active_view(app, AccessAll);
+
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    i32_Rect current = view.view_region;
+    int x = current.x0; //view.cursor.wrapped_x;
+    int y = current.y0; //view.cursor.wrapped_y;
+
+    View_Summary best = view;
+
+    for_views(nextview, app) {
+        if (nextview.view_id == view.view_id) continue;
+        i32_Rect next = nextview.view_region;
+        if (y < next.y0 || y > next.y1) continue;
+        if (x < next.x0) continue;
+        if (best.view_id == view.view_id || next.x0 > best.view_region.x0) best = nextview;
+    }
+
+    set_active_view(app, &best);
+}
+
+CUSTOM_COMMAND_SIG(focus_window_right) {
+    View_Summary view = get_active_view(app, AccessAll);
+
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    i32_Rect current = view.view_region;
+    int x = current.x0; //view.cursor.wrapped_x;
+    int y = current.y0; //view.cursor.wrapped_y;
+
+    View_Summary best = view;
+
+    for_views(nextview, app) {
+        if (nextview.view_id == view.view_id) continue;
+        i32_Rect next = nextview.view_region;
+        if (y < next.y0 || y > next.y1) continue;
+        if (x > next.x0) continue;
+        if (best.view_id == view.view_id || next.x0 < best.view_region.x0) best = nextview;
+    }
+
+    set_active_view(app, &best);
+}
+
+CUSTOM_COMMAND_SIG(focus_window_down) {
+    View_Summary view = get_active_view(app, AccessAll);
+
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    i32_Rect current = view.view_region;
+    int x = current.x0; //view.cursor.wrapped_x;
+    int y = current.y0; //view.cursor.wrapped_y;
+
+    View_Summary best = view;
+
+    for_views(nextview, app) {
+        if (nextview.view_id == view.view_id) continue;
+        i32_Rect next = nextview.view_region;
+        if (x < next.x0 || x > next.x1) continue;
+        if (y < next.y0) continue;
+        if (best.view_id == view.view_id || next.y0 > best.view_region.y0) best = nextview;
+    }
+
+    set_active_view(app, &best);
+}
+
+CUSTOM_COMMAND_SIG(focus_window_up) {
+    View_Summary view = get_active_view(app, AccessAll);
+
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    i32_Rect current = view.view_region;
+    int x = current.x0; //view.cursor.wrapped_x;
+    int y = current.y0; //view.cursor.wrapped_y;
+
+    View_Summary best = view;
+
+    for_views(nextview, app) {
+        if (nextview.view_id == view.view_id) continue;
+        i32_Rect next = nextview.view_region;
+        if (x < next.x0 || x > next.x1) continue;
+        if (y > next.y0) continue;
+        if (best.view_id == view.view_id || next.y0 < best.view_region.y0) best = nextview;
+    }
+
+    set_active_view(app, &best);
+}
+
+CUSTOM_COMMAND_SIG(close_window) {
+    set_current_keymap(app, mapid_normal);
+    end_chord_bar(app);
+
+    View_Summary view = get_view_first(app, AccessAll);
+    get_view_next(app, &view, AccessAll);
+    if (!view.exists) send_exit_signal(app);
+    else close_panel(app);
+}
+
+CUSTOM_COMMAND_SIG(combine_with_next_line) {
+    seek_end_of_line(app);
+    delete_char(app);
+}
+
+CUSTOM_COMMAND_SIG(paste_before_cursor_char) {
+    View_Summary view;
+    Buffer_Summary buffer;
+    
+    unsigned int access = AccessOpen;
+    view = get_active_view(app, access);
+    buffer = get_buffer(app, view.buffer_id, access);
+
+    Vim_Register* reg = state.registers + state.paste_register;
+    if (reg->is_line) {
+        seek_beginning_of_line(app);
+        refresh_view(app, &view);
+        int paste_pos = view.cursor.pos;
+		paste_from_register(app, &buffer, paste_pos, reg); 
+        view_set_cursor(app, &view, seek_pos(paste_pos), true);
+    } else {
+        int paste_pos = view.cursor.pos;
+		paste_from_register(app, &buffer, paste_pos, reg); 
+        view_set_cursor(app, &view, seek_pos(paste_pos + reg->text.size - 1),
+                        true);
+    }
+    clear_register_selection();
+}
+
+CUSTOM_COMMAND_SIG(paste_after_cursor_char) {
+    View_Summary view;
+    Buffer_Summary buffer;
+    
+    unsigned int access = AccessOpen;
+    view = get_active_view(app, access);
+    buffer = get_buffer(app, view.buffer_id, access);
+
+    Vim_Register* reg = state.registers + state.paste_register;
+    if (reg->is_line) {
+        seek_end_of_line(app);
+        move_right(app);
+        refresh_view(app, &view);
+        int paste_pos = view.cursor.pos;
+		paste_from_register(app, &buffer, paste_pos, reg); 
+        view_set_cursor(app, &view, seek_pos(paste_pos), true);
+    } else {
+        int paste_pos = view.cursor.pos + 1;
+		paste_from_register(app, &buffer, paste_pos, reg); 
+        view_set_cursor(app, &view, seek_pos(paste_pos + reg->text.size - 1),
+                        true);
+    }
+    clear_register_selection();
+}
+
+CUSTOM_COMMAND_SIG(visual_delete) {
+    if (state.mode == mode_visual_block) {
+        exec_visual_block_action(app, vimaction_delete_range);
+        enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+        return;
+    }
+    state.action = vimaction_delete_range;
+    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+CUSTOM_COMMAND_SIG(visual_change) {
+    if (state.mode == mode_visual_block) {
+        exec_visual_block_action(app, vimaction_change_range);
+        return;
+    }
+    state.action = vimaction_change_range;
+    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+CUSTOM_COMMAND_SIG(visual_yank) {
+    if (state.mode == mode_visual_block) {
+        exec_visual_block_action(app, vimaction_yank_range);
+        enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+        return;
+    }
+    state.action = vimaction_yank_range;
+    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+CUSTOM_COMMAND_SIG(visual_format) {
+    state.action = vimaction_format_range;
+    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+CUSTOM_COMMAND_SIG(visual_indent_right) {
+    state.action = vimaction_indent_right_range;
+    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+CUSTOM_COMMAND_SIG(visual_indent_left) {
+    state.action = vimaction_indent_left_range;
+    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+CUSTOM_COMMAND_SIG(visual_insert) {
+    if (state.mode == mode_visual_block) {
+        start_visual_block_insert(app, false);
+        return;
+    }
+    View_Summary view = get_active_view(app, AccessOpen);
+    view_set_cursor(app, &view, seek_pos(state.selection_range.start), true);
+    enter_insert_mode(app, view.buffer_id);
+}
+
+CUSTOM_COMMAND_SIG(visual_append) {
+    if (state.mode == mode_visual_block) {
+        start_visual_block_insert(app, true);
+        return;
+    }
+    View_Summary view = get_active_view(app, AccessOpen);
+    view_set_cursor(app, &view, seek_pos(state.selection_range.end), true);
+    enter_insert_mode(app, view.buffer_id);
+}
+
+CUSTOM_COMMAND_SIG(select_register) {
+    User_Input trigger;
+    trigger = get_command_input(app);
+
+    Register_Id regid = regid_from_char(trigger.key.character);
+    if (regid == reg_unnamed) {
+        enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+    }
+
+    state.yank_register = state.paste_register = regid;
+    char str[2] = { (char)trigger.key.character, '\0' };
+    push_to_chord_bar(app, lit(str));
+
+    reset_keymap_for_current_mode(app);
+}
+
+// Marks:                                                             @marks
+// m{a-z} marks a spot in the current buffer and m{A-Z} a spot in its file;
+// `{x} jumps back to it and '{x} to the start of its line. The edit hook
+// keeps each mark on the text it was set on.
+struct Local_Marks {
+    Buffer_ID buffer_id;
+    // -1 where unset
+    int pos[26];
+};
+
+static Local_Marks* local_marks = 0;
+static int local_marks_count = 0;
+static int local_marks_capacity = 0;
+
+static Local_Marks* get_local_marks(Buffer_ID buffer_id, bool create) {
+    for (int i = 0; i < local_marks_count; ++i) {
+        if (local_marks[i].buffer_id == buffer_id) { return local_marks + i; }
+    }
+    if (!create) { return 0; }
+    if (local_marks_count == local_marks_capacity) {
+        local_marks_capacity = (local_marks_capacity ? local_marks_capacity * 2 : 16);
+        local_marks = (Local_Marks*)realloc(local_marks,
+                                            local_marks_capacity * sizeof(Local_Marks));
+    }
+    Local_Marks* marks = local_marks + local_marks_count++;
+    marks->buffer_id = buffer_id;
+    for (int i = 0; i < ArrayCount(marks->pos); ++i) { marks->pos[i] = -1; }
+    return marks;
+}
+
+// Called from the open and new file hooks. Buffer ids get reused, and a
+// new buffer shouldn't inherit the marks of one that was killed.
+static void reset_local_marks(Buffer_ID buffer_id) {
+    Local_Marks* marks = get_local_marks(buffer_id, false);
+    if (!marks) { return; }
+    for (int i = 0; i < ArrayCount(marks->pos); ++i) { marks->pos[i] = -1; }
+}
+
+static void shift_mark(int* pos, Range range, int new_size) {
+    if (*pos >= range.end) {
+        *pos += new_size - (range.end - range.start);
+    } else if (*pos > range.start) {
+        *pos = range.start;
+    }
+}
+
+// Called from the edit hook.
+static void apply_edit_to_marks(Buffer_ID buffer_id, Range range, int new_size) {
+    Local_Marks* marks = get_local_marks(buffer_id, false);
+    if (marks) {
+        for (int i = 0; i < ArrayCount(marks->pos); ++i) {
+            if (marks->pos[i] >= 0) { shift_mark(marks->pos + i, range, new_size); }
+        }
+    }
+    for (int i = 0; i < ArrayCount(state.marks); ++i) {
+        if (state.marks[i].buffer_id == buffer_id) {
+            shift_mark(&state.marks[i].pos, range, new_size);
+        }
+    }
+}
+
+static void set_global_mark(Vim_Mark* mark, Buffer_Summary* buffer, int pos) {
+    free(mark->file_name.str);
+    mark->file_name = make_string((char*)malloc(buffer->file_name_len),
+                                  buffer->file_name_len);
+    memcpy(mark->file_name.str, buffer->file_name, buffer->file_name_len);
+    mark->buffer_id = buffer->buffer_id;
+    mark->pos = pos;
+    ++state.session_changes;
+}
+
+// Called from the open and new file hooks, so marks from the session file
+// follow edits once their file is open. Marks still on a killed buffer that
+// had this id come off it first.
+static void attach_global_marks(struct Application_Links* app,
+                                Buffer_ID buffer_id) {
+    for (int i = 0; i < ArrayCount(state.marks); ++i) {
+        if (state.marks[i].buffer_id == buffer_id) { state.marks[i].buffer_id = 0; }
+    }
+    Buffer_Summary buffer = get_buffer(app, buffer_id, AccessAll);
+    if (!buffer.exists || buffer.file_name_len <= 0) { return; }
+    String file_name = make_string(buffer.file_name, buffer.file_name_len);
+    for (int i = 0; i < ArrayCount(state.marks); ++i) {
+        if (state.marks[i].file_name.str && match(state.marks[i].file_name, file_name)) {
+            state.marks[i].buffer_id = buffer_id;
+        }
+    }
+}
+
+CUSTOM_COMMAND_SIG(set_vim_mark) {
+    User_Input trigger = get_command_input(app);
+    Key_Code c = trigger.key.character;
+    View_Summary view = get_active_view(app, AccessAll);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+    enter_normal_mode(app, buffer.buffer_id);
+    // 4coder's own mark goes here too, as m set it before there were
+    // lettered marks
+    set_jump_mark(app, &view);
+    if ('a' <= c && c <= 'z') {
+        get_local_marks(buffer.buffer_id, true)->pos[c - 'a'] = view.cursor.pos;
+    } else if ('A' <= c && c <= 'Z') {
+        if (buffer.file_name_len <= 0) {
+            fprintf(stderr, "Mark %c needs a buffer with a file\n", (char)c);
+            return;
+        }
+        set_global_mark(state.marks + (c - 'A'), &buffer, view.cursor.pos);
+    }
+}
+
+template <bool to_line>
+CUSTOM_COMMAND_SIG(jump_to_vim_mark) {
+    User_Input trigger = get_command_input(app);
+    Key_Code c = trigger.key.character;
+    View_Summary view = get_active_view(app, AccessAll);
+    enter_normal_mode(app, view.buffer_id);
+    // `` and '' go back to where the cursor was before the last jump, and
+    // leave the mark where it is now
+    int pos = -1;
+    if (c == '`' || c == '\'') {
+        cursor_mark_swap(app);
+        refresh_view(app, &view);
+        pos = view.cursor.pos;
+    } else if ('a' <= c && c <= 'z') {
+        Local_Marks* marks = get_local_marks(view.buffer_id, false);
+        if (marks) { pos = marks->pos[c - 'a']; }
+        if (pos >= 0) { set_jump_mark(app, &view); }
+    } else if (('A' <= c && c <= 'Z') || ('0' <= c && c <= '9')) {
+        Vim_Mark* mark = state.marks + (c <= '9' ? MARK_0 + (c - '0') : c - 'A');
+        if (mark->file_name.str) {
+            // Before leaving the buffer, so `` comes back here from there
+            set_jump_mark(app, &view);
+            Buffer_Summary buffer = get_buffer(app, mark->buffer_id, AccessAll);
+            // Buffer ids get reused, so check it's still the same file
+            if (!buffer.exists ||
+                !match(make_string(buffer.file_name, buffer.file_name_len),
+                       mark->file_name)) {
+                mark->buffer_id = 0;
+            }
+            if (mark->buffer_id == 0 || mark->buffer_id != view.buffer_id) {
+                if (!view_open_file(app, &view, mark->file_name.str,
+                                    mark->file_name.size, true)) {
+                    fprintf(stderr, "Couldn't open %.*s\n", mark->file_name.size,
+                            mark->file_name.str);
+                    return;
+                }
+                refresh_view(app, &view);
+                mark->buffer_id = view.buffer_id;
+            }
+            pos = mark->pos;
+        }
+    }
+    if (pos < 0) {
+        fprintf(stderr, "Mark not set\n");
+        return;
+    }
+
+    if (to_line) {
+        Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+        if (pos > buffer.size) { pos = buffer.size; }
+        int line = buffer_get_line_number(app, &buffer, pos);
+        pos = buffer_get_line_start(app, &buffer, line);
+        int line_end = buffer_get_line_end(app, &buffer, line);
+        while (pos < line_end && char_is_whitespace(buffer_get_char(app, &buffer, pos))) {
+            ++pos;
+        }
+    }
+    view_set_cursor(app, &view, seek_pos(pos), true);
+}
+
+#define jump_to_mark jump_to_vim_mark<false>
+#define jump_to_mark_line jump_to_vim_mark<true>
+
+CUSTOM_COMMAND_SIG(enter_chord_mark) {
+    set_current_keymap(app, mapid_chord_mark);
+    push_to_chord_bar(app, lit("m"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_mark_jump) {
+    set_current_keymap(app, mapid_chord_mark_jump);
+    push_to_chord_bar(app, lit("`"));
+}
+
+CUSTOM_COMMAND_SIG(enter_chord_mark_jump_line) {
+    set_current_keymap(app, mapid_chord_mark_jump_line);
+    push_to_chord_bar(app, lit("'"));
+}
+
+// Open name in view. Relative names are taken from the folder of
+// base_file_name, the way gf and tags files resolve them.
+static bool view_open_file_relative(struct Application_Links* app,
+                                    View_Summary* view, String base_file_name,
+                                    String name, bool never_new) {
+    char file_name_[4096];
+    String file_name = make_fixed_width_string(file_name_);
+    bool absolute = (name.size > 0 && (name.str[0] == '/' || name.str[0] == '\\' ||
+                                       (name.size > 1 && name.str[1] == ':')));
+    if (!absolute) {
+        copy(&file_name, base_file_name);
+        remove_last_folder(&file_name);
+    }
+    if (!append_checked_ss(&file_name, name)) { return false; }
+    return view_open_file(app, view, expand_str(file_name), never_new);
+}
+
+CUSTOM_COMMAND_SIG(vim_open_file_in_quotes){
+    // @COPYPASTA from 4coder_default_include.cpp
+    View_Summary view;
+    Buffer_Summary buffer;
+    char short_file_name[128];
+    int pos, start, end, size;
+    
+    unsigned int access = AccessProtected;
+    view = get_active_view(app, access);
+    buffer = get_buffer(app, view.buffer_id, access);
+    pos = view.cursor.pos;
+    buffer_seek_delimiter_forward(app, &buffer, pos + 1, '"', &end);
+    buffer_seek_delimiter_backward(app, &buffer, pos, '"', &start);
+    
+    ++start;
+    size = end - start;
+
+    end_chord_bar(app);
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+    
+    // NOTE(allen): This check is necessary because buffer_read_range
+    // requires that the output buffer you provide is at least (end - start) bytes long.
+    if (size < sizeof(short_file_name)){
+        buffer_read_range(app, &buffer, start, end, short_file_name);
+        view_open_file_relative(app, &view,
+                                make_string(buffer.file_name, buffer.file_name_len),
+                                make_string(short_file_name, size), false);
+    }
+}
+
+// * and # search for the word under the cursor as a whole word, g* and g#
+// also match it inside longer words.
+template <Search_Direction direction, bool whole_word>
+CUSTOM_COMMAND_SIG(search_for_word_under_cursor) {
+    View_Summary view;
+    Buffer_Summary buffer;
+    view = get_active_view(app, AccessAll);
+    buffer = get_buffer(app, view.buffer_id, AccessAll);
+    if (!buffer.exists) return;
+    Range word = get_word_under_cursor(app, &buffer, &view);
+    char word_buffer[sizeof(state.last_search.text_buffer)];
+    int word_size = word.end - word.start;
+    if (word_size <= 0) {
+        enter_normal_mode(app, buffer.buffer_id);
+        return;
+    }
+    if (word_size > (int)sizeof(word_buffer)) { word_size = sizeof(word_buffer); }
+    buffer_read_range(app, &buffer, word.start, word.start + word_size, word_buffer);
+    // Going backward, skip the start of the word we're already on
+    if (direction == search_backward) { view.cursor.pos = word.start; }
+    buffer_search(app, make_string(word_buffer, word_size), view, direction,
+                  whole_word);
+}
+
+#define search_under_cursor search_for_word_under_cursor<search_forward, true>
+#define search_under_cursor_reverse search_for_word_under_cursor<search_backward, true>
+#define search_under_cursor_partial search_for_word_under_cursor<search_forward, false>
+#define search_under_cursor_partial_reverse search_for_word_under_cursor<search_backward, false>
+
+CUSTOM_COMMAND_SIG(vim_search) {
+    buffer_query_search(app, search_forward);
+}
+
+CUSTOM_COMMAND_SIG(vim_search_reverse) {
+    buffer_query_search(app, search_backward);
+}
+
+CUSTOM_COMMAND_SIG(vim_search_next) {
+    View_Summary view = get_active_view(app, AccessAll);
+    buffer_search(app, state.last_search.text, view,
+                  state.last_search.direction, state.last_search.whole_word);
+}
+
+CUSTOM_COMMAND_SIG(vim_search_prev) {
+    View_Summary view = get_active_view(app, AccessAll);
+    Search_Direction current_direction = state.last_search.direction;
+    buffer_search(app, state.last_search.text, view,
+                  (Search_Direction)(-current_direction),
+                  state.last_search.whole_word);
+    // Preserve search direction
+    state.last_search.direction = current_direction;
+}
+
+CUSTOM_COMMAND_SIG(vim_delete_char) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    if (!view.exists) { return; }
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    
+    char nextch[2];
+    int pos = view.cursor.pos;
+    buffer_read_range(app, &buffer, pos, pos + 1, nextch);
+    if (nextch[0] != '\n') {
+        if (0 < buffer.size && pos < buffer.size){
+            buffer_replace_range(app, &buffer,
+                                      pos, pos+1, 0, 0);
+            // TODO(chr): Going into register?
+        }
+    }
+}
+
+// TODO(chr): Measure the lister size?
+CUSTOM_COMMAND_SIG(lister__page_down) {
+    View_Summary view = get_active_view(app, AccessAll);
+    int scroll = get_view_options(view.view_id)->scroll;
+    for (int i = 0; i < scroll; ++i) {
+        lister__move_down(app);
+    }
+}
+
+CUSTOM_COMMAND_SIG(lister__page_up) {
+    View_Summary view = get_active_view(app, AccessAll);
+    int scroll = get_view_options(view.view_id)->scroll;
+    for (int i = 0; i < scroll; ++i) {
+        lister__move_up(app);
+    }
+}
+
+//=============================================================================
+// > Statusbar processing and commands <                             @statusbar
+// This is where the vim statusbar feature is created.
+//
+// Define a command with VIM_COMMAND_FUNC_SIG and then add it to the statusbar
+// library with define_command().
+//=============================================================================
+
+// Ex ranges:                                                          @ranges
+// An address is a line number, . (cursor line), $ (last line) or '< / '>
+// (visual selection), optionally followed by +N/-N offsets.
+static bool parse_ex_address(struct Application_Links* app,
+                             Buffer_Summary* buffer, String line, int* pos,
+                             int current_line, int* out) {
+    int p = *pos;
+    int address = 0;
+    bool have_address = false;
+    if (p < line.size) {
+        char c = line.str[p];
+        if (char_is_numeric(c)) {
+            while (p < line.size && char_is_numeric(line.str[p])) {
+                address = address*10 + (line.str[p] - '0');
+                ++p;
+            }
+            have_address = true;
+        } else if (c == '.') {
+            address = current_line;
+            ++p;
+            have_address = true;
+        } else if (c == '$') {
+            address = buffer->line_count;
+            ++p;
+            have_address = true;
+        } else if (c == '\'' && p + 1 < line.size &&
+                   (line.str[p + 1] == '<' || line.str[p + 1] == '>')) {
+            if (state.selection_range.end <= state.selection_range.start) {
+                return false;
+            }
+            int mark_pos = (line.str[p + 1] == '<' ?
+                            state.selection_range.start :
+                            state.selection_range.end - 1);
+            address = buffer_get_line_number(app, buffer, mark_pos);
+            p += 2;
+            have_address = true;
+        }
+    }
+    while (p < line.size && (line.str[p] == '+' || line.str[p] == '-')) {
+        if (!have_address) {
+            address = current_line;
+            have_address = true;
+        }
+        int sign = (line.str[p] == '+' ? 1 : -1);
+        ++p;
+        int offset = 0;
+        bool have_offset = false;
+        while (p < line.size && char_is_numeric(line.str[p])) {
+            offset = offset*10 + (line.str[p] - '0');
+            have_offset = true;
+            ++p;
+        }
+        address += sign*(have_offset ? offset : 1);
+    }
+    if (!have_address) { return false; }
+    if (address < 1) { address = 1; }
+    if (address > buffer->line_count) { address = buffer->line_count; }
+    *pos = p;
+    *out = address;
+    return true;
+}
+
+// Parse an optional range at *pos: % for the whole buffer, or one or two
+// addresses separated by a comma.
+static bool parse_ex_range(struct Application_Links* app, String line,
+                           int* pos, Range* out) {
+    View_Summary view = get_active_view(app, AccessAll);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+    if (!buffer.exists) { return false; }
+    int current_line = view.cursor.line;
+
+    if (*pos < line.size && line.str[*pos] == '%') {
+        ++*pos;
+        *out = make_range(1, buffer.line_count);
+        return true;
+    }
+
+    int first = 0;
+    if (!parse_ex_address(app, &buffer, line, pos, current_line, &first)) {
+        return false;
+    }
+    int last = first;
+    if (*pos < line.size && line.str[*pos] == ',') {
+        ++*pos;
+        parse_ex_address(app, &buffer, line, pos, current_line, &last);
+    }
+    *out = make_range(first, last);
+    return true;
+}
+
+// The line range for the statusbar command being run. Without an explicit
+// range this is the whole buffer or just the cursor line, depending on the
+// command.
+static Range get_command_lines(struct Application_Links* app,
+                               Buffer_Summary* buffer,
+                               bool default_to_whole_buffer) {
+    if (state.has_command_range) {
+        return state.command_range;
+    }
+    if (default_to_whole_buffer) {
+        return make_range(1, buffer->line_count);
+    }
+    View_Summary view = get_active_view(app, AccessAll);
+    return make_range(view.cursor.line, view.cursor.line);
+}
+
+// Buffer positions spanned by a line range, not including the last newline.
+static Range get_lines_pos_range(struct Application_Links* app,
+                                 Buffer_Summary* buffer, Range lines) {
+    return make_range(buffer_get_line_start(app, buffer, lines.start),
+                      buffer_get_line_end(app, buffer, lines.end));
+}
+
+// The command named exactly, or else the first one it's an abbreviation of
+static Vim_Command_Defn* find_ex_command(String command) {
+    Vim_Command_Defn* found = 0;
+    for (int command_index = 0; command_index < defined_command_count; ++command_index) {
+        Vim_Command_Defn* defn = defined_commands + command_index;
+        if (match(defn->command, command)) {
+            return defn;
+        }
+        if (!found && match_part(defn->command, command)) {
+            found = defn;
+        }
+    }
+    return found;
+}
+
+// Parse a single statusbar line and run the command it names. Commands are
+// matched exactly first, and then by prefix in definition order so that
+// abbreviations like :w and :vs keep working.
+static void exec_status_command(struct Application_Links* app, String line) {
+    int command_offset = 0;
+    while (command_offset < line.size && 
+           char_is_whitespace(line.str[command_offset])) {
+        ++command_offset;
+    }
+
+    int count = 0;
+    int count_end = command_offset;
+    for (; count_end < line.size && char_is_numeric(line.str[count_end]); ++count_end) {
+        count = count*10 + (line.str[count_end] - '0');
+    }
+    // Only a number right before the command name
+    bool is_count = (count_end < line.size && char_is_alpha(line.str[count_end]));
+    state.command_count = (is_count ? count : 0);
+
+    Range range = {};
+    bool has_range = parse_ex_range(app, line, &command_offset, &range);
+    if (!has_range && state.selection_range.start >= 0 &&
+        is_visual_mode(state.mode)) {
+        // Like vim's automatic '<,'>
+        View_Summary view = get_active_view(app, AccessAll);
+        Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+        range = make_range(
+            buffer_get_line_number(app, &buffer, state.selection_range.start),
+            buffer_get_line_number(app, &buffer, state.selection_range.end - 1));
+        has_range = true;
+    }
+    state.command_range = range;
+    state.has_command_range = has_range;
+
+    // Command names are all letters; anything else (e.g. the / in :g/pat/d)
+    // starts the argument string.
+    int command_end = command_offset;
+    while (command_end < line.size &&
+           char_is_alpha(line.str[command_end])) {
+        ++command_end;
+    }
+    
+    if (command_end == command_offset) {
+        // A bare range, like :42, jumps to its last line
+        if (has_range && command_end == line.size) {
+            active_view_to_line(app, range.end);
+        }
+        return;
+    }
+    String command = substr(line, command_offset, command_end - command_offset);
+    bool command_force = false;
+    if (command_end < line.size && line.str[command_end] == '!') {
+        ++command_end;
+        command_force = true;
+    }
+
+    int arg_start = command_end;
+    while (arg_start < line.size && 
+           char_is_whitespace(line.str[arg_start])) {
+        ++arg_start;
+    }
+    String argstr = substr(line, arg_start, line.size - arg_start);
+
+    Vim_Command_Defn* found = find_ex_command(command);
+    if (found) {
+        found->func(app, command, argstr, command_force);
+    }
+}
+
+// Fuzzy file finder:                                               @finder
+// :e opens a finder over every file under the current directory. The tree
+// is walked once, in parallel, into a File_Index: all the strings sit in
+// one arena, with each directory's path stored once and shared by its files.
+// On Linux inotify keeps the index current; elsewhere it's rebuilt once it
+// gets older than FILE_INDEX_MAX_AGE seconds.
+//
+// Each keystroke first drops every file whose character mask doesn't cover
+// the query's (a flat AND over an array of uint64s), then scores the
+// survivors as subsequence matches. Typing more of the query only rescans
+// the files that matched before.
+#include <time.h>
+#if defined(IS_LINUX)
+#include <sys/inotify.h>
+#endif
+
+constexpr int FINDER_RESULTS = 8;
+constexpr int FILE_INDEX_MAX_AGE = 30;
+
+struct File_Index_Dir {
+    // Offset in strings of the path relative to the root, ending in / (empty
+    // for the root itself)
+    int path;
+    int path_size;
+    bool removed;
+};
+
+struct File_Index_Entry {
+    int dir;
+    int name;
+    int name_size;
+    bool removed;
+};
+
+struct File_Index {
+    bool built;
+    char root[4096];
+    int root_len;
+    time_t built_at;
+
+    char* strings;
+    int strings_size;
+    int strings_capacity;
+    File_Index_Dir* dirs;
+    int dir_count;
+    int dir_capacity;
+    File_Index_Entry* files;
+    // Bit per character class present in each file's path, see path_char_mask
+    uint64_t* masks;
+    int file_count;
+    int file_capacity;
+
+    // Open addressed (dir, name) -> file + 1, for change notifications
+    int* file_table;
+    int file_table_capacity;
+
+#if defined(IS_LINUX)
+    int inotify_fd;
+    // Watch descriptor -> dir
+    int* watch_dirs;
+    int watch_dir_capacity;
+#endif
+};
+
+static File_Index file_index = {};
+
+static uint64_t path_char_mask(const char* str, int size, uint64_t mask) {
+    for (int i = 0; i < size; ++i) {
+        char c = char_to_lower(str[i]);
+        if (c >= 'a' && c <= 'z') { mask |= 1ull << (c - 'a'); }
+        else if (c >= '0' && c <= '9') { mask |= 1ull << (26 + c - '0'); }
+        else if (c == '_') { mask |= 1ull << 36; }
+        else if (c == '-') { mask |= 1ull << 37; }
+        else if (c == '.') { mask |= 1ull << 38; }
+        else if (c == '/') { mask |= 1ull << 39; }
+    }
+    return mask;
+}
+
+static int file_index_push_string(File_Index* index, const char* str, int size) {
+    if (index->strings_size + size > index->strings_capacity) {
+        index->strings_capacity = (index->strings_size + size) * 2 + 4096;
+        index->strings = (char*)realloc(index->strings, index->strings_capacity);
+    }
+    int offset = index->strings_size;
+    memcpy(index->strings + offset, str, size);
+    index->strings_size += size;
+    return offset;
+}
+
+static int file_index_add_dir(File_Index* index, const char* path, int size) {
+    if (index->dir_count == index->dir_capacity) {
+        index->dir_capacity = index->dir_capacity ? index->dir_capacity * 2 : 256;
+        index->dirs = (File_Index_Dir*)realloc(
+            index->dirs, index->dir_capacity * sizeof(File_Index_Dir));
+    }
+    File_Index_Dir* dir = index->dirs + index->dir_count;
+    dir->path = file_index_push_string(index, path, size);
+    dir->path_size = size;
+    dir->removed = false;
+    return index->dir_count++;
+}
+
+static uint32_t hash_file_key(int dir, const char* name, int size) {
+    uint32_t hash = 2166136261u ^ (uint32_t)dir;
+    for (int i = 0; i < size; ++i) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void file_table_insert(File_Index* index, int file) {
+    File_Index_Entry* entry = index->files + file;
+    uint32_t mask = index->file_table_capacity - 1;
+    uint32_t slot = hash_file_key(entry->dir, index->strings + entry->name,
+                                  entry->name_size) & mask;
+    while (index->file_table[slot]) { slot = (slot + 1) & mask; }
+    index->file_table[slot] = file + 1;
+}
+
+static void rebuild_file_table(File_Index* index) {
+    int capacity = 1024;
+    while (capacity < index->file_count * 2) { capacity *= 2; }
+    free(index->file_table);
+    index->file_table = (int*)calloc(capacity, sizeof(int));
+    index->file_table_capacity = capacity;
+    for (int i = 0; i < index->file_count; ++i) { file_table_insert(index, i); }
+}
+
+static int file_table_find(File_Index* index, int dir, const char* name, int size) {
+    if (!index->file_table) { return -1; }
+    uint32_t mask = index->file_table_capacity - 1;
+    uint32_t slot = hash_file_key(dir, name, size) & mask;
+    while (int file = index->file_table[slot]) {
+        File_Index_Entry* entry = index->files + file - 1;
+        if (entry->dir == dir && entry->name_size == size &&
+            memcmp(index->strings + entry->name, name, size) == 0) {
+            return file - 1;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+static int file_index_add_file(File_Index* index, int dir, const char* name, int size) {
+    if (index->file_count == index->file_capacity) {
+        index->file_capacity = index->file_capacity ? index->file_capacity * 2 : 1024;
+        index->files = (File_Index_Entry*)realloc(
+            index->files, index->file_capacity * sizeof(File_Index_Entry));
+        index->masks = (uint64_t*)realloc(
+            index->masks, index->file_capacity * sizeof(uint64_t));
+    }
+    int file = index->file_count++;
+    File_Index_Entry* entry = index->files + file;
+    entry->dir = dir;
+    entry->name = file_index_push_string(index, name, size);
+    entry->name_size = size;
+    entry->removed = false;
+    File_Index_Dir* parent = index->dirs + dir;
+    index->masks[file] = path_char_mask(name, size, path_char_mask(
+        index->strings + parent->path, parent->path_size, 0));
+    if (index->file_table) {
+        if (index->file_count * 2 > index->file_table_capacity) {
+            rebuild_file_table(index);
+        } else {
+            file_table_insert(index, file);
+        }
+    }
+    return file;
+}
+
+static void free_file_index(File_Index* index) {
+    free(index->strings);
+    free(index->dirs);
+    free(index->files);
+    free(index->masks);
+    free(index->file_table);
+#if defined(IS_LINUX)
+    if (index->inotify_fd > 0) { close(index->inotify_fd); }
+    free(index->watch_dirs);
+#endif
+    *index = {};
+}
+
+#if defined(VIM_HAS_THREADS)
+// Walk the directory at path (relative path starting at rel_start) into
+// index, under dir. path has room for 4096 chars.
+static void walk_file_index_dir(File_Index* index, char* path, int path_len,
+                                int rel_start, int dir) {
+    DIR* handle = opendir(path);
+    if (!handle) { return; }
+    while (struct dirent* entry = readdir(handle)) {
+        // Skips . and .. along with hidden things like .git
+        if (entry->d_name[0] == '.') { continue; }
+        int name_len = (int)strlen(entry->d_name);
+        if (path_len + name_len + 2 >= 4096) { continue; }
+        bool is_dir = (entry->d_type == DT_DIR);
+        bool is_file = (entry->d_type == DT_REG);
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat info;
+            path[path_len] = '/';
+            memcpy(path + path_len + 1, entry->d_name, name_len + 1);
+            if (stat(path, &info) == 0) {
+                // Don't follow links into directories; they can loop
+                is_dir = (entry->d_type == DT_UNKNOWN && S_ISDIR(info.st_mode));
+                is_file = S_ISREG(info.st_mode);
+            }
+            path[path_len] = 0;
+        }
+        if (is_dir) {
+            path[path_len] = '/';
+            memcpy(path + path_len + 1, entry->d_name, name_len);
+            path[path_len + 1 + name_len] = '/';
+            int sub_len = path_len + 1 + name_len;
+            int sub_dir = file_index_add_dir(index, path + rel_start,
+                                             sub_len + 1 - rel_start);
+            path[sub_len] = 0;
+            walk_file_index_dir(index, path, sub_len, rel_start, sub_dir);
+            path[path_len] = 0;
+        } else if (is_file) {
+            file_index_add_file(index, dir, entry->d_name, name_len);
+        }
+    }
+    closedir(handle);
+}
+
+struct File_Walk_Context {
+    File_Index* index;
+    char** top_dirs;
+    int top_dir_count;
+    int next_top_dir;
+    File_Index* results;
+};
+
+static void file_walk_job(void* data, int job_index) {
+    File_Walk_Context* ctx = (File_Walk_Context*)data;
+    File_Index* out = ctx->results + job_index;
+    char path[4096];
+    for (;;) {
+        int i = __atomic_fetch_add(&ctx->next_top_dir, 1, __ATOMIC_RELAXED);
+        if (i >= ctx->top_dir_count) { break; }
+        int name_len = (int)strlen(ctx->top_dirs[i]);
+        int root_len = ctx->index->root_len;
+        if (root_len + name_len + 2 >= (int)sizeof(path)) { continue; }
+        memcpy(path, ctx->index->root, root_len);
+        path[root_len] = '/';
+        memcpy(path + root_len + 1, ctx->top_dirs[i], name_len);
+        path[root_len + 1 + name_len] = '/';
+        int dir = file_index_add_dir(out, path + root_len + 1, name_len + 1);
+        path[root_len + 1 + name_len] = 0;
+        walk_file_index_dir(out, path, root_len + 1 + name_len, root_len + 1, dir);
+    }
+}
+
+// Append from's dirs and files to into.
+static void merge_file_index(File_Index* into, File_Index* from) {
+    int dir_base = into->dir_count;
+    for (int i = 0; i < from->dir_count; ++i) {
+        file_index_add_dir(into, from->strings + from->dirs[i].path,
+                           from->dirs[i].path_size);
+    }
+    for (int i = 0; i < from->file_count; ++i) {
+        File_Index_Entry* entry = from->files + i;
+        file_index_add_file(into, dir_base + entry->dir,
+                            from->strings + entry->name, entry->name_size);
+    }
+}
+
+static void walk_file_index(File_Index* index) {
+    DIR* handle = opendir(index->root);
+    if (!handle) { return; }
+    char** top_dirs = 0;
+    int top_dir_count = 0;
+    while (struct dirent* entry = readdir(handle)) {
+        if (entry->d_name[0] == '.') { continue; }
+        bool is_dir = (entry->d_type == DT_DIR);
+        bool is_file = (entry->d_type == DT_REG);
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", index->root, entry->d_name);
+            struct stat info;
+            if (stat(path, &info) == 0) {
+                is_dir = (entry->d_type == DT_UNKNOWN && S_ISDIR(info.st_mode));
+                is_file = S_ISREG(info.st_mode);
+            }
+        }
+        if (is_dir) {
+            top_dirs = (char**)realloc(top_dirs, (top_dir_count + 1) * sizeof(char*));
+            top_dirs[top_dir_count++] = strdup(entry->d_name);
+        } else if (is_file) {
+            file_index_add_file(index, 0, entry->d_name, (int)strlen(entry->d_name));
+        }
+    }
+    closedir(handle);
+
+    File_Walk_Context ctx = {};
+    ctx.index = index;
+    ctx.top_dirs = top_dirs;
+    ctx.top_dir_count = top_dir_count;
+    int job_count = get_core_count();
+    if (job_count > top_dir_count) { job_count = top_dir_count; }
+    ctx.results = (File_Index*)calloc(job_count, sizeof(File_Index));
+    run_parallel_jobs(file_walk_job, &ctx, job_count);
+    for (int i = 0; i < job_count; ++i) {
+        merge_file_index(index, ctx.results + i);
+        free_file_index(ctx.results + i);
+    }
+    free(ctx.results);
+    for (int i = 0; i < top_dir_count; ++i) { free(top_dirs[i]); }
+    free(top_dirs);
+}
+#else
+// Without threads, 4coder's own directory listing walks the tree.
+static void walk_file_index_dir(struct Application_Links* app, File_Index* index,
+                                char* path, int path_len, int rel_start, int dir) {
+    File_List list = get_file_list(app, path, path_len);
+    for (uint32_t i = 0; i < list.count; ++i) {
+        File_Info* info = list.infos + i;
+        if (info->filename_len == 0 || info->filename[0] == '.') { continue; }
+        if (path_len + info->filename_len + 2 >= 4096) { continue; }
+        if (info->folder) {
+            path[path_len] = '/';
+            memcpy(path + path_len + 1, info->filename, info->filename_len);
+            int sub_len = path_len + 1 + info->filename_len;
+            path[sub_len] = '/';
+            int sub_dir = file_index_add_dir(index, path + rel_start,
+                                             sub_len + 1 - rel_start);
+            path[sub_len] = 0;
+            walk_file_index_dir(app, index, path, sub_len, rel_start, sub_dir);
+            path[path_len] = 0;
+        } else {
+            file_index_add_file(index, dir, info->filename, info->filename_len);
+        }
+    }
+    free_file_list(app, list);
+}
+#endif
+
+#if defined(IS_LINUX)
+static void watch_file_index_dir(File_Index* index, int dir) {
+    if (index->inotify_fd <= 0) { return; }
+    char path[4096];
+    File_Index_Dir* record = index->dirs + dir;
+    snprintf(path, sizeof(path), "%s/%.*s", index->root, record->path_size,
+             index->strings + record->path);
+    int wd = inotify_add_watch(index->inotify_fd, path,
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                               IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) {
+        // Usually out of watches; fall back to rebuilding by age
+        close(index->inotify_fd);
+        index->inotify_fd = 0;
+        return;
+    }
+    if (wd >= index->watch_dir_capacity) {
+        int capacity = (wd + 1) * 2;
+        index->watch_dirs = (int*)realloc(index->watch_dirs, capacity * sizeof(int));
+        for (int i = index->watch_dir_capacity; i < capacity; ++i) {
+            index->watch_dirs[i] = -1;
+        }
+        index->watch_dir_capacity = capacity;
+    }
+    index->watch_dirs[wd] = dir;
+}
+
+static void remove_file_index_dir(File_Index* index, const char* path, int size) {
+    for (int i = 1; i < index->dir_count; ++i) {
+        File_Index_Dir* dir = index->dirs + i;
+        if (dir->path_size >= size &&
+            memcmp(index->strings + dir->path, path, size) == 0) {
+            dir->removed = true;
+        }
+    }
+}
+
+// Apply whatever inotify has queued up since the last look.
+static void refresh_file_index(File_Index* index) {
+    alignas(struct inotify_event) char buffer[16384];
+    for (;;) {
+        ssize_t size = read(index->inotify_fd, buffer, sizeof(buffer));
+        if (size <= 0) { break; }
+        for (char* at = buffer; at < buffer + size;) {
+            struct inotify_event* event = (struct inotify_event*)at;
+            at += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                index->built = false;
+                return;
+            }
+            if (event->wd < 0 || event->wd >= index->watch_dir_capacity ||
+                index->watch_dirs[event->wd] < 0 || event->len == 0 ||
+                event->name[0] == '.') {
+                continue;
+            }
+            int dir = index->watch_dirs[event->wd];
+            int name_len = (int)strlen(event->name);
+            bool added = (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0;
+            if (event->mask & IN_ISDIR) {
+                char path[4096];
+                File_Index_Dir* parent = index->dirs + dir;
+                int rel_len = snprintf(path, sizeof(path), "%.*s%s/",
+                                       parent->path_size,
+                                       index->strings + parent->path, event->name);
+                if (rel_len >= (int)sizeof(path)) { continue; }
+                if (!added) {
+                    remove_file_index_dir(index, path, rel_len);
+                    continue;
+                }
+                int first_dir = index->dir_count;
+                int sub_dir = file_index_add_dir(index, path, rel_len);
+                char full[4096];
+                int full_len = snprintf(full, sizeof(full), "%s/%.*s", index->root,
+                                        rel_len - 1, path);
+                if (full_len >= (int)sizeof(full)) { continue; }
+                walk_file_index_dir(index, full, full_len, index->root_len + 1, sub_dir);
+                for (int i = first_dir; i < index->dir_count; ++i) {
+                    watch_file_index_dir(index, i);
+                }
+                if (index->inotify_fd <= 0) { return; }
+                continue;
+            }
+            int file = file_table_find(index, dir, event->name, name_len);
+            if (added) {
+                if (file >= 0) { index->files[file].removed = false; }
+                else { file_index_add_file(index, dir, event->name, name_len); }
+            } else if (file >= 0) {
+                index->files[file].removed = true;
+            }
+        }
+    }
+}
+#endif
+
+// The index for the current directory, built or brought up to date.
+static File_Index* get_file_index(struct Application_Links* app) {
+    char root[4096];
+    int root_len = directory_get_hot(app, root, sizeof(root) - 1);
+    while (root_len > 1 && root[root_len - 1] == '/') { --root_len; }
+    root[root_len] = 0;
+
+    File_Index* index = &file_index;
+    bool same_root = (index->built && index->root_len == root_len &&
+                      memcmp(index->root, root, root_len) == 0);
+#if defined(IS_LINUX)
+    if (same_root && index->inotify_fd > 0) {
+        refresh_file_index(index);
+        if (index->built) { return index; }
+    }
+#endif
+    if (same_root && time(0) - index->built_at < FILE_INDEX_MAX_AGE) {
+        return index;
+    }
+
+    free_file_index(index);
+    memcpy(index->root, root, root_len + 1);
+    index->root_len = root_len;
+    file_index_add_dir(index, "", 0);
+#if defined(VIM_HAS_THREADS)
+    walk_file_index(index);
+#else
+    char path[4096];
+    memcpy(path, root, root_len + 1);
+    walk_file_index_dir(app, index, path, root_len, root_len + 1, 0);
+#endif
+    rebuild_file_table(index);
+#if defined(IS_LINUX)
+    index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (int i = 0; i < index->dir_count && index->inotify_fd > 0; ++i) {
+        watch_file_index_dir(index, i);
+    }
+#endif
+    index->built = true;
+    index->built_at = time(0);
+    return index;
+}
+
+static bool is_word_start(const char* path, int i) {
+    if (i == 0) { return true; }
+    char prev = path[i - 1];
+    char c = path[i];
+    return (prev == '/' || prev == '_' || prev == '-' || prev == '.' ||
+            prev == ' ' || (char_is_lower(prev) && char_is_upper(c)));
+}
+
+// Score query as a subsequence of path, matching case-insensitively, or -1.
+// Rewards matches at word starts, runs of consecutive matches and matches
+// in the file name; gaps and long paths cost a little.
+static int score_subsequence(String query, const char* path, int size,
+                             int name_start) {
+    int score = 0;
+    int q = 0;
+    int last = -2;
+    for (int i = 0; i < size && q < query.size; ++i) {
+        if (char_to_lower(path[i]) != char_to_lower(query.str[q])) { continue; }
+        int gain = 1;
+        if (is_word_start(path, i)) { gain += 8; }
+        if (i == last + 1) { gain += 6; }
+        else if (last >= 0) { gain -= (i - last < 8 ? (i - last)/2 : 4); }
+        if (i >= name_start) { gain += 2; }
+        score += gain;
+        last = i;
+        ++q;
+    }
+    if (q < query.size) { return -1; }
+    score = score * 64 - size;
+    return (score > 0 ? score : 0);
+}
+
+static int score_file(File_Index* index, int file, String query) {
+    File_Index_Entry* entry = index->files + file;
+    File_Index_Dir* dir = index->dirs + entry->dir;
+    char path[4096];
+    if (dir->path_size + entry->name_size > (int)sizeof(path)) { return -1; }
+    memcpy(path, index->strings + dir->path, dir->path_size);
+    memcpy(path + dir->path_size, index->strings + entry->name, entry->name_size);
+    int size = dir->path_size + entry->name_size;
+    // A query that fits inside the file name alone beats one spread over
+    // the whole path.
+    int name_score = score_subsequence(query, path + dir->path_size,
+                                       entry->name_size, 0);
+    if (name_score >= 0) { return (1 << 24) + name_score - dir->path_size; }
+    return score_subsequence(query, path, size, dir->path_size);
+}
+
+struct Finder_Match {
+    int file;
+    int score;
+};
+
+// Narrow candidates down to the files that match query, and keep the best
+// FINDER_RESULTS of them in order.
+static int find_fuzzy_matches(File_Index* index, String query,
+                              int* candidates, int* candidate_count,
+                              Finder_Match* best) {
+    uint64_t query_mask = path_char_mask(query.str, query.size, 0);
+    int count = 0;
+    int in_count = *candidate_count;
+    int kept = 0;
+    for (int i = 0; i < in_count; ++i) {
+        int file = candidates[i];
+        if ((index->masks[file] & query_mask) != query_mask) { continue; }
+        File_Index_Entry* entry = index->files + file;
+        if (entry->removed || index->dirs[entry->dir].removed) { continue; }
+        int score = score_file(index, file, query);
+        if (score < 0) { continue; }
+        candidates[kept++] = file;
+
+        int slot = (count < FINDER_RESULTS ? count++ : FINDER_RESULTS);
+        while (slot > 0 && best[slot - 1].score < score) {
+            if (slot < FINDER_RESULTS) { best[slot] = best[slot - 1]; }
+            --slot;
+        }
+        if (slot < FINDER_RESULTS) {
+            best[slot].file = file;
+            best[slot].score = score;
+        }
+    }
+    *candidate_count = kept;
+    return count;
+}
+
+static void fuzzy_open_file(struct Application_Links* app) {
+    File_Index* index = get_file_index(app);
+
+    Query_Bar result_bars[FINDER_RESULTS];
+    char result_space[FINDER_RESULTS][256];
+    int result_bar_count = 0;
+    for (; result_bar_count < FINDER_RESULTS; ++result_bar_count) {
+        Query_Bar* result = result_bars + result_bar_count;
+        result->prompt = make_lit_string("  ");
+        result->string = make_fixed_width_string(result_space[result_bar_count]);
+        if (start_query_bar(app, result, 0) == 0) { break; }
+    }
+    defer(for (int i = 0; i < result_bar_count; ++i) {
+        end_query_bar(app, result_bars + i, 0);
+    });
+
+    Query_Bar bar;
+    if (start_query_bar(app, &bar, 0) == 0) return;
+    defer(end_query_bar(app, &bar, 0));
+    char bar_string_space[256];
+    bar.string = make_fixed_width_string(bar_string_space);
+    bar.prompt = make_lit_string(":e ");
+
+    // Files that matched the query so far; typing more only narrows these
+    int* candidates = (int*)malloc(index->file_count * sizeof(int) + 1);
+    defer(free(candidates));
+    int candidate_count = 0;
+    bool candidates_valid = false;
+    Finder_Match matches[FINDER_RESULTS];
+    int match_count = 0;
+    int selected = 0;
+
+    User_Input in;
+    for (;;) {
+        for (int i = 0; i < result_bar_count; ++i) {
+            Query_Bar* result = result_bars + i;
+            result->prompt = make_lit_string(i == selected && i < match_count ? "> " : "  ");
+            result->string.size = 0;
+            if (i < match_count) {
+                File_Index_Entry* entry = index->files + matches[i].file;
+                File_Index_Dir* dir = index->dirs + entry->dir;
+                append(&result->string, make_string(index->strings + dir->path,
+                                                    dir->path_size));
+                append(&result->string, make_string(index->strings + entry->name,
+                                                    entry->name_size));
+            }
+        }
+
+        in = get_user_input(app, EventOnAnyKey, EventOnEsc);
+        if (in.abort) return;
+        bool narrowed = false;
+        if (in.key.keycode == '\n') {
+            break;
+        } else if (in.key.keycode == '\t' || in.key.keycode == key_down ||
+                   (in.key.keycode == 'n' && in.key.modifiers[MDFR_CONTROL_INDEX])) {
+            if (match_count > 0) { selected = (selected + 1) % match_count; }
+            continue;
+        } else if (in.key.keycode == key_up ||
+                   (in.key.keycode == 'p' && in.key.modifiers[MDFR_CONTROL_INDEX])) {
+            if (match_count > 0) { selected = (selected + match_count - 1) % match_count; }
+            continue;
+        } else if (in.key.character && key_is_unmodified(&in.key)) {
+            append(&bar.string, (char)in.key.character);
+            narrowed = candidates_valid;
+        } else if (in.key.keycode == key_back) {
+            if (bar.string.size > 0) { --bar.string.size; }
+        } else {
+            continue;
+        }
+
+        match_count = 0;
+        selected = 0;
+        if (bar.string.size == 0) {
+            candidates_valid = false;
+            continue;
+        }
+        if (!narrowed) {
+            candidate_count = index->file_count;
+            for (int i = 0; i < candidate_count; ++i) { candidates[i] = i; }
+        }
+        match_count = find_fuzzy_matches(index, bar.string, candidates,
+                                         &candidate_count, matches);
+        candidates_valid = true;
+    }
+
+    View_Summary view = get_active_view(app, AccessAll);
+    char path_space[4096];
+    String path = make_fixed_width_string(path_space);
+    append(&path, make_string(index->root, index->root_len));
+    append(&path, "/");
+    if (match_count > 0) {
+        File_Index_Entry* entry = index->files + matches[selected].file;
+        File_Index_Dir* dir = index->dirs + entry->dir;
+        append(&path, make_string(index->strings + dir->path, dir->path_size));
+        append(&path, make_string(index->strings + entry->name, entry->name_size));
+    } else if (bar.string.size > 0) {
+        // Nothing matched, so treat it as the name of a new file
+        append(&path, bar.string);
+    } else {
+        return;
+    }
+    view_open_file(app, &view, path.str, path.size, false);
+}
+
+// Command line completion:                                         @cmdline
+// Tab at the : prompt completes the word before the cursor: a command name,
+// or the command's argument as its Ex_Arg_Kind says. Command names come
+// from a sorted copy of the registry, file names from a small cache of
+// sorted directory listings that are only reread when the directory
+// changes, buffer names from the buffer list and option names from a sorted
+// copy of the option table. Tab again steps through
+// the candidates, Shift-Tab steps back.
+constexpr int DIR_LISTING_CACHE = 8;
+
+struct Dir_Listing {
+    char path[4096];
+    int path_len;
+#if defined(VIM_HAS_THREADS)
+    time_t mtime;
+#endif
+    time_t read_at;
+    uint64_t last_used;
+    char* strings;
+    // Sorted; folders end in /
+    String* names;
+    int count;
+};
+
+static Dir_Listing dir_listings[DIR_LISTING_CACHE] = {};
+static uint64_t dir_listing_clock = 0;
+
+// Indices into defined_commands, sorted by name
+static int* sorted_commands = 0;
+static int sorted_command_count = 0;
+
+static bool string_less(String a, String b) {
+    return compare(a, b) < 0;
+}
+
+static int compare_strings(const void* a, const void* b) {
+    return compare(*(const String*)a, *(const String*)b);
+}
+
+static void sort_strings(String* strings, int count) {
+    if (count > 1) { qsort(strings, count, sizeof(String), compare_strings); }
+}
+
+// First of the sorted strings not less than prefix.
+static int lower_bound_strings(String* strings, int count, String prefix) {
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (string_less(strings[mid], prefix)) { low = mid + 1; }
+        else { high = mid; }
+    }
+    return low;
+}
+
+static void update_sorted_commands() {
+    if (sorted_command_count == defined_command_count) { return; }
+    sorted_commands = (int*)realloc(sorted_commands,
+                                    defined_command_count * sizeof(int));
+    for (int i = 0; i < defined_command_count; ++i) {
+        int j = i;
+        for (; j > 0 && string_less(defined_commands[i].command,
+                                    defined_commands[sorted_commands[j - 1]].command); --j) {
+            sorted_commands[j] = sorted_commands[j - 1];
+        }
+        sorted_commands[j] = i;
+    }
+    sorted_command_count = defined_command_count;
+}
+
+static bool dir_listing_is_current(Dir_Listing* listing) {
+#if defined(VIM_HAS_THREADS)
+    struct stat info;
+    return (stat(listing->path, &info) == 0 && info.st_mtime == listing->mtime);
+#else
+    return (time(0) - listing->read_at < FILE_INDEX_MAX_AGE);
+#endif
+}
+
+static Dir_Listing* get_dir_listing(struct Application_Links* app, String path) {
+    if (path.size >= (int)sizeof(dir_listings[0].path)) { return 0; }
+    Dir_Listing* listing = 0;
+    for (int i = 0; i < DIR_LISTING_CACHE; ++i) {
+        Dir_Listing* cached = dir_listings + i;
+        if (cached->names && match(make_string(cached->path, cached->path_len), path)) {
+            listing = cached;
+            break;
+        }
+        if (!listing || cached->last_used < listing->last_used) { listing = cached; }
+    }
+    listing->last_used = ++dir_listing_clock;
+    if (listing->names && match(make_string(listing->path, listing->path_len), path) &&
+        dir_listing_is_current(listing)) {
+        return listing;
+    }
+
+    free(listing->strings);
+    free(listing->names);
+    *listing = {};
+    listing->last_used = dir_listing_clock;
+    memcpy(listing->path, path.str, path.size);
+    listing->path[path.size] = 0;
+    listing->path_len = path.size;
+    listing->read_at = time(0);
+#if defined(VIM_HAS_THREADS)
+    struct stat info;
+    if (stat(listing->path, &info) == 0) { listing->mtime = info.st_mtime; }
+#endif
+
+    File_List list = get_file_list(app, listing->path, listing->path_len);
+    defer(free_file_list(app, list));
+    int strings_size = 0;
+    for (uint32_t i = 0; i < list.count; ++i) {
+        strings_size += list.infos[i].filename_len + 1;
+    }
+    listing->strings = (char*)malloc(strings_size + 1);
+    listing->names = (String*)malloc((list.count + 1) * sizeof(String));
+    int at = 0;
+    for (uint32_t i = 0; i < list.count; ++i) {
+        File_Info* info = list.infos + i;
+        if (info->filename_len == 0) { continue; }
+        String name = make_string(listing->strings + at, info->filename_len);
+        memcpy(name.str, info->filename, info->filename_len);
+        if (info->folder) { name.str[name.size++] = '/'; }
+        at += name.size;
+        listing->names[listing->count++] = name;
+    }
+    sort_strings(listing->names, listing->count);
+    return listing;
+}
+
+struct Cmdline_Completion {
+    bool active;
+    // Where the completed part of the line starts
+    int start;
+    String* candidates;
+    int count;
+    int capacity;
+    int current;
+};
+
+static void push_completion(Cmdline_Completion* completion, String candidate) {
+    if (completion->count == completion->capacity) {
+        completion->capacity = (completion->capacity ? completion->capacity * 2 : 64);
+        completion->candidates = (String*)realloc(
+            completion->candidates, completion->capacity * sizeof(String));
+    }
+    completion->candidates[completion->count++] = candidate;
+}
+
+static void complete_command_names(Cmdline_Completion* completion, String prefix) {
+    update_sorted_commands();
+    int low = 0;
+    int high = sorted_command_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (string_less(defined_commands[sorted_commands[mid]].command, prefix)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (int i = low; i < sorted_command_count; ++i) {
+        String name = defined_commands[sorted_commands[i]].command;
+        if (!match_part(name, prefix)) { break; }
+        push_completion(completion, name);
+    }
+}
+
+// word is what's typed so far of a path, absolute or from the current
+// directory. Only the part after its last / gets completed.
+static void complete_file_names(struct Application_Links* app,
+                                Cmdline_Completion* completion, String word,
+                                int word_start) {
+    int name_start = word.size;
+    while (name_start > 0 && word.str[name_start - 1] != '/' &&
+           word.str[name_start - 1] != '\\') {
+        --name_start;
+    }
+    String prefix = substr(word, name_start, word.size - name_start);
+    String folder = substr(word, 0, name_start);
+    completion->start = word_start + name_start;
+
+    char path_space[4096];
+    String path = make_fixed_width_string(path_space);
+    bool absolute = (folder.size > 0 && (folder.str[0] == '/' || folder.str[0] == '\\' ||
+                                         (folder.size > 1 && folder.str[1] == ':')));
+    if (!absolute) {
+        path.size = directory_get_hot(app, path.str, path.memory_size);
+        if (path.size > 0 && path.str[path.size - 1] != '/' &&
+            path.str[path.size - 1] != '\\') {
+            append(&path, "/");
+        }
+    }
+    if (!append_checked_ss(&path, folder)) { return; }
+    // Without the trailing separator, except for the root itself
+    if (path.size > 1 && (path.str[path.size - 1] == '/' || path.str[path.size - 1] == '\\')) {
+        --path.size;
+    }
+    Dir_Listing* listing = get_dir_listing(app, path);
+    if (!listing) { return; }
+    bool show_hidden = (prefix.size > 0 && prefix.str[0] == '.');
+    for (int i = lower_bound_strings(listing->names, listing->count, prefix);
+         i < listing->count && match_part(listing->names[i], prefix); ++i) {
+        if (!show_hidden && listing->names[i].str[0] == '.') { continue; }
+        push_completion(completion, listing->names[i]);
+    }
+}
+
+static void complete_option_names(Cmdline_Completion* completion, String word) {
+    static String sorted_names[OPTION_COUNT] = {};
+    if (sorted_names[0].size == 0) {
+        for (int i = 0; i < OPTION_COUNT; ++i) { sorted_names[i] = option_infos[i].name; }
+        sort_strings(sorted_names, OPTION_COUNT);
+    }
+    // Only the name, not any no or inv in front of it or value after it
+    int name_start = 0;
+    if (match_part(word, lit("no"))) { name_start = 2; }
+    if (match_part(word, lit("inv"))) { name_start = 3; }
+    String prefix = substr(word, name_start, word.size - name_start);
+    if (find_s_char(prefix, 0, '=') < prefix.size) { return; }
+    completion->start += name_start;
+    for (int i = lower_bound_strings(sorted_names, OPTION_COUNT, prefix);
+         i < OPTION_COUNT && match_part(sorted_names[i], prefix); ++i) {
+        if (name_start > 0 &&
+            option_infos[find_option(sorted_names[i])].type != optiontype_bool) {
+            continue;
+        }
+        push_completion(completion, sorted_names[i]);
+    }
+}
+
+static void complete_buffer_names(struct Application_Links* app,
+                                  Cmdline_Completion* completion, String prefix) {
+    for (Buffer_Summary buffer = get_buffer_first(app, AccessAll);
+         buffer.exists;
+         get_buffer_next(app, &buffer, AccessAll)) {
+        String name = make_string(buffer.buffer_name, buffer.buffer_name_len);
+        if (match_part(name, prefix)) { push_completion(completion, name); }
+    }
+    sort_strings(completion->candidates, completion->count);
+}
+
+// Work out what the end of line is, and gather what it could complete to.
+static void begin_cmdline_completion(struct Application_Links* app,
+                                     Cmdline_Completion* completion, String line) {
+    completion->count = 0;
+    completion->current = -1;
+
+    // Skip over any range in front of the command name
+    int command_start = 0;
+    while (command_start < line.size && !char_is_alpha(line.str[command_start])) {
+        ++command_start;
+    }
+    int command_end = command_start;
+    while (command_end < line.size && char_is_alpha(line.str[command_end])) {
+        ++command_end;
+    }
+    if (command_end == line.size) {
+        completion->start = command_start;
+        complete_command_names(completion, substr(line, command_start,
+                                                  command_end - command_start));
+    } else {
+        Vim_Command_Defn* defn = find_ex_command(
+            substr(line, command_start, command_end - command_start));
+        int word_start = line.size;
+        while (word_start > command_end && !char_is_whitespace(line.str[word_start - 1])) {
+            --word_start;
+        }
+        String word = substr(line, word_start, line.size - word_start);
+        completion->start = word_start;
+        switch (defn ? defn->arg_kind : exarg_none) {
+            case exarg_file: {
+                complete_file_names(app, completion, word, word_start);
+            } break;
+
+            case exarg_buffer: {
+                complete_buffer_names(app, completion, word);
+            } break;
+
+            case exarg_option: {
+                complete_option_names(completion, word);
+            } break;
+
+            case exarg_none: break;
+        }
+    }
+    completion->active = (completion->count > 0);
+}
+
+// Tab (direction 1) or Shift-Tab (-1) at the : prompt.
+static void step_cmdline_completion(struct Application_Links* app,
+                                    Cmdline_Completion* completion,
+                                    String* line, int direction) {
+    if (!completion->active) {
+        begin_cmdline_completion(app, completion, *line);
+        if (!completion->active) { return; }
+    }
+    completion->current += direction;
+    if (completion->current < 0) { completion->current = completion->count - 1; }
+    if (completion->current >= completion->count) { completion->current = 0; }
+    line->size = completion->start;
+    append_checked_ss(line, completion->candidates[completion->current]);
+}
+
+CUSTOM_COMMAND_SIG(status_command){
+    User_Input in;
+    Query_Bar bar;
+
+    set_current_keymap(app, mapid_normal);
+
+    if (start_query_bar(app, &bar, 0) == 0) return;
+    defer(end_query_bar(app, &bar, 0));
+
+    char bar_string_space[256];
+    bar.string = make_fixed_width_string(bar_string_space);
+
+    bar.prompt = make_lit_string(":");
+
+    History_Browse browse = begin_history_browse(&state.command_history);
+    Cmdline_Completion completion = {};
+    defer(free(completion.candidates));
+
+    while (1){
+        in = get_user_input(app, EventOnAnyKey, EventOnEsc);
+        if (in.abort) break;
+        if (in.key.keycode == '\n'){
+            break;
+        }
+        else if (in.key.keycode == '\t') {
+            step_cmdline_completion(app, &completion, &bar.string,
+                                    in.key.modifiers[MDFR_SHIFT_INDEX] ? -1 : 1);
+            continue;
+        }
+        else if (in.key.keycode == key_up) {
+            browse_history(&browse, &bar.string, search_backward);
+            completion.active = false;
+            continue;
+        }
+        else if (in.key.keycode == key_down) {
+            browse_history(&browse, &bar.string, search_forward);
+            completion.active = false;
+            continue;
+        }
+        else if (in.key.character && key_is_unmodified(&in.key)){
+            append(&bar.string, (char)in.key.character);
+        }
+        else if (in.key.keycode == key_back){
+            if (bar.string.size > 0){
+                --bar.string.size;
+            }
+        }
+        browse.index = state.command_history.count;
+        completion.active = false;
+
+        // TODO(chr): Make these hookable so users can make their own
+        // interactive stuff
+        if (match(bar.string, make_lit_string("e "))) {
+            fuzzy_open_file(app);
+            return;
+        }
+
+        if (match(bar.string, make_lit_string("b "))) {
+            exec_command(app, interactive_switch_buffer);
+            return;
+        }
+
+        if (match(bar.string, make_lit_string("bw "))) {
+            exec_command(app, interactive_kill_buffer);
+            return;
+        }
+    }
+    if (in.abort) return;
+
+    push_history(&state.command_history, bar.string);
+    exec_status_command(app, bar.string);
+    if (is_visual_mode(state.mode)) {
+        enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+    }
+}
+
+void define_command(String command, Vim_Command_Func func,
+                    Ex_Arg_Kind arg_kind = exarg_none) {
+    Vim_Command_Defn* defn = defined_commands + defined_command_count++;
+    defn->command = command;
+    defn->func = func;
+    defn->arg_kind = arg_kind;
+}
+
+// Background writes:                                                 @writes
+// :w and :wa copy the buffer and hand the copy to a thread, which writes it
+// with write_entire_file_atomic (a temporary file, fsync, then a rename) so
+// a slow disk never holds up typing. The render caller picks up finished
+// writes: it reports them, and if the buffer hasn't changed since it was
+// copied, marks it saved and adds to its undo log. Platforms without
+// pthreads, and :w with a file name, still save on this thread.
+struct Write_Job {
+    Buffer_ID buffer_id;
+    // The buffer's edit version when it was copied
+    uint64_t version;
+    char path[4096];
+    char* text;
+    int size;
+    // Newlines go out as \r\n
+    bool crlf;
+    // Only read once done is set
+    bool failed;
+    bool done;
+    Write_Job* next;
+};
+
+// Touched only on the main thread, apart from each job's done and failed
+static Write_Job* write_jobs = 0;
+
+static void run_write_job(Write_Job* job) {
+    const char* data = job->text;
+    size_t size = job->size;
+    char* converted = 0;
+    if (job->crlf) {
+        size_t newlines = 0;
+        for (int i = 0; i < job->size; ++i) { newlines += (job->text[i] == '\n'); }
+        converted = (char*)malloc(size + newlines + 1);
+        size_t at = 0;
+        for (int i = 0; i < job->size; ++i) {
+            if (job->text[i] == '\n') { converted[at++] = '\r'; }
+            converted[at++] = job->text[i];
+        }
+        data = converted;
+        size = at;
+    }
+    job->failed = !write_entire_file_atomic(job->path, data, size);
+    free(converted);
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+}
+
+#if defined(VIM_HAS_THREADS)
+static void* write_job_thread_proc(void* param) {
+    run_write_job((Write_Job*)param);
+    return 0;
+}
+#endif
+
+static void finish_write_job(struct Application_Links* app, Write_Job* job) {
+    Buffer_Summary buffer = get_buffer(app, job->buffer_id, AccessAll);
+    char message_space[4200];
+    String message = make_fixed_width_string(message_space);
+    if (job->failed) {
+        append(&message, "Couldn't write ");
+        append(&message, job->path);
+    } else {
+        append(&message, "\"");
+        append(&message, front_of_directory(make_string_slowly(job->path)));
+        append(&message, "\" ");
+        append_int_to_str(&message, job->size);
+        append(&message, "B written");
+        if (buffer.exists && get_buffer_edit_version(app, &buffer) == job->version) {
+            buffer_set_dirty_state(app, &buffer, DirtyState_UpToDate);
+            write_undo_log(app, &buffer);
+        }
+    }
+    append(&message, "\n");
+    print_message(app, message.str, message.size);
+    free(job->text);
+    free(job);
+}
+
+// Report the writes that are done. With wait, waits for all of them first.
+static void drain_write_jobs(struct Application_Links* app, bool wait) {
+    for (Write_Job** at = &write_jobs; *at;) {
+        Write_Job* job = *at;
+        while (wait && !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+#if defined(VIM_HAS_THREADS)
+            usleep(1000);
+#endif
+        }
+        if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+            at = &job->next;
+            continue;
+        }
+        *at = job->next;
+        finish_write_job(app, job);
+    }
+}
+
+static void start_write_job(struct Application_Links* app, Buffer_Summary* buffer) {
+    if (buffer->file_name_len <= 0 ||
+        buffer->file_name_len >= (int)sizeof(Write_Job::path)) {
+        fprintf(stderr, "No file name\n");
+        return;
+    }
+#if defined(VIM_HAS_THREADS)
+    // Don't let an older copy of this buffer land after the new one
+    for (Write_Job* job = write_jobs; job; job = job->next) {
+        if (job->buffer_id != buffer->buffer_id) { continue; }
+        while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) { usleep(1000); }
+    }
+    drain_write_jobs(app, false);
+
+    Write_Job* job = (Write_Job*)calloc(1, sizeof(Write_Job));
+    job->buffer_id = buffer->buffer_id;
+    job->version = get_buffer_edit_version(app, buffer);
+    memcpy(job->path, buffer->file_name, buffer->file_name_len);
+    job->size = buffer->size;
+    job->text = (char*)malloc(job->size + 1);
+    buffer_read_range(app, buffer, 0, job->size, job->text);
+    int32_t eol = 0;
+    buffer_get_setting(app, buffer, BufferSetting_Eol, &eol);
+    job->crlf = (eol != 0);
+    job->next = write_jobs;
+    write_jobs = job;
+
+    pthread_t thread;
+    if (pthread_create(&thread, 0, write_job_thread_proc, job) == 0) {
+        pthread_detach(thread);
+    } else {
+        run_write_job(job);
+    }
+#else
+    save_buffer(app, buffer, buffer->file_name, buffer->file_name_len, 0);
+    write_undo_log(app, buffer);
+#endif
+}
+
+VIM_COMMAND_FUNC_SIG(write_file) {
+    View_Summary view = get_active_view(app, AccessProtected);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessProtected);
+    if (argstr.str == NULL || argstr.size == 0) {
+        start_write_job(app, &buffer);
+    } else {
+        save_buffer(app, &buffer, expand_str(argstr), 0);
+    }
+}
+
+// Every buffer with unsaved changes, each on its own thread.
+VIM_COMMAND_FUNC_SIG(write_all) {
+    for (Buffer_Summary buffer = get_buffer_first(app, AccessProtected);
+         buffer.exists; get_buffer_next(app, &buffer, AccessProtected)) {
+        if (buffer.file_name_len > 0 && buffer.dirty == DirtyState_UnsavedChanges) {
+            start_write_job(app, &buffer);
+        }
+    }
+}
+
+VIM_COMMAND_FUNC_SIG(edit_file) {
+    exec_command(app, interactive_open);
+}
+
+VIM_COMMAND_FUNC_SIG(new_file) {
+    View_Summary view = get_active_view(app, AccessAll);
+    View_Summary new_view = open_view(app, &view, ViewSplit_Top);
+    new_view_settings(app, &new_view);
+    set_active_view(app, &new_view);
+    if (compare(argstr, make_lit_string("")) == 0) {
+        exec_command(app, interactive_new);
+    } else {
+        Buffer_Summary buffer = create_buffer(app, argstr.str, argstr.size, 0);
+        if (buffer.exists){
+            view_set_buffer(app, &new_view, buffer.buffer_id, SetBuffer_KeepOriginalGUI);
+        }
+    }
+}
+
+VIM_COMMAND_FUNC_SIG(new_file_open_vertical) {
+    View_Summary view = get_active_view(app, AccessAll);
+    View_Summary new_view = open_view(app, &view, ViewSplit_Right);
+    new_view_settings(app, &new_view);
+    set_active_view(app, &new_view);
+    exec_command(app, interactive_new);
+}
+
+VIM_COMMAND_FUNC_SIG(colorscheme) {
+    if (argstr.str && argstr.size > 0) {
+        change_theme(app, expand_str(argstr));
+    }
+    // else set bar text (...) to current colorscheme
+    else {
+        exec_command(app, open_color_tweaker);
+    }
+}
+
+VIM_COMMAND_FUNC_SIG(close_view) {
+    View_Summary view = get_view_first(app, AccessAll);
+    get_view_next(app, &view, AccessAll);
+    if (!view.exists) send_exit_signal(app);
+    else close_panel(app);
+}
+
+VIM_COMMAND_FUNC_SIG(close_all) {
+    drain_write_jobs(app, true);
+    send_exit_signal(app);
+}
+
+// These wait for the writes, so the buffers are marked saved by the time
+// 4coder checks for unsaved changes on the way out.
+VIM_COMMAND_FUNC_SIG(write_file_and_close_all) {
+    write_all(app, command, argstr, force);
+    close_all(app, command, argstr, force);
+}
+
+VIM_COMMAND_FUNC_SIG(write_file_and_close_view) {
+    write_file(app, command, argstr, force);
+    drain_write_jobs(app, true);
+    close_view(app, command, argstr, force);
+}
+
+// Open a view on the right of view showing the same buffer, leaving view
+// active.
+static View_Summary split_view_right(struct Application_Links* app, View_Summary* view) {
+    View_Summary new_view = open_view(app, view, ViewSplit_Right);
+    view_set_buffer(app, &new_view, view->buffer_id, 0);
+    set_active_view(app, view);
+    return new_view;
+}
+
+VIM_COMMAND_FUNC_SIG(vertical_split) {
+    View_Summary view = get_active_view(app, AccessAll);
+    split_view_right(app, &view);
+}
+
+VIM_COMMAND_FUNC_SIG(horizontal_split) {
+    View_Summary view = get_active_view(app, AccessAll);
+    View_Summary new_view = open_view(app, &view, ViewSplit_Right);
+    view_set_buffer(app, &new_view, view.buffer_id, 0);
+    set_active_view(app, &view);
+}
+
+VIM_COMMAND_FUNC_SIG(switch_buffer) {
+    String name = skip_chop_whitespace(argstr);
+    if (name.size == 0) {
+        exec_command(app, interactive_switch_buffer);
+        return;
+    }
+    // The buffer named exactly, or the only one whose name has it in
+    Buffer_Summary found = {};
+    int partial_count = 0;
+    for (Buffer_Summary buffer = get_buffer_first(app, AccessAll);
+         buffer.exists;
+         get_buffer_next(app, &buffer, AccessAll)) {
+        String buffer_name = make_string(buffer.buffer_name, buffer.buffer_name_len);
+        if (match(buffer_name, name)) {
+            found = buffer;
+            partial_count = 1;
+            break;
+        }
+        if (find_substr(buffer_name, 0, name) < buffer_name.size) {
+            found = buffer;
+            ++partial_count;
+        }
+    }
+    if (partial_count != 1) {
+        fprintf(stderr, partial_count == 0 ? "No matching buffer for %.*s\n"
+                                           : "More than one match for %.*s\n",
+                name.size, name.str);
+        return;
+    }
+    View_Summary view = get_active_view(app, AccessAll);
+    view_set_buffer(app, &view, found.buffer_id, 0);
+}
+
+VIM_COMMAND_FUNC_SIG(change_directory) {
+    char dir[4096];
+    String dirstr = make_fixed_width_string(dir);
+    dirstr.size = directory_get_hot(app, dirstr.str, dirstr.memory_size);
+    assert(dirstr.size < 4096);
+    if (!directory_cd_expand_user(app, dirstr.str, &dirstr.size, dirstr.memory_size,
+                                  argstr.str, argstr.size)) {
+        fprintf(stderr, "Couldn't change directory to %.*s\n", argstr.size, argstr.str);
+        return;
+    }
+    fprintf(stderr, "%.*s\n", (int)dirstr.size, dirstr.str);
+    directory_set_hot(app, dirstr.str, dirstr.size);
+}
+
+// Large files:                                                     @largefile
+// A file of largefile megabytes or more (0 turns this off) opens with
+// largefilemode set. Those buffers aren't lexed or wrapped, the render
+// caller skips the NOTE/TODO scan and the brace and paren highlights, and
+// keyword completion leaves them out of its index. Searching them needs
+// nothing special, since every search already reads a window at a time.
+// :setlocal nolargefilemode gets the usual settings back.
+static void apply_large_file_mode(struct Application_Links* app,
+                                  Buffer_ID buffer_id) {
+    Buffer_Summary buffer = get_buffer(app, buffer_id, AccessAll);
+    if (!buffer.exists) { return; }
+    if (!buffer_is_large_file(buffer_id)) {
+        default_file_settings(app, buffer_id);
+        return;
+    }
+    buffer_set_setting(app, &buffer, BufferSetting_Lex, false);
+    buffer_set_setting(app, &buffer, BufferSetting_WrapLine, false);
+    buffer_set_setting(app, &buffer, BufferSetting_VirtualWhitespace, false);
+
+    char message_space[256];
+    String message = make_fixed_width_string(message_space);
+    append(&message, "Large file mode: ");
+    append(&message, make_string(buffer.buffer_name, buffer.buffer_name_len));
+    append(&message, " (");
+    append_int_to_str(&message, buffer.size >> 20);
+    append(&message, " MB)\n");
+    print_message(app, message.str, message.size);
+}
+
+// From the open file hook, in place of default_file_settings.
+static void init_large_file_mode(struct Application_Links* app,
+                                 Buffer_ID buffer_id) {
+    Buffer_Summary buffer = get_buffer(app, buffer_id, AccessAll);
+    int64_t threshold = (int64_t)global_options.largefile << 20;
+    if (threshold > 0 && buffer.size >= threshold) {
+        get_buffer_options(buffer_id)->largefilemode = true;
+    }
+    apply_large_file_mode(app, buffer_id);
+}
+
+// :set, :setlocal and :setglobal:                                        @set
+// Each argument is one of name, noname, invname, name!, name=value, name?
+// or name&. :set changes the current buffer's or view's copy of a local
+// option and the global value new buffers and views start from; :setlocal
+// and :setglobal change just one of them. With no arguments, every option
+// that isn't at its default is shown.
+enum Set_Target {
+    settarget_both,
+    settarget_local,
+    settarget_global,
+};
+
+static void append_option_value(String* out, int index, Vim_Options* options) {
+    void* field = get_option_field(options, index);
+    switch (option_infos[index].type) {
+        case optiontype_bool: {
+            if (!*(Option_bool*)field) { append(out, "no"); }
+            append(out, option_infos[index].name);
+        } break;
+
+        case optiontype_int: {
+            append(out, option_infos[index].name);
+            append(out, "=");
+            append_int_to_str(out, *(Option_int*)field);
+        } break;
+
+        case optiontype_text: {
+            Option_text* text = (Option_text*)field;
+            append(out, option_infos[index].name);
+            append(out, "=");
+            append(out, make_string(text->str, text->size));
+        } break;
+    }
+}
+
+static bool option_is_default(int index, Vim_Options* options) {
+    void* field = get_option_field(options, index);
+    void* value = get_option_field((Vim_Options*)&default_options, index);
+    switch (option_infos[index].type) {
+        case optiontype_bool: return *(Option_bool*)field == *(Option_bool*)value;
+        case optiontype_int: return *(Option_int*)field == *(Option_int*)value;
+        case optiontype_text: {
+            Option_text* a = (Option_text*)field;
+            Option_text* b = (Option_text*)value;
+            return match(make_string(a->str, a->size), make_string(b->str, b->size));
+        }
+    }
+    return true;
+}
+
+// Everything one argument should change: the local copy, the global one or
+// both. The first is also where name? reads from.
+static int get_set_targets(struct Application_Links* app, int index,
+                           Set_Target target, Vim_Options* out[2]) {
+    Vim_Options* local = &global_options;
+    if (option_infos[index].scope != optionscope_global) {
+        View_Summary view = get_active_view(app, AccessAll);
+        local = (option_infos[index].scope == optionscope_buffer ?
+                 get_buffer_options(view.buffer_id) : get_view_options(view.view_id));
+    }
+    if (local == &global_options || target == settarget_global) {
+        out[0] = &global_options;
+        return 1;
+    }
+    out[0] = local;
+    if (target == settarget_local) { return 1; }
+    out[1] = &global_options;
+    return 2;
+}
+
+static bool set_option(struct Application_Links* app, String arg,
+                       Set_Target target, String* message) {
+    enum { op_set, op_unset, op_invert, op_assign, op_show, op_reset } op = op_set;
+    String name = arg;
+    String value = {};
+    int equals = find_s_char(arg, 0, '=');
+    if (equals < arg.size) {
+        op = op_assign;
+        name = substr(arg, 0, equals);
+        value = substr(arg, equals + 1, arg.size - equals - 1);
+    } else if (arg.size > 0 && arg.str[arg.size - 1] == '?') {
+        op = op_show;
+        --name.size;
+    } else if (arg.size > 0 && arg.str[arg.size - 1] == '&') {
+        op = op_reset;
+        --name.size;
+    } else if (arg.size > 0 && arg.str[arg.size - 1] == '!') {
+        op = op_invert;
+        --name.size;
+    }
+
+    int index = find_option(name);
+    if (index < 0 && op == op_set && match_part(name, lit("no"))) {
+        index = find_option(substr(name, 2, name.size - 2));
+        op = op_unset;
+    }
+    if (index < 0 && op == op_set && match_part(name, lit("inv"))) {
+        index = find_option(substr(name, 3, name.size - 3));
+        op = op_invert;
+    }
+    if (index < 0) {
+        fprintf(stderr, "Unknown option: %.*s\n", arg.size, arg.str);
+        return false;
+    }
+    const Option_Info* info = option_infos + index;
+    if (info->type != optiontype_bool && op == op_set) { op = op_show; }
+    if (info->type == optiontype_bool ? op == op_assign :
+        (op == op_unset || op == op_invert)) {
+        fprintf(stderr, "Invalid argument: %.*s\n", arg.size, arg.str);
+        return false;
+    }
+    if (op == op_assign && info->type == optiontype_int && !str_is_int(value)) {
+        fprintf(stderr, "Number required after =: %.*s\n", arg.size, arg.str);
+        return false;
+    }
+    if (op == op_assign && info->type == optiontype_int && str_to_int(value) < info->min) {
+        fprintf(stderr, "Argument must be at least %d: %.*s\n", info->min,
+                arg.size, arg.str);
+        return false;
+    }
+
+    Vim_Options* targets[2] = {};
+    int target_count = get_set_targets(app, index, target, targets);
+    if (op == op_show) {
+        append(message, "  ");
+        append_option_value(message, index, targets[0]);
+        append(message, "\n");
+        return true;
+    }
+    for (int i = 0; i < target_count; ++i) {
+        void* field = get_option_field(targets[i], index);
+        switch (op) {
+            case op_set: *(Option_bool*)field = true; break;
+            case op_unset: *(Option_bool*)field = false; break;
+            case op_invert: *(Option_bool*)field = !*(Option_bool*)field; break;
+            case op_reset: {
+                memcpy(field, get_option_field((Vim_Options*)&default_options, index),
+                       (info->type == optiontype_bool ? sizeof(Option_bool) :
+                        info->type == optiontype_int ? sizeof(Option_int) :
+                        sizeof(Option_text)));
+            } break;
+            case op_assign: {
+                if (info->type == optiontype_int) {
+                    *(Option_int*)field = str_to_int(value);
+                } else {
+                    Option_text* text = (Option_text*)field;
+                    text->size = (value.size < (int)sizeof(text->str) ?
+                                  value.size : (int)sizeof(text->str));
+                    memcpy(text->str, value.str, text->size);
+                }
+            } break;
+            case op_show: break;
+        }
+    }
+    return true;
+}
+
+static void exec_set_command(struct Application_Links* app, String argstr,
+                             Set_Target target) {
+    char message_space[1024];
+    String message = make_fixed_width_string(message_space);
+    if (argstr.size == 0) {
+        for (int i = 0; i < OPTION_COUNT; ++i) {
+            Vim_Options* targets[2] = {};
+            get_set_targets(app, i, target, targets);
+            if (option_is_default(i, targets[0])) { continue; }
+            append(&message, "  ");
+            append_option_value(&message, i, targets[0]);
+            append(&message, "\n");
+        }
+    }
+
+    View_Summary view = get_active_view(app, AccessAll);
+    bool was_large_file = buffer_is_large_file(view.buffer_id);
+
+    // Arguments are split on whitespace, which a backslash escapes
+    char arg_space[sizeof(Option_text::str)];
+    int pos = 0;
+    while (pos < argstr.size) {
+        while (pos < argstr.size && char_is_whitespace(argstr.str[pos])) { ++pos; }
+        if (pos == argstr.size) { break; }
+        String arg = make_fixed_width_string(arg_space);
+        while (pos < argstr.size && !char_is_whitespace(argstr.str[pos])) {
+            if (argstr.str[pos] == '\\' && pos + 1 < argstr.size) { ++pos; }
+            append(&arg, argstr.str[pos]);
+            ++pos;
+        }
+        if (!set_option(app, arg, target, &message)) { break; }
+    }
+    if (message.size > 0) { print_message(app, message.str, message.size); }
+    if (buffer_is_large_file(view.buffer_id) != was_large_file) {
+        apply_large_file_mode(app, view.buffer_id);
+    }
+}
+
+VIM_COMMAND_FUNC_SIG(set_options) {
+    exec_set_command(app, argstr, settarget_both);
+}
+
+VIM_COMMAND_FUNC_SIG(set_local_options) {
+    exec_set_command(app, argstr, settarget_local);
+}
+
+VIM_COMMAND_FUNC_SIG(set_global_options) {
+    exec_set_command(app, argstr, settarget_global);
+}
+
+// Argument list:                                                     @arglist
+// The files 4coder was started with (or that :args was given) are only
+// remembered, and each one is opened the first time :next, :prev, :first,
+// :last or :argument goes to it, so startup costs the same however many
+// there are. After each move the next file is read once in the background,
+// which leaves it in the OS file cache for when it's opened.
+struct Arg_List {
+    // Full paths
+    String* paths;
+    int count;
+    int current;
+};
+
+static Arg_List arg_list = {};
+
+#if defined(VIM_HAS_THREADS)
+// Set while a prefetch thread is running, so :next held down doesn't start
+// a thread per file.
+static bool arg_prefetching = false;
+
+static void* arg_prefetch_thread_proc(void* param) {
+    char* path = (char*)param;
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        char chunk[1 << 16];
+        while (read(fd, chunk, sizeof(chunk)) > 0) {}
+        close(fd);
+    }
+    free(path);
+    __atomic_store_n(&arg_prefetching, false, __ATOMIC_RELEASE);
+    return 0;
+}
+#endif
+
+static void prefetch_arg(struct Application_Links* app, int index) {
+#if defined(VIM_HAS_THREADS)
+    if (index < 0 || index >= arg_list.count) { return; }
+    String path = arg_list.paths[index];
+    Buffer_Summary buffer = get_buffer_by_file_name(app, path.str, path.size, AccessAll);
+    if (buffer.exists) { return; }
+    if (__atomic_exchange_n(&arg_prefetching, true, __ATOMIC_ACQ_REL)) { return; }
+    char* path_copy = (char*)malloc(path.size + 1);
+    memcpy(path_copy, path.str, path.size);
+    path_copy[path.size] = 0;
+    pthread_t thread;
+    if (pthread_create(&thread, 0, arg_prefetch_thread_proc, path_copy) == 0) {
+        pthread_detach(thread);
+        return;
+    }
+    free(path_copy);
+    __atomic_store_n(&arg_prefetching, false, __ATOMIC_RELEASE);
+#endif
+}
+
+// Relative paths are kept relative to the directory they were given in,
+// not whatever :cd says later.
+static void set_arg_list(struct Application_Links* app, char** files, int count) {
+    for (int i = 0; i < arg_list.count; ++i) { free(arg_list.paths[i].str); }
+    free(arg_list.paths);
+    arg_list = {};
+    if (count <= 0) { return; }
+
+    char dir_space[4096];
+    String dir = make_fixed_width_string(dir_space);
+    dir.size = directory_get_hot(app, dir.str, dir.memory_size);
+    if (dir.size > 0 && dir.str[dir.size - 1] != '/' && dir.str[dir.size - 1] != '\\') {
+        append(&dir, "/");
+    }
+    arg_list.paths = (String*)malloc(count * sizeof(String));
+    for (int i = 0; i < count; ++i) {
+        String file = make_string(files[i], (int32_t)strlen(files[i]));
+        bool absolute = (file.size > 0 && (file.str[0] == '/' || file.str[0] == '\\' ||
+                                           (file.size > 1 && file.str[1] == ':')));
+        int prefix_size = (absolute ? 0 : dir.size);
+        String path = make_string((char*)malloc(prefix_size + file.size + 1), 0,
+                                  prefix_size + file.size + 1);
+        if (!absolute) { append(&path, dir); }
+        append(&path, file);
+        terminate_with_null(&path);
+        arg_list.paths[arg_list.count++] = path;
+    }
+}
+
+static bool edit_arg(struct Application_Links* app, int index) {
+    if (arg_list.count == 0) {
+        fprintf(stderr, "The argument list is empty\n");
+        return false;
+    }
+    if (index < 0 || index >= arg_list.count) {
+        fprintf(stderr, "No argument %d, the list has %d\n", index + 1, arg_list.count);
+        return false;
+    }
+    String path = arg_list.paths[index];
+    Buffer_Summary buffer = get_buffer_by_file_name(app, path.str, path.size, AccessAll);
+    if (!buffer.exists) {
+        buffer = create_buffer(app, path.str, path.size, 0);
+    }
+    if (!buffer.exists) {
+        fprintf(stderr, "Couldn't open %.*s\n", path.size, path.str);
+        return false;
+    }
+    View_Summary view = get_active_view(app, AccessAll);
+    view_set_buffer(app, &view, buffer.buffer_id, 0);
+    arg_list.current = index;
+
+    char message_space[4200];
+    String message = make_fixed_width_string(message_space);
+    append(&message, "(");
+    append_int_to_str(&message, index + 1);
+    append(&message, " of ");
+    append_int_to_str(&message, arg_list.count);
+    append(&message, "): ");
+    append(&message, make_string(buffer.buffer_name, buffer.buffer_name_len));
+    append(&message, "\n");
+    print_message(app, message.str, message.size);
+
+    prefetch_arg(app, index + 1);
+    return true;
+}
+
+// A count in front, as in :3next, moves that many files. A visual
+// selection's lines aren't a count.
+static int get_arg_count() {
+    return (state.command_count > 0 ? state.command_count : 1);
+}
+
+// With no arguments, lists the files with the current one in brackets.
+// Otherwise the files given become the new list and the first is opened.
+VIM_COMMAND_FUNC_SIG(argument_list) {
+    if (argstr.size > 0) {
+        char* words[256];
+        int word_count = 0;
+        char* copy = (char*)malloc(argstr.size + 1);
+        defer(free(copy));
+        memcpy(copy, argstr.str, argstr.size);
+        copy[argstr.size] = 0;
+        for (char* at = copy; *at && word_count < ArrayCount(words);) {
+            while (*at && char_is_whitespace(*at)) { *at++ = 0; }
+            if (!*at) { break; }
+            words[word_count++] = at;
+            while (*at && !char_is_whitespace(*at)) { ++at; }
+        }
+        set_arg_list(app, words, word_count);
+        edit_arg(app, 0);
+        return;
+    }
+
+    String message = make_string((char*)malloc(1 << 16), 0, 1 << 16);
+    defer(free(message.str));
+    for (int i = 0; i < arg_list.count; ++i) {
+        String path = arg_list.paths[i];
+        String name = front_of_directory(path);
+        if (message.size + name.size + 4 > message.memory_size) { break; }
+        if (i == arg_list.current) { append(&message, "["); }
+        append(&message, name);
+        if (i == arg_list.current) { append(&message, "]"); }
+        append(&message, " ");
+    }
+    append(&message, "\n");
+    print_message(app, message.str, message.size);
+}
+
+VIM_COMMAND_FUNC_SIG(next_arg) {
+    edit_arg(app, arg_list.current + get_arg_count());
+}
+
+VIM_COMMAND_FUNC_SIG(previous_arg) {
+    edit_arg(app, arg_list.current - get_arg_count());
+}
+
+VIM_COMMAND_FUNC_SIG(first_arg) {
+    edit_arg(app, 0);
+}
+
+VIM_COMMAND_FUNC_SIG(last_arg) {
+    edit_arg(app, arg_list.count - 1);
+}
+
+// :argument N, or :Nargument; with neither, reopens the current file.
+VIM_COMMAND_FUNC_SIG(goto_arg) {
+    int index = arg_list.current;
+    if (argstr.size > 0 && str_is_int(argstr)) {
+        index = str_to_int(argstr) - 1;
+    } else if (state.command_count > 0) {
+        index = state.command_count - 1;
+    }
+    edit_arg(app, index);
+}
+
+// Diff mode:                                                           @diff
+// :diffthis puts the current buffer in diff mode, and once there are two
+// they're compared line by line. Each line is hashed (in parallel for big
+// buffers) and the hashes are diffed with Myers' algorithm, the linear
+// space version that splits each stretch at the middle of its edit path.
+// Past DIFF_COST_LIMIT differences a stretch is split at the furthest any
+// path got instead, so files with little in common still diff quickly.
+//
+// The edit hook widens a dirty span per buffer like it does for the
+// structure caches. The next update rehashes just the lines in it and
+// rediffs only the stretch between the unchanged hunks on either side.
+//
+// ]c and [c jump between hunks, do and dp copy the hunk under the cursor
+// from or to the other buffer. There are no filler lines, so a place
+// where only the other buffer has lines is marked on the line after it.
+constexpr int DIFF_COST_LIMIT = 1024;
+
+struct Diff_Side {
+    Buffer_ID buffer_id;
+    // See get_buffer_generation
+    uint64_t generation;
+    // line_starts[line_count] is the size of the buffer. A last line with
+    // no newline still counts, but a final newline doesn't start an
+    // empty one.
+    int* line_starts;
+    uint64_t* hashes;
+    int line_count;
+    // Edited since the last update, in current buffer coordinates
+    bool has_dirty;
+    Range dirty;
+};
+
+// Lines [a, a + a_count) of the first buffer are lines [b, b + b_count) of
+// the second. A count of 0 is a place where the other buffer has lines.
+struct Diff_Hunk {
+    int a;
+    int a_count;
+    int b;
+    int b_count;
+};
+
+struct Diff_Hunk_List {
+    Diff_Hunk* hunks;
+    int count;
+    int capacity;
+};
+
+struct Diff_State {
+    Diff_Side sides[2];
+    int side_count;
+    bool computed;
+    Diff_Hunk_List hunks;
+};
+
+static Diff_State diff_state = {};
+
+static int get_hunk_start(Diff_Hunk* hunk, int side) {
+    return (side == 0 ? hunk->a : hunk->b);
+}
+
+static int get_hunk_count(Diff_Hunk* hunk, int side) {
+    return (side == 0 ? hunk->a_count : hunk->b_count);
+}
+
+static void push_diff_hunk(Diff_Hunk_List* list, int a, int a_count,
+                           int b, int b_count) {
+    if (a_count == 0 && b_count == 0) { return; }
+    if (list->count > 0) {
+        // Hunks that touch become one
+        Diff_Hunk* last = list->hunks + list->count - 1;
+        if (last->a + last->a_count == a && last->b + last->b_count == b) {
+            last->a_count += a_count;
+            last->b_count += b_count;
+            return;
+        }
+    }
+    if (list->count == list->capacity) {
+        list->capacity = (list->capacity ? list->capacity * 2 : 64);
+        list->hunks = (Diff_Hunk*)realloc(list->hunks,
+                                          list->capacity * sizeof(Diff_Hunk));
+    }
+    list->hunks[list->count++] = { a, a_count, b, b_count };
+}
+
+struct Diff_Hash_Job {
+    // Starts at line_starts[0]
+    const char* text;
+    const int* line_starts;
+    uint64_t* hashes;
+    int line_count;
+    int job_count;
+};
+
+// Line endings aren't part of a line, so \r\n and \n files compare equal.
+static void diff_hash_job(void* data, int job_index) {
+    Diff_Hash_Job* job = (Diff_Hash_Job*)data;
+    int first = (int)((int64_t)job->line_count * job_index / job->job_count);
+    int last = (int)((int64_t)job->line_count * (job_index + 1) / job->job_count);
+    for (int line = first; line < last; ++line) {
+        const char* at = job->text + (job->line_starts[line] - job->line_starts[0]);
+        const char* end = job->text + (job->line_starts[line + 1] - job->line_starts[0]);
+        if (end > at && end[-1] == '\n') { --end; }
+        if (end > at && end[-1] == '\r') { --end; }
+        uint64_t hash = 14695981039346656037ull;
+        for (; at < end; ++at) {
+            hash = (hash ^ (uint8_t)*at) * 1099511628211ull;
+        }
+        job->hashes[line] = hash;
+    }
+}
+
+// Replace lines [first, old_end) of side with the lines of the buffer
+// between their old start and old_end's start moved by size_delta.
+static void rescan_diff_lines(struct Application_Links* app, Diff_Side* side,
+                              Buffer_Summary* buffer, int first, int old_end,
+                              int size_delta) {
+    int start = side->line_starts[first];
+    int end = side->line_starts[old_end] + size_delta;
+    int size = end - start;
+    char* text = (char*)malloc(size + 1);
+    defer(free(text));
+    buffer_read_range(app, buffer, start, end, text);
+
+    int* starts = 0;
+    int count = 0;
+    int capacity = 0;
+    for (int at = 0; at < size;) {
+        if (count + 1 >= capacity) {
+            capacity = (capacity ? capacity * 2 : 256);
+            starts = (int*)realloc(starts, capacity * sizeof(int));
+        }
+        starts[count++] = start + at;
+        const char* newline = (const char*)memchr(text + at, '\n', size - at);
+        at = (newline ? (int)(newline - text) + 1 : size);
+    }
+    defer(free(starts));
+
+    int new_count = side->line_count - (old_end - first) + count;
+    int tail = side->line_count - old_end;
+    if (new_count > side->line_count) {
+        side->line_starts = (int*)realloc(side->line_starts, (new_count + 1) * sizeof(int));
+        side->hashes = (uint64_t*)realloc(side->hashes, (new_count + 1) * sizeof(uint64_t));
+    }
+    memmove(side->line_starts + first + count, side->line_starts + old_end,
+            (tail + 1) * sizeof(int));
+    if (tail > 0) {
+        memmove(side->hashes + first + count, side->hashes + old_end,
+                tail * sizeof(uint64_t));
+    }
+    for (int i = first + count; i <= new_count; ++i) {
+        side->line_starts[i] += size_delta;
+    }
+    if (count > 0) { memcpy(side->line_starts + first, starts, count * sizeof(int)); }
+    side->line_count = new_count;
+
+    Diff_Hash_Job job = {};
+    job.text = text;
+    job.line_starts = side->line_starts + first;
+    job.hashes = side->hashes + first;
+    job.line_count = count;
+    job.job_count = (count >= (1 << 14) ? get_core_count() : 1);
+    run_parallel_jobs(diff_hash_job, &job, job.job_count);
+}
+
+// Largest i with line_starts[i] <= pos, or 0.
+static int get_diff_line(Diff_Side* side, int pos) {
+    int lo = 0;
+    int hi = side->line_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1)/2;
+        if (side->line_starts[mid] <= pos) { lo = mid; }
+        else { hi = mid - 1; }
+    }
+    return (lo < side->line_count ? lo : (side->line_count > 0 ? side->line_count - 1 : 0));
+}
+
+struct Myers_Context {
+    const uint64_t* a;
+    const uint64_t* b;
+    // Furthest x reached on each diagonal, forward and backward
+    int* forward;
+    int* backward;
+    Diff_Hunk_List* out;
+};
+
+// Where to split a[a0, a1) against b[b0, b1), whose first lines differ
+// and whose last lines differ. Returns false when it couldn't find a
+// split that makes both halves smaller.
+static bool find_diff_split(Myers_Context* ctx, int a0, int a1, int b0, int b1,
+                            int* split_a, int* split_b) {
+    const uint64_t* a = ctx->a + a0;
+    const uint64_t* b = ctx->b + b0;
+    int n = a1 - a0;
+    int m = b1 - b0;
+    int max_d = (n + m + 1)/2;
+    if (max_d > DIFF_COST_LIMIT) { max_d = DIFF_COST_LIMIT; }
+    int offset = max_d + 1;
+    int length = 2*offset + 2;
+    int* v1 = ctx->forward;
+    int* v2 = ctx->backward;
+    for (int i = 0; i < length; ++i) { v1[i] = v2[i] = -1; }
+    v1[offset + 1] = 0;
+    v2[offset + 1] = 0;
+    int delta = n - m;
+    // Whether the forward or the backward search is the one to meet the other
+    bool front = (delta % 2 != 0);
+    // Diagonals that have run off the sides of the grid
+    int k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+    for (int d = 0; d < max_d; ++d) {
+        for (int k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+            int k1_offset = offset + k1;
+            int x1 = ((k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1])) ?
+                      v1[k1_offset + 1] : v1[k1_offset - 1] + 1);
+            int y1 = x1 - k1;
+            while (x1 < n && y1 < m && a[x1] == b[y1]) { ++x1; ++y1; }
+            v1[k1_offset] = x1;
+            if (x1 > n) {
+                k1_end += 2;
+            } else if (y1 > m) {
+                k1_start += 2;
+            } else if (front) {
+                int k2_offset = offset + delta - k1;
+                if (k2_offset >= 0 && k2_offset < length && v2[k2_offset] != -1 &&
+                    x1 >= n - v2[k2_offset]) {
+                    *split_a = a0 + x1;
+                    *split_b = b0 + y1;
+                    return true;
+                }
+            }
+        }
+        for (int k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+            int k2_offset = offset + k2;
+            int x2 = ((k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1])) ?
+                      v2[k2_offset + 1] : v2[k2_offset - 1] + 1);
+            int y2 = x2 - k2;
+            while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) { ++x2; ++y2; }
+            v2[k2_offset] = x2;
+            if (x2 > n) {
+                k2_end += 2;
+            } else if (y2 > m) {
+                k2_start += 2;
+            } else if (!front) {
+                int k1_offset = offset + delta - k2;
+                if (k1_offset >= 0 && k1_offset < length && v1[k1_offset] != -1) {
+                    int x1 = v1[k1_offset];
+                    int y1 = offset + x1 - k1_offset;
+                    if (x1 >= n - x2) {
+                        *split_a = a0 + x1;
+                        *split_b = b0 + y1;
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Too many differences for a minimal diff: split where the forward
+    // search got furthest.
+    int best = 0;
+    for (int k1 = -max_d; k1 <= max_d; ++k1) {
+        int x1 = v1[offset + k1];
+        int y1 = x1 - k1;
+        if (x1 < 0 || x1 > n || y1 < 0 || y1 > m) { continue; }
+        if (x1 + y1 > best) {
+            best = x1 + y1;
+            *split_a = a0 + x1;
+            *split_b = b0 + y1;
+        }
+    }
+    return (best > 0 && best < n + m);
+}
+
+static void diff_lines(Myers_Context* ctx, int a0, int a1, int b0, int b1) {
+    for (;;) {
+        while (a0 < a1 && b0 < b1 && ctx->a[a0] == ctx->b[b0]) { ++a0; ++b0; }
+        while (a0 < a1 && b0 < b1 && ctx->a[a1 - 1] == ctx->b[b1 - 1]) { --a1; --b1; }
+        if (a0 == a1 || b0 == b1) {
+            push_diff_hunk(ctx->out, a0, a1 - a0, b0, b1 - b0);
+            return;
+        }
+        int split_a = 0;
+        int split_b = 0;
+        if (!find_diff_split(ctx, a0, a1, b0, b1, &split_a, &split_b)) {
+            push_diff_hunk(ctx->out, a0, a1 - a0, b0, b1 - b0);
+            return;
+        }
+        diff_lines(ctx, a0, split_a, b0, split_b);
+        // The second half in this frame, so a long run of splits doesn't
+        // go deep
+        a0 = split_a;
+        b0 = split_b;
+    }
+}
+
+// Rediff a[a0, a1) against b[b0, b1), replacing hunks [first, last) and
+// moving the ones after by a_delta and b_delta lines.
+static void rediff(int a0, int a1, int b0, int b1, int first, int last,
+                   int a_delta, int b_delta) {
+    Diff_Hunk_List* hunks = &diff_state.hunks;
+    Diff_Hunk_List list = {};
+    for (int i = 0; i < first; ++i) {
+        Diff_Hunk* hunk = hunks->hunks + i;
+        push_diff_hunk(&list, hunk->a, hunk->a_count, hunk->b, hunk->b_count);
+    }
+
+    Myers_Context ctx = {};
+    ctx.a = diff_state.sides[0].hashes;
+    ctx.b = diff_state.sides[1].hashes;
+    ctx.forward = (int*)malloc((2*DIFF_COST_LIMIT + 4) * sizeof(int));
+    ctx.backward = (int*)malloc((2*DIFF_COST_LIMIT + 4) * sizeof(int));
+    defer(free(ctx.forward));
+    defer(free(ctx.backward));
+    ctx.out = &list;
+    diff_lines(&ctx, a0, a1, b0, b1);
+
+    for (int i = last; i < hunks->count; ++i) {
+        Diff_Hunk* hunk = hunks->hunks + i;
+        push_diff_hunk(&list, hunk->a + a_delta, hunk->a_count,
+                       hunk->b + b_delta, hunk->b_count);
+    }
+    free(hunks->hunks);
+    *hunks = list;
+}
+
+static void end_diff() {
+    for (int i = 0; i < diff_state.side_count; ++i) {
+        free(diff_state.sides[i].line_starts);
+        free(diff_state.sides[i].hashes);
+    }
+    free(diff_state.hunks.hunks);
+    diff_state = {};
+}
+
+static void apply_edit_to_diff(Buffer_ID buffer_id, Range range, int new_size) {
+    for (int i = 0; i < diff_state.side_count; ++i) {
+        Diff_Side* side = diff_state.sides + i;
+        if (side->buffer_id != buffer_id) { continue; }
+        Range dirty = make_range(range.start, range.start + new_size);
+        if (side->has_dirty) {
+            dirty = merge_dirty_range(dirty, side->dirty, range, new_size);
+        }
+        side->dirty = dirty;
+        side->has_dirty = true;
+    }
+}
+
+// Bring the hunks up to date with both buffers. Returns false when there
+// aren't two buffers to compare.
+static bool update_diff(struct Application_Links* app) {
+    if (diff_state.side_count < 2) { return false; }
+    Buffer_Summary buffers[2];
+    for (int i = 0; i < 2; ++i) {
+        buffers[i] = get_buffer(app, diff_state.sides[i].buffer_id, AccessAll);
+        // Gone, or killed and the id given to another buffer
+        if (!buffers[i].exists ||
+            get_buffer_generation(app, buffers[i].buffer_id) != diff_state.sides[i].generation) {
+            end_diff();
+            return false;
+        }
+    }
+
+    if (!diff_state.computed) {
+        for (int i = 0; i < 2; ++i) {
+            Diff_Side* side = diff_state.sides + i;
+            free(side->line_starts);
+            free(side->hashes);
+            side->line_starts = (int*)calloc(1, sizeof(int));
+            side->hashes = 0;
+            side->line_count = 0;
+            side->has_dirty = false;
+            rescan_diff_lines(app, side, buffers + i, 0, 0, buffers[i].size);
+        }
+        diff_state.hunks.count = 0;
+        rediff(0, diff_state.sides[0].line_count, 0, diff_state.sides[1].line_count,
+               0, 0, 0, 0);
+        diff_state.computed = true;
+        return true;
+    }
+    if (!diff_state.sides[0].has_dirty && !diff_state.sides[1].has_dirty) {
+        return true;
+    }
+
+    // The lines each side's edits touched, before and after
+    bool edited[2] = {};
+    int first[2] = {};
+    int old_end[2] = {};
+    int old_count[2] = {};
+    int line_delta[2] = {};
+    for (int i = 0; i < 2; ++i) {
+        Diff_Side* side = diff_state.sides + i;
+        old_count[i] = side->line_count;
+        if (!side->has_dirty) { continue; }
+        side->has_dirty = false;
+        edited[i] = true;
+        int size_delta = buffers[i].size - side->line_starts[side->line_count];
+        Range dirty = side->dirty;
+        if (dirty.start < 0) { dirty.start = 0; }
+        if (dirty.end > buffers[i].size) { dirty.end = buffers[i].size; }
+        first[i] = get_diff_line(side, dirty.start);
+        int old_dirty_end = dirty.end - size_delta;
+        old_end[i] = first[i];
+        while (old_end[i] < side->line_count &&
+               side->line_starts[old_end[i]] <= old_dirty_end) {
+            ++old_end[i];
+        }
+        rescan_diff_lines(app, side, buffers + i, first[i], old_end[i], size_delta);
+        line_delta[i] = side->line_count - old_count[i];
+    }
+
+    // Only the stretch between the last hunk wholly before the edits and
+    // the first one wholly after them needs diffing again
+    Diff_Hunk_List* hunks = &diff_state.hunks;
+    int lo = 0;
+    while (lo < hunks->count) {
+        Diff_Hunk* hunk = hunks->hunks + lo;
+        if (edited[0] && hunk->a + hunk->a_count >= first[0]) { break; }
+        if (edited[1] && hunk->b + hunk->b_count >= first[1]) { break; }
+        ++lo;
+    }
+    int hi = lo;
+    while (hi < hunks->count) {
+        Diff_Hunk* hunk = hunks->hunks + hi;
+        if ((!edited[0] || hunk->a > old_end[0]) &&
+            (!edited[1] || hunk->b > old_end[1])) {
+            break;
+        }
+        ++hi;
+    }
+    int a0 = (lo > 0 ? hunks->hunks[lo - 1].a + hunks->hunks[lo - 1].a_count : 0);
+    int b0 = (lo > 0 ? hunks->hunks[lo - 1].b + hunks->hunks[lo - 1].b_count : 0);
+    int a1 = (hi < hunks->count ? hunks->hunks[hi].a : old_count[0]) + line_delta[0];
+    int b1 = (hi < hunks->count ? hunks->hunks[hi].b : old_count[1]) + line_delta[1];
+    rediff(a0, a1, b0, b1, lo, hi, line_delta[0], line_delta[1]);
+    return true;
+}
+
+// Put a buffer in diff mode. Returns false when two already are.
+static bool add_diff_buffer(struct Application_Links* app, Buffer_ID buffer_id) {
+    uint64_t generation = get_buffer_generation(app, buffer_id);
+    for (int i = 0; i < diff_state.side_count; ++i) {
+        if (diff_state.sides[i].buffer_id != buffer_id) { continue; }
+        if (diff_state.sides[i].generation != generation) {
+            // A killed buffer's side, taken over by the one now on its id
+            diff_state.sides[i].generation = generation;
+            diff_state.computed = false;
+        }
+        return true;
+    }
+    if (diff_state.side_count == 2) {
+        fprintf(stderr, "Can't diff more than two buffers\n");
+        return false;
+    }
+    Diff_Side* side = diff_state.sides + diff_state.side_count++;
+    *side = {};
+    side->buffer_id = buffer_id;
+    side->generation = generation;
+    diff_state.computed = false;
+    return true;
+}
+
+// Which side of the diff a buffer is, or -1.
+static int get_diff_side(Buffer_ID buffer_id) {
+    for (int i = 0; i < diff_state.side_count; ++i) {
+        if (diff_state.sides[i].buffer_id == buffer_id) { return i; }
+    }
+    return -1;
+}
+
+// The first hunk of side that ends after line. A hunk where the other side
+// has lines and this one doesn't is drawn on the line after, so counts as
+// ending there.
+static int find_first_diff_hunk(int side, int line) {
+    Diff_Hunk_List* hunks = &diff_state.hunks;
+    int lo = 0;
+    int hi = hunks->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        Diff_Hunk* hunk = hunks->hunks + mid;
+        int count = get_hunk_count(hunk, side);
+        if (get_hunk_start(hunk, side) + (count > 0 ? count : 1) <= line) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+    return lo;
+}
+
+// The hunk drawn on line of side, or -1.
+static int find_diff_hunk(int side, int line) {
+    Diff_Hunk_List* hunks = &diff_state.hunks;
+    int lo = find_first_diff_hunk(side, line);
+    if (lo < hunks->count && get_hunk_start(hunks->hunks + lo, side) <= line) {
+        return lo;
+    }
+    return -1;
+}
+
+VIM_COMMAND_FUNC_SIG(diff_this) {
+    add_diff_buffer(app, get_current_view_buffer_id(app, AccessAll));
+}
+
+// Opens the file in a vertical split and diffs it with the current buffer.
+VIM_COMMAND_FUNC_SIG(diff_split) {
+    String name = skip_chop_whitespace(argstr);
+    if (name.size == 0) {
+        fprintf(stderr, ":diffsplit needs a file name\n");
+        return;
+    }
+    char path_space[4096];
+    String path = make_fixed_width_string(path_space);
+    bool absolute = (name.str[0] == '/' || name.str[0] == '\\' ||
+                     (name.size > 1 && name.str[1] == ':'));
+    if (!absolute) {
+        path.size = directory_get_hot(app, path.str, path.memory_size);
+        if (path.size > 0 && path.str[path.size - 1] != '/' && path.str[path.size - 1] != '\\') {
+            append(&path, "/");
+        }
+    }
+    if (!append_checked_ss(&path, name)) { return; }
+
+    View_Summary view = get_active_view(app, AccessAll);
+    View_Summary new_view = split_view_right(app, &view);
+    if (!view_open_file(app, &new_view, expand_str(path), false)) {
+        fprintf(stderr, "Couldn't open %.*s\n", path.size, path.str);
+        return;
+    }
+    refresh_view(app, &new_view);
+    if (diff_state.side_count == 2) { end_diff(); }
+    add_diff_buffer(app, view.buffer_id);
+    add_diff_buffer(app, new_view.buffer_id);
+}
+
+VIM_COMMAND_FUNC_SIG(diff_off) {
+    end_diff();
+}
+
+VIM_COMMAND_FUNC_SIG(diff_update) {
+    diff_state.computed = false;
+}
+
+// ]c and [c
+template <Search_Direction direction>
+CUSTOM_COMMAND_SIG(vim_diff_jump) {
+    View_Summary view = get_active_view(app, AccessProtected);
+    enter_normal_mode(app, view.buffer_id);
+    int side_index = get_diff_side(view.buffer_id);
+    if (side_index < 0 || !update_diff(app)) { return; }
+    Diff_Side* side = diff_state.sides + side_index;
+    int line = get_diff_line(side, view.cursor.pos);
+
+    Diff_Hunk_List* hunks = &diff_state.hunks;
+    int found = -1;
+    if (direction == search_forward) {
+        for (int i = 0; i < hunks->count; ++i) {
+            if (get_hunk_start(hunks->hunks + i, side_index) > line) {
+                found = i;
+                break;
+            }
+        }
+    } else {
+        for (int i = hunks->count - 1; i >= 0; --i) {
+            if (get_hunk_start(hunks->hunks + i, side_index) < line) {
+                found = i;
+                break;
+            }
+        }
+    }
+    if (found < 0) { return; }
+    int target = get_hunk_start(hunks->hunks + found, side_index);
+    if (target >= side->line_count && target > 0) { target = side->line_count - 1; }
+    view_set_cursor(app, &view, seek_pos(side->line_starts[target]), true);
+}
+
+#define vim_next_hunk vim_diff_jump<search_forward>
+#define vim_prev_hunk vim_diff_jump<search_backward>
+
+// do takes the other buffer's lines for the hunk under the cursor, dp
+// gives it this buffer's. The diff catches up through the edit hook.
+template <bool put>
+CUSTOM_COMMAND_SIG(vim_diff_copy) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    // co and cp aren't anything
+    bool is_delete = (state.action == vimaction_delete_range);
+    enter_normal_mode(app, view.buffer_id);
+    if (!is_delete) { return; }
+    int this_side = get_diff_side(view.buffer_id);
+    if (this_side < 0 || !update_diff(app)) {
+        fprintf(stderr, "Not in diff mode\n");
+        return;
+    }
+    int line = get_diff_line(diff_state.sides + this_side, view.cursor.pos);
+    int hunk_index = find_diff_hunk(this_side, line);
+    if (hunk_index < 0) {
+        fprintf(stderr, "No differences here\n");
+        return;
+    }
+    Diff_Hunk hunk = diff_state.hunks.hunks[hunk_index];
+
+    int from = (put ? this_side : 1 - this_side);
+    int to = 1 - from;
+    Diff_Side* src = diff_state.sides + from;
+    Diff_Side* dst = diff_state.sides + to;
+    Buffer_Summary src_buffer = get_buffer(app, src->buffer_id, AccessAll);
+    Buffer_Summary dst_buffer = get_buffer(app, dst->buffer_id, AccessOpen);
+    if (!dst_buffer.exists) { return; }
+    int src_start = src->line_starts[get_hunk_start(&hunk, from)];
+    int src_end = src->line_starts[get_hunk_start(&hunk, from) + get_hunk_count(&hunk, from)];
+    int dst_start = dst->line_starts[get_hunk_start(&hunk, to)];
+    int dst_end = dst->line_starts[get_hunk_start(&hunk, to) + get_hunk_count(&hunk, to)];
+
+    // Room for a newline on either end
+    int size = src_end - src_start;
+    char* text = (char*)malloc(size + 2);
+    defer(free(text));
+    char* at = text + 1;
+    buffer_read_range(app, &src_buffer, src_start, src_end, at);
+
+    // Keep every line ending in a newline except for the destination's
+    // last, if it had none
+    char last = 0;
+    if (dst_buffer.size > 0) {
+        buffer_read_range(app, &dst_buffer, dst_buffer.size - 1, dst_buffer.size, &last);
+    }
+    bool dst_unterminated = (dst_buffer.size > 0 && last != '\n');
+    if (size > 0 && at[size - 1] != '\n' && dst_end < dst_buffer.size) {
+        at[size++] = '\n';
+    }
+    if (size > 0 && at[size - 1] == '\n' && dst_end == dst_buffer.size && dst_unterminated) {
+        if (dst_start == dst_end) {
+            *--at = '\n';
+        } else {
+            --size;
+        }
+    }
+    buffer_replace_range(app, &dst_buffer, dst_start, dst_end, at, size);
+}
+
+#define vim_diff_obtain vim_diff_copy<false>
+#define vim_diff_put vim_diff_copy<true>
+
+// Read one delimited field of an ex argument (the "pat" in /pat/), handling
+// backslash-escaped delimiters. Returns the offset just past the field.
+static int parse_delimited(String args, int pos, char delim, String* out) {
+    while (pos < args.size && args.str[pos] != delim) {
+        if (args.str[pos] == '\\' && pos + 1 < args.size &&
+            args.str[pos + 1] == delim) {
+            ++pos;
+        }
+        append(out, args.str[pos]);
+        ++pos;
+    }
+    if (pos < args.size) { ++pos; }
+    return pos;
+}
+
+struct Substitute_Args {
+    String pattern;
+    String replacement;
+    bool global;
+    char pattern_space[256];
+    char replacement_space[256];
+};
+
+// Parse "/pat/rep/flags" into a, returning false if it isn't one.
+static bool parse_substitute_args(String args, Substitute_Args* a) {
+    a->pattern = make_fixed_width_string(a->pattern_space);
+    a->replacement = make_fixed_width_string(a->replacement_space);
+    a->global = false;
+    if (args.size < 1 || char_is_alpha_numeric(args.str[0]) ||
+        char_is_whitespace(args.str[0])) {
+        return false;
+    }
+    char delim = args.str[0];
+    int pos = parse_delimited(args, 1, delim, &a->pattern);
+    pos = parse_delimited(args, pos, delim, &a->replacement);
+    for (; pos < args.size; ++pos) {
+        if (args.str[pos] == 'g') { a->global = true; }
+    }
+    return true;
+}
+
+// Queue replacements of pattern inside the buffer range line, where text
+// holds the buffer contents starting at text_pos. The replacement string is
+// already in the batch at rep_start.
+static int push_line_substitutions(Edit_Batch* batch, const char* text,
+                                   int text_pos, Range line, String pattern,
+                                   int rep_start, int rep_len, bool global) {
+    int count = 0;
+    int pos = line.start - text_pos;
+    int end = line.end - text_pos;
+    while (pos < end) {
+        int hit = text_find_forward(text, end, pos, pattern);
+        if (hit < 0) { break; }
+        edit_batch_push(batch, text_pos + hit, text_pos + hit + pattern.size,
+                        rep_start, rep_len);
+        ++count;
+        if (!global) { break; }
+        pos = hit + pattern.size;
+    }
+    return count;
+}
+
+VIM_COMMAND_FUNC_SIG(substitute) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    if (!buffer.exists) { return; }
+
+    Substitute_Args args;
+    if (!parse_substitute_args(argstr, &args)) { return; }
+    if (args.pattern.size == 0) { args.pattern = state.last_search.text; }
+    if (args.pattern.size == 0) { return; }
+
+    Range lines = get_command_lines(app, &buffer, false);
+    Range span = get_lines_pos_range(app, &buffer, lines);
+    char* text = (char*)malloc(span.end - span.start + 1);
+    defer(free(text));
+    buffer_read_range(app, &buffer, span.start, span.end, text);
+
+    Edit_Batch batch = {};
+    defer(edit_batch_free(&batch));
+    int rep_start = edit_batch_push_string(&batch, args.replacement.str,
+                                           args.replacement.size);
+    for (int line_start = span.start; line_start <= span.end;) {
+        const char* newline = (const char*)memchr(
+            text + (line_start - span.start), '\n', span.end - line_start);
+        int line_end = newline ? span.start + (int)(newline - text) : span.end;
+        push_line_substitutions(&batch, text, span.start,
+                                make_range(line_start, line_end),
+                                args.pattern, rep_start, args.replacement.size,
+                                args.global);
+        line_start = line_end + 1;
+    }
+    edit_batch_apply(app, &buffer, &batch);
+}
+
+VIM_COMMAND_FUNC_SIG(delete_lines) {
+    if (!state.has_command_range) {
+        vim_delete_line(app);
+        return;
+    }
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    if (!buffer.exists) { return; }
+    Range span = get_lines_pos_range(app, &buffer, state.command_range);
+    if (span.end < buffer.size) { ++span.end; }
+    state.action = vimaction_delete_range;
+    vim_exec_action(app, span, true);
+}
+
+// :g and :v                                                           @global
+// Runs in two passes. The first walks the buffer once and marks every line
+// that matches (or, for :v, doesn't). The second runs the command on them.
+// :d and :s are fused into a single batched edit; anything else runs once
+// per line from buffer markers, so earlier edits can't shift later lines out
+// from under it, and the whole run is merged into one undo step.
+static void run_global(struct Application_Links* app, String argstr,
+                       bool invert) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    if (!buffer.exists || argstr.size < 2) { return; }
+
+    char pattern_space[256];
+    String pattern = make_fixed_width_string(pattern_space);
+    int cmd_start = parse_delimited(argstr, 1, argstr.str[0], &pattern);
+    if (pattern.size == 0) { pattern = state.last_search.text; }
+    if (pattern.size == 0) { return; }
+    String cmd = skip_chop_whitespace(substr_tail(argstr, cmd_start));
+    if (cmd.size == 0) { return; }
+
+    // Pass 1: mark.
+    char* text = read_entire_buffer(app, &buffer);
+    defer(free(text));
+    Range* lines = 0;
+    int line_count = 0;
+    int line_capacity = 0;
+    defer(free(lines));
+    Range scan_lines = get_command_lines(app, &buffer, true);
+    Range scan = get_lines_pos_range(app, &buffer, scan_lines);
+    int last_line_number = 0;
+    int next_hit = -1;
+    int line_number = scan_lines.start;
+    for (int line_start = scan.start; line_start <= scan.end; ++line_number) {
+        // Nothing follows the buffer's trailing newline
+        if (line_start == buffer.size && line_start > scan.start) { break; }
+        const char* newline = (const char*)memchr(
+            text + line_start, '\n', scan.end - line_start);
+        int line_end = newline ? (int)(newline - text) : scan.end;
+        if (next_hit != -2 && next_hit < line_start) {
+            next_hit = text_find_forward(text, buffer.size, line_start, pattern);
+            if (next_hit < 0) { next_hit = -2; }
+        }
+        bool matched = (next_hit >= 0 && next_hit < line_end);
+        if (matched != invert) {
+            if (line_count == line_capacity) {
+                line_capacity = line_capacity ? line_capacity * 2 : 256;
+                lines = (Range*)realloc(lines, line_capacity * sizeof(Range));
+            }
+            lines[line_count++] = make_range(line_start, line_end);
+            last_line_number = line_number;
+        }
+        line_start = line_end + 1;
+    }
+    if (line_count == 0) { return; }
+
+    // Pass 2: execute.
+    int name_size = 0;
+    while (name_size < cmd.size && char_is_alpha(cmd.str[name_size])) {
+        ++name_size;
+    }
+    String name = substr(cmd, 0, name_size);
+    String rest = skip_chop_whitespace(substr_tail(cmd, name_size));
+
+    if (name.size > 0 && match_part(lit("delete"), name) && rest.size == 0) {
+        Edit_Batch batch = {};
+        defer(edit_batch_free(&batch));
+        for (int i = 0; i < line_count; ++i) {
+            Range line = lines[i];
+            if (line.end < buffer.size) {
+                edit_batch_push(&batch, line.start, line.end + 1, 0, 0);
+            } else if (line.start > 0) {
+                // The last line goes with the newline before it. If the line
+                // before was deleted too, that newline is already in the
+                // previous edit, so take the one before the whole run.
+                Buffer_Edit* last = (batch.count > 0 ? batch.edits + batch.count - 1 : 0);
+                if (last && last->len == 0 && last->end > line.start - 1) {
+                    if (last->start > 0) { --last->start; }
+                    last->end = line.end;
+                } else {
+                    edit_batch_push(&batch, line.start - 1, line.end, 0, 0);
+                }
+            } else {
+                edit_batch_push(&batch, line.start, line.end, 0, 0);
+            }
+        }
+        edit_batch_apply(app, &buffer, &batch);
+        active_view_to_line(app, last_line_number - line_count + 1);
+        return;
+    }
+
+    Substitute_Args args;
+    if (name.size > 0 && match_part(lit("substitute"), name) &&
+        parse_substitute_args(rest, &args)) {
+        if (args.pattern.size == 0) { args.pattern = pattern; }
+        Edit_Batch batch = {};
+        defer(edit_batch_free(&batch));
+        int rep_start = edit_batch_push_string(&batch, args.replacement.str,
+                                               args.replacement.size);
+        for (int i = 0; i < line_count; ++i) {
+            push_line_substitutions(&batch, text, 0, lines[i], args.pattern,
+                                    rep_start, args.replacement.size,
+                                    args.global);
+        }
+        edit_batch_apply(app, &buffer, &batch);
+        active_view_to_line(app, last_line_number);
+        return;
+    }
+
+    Marker* markers = (Marker*)malloc(line_count * sizeof(Marker));
+    defer(free(markers));
+    for (int i = 0; i < line_count; ++i) {
+        markers[i].pos = lines[i].start;
+        markers[i].lean_right = false;
+    }
+    Managed_Object marker_object = alloc_buffer_markers_on_buffer(
+        app, buffer.buffer_id, line_count, 0);
+    defer(managed_object_free(app, marker_object));
+    managed_object_store_data(app, marker_object, 0, line_count, markers);
+
+    History_Group group = begin_history_group(app, buffer.buffer_id);
+    for (int i = 0; i < line_count; ++i) {
+        Marker marker;
+        managed_object_load_data(app, marker_object, i, 1, &marker);
+        view = get_active_view(app, AccessOpen);
+        view_set_cursor(app, &view, seek_pos(marker.pos), true);
+        exec_status_command(app, cmd);
+    }
+    end_history_group(app, group);
+}
+
+VIM_COMMAND_FUNC_SIG(global_command) {
+    run_global(app, argstr, force);
+}
+
+VIM_COMMAND_FUNC_SIG(inverse_global_command) {
+    run_global(app, argstr, true);
+}
+
+// :sort                                                                 @sort
+// Lines are views into one read of the range. Only an index array gets
+// sorted (a stable merge sort, split across cores for big ranges) and the
+// result goes back as a single replace.
+enum Sort_Flags {
+    sort_numeric = 1 << 0,
+    sort_unique = 1 << 1,
+    sort_ignore_case = 1 << 2,
+    sort_reverse = 1 << 3,
+};
+
+struct Sort_Line {
+    int start;
+    int size;
+    // The part of the line being compared; everything after the /pat/
+    // match, or the whole line.
+    int key_start;
+    int key_size;
+    bool has_key;
+    bool has_number;
+    int64_t number;
+};
+
+struct Sort_Context {
+    const char* text;
+    Sort_Line* lines;
+    unsigned int flags;
+    int* indices;
+    int* scratch;
+    // Chunk boundaries into indices, for the parallel passes
+    int* chunk_starts;
+    int chunk_count;
+    int merge_width;
+};
+
+constexpr int SORT_PARALLEL_MIN_LINES = 1 << 16;
+
+static int compare_sort_lines(Sort_Context* ctx, int a_index, int b_index) {
+    const Sort_Line* a = ctx->lines + a_index;
+    const Sort_Line* b = ctx->lines + b_index;
+    // Lines without a /pat/ match stay in front, in their original order
+    if (a->has_key != b->has_key) { return a->has_key ? 1 : -1; }
+    if (!a->has_key) { return 0; }
+
+    int result = 0;
+    if (ctx->flags & sort_numeric) {
+        if (a->has_number != b->has_number) {
+            result = a->has_number ? 1 : -1;
+        } else if (a->has_number) {
+            result = (a->number > b->number) - (a->number < b->number);
+        }
+    } else {
+        const char* a_str = ctx->text + a->key_start;
+        const char* b_str = ctx->text + b->key_start;
+        int size = (a->key_size < b->key_size ? a->key_size : b->key_size);
+        if (ctx->flags & sort_ignore_case) {
+            for (int i = 0; i < size && result == 0; ++i) {
+                result = ((unsigned char)char_to_lower(a_str[i]) -
+                          (unsigned char)char_to_lower(b_str[i]));
+            }
+        } else {
+            result = memcmp(a_str, b_str, size);
+        }
+        if (result == 0) { result = a->key_size - b->key_size; }
+    }
+    return (ctx->flags & sort_reverse) ? -result : result;
+}
+
+// For u: whole lines are compared, not the keys, so lines that only sort
+// alike are all kept.
+static bool sort_lines_match(Sort_Context* ctx, int a_index, int b_index) {
+    const Sort_Line* a = ctx->lines + a_index;
+    const Sort_Line* b = ctx->lines + b_index;
+    if (a->size != b->size) { return false; }
+    const char* a_str = ctx->text + a->start;
+    const char* b_str = ctx->text + b->start;
+    if (ctx->flags & sort_ignore_case) {
+        for (int i = 0; i < a->size; ++i) {
+            if (char_to_lower(a_str[i]) != char_to_lower(b_str[i])) { return false; }
+        }
+        return true;
+    }
+    return memcmp(a_str, b_str, a->size) == 0;
+}
+
+// Stable merge of indices[start, mid) and indices[mid, end).
+static void merge_sort_runs(Sort_Context* ctx, int start, int mid, int end) {
+    int* in = ctx->indices;
+    int* out = ctx->scratch;
+    int a = start, b = mid, o = start;
+    while (a < mid && b < end) {
+        if (compare_sort_lines(ctx, in[b], in[a]) < 0) { out[o++] = in[b++]; }
+        else { out[o++] = in[a++]; }
+    }
+    while (a < mid) { out[o++] = in[a++]; }
+    while (b < end) { out[o++] = in[b++]; }
+    memcpy(in + start, out + start, (end - start) * sizeof(int));
+}
+
+static void merge_sort_range(Sort_Context* ctx, int start, int end) {
+    for (int width = 1; width < end - start; width *= 2) {
+        for (int run = start; run < end - width; run += 2*width) {
+            int run_end = run + 2*width;
+            if (run_end > end) { run_end = end; }
+            merge_sort_runs(ctx, run, run + width, run_end);
+        }
+    }
+}
+
+static void sort_chunk_job(void* data, int job_index) {
+    Sort_Context* ctx = (Sort_Context*)data;
+    merge_sort_range(ctx, ctx->chunk_starts[job_index],
+                     ctx->chunk_starts[job_index + 1]);
+}
+
+static void merge_chunks_job(void* data, int job_index) {
+    Sort_Context* ctx = (Sort_Context*)data;
+    int first = job_index * 2 * ctx->merge_width;
+    int mid = first + ctx->merge_width;
+    int last = mid + ctx->merge_width;
+    if (mid >= ctx->chunk_count) { return; }
+    if (last > ctx->chunk_count) { last = ctx->chunk_count; }
+    merge_sort_runs(ctx, ctx->chunk_starts[first], ctx->chunk_starts[mid],
+                    ctx->chunk_starts[last]);
+}
+
+static void sort_line_indices(Sort_Context* ctx, int count) {
+    int chunk_count = get_core_count();
+    if (count < SORT_PARALLEL_MIN_LINES || chunk_count < 2) {
+        merge_sort_range(ctx, 0, count);
+        return;
+    }
+    int chunk_starts[65];
+    for (int i = 0; i <= chunk_count; ++i) {
+        chunk_starts[i] = (int)((int64_t)count * i / chunk_count);
+    }
+    ctx->chunk_starts = chunk_starts;
+    ctx->chunk_count = chunk_count;
+    run_parallel_jobs(sort_chunk_job, ctx, chunk_count);
+    for (int width = 1; width < chunk_count; width *= 2) {
+        ctx->merge_width = width;
+        int pair_count = (chunk_count + 2*width - 1) / (2*width);
+        run_parallel_jobs(merge_chunks_job, ctx, pair_count);
+    }
+}
+
+VIM_COMMAND_FUNC_SIG(sort_lines) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    if (!buffer.exists) { return; }
+
+    unsigned int flags = (force ? sort_reverse : 0);
+    char pattern_space[256];
+    String pattern = make_fixed_width_string(pattern_space);
+    bool has_pattern = false;
+    for (int i = 0; i < argstr.size; ++i) {
+        switch (argstr.str[i]) {
+            case 'n': flags |= sort_numeric; break;
+            case 'u': flags |= sort_unique; break;
+            case 'i': flags |= sort_ignore_case; break;
+            case 'r': flags |= sort_reverse; break;
+            case '/': {
+                i = parse_delimited(argstr, i + 1, '/', &pattern) - 1;
+                has_pattern = true;
+            } break;
+        }
+    }
+    if (has_pattern && pattern.size == 0) { pattern = state.last_search.text; }
+
+    Range lines = get_command_lines(app, &buffer, true);
+    Range span = get_lines_pos_range(app, &buffer, lines);
+    int text_size = span.end - span.start;
+    char* text = (char*)malloc(text_size + 1);
+    defer(free(text));
+    buffer_read_range(app, &buffer, span.start, span.end, text);
+    // The empty "line" after the final newline isn't one to sort; leave the
+    // newline where it is.
+    if (span.end == buffer.size && text_size > 0 &&
+        text[text_size - 1] == '\n') {
+        --text_size;
+        --span.end;
+    }
+
+    int line_count = lines.end - lines.start + 1;
+    Sort_Line* sort_lines = (Sort_Line*)malloc(line_count * sizeof(Sort_Line));
+    defer(free(sort_lines));
+    int count = 0;
+    for (int line_start = 0; line_start <= text_size && count < line_count;) {
+        const char* newline = (const char*)memchr(text + line_start, '\n',
+                                                  text_size - line_start);
+        int line_end = newline ? (int)(newline - text) : text_size;
+        Sort_Line* line = sort_lines + count++;
+        line->start = line_start;
+        line->size = line_end - line_start;
+        line->key_start = line_start;
+        line->key_size = line->size;
+        line->has_key = true;
+        if (has_pattern) {
+            int hit = text_find_forward(text, line_end, line_start, pattern);
+            line->has_key = (hit >= 0);
+            if (line->has_key) {
+                line->key_start = hit + pattern.size;
+                line->key_size = line_end - line->key_start;
+            }
+        }
+        line->has_number = false;
+        line->number = 0;
+        if (flags & sort_numeric) {
+            const char* key = text + line->key_start;
+            int i = 0;
+            while (i < line->key_size && !char_is_numeric(key[i])) { ++i; }
+            if (i < line->key_size) {
+                bool negative = (i > 0 && key[i - 1] == '-');
+                // Numbers too big for an int64 all sort as the largest one
+                const int64_t number_max = 0x7FFFFFFFFFFFFFFFll;
+                for (; i < line->key_size && char_is_numeric(key[i]); ++i) {
+                    int digit = key[i] - '0';
+                    if (line->number > (number_max - digit) / 10) {
+                        line->number = number_max;
+                    } else {
+                        line->number = line->number*10 + digit;
+                    }
+                }
+                if (negative) { line->number = -line->number; }
+                line->has_number = true;
+            }
+        }
+        line_start = line_end + 1;
+    }
+
+    int* indices = (int*)malloc(count * sizeof(int));
+    int* scratch = (int*)malloc(count * sizeof(int));
+    defer(free(indices));
+    defer(free(scratch));
+    for (int i = 0; i < count; ++i) { indices[i] = i; }
+
+    Sort_Context ctx = {};
+    ctx.text = text;
+    ctx.lines = sort_lines;
+    ctx.flags = flags;
+    ctx.indices = indices;
+    ctx.scratch = scratch;
+    sort_line_indices(&ctx, count);
+
+    char* result = (char*)malloc(text_size + 1);
+    defer(free(result));
+    int result_size = 0;
+    int previous = -1;
+    for (int i = 0; i < count; ++i) {
+        int index = indices[i];
+        if ((flags & sort_unique) && previous >= 0 &&
+            sort_lines_match(&ctx, previous, index)) {
+            continue;
+        }
+        if (previous >= 0) { result[result_size++] = '\n'; }
+        memcpy(result + result_size, text + sort_lines[index].start,
+               sort_lines[index].size);
+        result_size += sort_lines[index].size;
+        previous = index;
+    }
+    buffer_replace_range(app, &buffer, span.start, span.end,
+                         result, result_size);
+}
+
+// Quickfix list:                                                   @quickfix
+// Locations collected by :vimgrep, :grep and :make, walked with :cn, :cp and
+// :cc. Once an entry's file is open it gets a marker, so it keeps pointing
+// at the right place while the file is edited.
+struct Quickfix_Entry {
+    char* file_name;
+    int line;
+    int column;
+    // The matching line or compiler message, cut to QUICKFIX_TEXT_MAX
+    char* text;
+    // The buffer the marker was placed in, or 0 before the file is open
+    Buffer_ID buffer_id;
+    Managed_Object markers;
+    int marker_index;
+};
+
+struct Quickfix_List {
+    Quickfix_Entry* entries;
+    int count;
+    int capacity;
+    int current;
+    // One marker object per batch of entries attached to a buffer
+    Managed_Object* marker_objects;
+    int marker_object_count;
+};
+
+constexpr int QUICKFIX_TEXT_MAX = 200;
+
+static Quickfix_List quickfix_list = {};
+
+static void push_quickfix_entry(Quickfix_List* list, Quickfix_Entry entry) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->entries = (Quickfix_Entry*)realloc(
+            list->entries, list->capacity * sizeof(Quickfix_Entry));
+    }
+    list->entries[list->count++] = entry;
+}
+
+static void clear_quickfix_list(Quickfix_List* list) {
+    for (int i = 0; i < list->count; ++i) {
+        free(list->entries[i].file_name);
+        free(list->entries[i].text);
+    }
+    free(list->entries);
+    free(list->marker_objects);
+    *list = {};
+    list->current = -1;
+}
+
+static void reset_quickfix_list(struct Application_Links* app) {
+    for (int i = 0; i < quickfix_list.marker_object_count; ++i) {
+        managed_object_free(app, quickfix_list.marker_objects[i]);
+    }
+    clear_quickfix_list(&quickfix_list);
+}
+
+// Place markers for the entries from first on that point into buffer's file
+// and aren't tracking it yet.
+static void attach_quickfix_markers(struct Application_Links* app,
+                                    Buffer_Summary* buffer, int first) {
+    if (!buffer->exists || !buffer->file_name || buffer->file_name_len <= 0) {
+        return;
+    }
+    String file_name = make_string(buffer->file_name, buffer->file_name_len);
+    int count = 0;
+    for (int i = first; i < quickfix_list.count; ++i) {
+        Quickfix_Entry* entry = quickfix_list.entries + i;
+        if (entry->buffer_id != buffer->buffer_id &&
+            match(file_name, entry->file_name)) {
+            ++count;
+        }
+    }
+    if (count == 0) { return; }
+
+    Managed_Object markers = alloc_buffer_markers_on_buffer(
+        app, buffer->buffer_id, count, 0);
+    Marker* positions = (Marker*)malloc(count * sizeof(Marker));
+    defer(free(positions));
+    int index = 0;
+    for (int i = first; i < quickfix_list.count; ++i) {
+        Quickfix_Entry* entry = quickfix_list.entries + i;
+        if (entry->buffer_id == buffer->buffer_id ||
+            !match(file_name, entry->file_name)) {
+            continue;
+        }
+        Partial_Cursor cursor = {};
+        buffer_compute_cursor(app, buffer, seek_line_char(entry->line, entry->column),
+                              &cursor);
+        positions[index].pos = cursor.pos;
+        positions[index].lean_right = false;
+        entry->buffer_id = buffer->buffer_id;
+        entry->markers = markers;
+        entry->marker_index = index++;
+    }
+    managed_object_store_data(app, markers, 0, count, positions);
+
+    quickfix_list.marker_objects = (Managed_Object*)realloc(
+        quickfix_list.marker_objects,
+        (quickfix_list.marker_object_count + 1) * sizeof(Managed_Object));
+    quickfix_list.marker_objects[quickfix_list.marker_object_count++] = markers;
+}
+
+// Attach markers for new entries whose files are already open.
+static void attach_quickfix_markers_to_open_buffers(struct Application_Links* app,
+                                                    int first) {
+    for (int i = first; i < quickfix_list.count; ++i) {
+        Quickfix_Entry* entry = quickfix_list.entries + i;
+        if (entry->buffer_id != 0) { continue; }
+        Buffer_Summary buffer = get_buffer_by_file_name(
+            app, entry->file_name, (int32_t)strlen(entry->file_name), AccessAll);
+        if (buffer.exists) { attach_quickfix_markers(app, &buffer, i); }
+    }
+}
+
+static void print_quickfix_entry(struct Application_Links* app, int index) {
+    Quickfix_Entry* entry = quickfix_list.entries + index;
+    char message_space[QUICKFIX_TEXT_MAX + 64];
+    String message = make_fixed_width_string(message_space);
+    append(&message, "(");
+    append_int_to_str(&message, index + 1);
+    append(&message, " of ");
+    append_int_to_str(&message, quickfix_list.count);
+    append(&message, "): ");
+    append(&message, entry->text);
+    append(&message, "\n");
+    print_message(app, message.str, message.size);
+}
+
+static void jump_to_quickfix_entry(struct Application_Links* app, int index) {
+    if (index < 0 || index >= quickfix_list.count) { return; }
+    Quickfix_Entry* entry = quickfix_list.entries + index;
+    View_Summary view = get_active_view(app, AccessAll);
+    if (!view_open_file(app, &view, entry->file_name,
+                        (int32_t)strlen(entry->file_name), true)) {
+        fprintf(stderr, "Couldn't open %s\n", entry->file_name);
+        return;
+    }
+    refresh_view(app, &view);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+    if (entry->buffer_id != buffer.buffer_id) {
+        attach_quickfix_markers(app, &buffer, 0);
+    }
+    Marker marker = {};
+    if (entry->buffer_id == buffer.buffer_id &&
+        managed_object_load_data(app, entry->markers, entry->marker_index, 1, &marker)) {
+        view_set_cursor(app, &view, seek_pos(marker.pos), true);
+    } else {
+        view_set_cursor(app, &view, seek_line_char(entry->line, entry->column), true);
+    }
+    quickfix_list.current = index;
+    print_quickfix_entry(app, index);
+}
+
+// Add an entry for every line of text matching pattern (every match, with
+// every_match). Pure memory work, so the grep workers use it too.
+static void grep_text(Quickfix_List* out, const char* file_name,
+                      const char* text, int size, String pattern,
+                      bool every_match) {
+    // Skip anything that looks binary
+    int sniff = (size < 8000 ? size : 8000);
+    if (memchr(text, 0, sniff)) { return; }
+
+    int line = 1;
+    int line_start = 0;
+    int counted_to = 0;
+    int pos = 0;
+    for (;;) {
+        int hit = text_find_forward(text, size, pos, pattern);
+        if (hit < 0) { break; }
+        for (;;) {
+            const char* newline = (const char*)memchr(text + counted_to, '\n',
+                                                      hit - counted_to);
+            if (!newline) { break; }
+            ++line;
+            counted_to = line_start = (int)(newline - text) + 1;
+        }
+        counted_to = hit;
+        const char* newline = (const char*)memchr(text + hit, '\n', size - hit);
+        int line_end = (newline ? (int)(newline - text) : size);
+
+        int text_start = line_start;
+        while (text_start < line_end && char_is_whitespace(text[text_start])) {
+            ++text_start;
+        }
+        int text_size = line_end - text_start;
+        if (text_size > QUICKFIX_TEXT_MAX) { text_size = QUICKFIX_TEXT_MAX; }
+        Quickfix_Entry entry = {};
+        entry.file_name = strdup(file_name);
+        entry.line = line;
+        entry.column = hit - line_start + 1;
+        entry.text = (char*)malloc(text_size + 1);
+        memcpy(entry.text, text + text_start, text_size);
+        entry.text[text_size] = 0;
+        push_quickfix_entry(out, entry);
+
+        pos = (every_match ? hit + pattern.size : line_end + 1);
+    }
+}
+
+// :vimgrep and :grep                                                   @grep
+// Open buffers are searched right away on the main thread, since their
+// contents may not be saved and the 4coder API can't be used anywhere else.
+// Files on disk are searched in the background: one thread walks the
+// directories and queues paths, a pool of workers mmaps and searches them,
+// and matches stream into the quickfix list from the render caller.
+// Without pthreads they're searched after the buffers, on the main thread.
+
+// One file argument. name is a basename pattern with * and ?, or null for a
+// plain path (a file, or a directory to search recursively).
+struct Grep_Spec {
+    char* dir;
+    char* name;
+    bool recursive;
+};
+
+static bool wildcard_match(const char* pattern, const char* name) {
+    const char* star = 0;
+    const char* star_name = 0;
+    while (*name) {
+        if (*pattern == '?' || *pattern == *name) { ++pattern; ++name; }
+        else if (*pattern == '*') { star = pattern++; star_name = name; }
+        else if (star) { pattern = star + 1; name = ++star_name; }
+        else { return false; }
+    }
+    while (*pattern == '*') { ++pattern; }
+    return *pattern == 0;
+}
+
+static bool grep_specs_match_path(Grep_Spec* specs, int spec_count,
+                                  const char* path) {
+    for (int i = 0; i < spec_count; ++i) {
+        Grep_Spec* spec = specs + i;
+        size_t dir_len = strlen(spec->dir);
+        if (strncmp(path, spec->dir, dir_len) != 0) { continue; }
+        if (!spec->name) {
+            if (path[dir_len] == 0 || path[dir_len] == '/') { return true; }
+            continue;
+        }
+        if (path[dir_len] != '/') { continue; }
+        const char* rest = path + dir_len + 1;
+        const char* base = strrchr(rest, '/');
+        if (base && !spec->recursive) { continue; }
+        base = (base ? base + 1 : rest);
+        if (spec->name[0] == 0 || wildcard_match(spec->name, base)) { return true; }
+    }
+    return false;
+}
+
+static void free_grep_specs(Grep_Spec* specs, int spec_count) {
+    for (int i = 0; i < spec_count; ++i) {
+        free(specs[i].dir);
+        free(specs[i].name);
+    }
+    free(specs);
+}
+
+// Turn the file arguments into absolute specs. No arguments means the
+// whole current directory.
+static int parse_grep_specs(struct Application_Links* app, String files,
+                            Grep_Spec** out) {
+    char hot_space[4096];
+    int hot_len = directory_get_hot(app, hot_space, sizeof(hot_space) - 1);
+    while (hot_len > 1 && hot_space[hot_len - 1] == '/') { --hot_len; }
+    hot_space[hot_len] = 0;
+
+    int count = 0;
+    *out = 0;
+    int pos = 0;
+    for (;;) {
+        while (pos < files.size && char_is_whitespace(files.str[pos])) { ++pos; }
+        if (pos >= files.size) { break; }
+        int start = pos;
+        while (pos < files.size && !char_is_whitespace(files.str[pos])) { ++pos; }
+        String arg = make_string(files.str + start, pos - start);
+
+        char path_space[4096];
+        String path = make_fixed_width_string(path_space);
+        if (match(arg, "%")) {
+            View_Summary view = get_active_view(app, AccessAll);
+            Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+            if (!buffer.file_name) { continue; }
+            append(&path, make_string(buffer.file_name, buffer.file_name_len));
+        } else {
+            if (arg.str[0] != '/') {
+                append(&path, make_string(hot_space, hot_len));
+                append(&path, "/");
+                if (match_part(arg, make_lit_string("./"))) { arg = substr_tail(arg, 2); }
+            }
+            append(&path, arg);
+        }
+        while (path.size > 1 && path.str[path.size - 1] == '/') { --path.size; }
+        terminate_with_null(&path);
+
+        Grep_Spec spec = {};
+        char* slash = strrchr(path.str, '/');
+        char* name = (slash ? slash + 1 : path.str);
+        if (strchr(name, '*') || strchr(name, '?')) {
+            if (strcmp(name, "**") == 0) {
+                spec.recursive = true;
+                spec.name = strdup("");
+            } else {
+                spec.name = strdup(name);
+            }
+            if (slash) { *slash = 0; }
+            int dir_len = (int)strlen(path.str);
+            if (dir_len >= 3 && strcmp(path.str + dir_len - 3, "/**") == 0) {
+                spec.recursive = true;
+                path.str[dir_len - 3] = 0;
+            }
+            spec.dir = strdup(path.str[0] ? path.str : "/");
+        } else {
+            spec.dir = strdup(path.str);
+        }
+
+        *out = (Grep_Spec*)realloc(*out, (count + 1) * sizeof(Grep_Spec));
+        (*out)[count++] = spec;
+    }
+
+    if (count == 0) {
+        *out = (Grep_Spec*)malloc(sizeof(Grep_Spec));
+        (*out)[0] = {};
+        (*out)[0].dir = strdup(hot_space);
+        count = 1;
+    }
+    return count;
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void print_grep_summary(struct Application_Links* app, int files_searched) {
+    char message_space[128];
+    String message = make_fixed_width_string(message_space);
+    append(&message, "grep: ");
+    append_int_to_str(&message, quickfix_list.count);
+    append(&message, " matches, ");
+    append_int_to_str(&message, files_searched);
+    append(&message, " files on disk searched\n");
+    print_message(app, message.str, message.size);
+}
+
+#if defined(VIM_HAS_THREADS)
+struct Grep_Job {
+    pthread_mutex_t lock;
+    pthread_cond_t more_paths;
+    // The main thread and every running thread hold a reference; the last
+    // one out frees the job.
+    int refs;
+    bool cancelled;
+
+    char* pattern;
+    int pattern_size;
+    bool every_match;
+    Grep_Spec* specs;
+    int spec_count;
+    // Open buffers, already searched. Sorted for bsearch.
+    char** skip_paths;
+    int skip_count;
+
+    // Paths found by the walker, taken in order by the workers
+    char** paths;
+    int path_count;
+    int path_capacity;
+    int next_path;
+    bool walk_done;
+    int workers_running;
+
+    // Matches waiting to be moved into the quickfix list
+    Quickfix_List results;
+    int files_searched;
+};
+
+static Grep_Job* active_grep_job = 0;
+
+static void release_grep_job(Grep_Job* job) {
+    pthread_mutex_lock(&job->lock);
+    int refs = --job->refs;
+    pthread_mutex_unlock(&job->lock);
+    if (refs > 0) { return; }
+
+    for (int i = 0; i < job->path_count; ++i) { free(job->paths[i]); }
+    free(job->paths);
+    for (int i = 0; i < job->skip_count; ++i) { free(job->skip_paths[i]); }
+    free(job->skip_paths);
+    free_grep_specs(job->specs, job->spec_count);
+    clear_quickfix_list(&job->results);
+    free(job->pattern);
+    pthread_cond_destroy(&job->more_paths);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+static bool grep_job_cancelled(Grep_Job* job) {
+    return __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED);
+}
+
+static void queue_grep_path(Grep_Job* job, const char* path) {
+    char* key = (char*)path;
+    if (job->skip_count > 0 &&
+        bsearch(&key, job->skip_paths, job->skip_count, sizeof(char*),
+                compare_paths)) {
+        return;
+    }
+    char* copy = strdup(path);
+    pthread_mutex_lock(&job->lock);
+    if (job->path_count == job->path_capacity) {
+        job->path_capacity = job->path_capacity ? job->path_capacity * 2 : 1024;
+        job->paths = (char**)realloc(job->paths, job->path_capacity * sizeof(char*));
+    }
+    job->paths[job->path_count++] = copy;
+    pthread_cond_signal(&job->more_paths);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// path holds path_len chars of a directory and has room for more.
+static void walk_grep_directory(Grep_Job* job, char* path, int path_len,
+                                const char* pattern, bool recursive) {
+    DIR* dir = opendir(path);
+    if (!dir) { return; }
+    while (struct dirent* entry = readdir(dir)) {
+        if (grep_job_cancelled(job)) { break; }
+        // Skips . and .. along with hidden things like .git
+        if (entry->d_name[0] == '.') { continue; }
+        int name_len = (int)strlen(entry->d_name);
+        if (path_len + 1 + name_len >= 4096) { continue; }
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, entry->d_name, name_len + 1);
+
+        bool is_dir = (entry->d_type == DT_DIR);
+        bool is_file = (entry->d_type == DT_REG);
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat info;
+            if (stat(path, &info) == 0) {
+                // Don't follow links into directories; they can loop
+                is_dir = (entry->d_type == DT_UNKNOWN && S_ISDIR(info.st_mode));
+                is_file = S_ISREG(info.st_mode);
+            }
+        }
+        if (is_dir && recursive) {
+            walk_grep_directory(job, path, path_len + 1 + name_len, pattern, true);
+        } else if (is_file && (!pattern || pattern[0] == 0 ||
+                               wildcard_match(pattern, entry->d_name))) {
+            queue_grep_path(job, path);
+        }
+        path[path_len] = 0;
+    }
+    closedir(dir);
+}
+
+static void* grep_walk_thread_proc(void* param) {
+    Grep_Job* job = (Grep_Job*)param;
+    char path[4096];
+    for (int i = 0; i < job->spec_count && !grep_job_cancelled(job); ++i) {
+        Grep_Spec* spec = job->specs + i;
+        int path_len = (int)strlen(spec->dir);
+        if (path_len >= (int)sizeof(path)) { continue; }
+        memcpy(path, spec->dir, path_len + 1);
+        if (spec->name) {
+            walk_grep_directory(job, path, path_len, spec->name, spec->recursive);
+            continue;
+        }
+        struct stat info;
+        if (stat(path, &info) != 0) { continue; }
+        if (S_ISDIR(info.st_mode)) {
+            walk_grep_directory(job, path, path_len, 0, true);
+        } else if (S_ISREG(info.st_mode)) {
+            queue_grep_path(job, path);
+        }
+    }
+    pthread_mutex_lock(&job->lock);
+    job->walk_done = true;
+    pthread_cond_broadcast(&job->more_paths);
+    pthread_mutex_unlock(&job->lock);
+    release_grep_job(job);
+    return 0;
+}
 
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
+static void* grep_search_thread_proc(void* param) {
+    Grep_Job* job = (Grep_Job*)param;
+    String pattern = make_string(job->pattern, job->pattern_size);
+    Quickfix_List found = {};
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        while (job->next_path == job->path_count && !job->walk_done &&
+               !job->cancelled) {
+            pthread_cond_wait(&job->more_paths, &job->lock);
+        }
+        if (job->cancelled || job->next_path == job->path_count) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        const char* path = job->paths[job->next_path++];
+        pthread_mutex_unlock(&job->lock);
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) { continue; }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0 && info.st_size < 0x7FFFFFFF) {
+            void* text = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (text != MAP_FAILED) {
+                grep_text(&found, path, (const char*)text, (int)info.st_size,
+                          pattern, job->every_match);
+                munmap(text, info.st_size);
+            }
+        }
+        close(fd);
 
-    i32_Rect current = view.view_region;
-    int x = current.x0; //view.cursor.wrapped_x;
-    int y = current.y0; //view.cursor.wrapped_y;
+        pthread_mutex_lock(&job->lock);
+        for (int i = 0; i < found.count; ++i) {
+            push_quickfix_entry(&job->results, found.entries[i]);
+        }
+        ++job->files_searched;
+        pthread_mutex_unlock(&job->lock);
+        found.count = 0;
+    }
+    free(found.entries);
 
-    View_Summary best = view;
+    pthread_mutex_lock(&job->lock);
+    --job->workers_running;
+    pthread_mutex_unlock(&job->lock);
+    release_grep_job(job);
+    return 0;
+}
 
-    for_views(nextview, app) {
-        if (nextview.view_id == view.view_id) continue;
-        i32_Rect next = nextview.view_region;
-        if (x < next.x0 || x > next.x1) continue;
-        if (y < next.y0) continue;
-        if (best.view_id == view.view_id || next.y0 > best.view_region.y0) best = nextview;
+static bool start_grep_thread(Grep_Job* job, void* (*proc)(void*)) {
+    pthread_t thread;
+    pthread_mutex_lock(&job->lock);
+    ++job->refs;
+    pthread_mutex_unlock(&job->lock);
+    if (pthread_create(&thread, 0, proc, job) != 0) {
+        pthread_mutex_lock(&job->lock);
+        --job->refs;
+        pthread_mutex_unlock(&job->lock);
+        return false;
     }
+    pthread_detach(thread);
+    return true;
+}
 
-    set_active_view(app, &best);
+// Takes ownership of specs and skip_paths.
+static void start_grep_job(String pattern, bool every_match,
+                           Grep_Spec* specs, int spec_count,
+                           char** skip_paths, int skip_count) {
+    Grep_Job* job = (Grep_Job*)calloc(1, sizeof(Grep_Job));
+    pthread_mutex_init(&job->lock, 0);
+    pthread_cond_init(&job->more_paths, 0);
+    job->refs = 1;
+    job->pattern = (char*)malloc(pattern.size);
+    memcpy(job->pattern, pattern.str, pattern.size);
+    job->pattern_size = pattern.size;
+    job->every_match = every_match;
+    job->specs = specs;
+    job->spec_count = spec_count;
+    if (skip_count > 0) { qsort(skip_paths, skip_count, sizeof(char*), compare_paths); }
+    job->skip_paths = skip_paths;
+    job->skip_count = skip_count;
+    job->results.current = -1;
+    active_grep_job = job;
+
+    if (!start_grep_thread(job, grep_walk_thread_proc)) {
+        job->walk_done = true;
+        return;
+    }
+    int worker_count = get_core_count();
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_mutex_lock(&job->lock);
+        ++job->workers_running;
+        pthread_mutex_unlock(&job->lock);
+        if (!start_grep_thread(job, grep_search_thread_proc)) {
+            pthread_mutex_lock(&job->lock);
+            --job->workers_running;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
 }
 
-CUSTOM_COMMAND_SIG(focus_window_up) {
+#else
+// Without threads, files on disk are searched right away too, walking the
+// tree with 4coder's own directory listing. Like :sort, a big job holds up
+// the editor until it's done.
+struct Grep_Serial {
+    String pattern;
+    bool every_match;
+    // Open buffers, already searched. Sorted for bsearch.
+    char** skip_paths;
+    int skip_count;
+    int files_searched;
+};
+
+static void grep_serial_file(Grep_Serial* grep, const char* path) {
+    char* key = (char*)path;
+    if (grep->skip_count > 0 &&
+        bsearch(&key, grep->skip_paths, grep->skip_count, sizeof(char*),
+                compare_paths)) {
+        return;
+    }
+    size_t size = 0;
+    const char* text = map_entire_file(path, &size);
+    if (text && size < 0x7FFFFFFF) {
+        grep_text(&quickfix_list, path, text, (int)size, grep->pattern,
+                  grep->every_match);
+    }
+    unmap_entire_file(text, size);
+    ++grep->files_searched;
+}
+
+// path holds path_len chars of a directory and has room for more.
+static void walk_grep_directory(struct Application_Links* app, Grep_Serial* grep,
+                                char* path, int path_len, const char* pattern,
+                                bool recursive) {
+    File_List list = get_file_list(app, path, path_len);
+    for (uint32_t i = 0; i < list.count; ++i) {
+        File_Info* info = list.infos + i;
+        // Skips . and .. along with hidden things like .git
+        if (info->filename_len == 0 || info->filename[0] == '.') { continue; }
+        if (path_len + 1 + info->filename_len >= 4096) { continue; }
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, info->filename, info->filename_len);
+        int sub_len = path_len + 1 + info->filename_len;
+        path[sub_len] = 0;
+        if (info->folder) {
+            if (recursive) {
+                walk_grep_directory(app, grep, path, sub_len, pattern, true);
+            }
+        } else if (!pattern || pattern[0] == 0 ||
+                   wildcard_match(pattern, path + path_len + 1)) {
+            grep_serial_file(grep, path);
+        }
+        path[path_len] = 0;
+    }
+    free_file_list(app, list);
+}
+
+// Takes ownership of specs and skip_paths.
+static void grep_files_serially(struct Application_Links* app, String pattern,
+                                bool every_match, Grep_Spec* specs, int spec_count,
+                                char** skip_paths, int skip_count) {
+    if (skip_count > 0) { qsort(skip_paths, skip_count, sizeof(char*), compare_paths); }
+    Grep_Serial grep = {};
+    grep.pattern = pattern;
+    grep.every_match = every_match;
+    grep.skip_paths = skip_paths;
+    grep.skip_count = skip_count;
+    int first = quickfix_list.count;
+
+    char path[4096];
+    for (int i = 0; i < spec_count; ++i) {
+        Grep_Spec* spec = specs + i;
+        int path_len = (int)strlen(spec->dir);
+        if (path_len >= (int)sizeof(path)) { continue; }
+        memcpy(path, spec->dir, path_len + 1);
+        if (spec->name) {
+            walk_grep_directory(app, &grep, path, path_len, spec->name, spec->recursive);
+            continue;
+        }
+        // A plain path is a directory if it lists anything, else a file
+        File_List list = get_file_list(app, path, path_len);
+        bool is_dir = (list.count > 0);
+        free_file_list(app, list);
+        if (is_dir) {
+            walk_grep_directory(app, &grep, path, path_len, 0, true);
+        } else {
+            grep_serial_file(&grep, path);
+        }
+    }
+
+    attach_quickfix_markers_to_open_buffers(app, first);
+    print_grep_summary(app, grep.files_searched);
+    free_grep_specs(specs, spec_count);
+    for (int i = 0; i < skip_count; ++i) { free(skip_paths[i]); }
+    free(skip_paths);
+}
+
+#endif
+
+// Stops the search of files on disk, if one is still running. A serial
+// search is always finished by the time its command returns.
+static void cancel_grep_job() {
+#if defined(VIM_HAS_THREADS)
+    if (!active_grep_job) { return; }
+    pthread_mutex_lock(&active_grep_job->lock);
+    __atomic_store_n(&active_grep_job->cancelled, true, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&active_grep_job->more_paths);
+    pthread_mutex_unlock(&active_grep_job->lock);
+    release_grep_job(active_grep_job);
+    active_grep_job = 0;
+#endif
+}
+
+// Move whatever the workers have found into the quickfix list. Called from
+// the render caller, so results turn up on the next redraw.
+static void drain_grep_results(struct Application_Links* app) {
+#if defined(VIM_HAS_THREADS)
+    Grep_Job* job = active_grep_job;
+    if (!job) { return; }
+    int first = quickfix_list.count;
+    pthread_mutex_lock(&job->lock);
+    for (int i = 0; i < job->results.count; ++i) {
+        push_quickfix_entry(&quickfix_list, job->results.entries[i]);
+    }
+    job->results.count = 0;
+    bool done = (job->walk_done && job->workers_running == 0);
+    int files_searched = job->files_searched;
+    pthread_mutex_unlock(&job->lock);
+    attach_quickfix_markers_to_open_buffers(app, first);
+    if (!done) { return; }
+
+    print_grep_summary(app, files_searched);
+    release_grep_job(job);
+    active_grep_job = 0;
+#endif
+}
+
+static void run_grep(struct Application_Links* app, String pattern,
+                     bool every_match, bool jump, String files) {
+    if (pattern.size == 0) { pattern = state.last_search.text; }
+    if (pattern.size == 0) { return; }
+    cancel_grep_job();
+    reset_quickfix_list(app);
+
+    Grep_Spec* specs = 0;
+    int spec_count = parse_grep_specs(app, files, &specs);
+
+    char** skip_paths = 0;
+    int skip_count = 0;
+    for (Buffer_Summary buffer = get_buffer_first(app, AccessAll);
+         buffer.exists; get_buffer_next(app, &buffer, AccessAll)) {
+        if (!buffer.file_name || buffer.file_name_len <= 0) { continue; }
+        char* path = (char*)malloc(buffer.file_name_len + 1);
+        memcpy(path, buffer.file_name, buffer.file_name_len);
+        path[buffer.file_name_len] = 0;
+        if (!grep_specs_match_path(specs, spec_count, path)) {
+            free(path);
+            continue;
+        }
+        char* text = read_entire_buffer(app, &buffer);
+        int first = quickfix_list.count;
+        grep_text(&quickfix_list, path, text, buffer.size, pattern, every_match);
+        attach_quickfix_markers(app, &buffer, first);
+        free(text);
+        skip_paths = (char**)realloc(skip_paths, (skip_count + 1) * sizeof(char*));
+        skip_paths[skip_count++] = path;
+    }
+#if defined(VIM_HAS_THREADS)
+    if (jump && quickfix_list.count > 0) { jump_to_quickfix_entry(app, 0); }
+    start_grep_job(pattern, every_match, specs, spec_count, skip_paths, skip_count);
+#else
+    grep_files_serially(app, pattern, every_match, specs, spec_count,
+                        skip_paths, skip_count);
+    if (jump && quickfix_list.count > 0) { jump_to_quickfix_entry(app, 0); }
+#endif
+}
+
+// :vimgrep /pat/[g][j] {files}, or :vimgrep word {files}
+VIM_COMMAND_FUNC_SIG(vimgrep) {
+    char pattern_space[256];
+    String pattern = make_fixed_width_string(pattern_space);
+    bool every_match = false;
+    bool jump = true;
+    int pos = 0;
+    while (pos < argstr.size && char_is_whitespace(argstr.str[pos])) { ++pos; }
+    if (pos < argstr.size && !char_is_alpha_numeric(argstr.str[pos])) {
+        pos = parse_delimited(argstr, pos + 1, argstr.str[pos], &pattern);
+        for (; pos < argstr.size && !char_is_whitespace(argstr.str[pos]); ++pos) {
+            if (argstr.str[pos] == 'g') { every_match = true; }
+            if (argstr.str[pos] == 'j') { jump = false; }
+        }
+    } else {
+        while (pos < argstr.size && !char_is_whitespace(argstr.str[pos])) {
+            append(&pattern, argstr.str[pos++]);
+        }
+    }
+    run_grep(app, pattern, every_match, jump, substr_tail(argstr, pos));
+}
+
+// :grep[!] pattern {files}. The pattern may be quoted; ! skips the jump.
+VIM_COMMAND_FUNC_SIG(grep) {
+    char pattern_space[256];
+    String pattern = make_fixed_width_string(pattern_space);
+    int pos = 0;
+    while (pos < argstr.size && char_is_whitespace(argstr.str[pos])) { ++pos; }
+    if (pos < argstr.size && (argstr.str[pos] == '"' || argstr.str[pos] == '\'')) {
+        pos = parse_delimited(argstr, pos + 1, argstr.str[pos], &pattern);
+    } else {
+        while (pos < argstr.size && !char_is_whitespace(argstr.str[pos])) {
+            append(&pattern, argstr.str[pos++]);
+        }
+    }
+    run_grep(app, pattern, false, !force, substr_tail(argstr, pos));
+}
+
+VIM_COMMAND_FUNC_SIG(quickfix_next) {
+    drain_grep_results(app);
+    if (quickfix_list.current + 1 < quickfix_list.count) {
+        jump_to_quickfix_entry(app, quickfix_list.current + 1);
+    }
+}
+
+VIM_COMMAND_FUNC_SIG(quickfix_previous) {
+    drain_grep_results(app);
+    if (quickfix_list.current > 0) {
+        jump_to_quickfix_entry(app, quickfix_list.current - 1);
+    }
+}
+
+// :cc N jumps to entry N, :cc to the current one again
+VIM_COMMAND_FUNC_SIG(quickfix_goto) {
+    drain_grep_results(app);
+    int index = quickfix_list.current;
+    String number = skip_chop_whitespace(argstr);
+    if (number.size > 0 && str_is_int(number)) { index = str_to_int(number) - 1; }
+    if (index < 0) { index = 0; }
+    if (index >= quickfix_list.count) { index = quickfix_list.count - 1; }
+    jump_to_quickfix_entry(app, index);
+}
+
+// :copen lists the entries in a *quickfix* buffer below the current view;
+// enter on a line jumps to it.
+VIM_COMMAND_FUNC_SIG(quickfix_open) {
+    drain_grep_results(app);
+    String name = make_lit_string("*quickfix*");
+    Buffer_Summary buffer = get_buffer_by_name(app, name.str, name.size, AccessAll);
+    if (!buffer.exists) {
+        buffer = create_buffer(app, name.str, name.size, BufferCreate_AlwaysNew);
+        buffer_set_setting(app, &buffer, BufferSetting_Unimportant, true);
+    }
+
+    int text_capacity = 4096;
+    String text = make_string_cap((char*)malloc(text_capacity), 0, text_capacity);
+    defer(free(text.str));
+    for (int i = 0; i < quickfix_list.count; ++i) {
+        Quickfix_Entry* entry = quickfix_list.entries + i;
+        int needed = text.size + (int)strlen(entry->file_name) + (int)strlen(entry->text) + 32;
+        if (needed > text.memory_size) {
+            text.memory_size = needed * 2;
+            text.str = (char*)realloc(text.str, text.memory_size);
+        }
+        append(&text, entry->file_name);
+        append(&text, ":");
+        append_int_to_str(&text, entry->line);
+        append(&text, ":");
+        append_int_to_str(&text, entry->column);
+        append(&text, ": ");
+        append(&text, entry->text);
+        append(&text, "\n");
+    }
+    buffer_replace_range(app, &buffer, 0, buffer.size, text.str, text.size);
+
+    View_Summary list_view = {};
+    for_views(view, app) {
+        if (view.buffer_id == buffer.buffer_id) { list_view = view; }
+    }
+    if (!list_view.exists) {
+        View_Summary view = get_active_view(app, AccessAll);
+        list_view = open_view(app, &view, ViewSplit_Bottom);
+        new_view_settings(app, &list_view);
+        view_set_buffer(app, &list_view, buffer.buffer_id, 0);
+    }
+    set_active_view(app, &list_view);
+    int line = (quickfix_list.current >= 0 ? quickfix_list.current + 1 : 1);
+    view_set_cursor(app, &list_view, seek_line_char(line, 1), true);
+}
+
+// Enter on a *quickfix* line jumps to that entry in another view; anywhere
+// else it moves down a line like vim's <CR>.
+CUSTOM_COMMAND_SIG(quickfix_jump_or_move_down) {
     View_Summary view = get_active_view(app, AccessAll);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+    String buffer_name = make_string(buffer.buffer_name, buffer.buffer_name_len);
+    if (!buffer.exists || !match(buffer_name, "*quickfix*")) {
+        vim_move_down(app);
+        return;
+    }
+    for_views(other, app) {
+        if (other.view_id != view.view_id) {
+            set_active_view(app, &other);
+            break;
+        }
+    }
+    jump_to_quickfix_entry(app, view.cursor.line - 1);
+}
 
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
+// :make                                                                 @make
+// Runs makeprg into a *make* buffer without waiting for it. The file
+// edit range hook sees each chunk of output as 4coder appends it, and every
+// complete line that looks like a compiler message goes straight into the
+// quickfix list.
+struct Make_State {
+    Buffer_ID buffer_id;
+    // Where the build runs, for resolving relative paths in its output
+    char dir[4096];
+    int dir_len;
+    // The output line still being written
+    char partial[1024];
+    int partial_len;
+};
 
-    i32_Rect current = view.view_region;
-    int x = current.x0; //view.cursor.wrapped_x;
-    int y = current.y0; //view.cursor.wrapped_y;
+static Make_State make_state = {};
 
-    View_Summary best = view;
+static int read_line_number(String line, int* pos) {
+    int start = *pos;
+    int value = 0;
+    while (*pos < line.size && char_is_numeric(line.str[*pos])) {
+        value = value * 10 + (line.str[*pos] - '0');
+        ++*pos;
+    }
+    return (*pos > start ? value : -1);
+}
 
-    for_views(nextview, app) {
-        if (nextview.view_id == view.view_id) continue;
-        i32_Rect next = nextview.view_region;
-        if (x < next.x0 || x > next.x1) continue;
-        if (y > next.y0) continue;
-        if (best.view_id == view.view_id || next.y0 < best.view_region.y0) best = nextview;
+// Recognises "file:line[:col]: message" (gcc, clang) and
+// "file(line[,col]): message" (msvc).
+static bool parse_error_location(String line, String* file, int* line_number,
+                                 int* column, String* message) {
+    for (int i = 1; i < line.size; ++i) {
+        char open = line.str[i];
+        if (open != ':' && open != '(') { continue; }
+        int pos = i + 1;
+        int number = read_line_number(line, &pos);
+        if (number <= 0) { continue; }
+        int col = 1;
+        char close = (open == '(' ? ')' : ':');
+        if (open == '(' && pos < line.size && line.str[pos] == ',') {
+            ++pos;
+            int value = read_line_number(line, &pos);
+            if (value > 0) { col = value; }
+        }
+        if (open == ':' && pos < line.size && line.str[pos] == ':') {
+            int col_pos = pos + 1;
+            int value = read_line_number(line, &col_pos);
+            if (value > 0 && col_pos < line.size && line.str[col_pos] == ':') {
+                col = value;
+                pos = col_pos;
+            }
+        }
+        if (pos >= line.size || line.str[pos] != close) { continue; }
+        ++pos;
+        if (open == '(' && pos < line.size && line.str[pos] == ':') { ++pos; }
+
+        // Drop lead-ins like "In file included from"
+        String name = skip_chop_whitespace(substr(line, 0, i));
+        for (int j = name.size - 1; j >= 0; --j) {
+            if (char_is_whitespace(name.str[j])) {
+                name = substr_tail(name, j + 1);
+                break;
+            }
+        }
+        if (name.size == 0 || name.str[0] == '[') { return false; }
+        *file = name;
+        *line_number = number;
+        *column = col;
+        *message = skip_chop_whitespace(substr_tail(line, pos));
+        return true;
     }
+    return false;
+}
 
-    set_active_view(app, &best);
+static void parse_make_line(struct Application_Links* app, String line) {
+    String file = {};
+    String message = {};
+    int line_number = 0;
+    int column = 0;
+    if (!parse_error_location(line, &file, &line_number, &column, &message)) {
+        return;
+    }
+    char path_space[4096];
+    String path = make_fixed_width_string(path_space);
+    if (file.str[0] != '/' && !(file.size > 1 && file.str[1] == ':')) {
+        append(&path, make_string(make_state.dir, make_state.dir_len));
+        append(&path, "/");
+    }
+    append(&path, file);
+    terminate_with_null(&path);
+    if (message.size > QUICKFIX_TEXT_MAX) { message.size = QUICKFIX_TEXT_MAX; }
+
+    Quickfix_Entry entry = {};
+    entry.file_name = strdup(path.str);
+    entry.line = line_number;
+    entry.column = column;
+    entry.text = (char*)malloc(message.size + 1);
+    memcpy(entry.text, message.str, message.size);
+    entry.text[message.size] = 0;
+    push_quickfix_entry(&quickfix_list, entry);
+    attach_quickfix_markers_to_open_buffers(app, quickfix_list.count - 1);
 }
 
-CUSTOM_COMMAND_SIG(close_window) {
-    set_current_keymap(app, mapid_normal);
-    end_chord_bar(app);
+// Called from the edit hook with each chunk of text going into *make*.
+static void parse_make_output(struct Application_Links* app, String text) {
+    for (int i = 0; i < text.size; ++i) {
+        char c = text.str[i];
+        if (c == '\n') {
+            parse_make_line(app, make_string(make_state.partial, make_state.partial_len));
+            make_state.partial_len = 0;
+        } else if (c != '\r' && make_state.partial_len < (int)sizeof(make_state.partial)) {
+            make_state.partial[make_state.partial_len++] = c;
+        }
+    }
+}
 
-    View_Summary view = get_view_first(app, AccessAll);
-    get_view_next(app, &view, AccessAll);
-    if (!view.exists) send_exit_signal(app);
-    else close_panel(app);
+VIM_COMMAND_FUNC_SIG(make) {
+    cancel_grep_job();
+    reset_quickfix_list(app);
+
+    make_state.dir_len = directory_get_hot(app, make_state.dir, sizeof(make_state.dir));
+    while (make_state.dir_len > 1 && make_state.dir[make_state.dir_len - 1] == '/') {
+        --make_state.dir_len;
+    }
+    char command_space[1024];
+    String command_line = make_fixed_width_string(command_space);
+    append(&command_line, make_string(global_options.makeprg.str,
+                                      global_options.makeprg.size));
+    if (argstr.size > 0) {
+        append(&command_line, " ");
+        append(&command_line, argstr);
+    }
+
+    String name = make_lit_string("*make*");
+    // Stop parsing until the old output has been cleared out
+    make_state.buffer_id = 0;
+    exec_system_command(app, 0, buffer_identifier(name.str, name.size),
+                        make_state.dir, make_state.dir_len,
+                        command_line.str, command_line.size,
+                        CLI_OverlapWithConsole | CLI_SendEndSignal);
+    Buffer_Summary buffer = get_buffer_by_name(app, name.str, name.size, AccessAll);
+    make_state.buffer_id = buffer.buffer_id;
+    make_state.partial_len = 0;
 }
 
-CUSTOM_COMMAND_SIG(combine_with_next_line) {
-    seek_end_of_line(app);
-    delete_char(app);
+// Tags:                                                                 @tags
+// :tag, Ctrl-] and :tselect look names up in a ctags file. The file is
+// mapped, never parsed: ctags writes it sorted, so a lookup is a binary
+// search over byte offsets that backs up to the start of each probed line.
+// Names the tags file doesn't have fall back to definitions found in the
+// token streams of the open buffers, indexed per buffer and rebuilt only
+// when that buffer changes.
+struct Tags_File {
+    char path[4096];
+    const char* text;
+    size_t size;
+    // !_TAG_FILE_SORTED: 0 unsorted, 1 sorted, 2 sorted ignoring case
+    int sorted;
+#if defined(VIM_HAS_THREADS)
+    time_t mtime;
+#endif
+};
+
+static Tags_File tags_file = {};
+
+struct Tag_Match {
+    // For tags file matches: the file, and the line or the search pattern
+    char file_name[4096];
+    int line;
+    char pattern[SEARCH_PATTERN_MAX];
+    int pattern_size;
+    bool anchored;
+    // For matches found in an open buffer
+    Buffer_ID buffer_id;
+    int pos;
+    char kind;
+};
+
+struct Tag_Stack_Entry {
+    Buffer_ID buffer_id;
+    int pos;
+};
+
+// vim's tagstack is 20 deep too. The oldest entry falls off the bottom.
+constexpr int TAG_STACK_SIZE = 20;
+static Tag_Stack_Entry tag_stack[TAG_STACK_SIZE];
+static int tag_stack_count = 0;
+
+static void unmap_tags_file(Tags_File* file) {
+    unmap_entire_file(file->text, file->size);
+    file->text = 0;
+    file->size = 0;
+    file->path[0] = 0;
 }
 
-CUSTOM_COMMAND_SIG(paste_before_cursor_char) {
-    View_Summary view;
-    Buffer_Summary buffer;
-    
-    unsigned int access = AccessOpen;
-    view = get_active_view(app, access);
-    buffer = get_buffer(app, view.buffer_id, access);
+static bool map_tags_file(Tags_File* file, const char* path) {
+#if defined(VIM_HAS_THREADS)
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) { return false; }
+    if (file->text && strcmp(file->path, path) == 0 &&
+        info.st_mtime == file->mtime && (size_t)info.st_size == file->size) {
+        return true;
+    }
+    unmap_tags_file(file);
+    file->mtime = info.st_mtime;
+#else
+    if (file->text && strcmp(file->path, path) == 0) { return true; }
+    unmap_tags_file(file);
+#endif
+    file->text = map_entire_file(path, &file->size);
+    if (!file->text) { return false; }
+    strncpy(file->path, path, sizeof(file->path) - 1);
+    file->path[sizeof(file->path) - 1] = 0;
+
+    // The header lines all start with !_TAG_ and sort to the top
+    file->sorted = 1;
+    String sorted_key = make_lit_string("!_TAG_FILE_SORTED\t");
+    for (size_t at = 0; at < file->size && file->text[at] == '!';) {
+        const char* line = file->text + at;
+        const char* newline = (const char*)memchr(line, '\n', file->size - at);
+        size_t line_size = (newline ? newline - line : file->size - at);
+        if (line_size > (size_t)sorted_key.size &&
+            memcmp(line, sorted_key.str, sorted_key.size) == 0) {
+            file->sorted = line[sorted_key.size] - '0';
+        }
+        at += line_size + 1;
+    }
+    return true;
+}
 
-    Vim_Register* reg = state.registers + state.paste_register;
-    if (reg->is_line) {
-        seek_beginning_of_line(app);
-        refresh_view(app, &view);
-        int paste_pos = view.cursor.pos;
-		paste_from_register(app, &buffer, paste_pos, reg); 
-        view_set_cursor(app, &view, seek_pos(paste_pos), true);
+// Look for a tags file next to the buffer's file and then in each folder
+// above it, like vim's tags=./tags; setting, then in the hot directory.
+static Tags_File* find_tags_file(struct Application_Links* app,
+                                 Buffer_Summary* buffer) {
+    char path_space[4096];
+    String path = make_fixed_width_string(path_space);
+    if (buffer->file_name && buffer->file_name_len > 0) {
+        copy(&path, make_string(buffer->file_name, buffer->file_name_len));
+        // path always ends in a separator here, so step back past it to the
+        // one before
+        remove_last_folder(&path);
+        while (path.size > 0) {
+            int folder_size = path.size;
+            append(&path, "tags");
+            if (terminate_with_null(&path) && map_tags_file(&tags_file, path.str)) {
+                return &tags_file;
+            }
+            path.size = folder_size - 1;
+            while (path.size > 0 && path.str[path.size - 1] != '/' &&
+                   path.str[path.size - 1] != '\\') {
+                --path.size;
+            }
+        }
+    }
+    path.size = directory_get_hot(app, path.str, path.memory_size);
+    if (path.size > 0 && path.str[path.size - 1] != '/' && path.str[path.size - 1] != '\\') {
+        append(&path, "/");
+    }
+    append(&path, "tags");
+    if (terminate_with_null(&path) && map_tags_file(&tags_file, path.str)) {
+        return &tags_file;
+    }
+    unmap_tags_file(&tags_file);
+    return 0;
+}
+
+static int compare_tag_name(Tags_File* file, size_t line_start, String name) {
+    const char* line = file->text + line_start;
+    size_t available = file->size - line_start;
+    for (int i = 0; i < name.size; ++i) {
+        if ((size_t)i >= available || line[i] == '\t' || line[i] == '\n') { return -1; }
+        char a = line[i];
+        char b = name.str[i];
+        if (file->sorted == 2) {
+            a = char_to_lower(a);
+            b = char_to_lower(b);
+        }
+        if (a != b) { return (uint8_t)a < (uint8_t)b ? -1 : 1; }
+    }
+    if ((size_t)name.size < available && line[name.size] != '\t') { return 1; }
+    return 0;
+}
+
+static size_t tags_line_start(Tags_File* file, size_t pos) {
+    while (pos > 0 && file->text[pos - 1] != '\n') { --pos; }
+    return pos;
+}
+
+static size_t tags_next_line(Tags_File* file, size_t pos) {
+    const char* newline = (const char*)memchr(file->text + pos, '\n', file->size - pos);
+    return (newline ? newline - file->text + 1 : file->size);
+}
+
+// Fill out a match from one tags line: name<TAB>file<TAB>address;"<TAB>kind
+static bool parse_tag_line(Tags_File* file, size_t line_start, Tag_Match* out) {
+    size_t line_end = tags_next_line(file, line_start);
+    String line = make_string((char*)file->text + line_start, (int)(line_end - line_start));
+    if (line.size > 0 && line.str[line.size - 1] == '\n') { --line.size; }
+    if (line.size > 0 && line.str[line.size - 1] == '\r') { --line.size; }
+
+    int name_end = find_s_char(line, 0, '\t');
+    int file_end = find_s_char(line, name_end + 1, '\t');
+    if (file_end >= line.size) { return false; }
+    *out = {};
+
+    String file_name = substr(line, name_end + 1, file_end - name_end - 1);
+    String tags_path = make_string(file->path, (int)strlen(file->path));
+    String out_name = make_fixed_width_string(out->file_name);
+    bool absolute = (file_name.size > 0 && (file_name.str[0] == '/' || file_name.str[0] == '\\' ||
+                                            (file_name.size > 1 && file_name.str[1] == ':')));
+    if (!absolute) {
+        copy(&out_name, tags_path);
+        remove_last_folder(&out_name);
+    }
+    if (!append_checked_ss(&out_name, file_name) || !terminate_with_null(&out_name)) {
+        return false;
+    }
+
+    int at = file_end + 1;
+    char delimiter = (at < line.size ? line.str[at] : 0);
+    if (delimiter == '/' || delimiter == '?') {
+        ++at;
+        if (at < line.size && line.str[at] == '^') {
+            out->anchored = true;
+            ++at;
+        }
+        for (; at < line.size && line.str[at] != delimiter; ++at) {
+            char c = line.str[at];
+            if (c == '\\' && at + 1 < line.size) {
+                c = line.str[++at];
+            }
+            if (c == '$' && at + 1 < line.size && line.str[at + 1] == delimiter) {
+                continue;
+            }
+            // Long patterns only keep their start; it's rarely ambiguous
+            if (out->pattern_size < (int)sizeof(out->pattern)) {
+                out->pattern[out->pattern_size++] = c;
+            }
+        }
     } else {
-        int paste_pos = view.cursor.pos;
-		paste_from_register(app, &buffer, paste_pos, reg); 
-        view_set_cursor(app, &view, seek_pos(paste_pos + reg->text.size - 1),
-                        true);
+        while (at < line.size && char_is_numeric(line.str[at])) {
+            out->line = out->line * 10 + (line.str[at++] - '0');
+        }
+    }
+
+    // The kind is the first extension field, either bare or as kind:x
+    int fields = find_substr(line, at, make_lit_string(";\"\t"));
+    if (fields < line.size) {
+        String kind = substr_tail(line, fields + 3);
+        if (match_part(kind, make_lit_string("kind:"))) { kind = substr_tail(kind, 5); }
+        if (kind.size > 0) { out->kind = kind.str[0]; }
+    }
+    return true;
+}
+
+static void push_tag_match(Tag_Match** matches, int* count, int* capacity,
+                           Tag_Match* match) {
+    if (*count == *capacity) {
+        *capacity = (*capacity ? *capacity * 2 : 16);
+        *matches = (Tag_Match*)realloc(*matches, *capacity * sizeof(Tag_Match));
+    }
+    (*matches)[(*count)++] = *match;
+}
+
+static int find_file_tags(Tags_File* file, String name, Tag_Match** matches,
+                          int count, int* capacity) {
+    if (file->sorted == 0) {
+        for (size_t at = 0; at < file->size; at = tags_next_line(file, at)) {
+            Tag_Match match;
+            if (compare_tag_name(file, at, name) == 0 && parse_tag_line(file, at, &match)) {
+                push_tag_match(matches, &count, capacity, &match);
+            }
+        }
+        return count;
+    }
+
+    // lo always sits on a line start; find the first line >= name
+    size_t lo = 0;
+    size_t hi = file->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        size_t line_start = tags_line_start(file, mid);
+        if (compare_tag_name(file, line_start, name) < 0) {
+            lo = tags_next_line(file, mid);
+        } else {
+            hi = line_start;
+        }
+    }
+    for (size_t at = lo; at < file->size && compare_tag_name(file, at, name) == 0;
+         at = tags_next_line(file, at)) {
+        Tag_Match match;
+        if (parse_tag_line(file, at, &match)) {
+            push_tag_match(matches, &count, capacity, &match);
+        }
+    }
+    return count;
+}
+
+// Definitions in one buffer's token stream, sorted by name.
+struct Token_Tag {
+    int name;
+    int name_size;
+    int pos;
+    char kind;
+};
+
+struct Token_Tag_Index {
+    Buffer_ID buffer_id;
+    uint64_t version;
+    // Each definition's name, back to back; Token_Tag::name is an offset
+    char* names;
+    int names_size;
+    Token_Tag* tags;
+    int count;
+    bool seen;
+};
+
+static Token_Tag_Index* token_tag_indices = 0;
+static int token_tag_index_count = 0;
+static int token_tag_index_capacity = 0;
+
+static char* sorting_token_tag_names = 0;
+
+static int compare_token_tags(const void* a, const void* b) {
+    const Token_Tag* left = (const Token_Tag*)a;
+    const Token_Tag* right = (const Token_Tag*)b;
+    int size = (left->name_size < right->name_size ? left->name_size : right->name_size);
+    int result = memcmp(sorting_token_tag_names + left->name,
+                        sorting_token_tag_names + right->name, size);
+    if (result == 0) { result = left->name_size - right->name_size; }
+    return (result ? result : left->pos - right->pos);
+}
+
+// An identifier is taken as a definition when it follows #define or
+// struct/union/enum/class and opens a body, or when its parameter list is
+// followed by a function body.
+static void build_token_tag_index(struct Application_Links* app,
+                                  Buffer_Summary* buffer, Token_Tag_Index* index) {
+    free(index->names);
+    free(index->tags);
+    index->names = 0;
+    index->names_size = 0;
+    index->tags = 0;
+    index->count = 0;
+    int capacity = 0;
+    int names_capacity = 0;
+
+    int token_count = buffer_token_count(app, buffer);
+    Cpp_Token* tokens = (Cpp_Token*)malloc((token_count + 1) * sizeof(Cpp_Token));
+    defer(free(tokens));
+    buffer_read_tokens(app, buffer, 0, token_count, tokens);
+
+    for (int i = 0; i < token_count; ++i) {
+        Cpp_Token* token = tokens + i;
+        if (token->type != CPP_TOKEN_IDENTIFIER) { continue; }
+        Cpp_Token* prev = (i > 0 ? token - 1 : 0);
+        Cpp_Token* next = (i + 1 < token_count ? token + 1 : 0);
+        char kind = 0;
+        if (prev && prev->type == CPP_PP_DEFINE) {
+            kind = 'd';
+        } else if (prev && prev->type == CPP_TOKEN_KEY_TYPE_DECLARATION && next &&
+                   (next->type == CPP_TOKEN_BRACE_OPEN || next->type == CPP_TOKEN_COLON)) {
+            kind = 's';
+        } else if (next && next->type == CPP_TOKEN_PARENTHESE_OPEN) {
+            int depth = 0;
+            int after = i + 1;
+            for (; after < token_count; ++after) {
+                if (tokens[after].type == CPP_TOKEN_PARENTHESE_OPEN) { ++depth; }
+                if (tokens[after].type == CPP_TOKEN_PARENTHESE_CLOSE && --depth == 0) { break; }
+                if (tokens[after].type == CPP_TOKEN_BRACE_OPEN ||
+                    tokens[after].type == CPP_TOKEN_SEMICOLON) { break; }
+            }
+            // Skip trailing const, override and the like
+            for (++after; after < token_count &&
+                 (tokens[after].type == CPP_TOKEN_KEY_QUALIFIER ||
+                  tokens[after].type == CPP_TOKEN_IDENTIFIER); ++after) {}
+            if (depth == 0 && after < token_count &&
+                tokens[after].type == CPP_TOKEN_BRACE_OPEN) {
+                kind = 'f';
+            }
+        }
+        if (!kind) { continue; }
+        if (index->count == capacity) {
+            capacity = (capacity ? capacity * 2 : 256);
+            index->tags = (Token_Tag*)realloc(index->tags, capacity * sizeof(Token_Tag));
+        }
+        if (index->names_size + token->size > names_capacity) {
+            names_capacity = (index->names_size + token->size) * 2 + 1024;
+            index->names = (char*)realloc(index->names, names_capacity);
+        }
+        buffer_read_range(app, buffer, token->start, token->start + token->size,
+                          index->names + index->names_size);
+        index->tags[index->count++] = { index->names_size, token->size, token->start, kind };
+        index->names_size += token->size;
+    }
+    sorting_token_tag_names = index->names;
+    if (index->count > 0) {
+        qsort(index->tags, index->count, sizeof(Token_Tag), compare_token_tags);
+    }
+}
+
+static int find_token_tags(struct Application_Links* app, String name,
+                           Tag_Match** matches, int count, int* capacity) {
+    for (int i = 0; i < token_tag_index_count; ++i) {
+        token_tag_indices[i].seen = false;
+    }
+    for (Buffer_Summary buffer = get_buffer_first(app, AccessAll);
+         buffer.exists; get_buffer_next(app, &buffer, AccessAll)) {
+        if (!buffer.tokens_are_ready) { continue; }
+        Token_Tag_Index* index = 0;
+        for (int i = 0; i < token_tag_index_count; ++i) {
+            if (token_tag_indices[i].buffer_id == buffer.buffer_id) {
+                index = token_tag_indices + i;
+                break;
+            }
+        }
+        uint64_t version = get_buffer_edit_version(app, &buffer);
+        if (!index) {
+            if (token_tag_index_count == token_tag_index_capacity) {
+                token_tag_index_capacity = (token_tag_index_capacity ? token_tag_index_capacity * 2 : 16);
+                token_tag_indices = (Token_Tag_Index*)realloc(
+                    token_tag_indices, token_tag_index_capacity * sizeof(Token_Tag_Index));
+            }
+            index = token_tag_indices + token_tag_index_count++;
+            *index = {};
+            index->buffer_id = buffer.buffer_id;
+            build_token_tag_index(app, &buffer, index);
+        } else if (index->version != version) {
+            build_token_tag_index(app, &buffer, index);
+        }
+        index->version = version;
+        index->seen = true;
+
+        int lo = 0;
+        int hi = index->count;
+        while (lo < hi) {
+            int mid = lo + (hi - lo)/2;
+            Token_Tag* tag = index->tags + mid;
+            int size = (tag->name_size < name.size ? tag->name_size : name.size);
+            int result = memcmp(index->names + tag->name, name.str, size);
+            if (result < 0 || (result == 0 && tag->name_size < name.size)) { lo = mid + 1; }
+            else { hi = mid; }
+        }
+        for (; lo < index->count; ++lo) {
+            Token_Tag* tag = index->tags + lo;
+            if (tag->name_size != name.size ||
+                memcmp(index->names + tag->name, name.str, name.size) != 0) {
+                break;
+            }
+            Tag_Match match = {};
+            match.buffer_id = buffer.buffer_id;
+            match.pos = tag->pos;
+            match.kind = tag->kind;
+            String file_name = make_fixed_width_string(match.file_name);
+            append_checked_ss(&file_name, make_string(buffer.buffer_name, buffer.buffer_name_len));
+            terminate_with_null(&file_name);
+            push_tag_match(matches, &count, capacity, &match);
+        }
+    }
+
+    // Forget buffers that were closed
+    for (int i = 0; i < token_tag_index_count;) {
+        if (token_tag_indices[i].seen) {
+            ++i;
+            continue;
+        }
+        free(token_tag_indices[i].names);
+        free(token_tag_indices[i].tags);
+        token_tag_indices[i] = token_tag_indices[--token_tag_index_count];
     }
-    clear_register_selection();
+    return count;
 }
 
-CUSTOM_COMMAND_SIG(paste_after_cursor_char) {
-    View_Summary view;
-    Buffer_Summary buffer;
-    
-    unsigned int access = AccessOpen;
-    view = get_active_view(app, access);
-    buffer = get_buffer(app, view.buffer_id, access);
+static int find_tags(struct Application_Links* app, String name,
+                     Tag_Match** matches) {
+    View_Summary view = get_active_view(app, AccessAll);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+    int count = 0;
+    int capacity = 0;
+    Tags_File* file = find_tags_file(app, &buffer);
+    if (file) {
+        count = find_file_tags(file, name, matches, count, &capacity);
+    }
+    if (count == 0) {
+        count = find_token_tags(app, name, matches, count, &capacity);
+    }
+    return count;
+}
 
-    Vim_Register* reg = state.registers + state.paste_register;
-    if (reg->is_line) {
-        seek_end_of_line(app);
-        move_right(app);
-        refresh_view(app, &view);
-        int paste_pos = view.cursor.pos;
-		paste_from_register(app, &buffer, paste_pos, reg); 
-        view_set_cursor(app, &view, seek_pos(paste_pos), true);
-    } else {
-        int paste_pos = view.cursor.pos + 1;
-		paste_from_register(app, &buffer, paste_pos, reg); 
-        view_set_cursor(app, &view, seek_pos(paste_pos + reg->text.size - 1),
-                        true);
+static void jump_to_tag(struct Application_Links* app, Tag_Match* match) {
+    View_Summary view = get_active_view(app, AccessAll);
+    if (tag_stack_count == TAG_STACK_SIZE) {
+        memmove(tag_stack, tag_stack + 1, (TAG_STACK_SIZE - 1) * sizeof(Tag_Stack_Entry));
+        --tag_stack_count;
     }
-    clear_register_selection();
+    tag_stack[tag_stack_count++] = { view.buffer_id, view.cursor.pos };
+    set_jump_mark(app, &view);
+
+    if (match->buffer_id) {
+        view_set_buffer(app, &view, match->buffer_id, 0);
+        view_set_cursor(app, &view, seek_pos(match->pos), true);
+        return;
+    }
+    if (!view_open_file_relative(app, &view, make_lit_string(""),
+                                 make_string(match->file_name, (int)strlen(match->file_name)),
+                                 true)) {
+        fprintf(stderr, "Couldn't open %s\n", match->file_name);
+        --tag_stack_count;
+        return;
+    }
+    refresh_view(app, &view);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+    if (match->pattern_size == 0) {
+        view_set_cursor(app, &view, seek_line_char(match->line > 0 ? match->line : 1, 0), true);
+        return;
+    }
+    String pattern = make_string(match->pattern, match->pattern_size);
+    int pos = 0;
+    int found = 0;
+    while (buffer_seek_match(app, &buffer, pos, search_forward, pattern,
+                             false, false, &found)) {
+        if (!match->anchored || found == 0 ||
+            buffer_get_char(app, &buffer, found - 1) == '\n') {
+            view_set_cursor(app, &view, seek_pos(found), true);
+            return;
+        }
+        pos = found + 1;
+    }
+    fprintf(stderr, "Tag pattern not found in %s\n", match->file_name);
 }
 
-CUSTOM_COMMAND_SIG(visual_delete) {
-    state.action = vimaction_delete_range;
-    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
-    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+static void jump_to_tag_name(struct Application_Links* app, String name) {
+    if (name.size == 0) { return; }
+    Tag_Match* matches = 0;
+    defer(free(matches));
+    int count = find_tags(app, name, &matches);
+    if (count == 0) {
+        fprintf(stderr, "tag not found: %.*s\n", name.size, name.str);
+        return;
+    }
+    jump_to_tag(app, matches);
 }
 
-CUSTOM_COMMAND_SIG(visual_change) {
-    state.action = vimaction_change_range;
-    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
-    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+// The keyword under the cursor, or the next one on its line.
+static bool get_cursor_keyword(struct Application_Links* app, View_Summary* view,
+                               char* out, int out_size, int* out_len) {
+    Buffer_Summary buffer = get_buffer(app, view->buffer_id, AccessAll);
+    int pos = view->cursor.pos;
+    int line_start = seek_line_beginning(app, &buffer, pos);
+    int line_end = seek_line_end(app, &buffer, pos);
+    int size = line_end - line_start;
+    char* line = (char*)malloc(size + 1);
+    defer(free(line));
+    buffer_read_range(app, &buffer, line_start, line_end, line);
+
+    int at = pos - line_start;
+    while (at < size && get_char_class(line[at], false) != 1) { ++at; }
+    if (at >= size) { return false; }
+    int start = at;
+    int end = at;
+    while (start > 0 && get_char_class(line[start - 1], false) == 1) { --start; }
+    while (end < size && get_char_class(line[end], false) == 1) { ++end; }
+    if (end - start > out_size) { return false; }
+    memcpy(out, line + start, end - start);
+    *out_len = end - start;
+    return true;
 }
 
-CUSTOM_COMMAND_SIG(visual_yank) {
-    state.action = vimaction_yank_range;
-    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
-    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+CUSTOM_COMMAND_SIG(vim_jump_to_tag) {
+    View_Summary view = get_active_view(app, AccessAll);
+    char name[256];
+    int name_len = 0;
+    if (get_cursor_keyword(app, &view, name, sizeof(name), &name_len)) {
+        jump_to_tag_name(app, make_string(name, name_len));
+    }
 }
 
-CUSTOM_COMMAND_SIG(visual_format) {
-    state.action = vimaction_format_range;
-    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
-    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+CUSTOM_COMMAND_SIG(vim_pop_tag) {
+    if (tag_stack_count == 0) {
+        fprintf(stderr, "at bottom of tag stack\n");
+        return;
+    }
+    Tag_Stack_Entry entry = tag_stack[--tag_stack_count];
+    View_Summary view = get_active_view(app, AccessAll);
+    view_set_buffer(app, &view, entry.buffer_id, 0);
+    view_set_cursor(app, &view, seek_pos(entry.pos), true);
 }
 
-CUSTOM_COMMAND_SIG(visual_indent_right) {
-    state.action = vimaction_format_range; // TODO(chr)
-    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
-    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+VIM_COMMAND_FUNC_SIG(tag) {
+    jump_to_tag_name(app, argstr);
 }
 
-CUSTOM_COMMAND_SIG(visual_indent_left) {
-    state.action = vimaction_format_range; // TODO(chr)
-    vim_exec_action(app, state.selection_range, state.mode == mode_visual_line);
-    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+VIM_COMMAND_FUNC_SIG(pop_tag) {
+    vim_pop_tag(app);
 }
 
-CUSTOM_COMMAND_SIG(select_register) {
-    User_Input trigger;
-    trigger = get_command_input(app);
+// Lists every match for the name in query bars. Enter, or a match's
+// number, jumps to it.
+VIM_COMMAND_FUNC_SIG(tag_select) {
+    String name = argstr;
+    char name_space[256];
+    if (name.size == 0) {
+        View_Summary view = get_active_view(app, AccessAll);
+        int name_len = 0;
+        if (!get_cursor_keyword(app, &view, name_space, sizeof(name_space), &name_len)) {
+            return;
+        }
+        name = make_string(name_space, name_len);
+    }
+    Tag_Match* matches = 0;
+    defer(free(matches));
+    int count = find_tags(app, name, &matches);
+    if (count == 0) {
+        fprintf(stderr, "tag not found: %.*s\n", name.size, name.str);
+        return;
+    }
 
-    Register_Id regid = regid_from_char(trigger.key.character);
-    if (regid == reg_unnamed) {
-        enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+    constexpr int TSELECT_RESULTS = 9;
+    Query_Bar result_bars[TSELECT_RESULTS];
+    char result_space[TSELECT_RESULTS][256];
+    int result_bar_count = 0;
+    for (; result_bar_count < TSELECT_RESULTS && result_bar_count < count; ++result_bar_count) {
+        Query_Bar* result = result_bars + result_bar_count;
+        result->string = make_fixed_width_string(result_space[result_bar_count]);
+        if (start_query_bar(app, result, 0) == 0) { break; }
     }
+    defer(for (int i = 0; i < result_bar_count; ++i) {
+        end_query_bar(app, result_bars + i, 0);
+    });
 
-    state.yank_register = state.paste_register = regid;
-    char str[2] = { (char)trigger.key.character, '\0' };
-    push_to_chord_bar(app, lit(str));
+    Query_Bar bar;
+    if (start_query_bar(app, &bar, 0) == 0) return;
+    defer(end_query_bar(app, &bar, 0));
+    bar.prompt = make_lit_string("Type number and <Enter>: ");
+    bar.string = make_lit_string("");
+
+    int selected = 0;
+    for (;;) {
+        for (int i = 0; i < result_bar_count; ++i) {
+            Query_Bar* result = result_bars + i;
+            Tag_Match* match = matches + i;
+            result->prompt = make_lit_string(i == selected ? "> " : "  ");
+            result->string.size = 0;
+            append_int_to_str(&result->string, i + 1);
+            append(&result->string, "  ");
+            append(&result->string, match->kind ? match->kind : ' ');
+            append(&result->string, "  ");
+            append(&result->string, match->file_name);
+            if (match->line > 0) {
+                append(&result->string, ":");
+                append_int_to_str(&result->string, match->line);
+            }
+        }
 
-    reset_keymap_for_current_mode(app);
+        User_Input in = get_user_input(app, EventOnAnyKey, EventOnEsc);
+        if (in.abort) return;
+        if (in.key.keycode == '\n') {
+            break;
+        } else if ((int)in.key.keycode >= '1' && (int)in.key.keycode < '1' + result_bar_count) {
+            selected = in.key.keycode - '1';
+            break;
+        } else if (in.key.keycode == '\t' || in.key.keycode == key_down ||
+                   (in.key.keycode == 'n' && in.key.modifiers[MDFR_CONTROL_INDEX])) {
+            selected = (selected + 1) % result_bar_count;
+        } else if (in.key.keycode == key_up ||
+                   (in.key.keycode == 'p' && in.key.modifiers[MDFR_CONTROL_INDEX])) {
+            selected = (selected + result_bar_count - 1) % result_bar_count;
+        }
+    }
+    if (result_bar_count > 0) {
+        jump_to_tag(app, matches + selected);
+    }
 }
 
-CUSTOM_COMMAND_SIG(vim_open_file_in_quotes){
-    // @COPYPASTA from 4coder_default_include.cpp
-    View_Summary view;
-    Buffer_Summary buffer;
-    char short_file_name[128];
-    int pos, start, end, size;
-    
-    unsigned int access = AccessProtected;
-    view = get_active_view(app, access);
-    buffer = get_buffer(app, view.buffer_id, access);
-    pos = view.cursor.pos;
-    buffer_seek_delimiter_forward(app, &buffer, pos + 1, '"', &end);
-    buffer_seek_delimiter_backward(app, &buffer, pos, '"', &start);
-    
-    ++start;
-    size = end - start;
+// Undo tree:                                                        @undotree
+// 4coder's history is a line: undo, then edit, and the undone changes are
+// gone. The vim layer keeps every state it has seen in a tree instead. After
+// each command the tree is synced with 4coder's records, so a dropped redo
+// branch is already copied out by the time 4coder throws it away. Moves
+// along 4coder's line are left to 4coder; moves onto another branch rewind
+// 4coder to its oldest state and replay the tree's edits with history
+// recording off, leaving the target as the new oldest state.
+//
+// With a file behind the buffer, :w also appends the states made since the
+// last write to an undo log next to it (.name.un~). The log is only read,
+// through mmap, when an undo goes past the state the buffer was opened in.
+struct Undo_Edit {
+    int pos;
+    // Offsets into Undo_Tree::strings
+    int old_text;
+    int old_size;
+    int new_text;
+    int new_size;
+};
 
-    end_chord_bar(app);
-    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
-    
-    // NOTE(allen): This check is necessary because buffer_read_range
-    // requires that the output buffer you provide is at least (end - start) bytes long.
-    if (size < sizeof(short_file_name)){
-        char file_name_[256];
-        String file_name = make_fixed_width_string(file_name_);
-        
-        buffer_read_range(app, &buffer, start, end, short_file_name);
-        
-        copy(&file_name, make_string(buffer.file_name, buffer.file_name_len));
-        remove_last_folder(&file_name);
-        append(&file_name, make_string(short_file_name, size));
-        
-        view_open_file(app, &view, expand_str(file_name), false);
+struct Undo_Node {
+    // -1 for the oldest known state
+    int parent;
+    // Creation order, which g- and g+ walk
+    int seq;
+    int64_t time;
+    // The edits that lead here from the parent
+    int first_edit;
+    int edit_count;
+    // Of the 4coder record the node came from, to spot a replaced branch
+    uint64_t hash;
+    // Id in the undo log, or 0 if it hasn't been written
+    uint32_t log_id;
+    // Merged into another node when the log was loaded
+    bool dead;
+};
+
+struct Undo_Tree {
+    Buffer_ID buffer_id;
+    // A tree left by a killed buffer whose id was reused doesn't match
+    uint64_t generation;
+
+    Undo_Node* nodes;
+    int node_count;
+    int node_capacity;
+    Undo_Edit* edits;
+    int edit_count;
+    int edit_capacity;
+    char* strings;
+    int strings_size;
+    int strings_capacity;
+
+    // 4coder's history as tree nodes: linear[0] is the state with nothing
+    // left to undo and linear[k] the state after record k
+    int* linear;
+    int linear_count;
+    int linear_capacity;
+    int known_current;
+
+    int current;
+    int next_seq;
+
+    // Content hash of linear[0] when the tree was made, to check the undo
+    // log still describes this file
+    uint64_t base_hash;
+    bool log_loaded;
+};
+
+static Undo_Tree* undo_trees = 0;
+static int undo_tree_count = 0;
+static int undo_tree_capacity = 0;
+
+constexpr char UNDO_LOG_MAGIC[8] = { '4', 'V', 'I', 'M', 'U', 'N', 'D', 'O' };
+constexpr uint32_t UNDO_LOG_VERSION = 1;
+enum Undo_Log_Record {
+    undolog_node = 1,
+    undolog_checkpoint = 2,
+};
+// type, node id, next free id, content hash, type again
+constexpr int UNDO_CHECKPOINT_SIZE = 1 + 4 + 4 + 8 + 1;
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, int size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (int i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
     }
+    return hash;
 }
 
-CUSTOM_COMMAND_SIG(search_under_cursor) {
-    View_Summary view;
-    Buffer_Summary buffer;
-    view = get_active_view(app, AccessAll);
-    buffer = get_buffer(app, view.buffer_id, AccessAll);
-    if (!buffer.exists) return;
-    Range word = get_word_under_cursor(app, &buffer, &view);
-    char* wordStr = (char*)malloc(word.end - word.start);
-    defer(free(wordStr));
-    buffer_read_range(app, &buffer, word.start, word.end, wordStr);
-    buffer_search(app, make_string(wordStr, word.end - word.start), view,
-                  search_forward);
+static uint64_t hash_buffer_text(struct Application_Links* app,
+                                 Buffer_Summary* buffer) {
+    char chunk[4096];
+    uint64_t hash = 14695981039346656037ull;
+    for (int pos = 0; pos < buffer->size; pos += sizeof(chunk)) {
+        int end = pos + (int)sizeof(chunk);
+        if (end > buffer->size) { end = buffer->size; }
+        buffer_read_range(app, buffer, pos, end, chunk);
+        hash = hash_bytes(hash, chunk, end - pos);
+    }
+    return hash;
 }
 
-CUSTOM_COMMAND_SIG(vim_search) {
-    buffer_query_search(app, search_forward);
+static int push_undo_string(Undo_Tree* tree, const char* str, int size) {
+    if (tree->strings_size + size > tree->strings_capacity) {
+        tree->strings_capacity = (tree->strings_size + size) * 2 + 1024;
+        tree->strings = (char*)realloc(tree->strings, tree->strings_capacity);
+    }
+    int offset = tree->strings_size;
+    if (size > 0) { memcpy(tree->strings + offset, str, size); }
+    tree->strings_size += size;
+    return offset;
 }
 
-CUSTOM_COMMAND_SIG(vim_search_reverse) {
-    buffer_query_search(app, search_backward);
+static void push_undo_edit(Undo_Tree* tree, int pos, const char* old_text,
+                           int old_size, const char* new_text, int new_size) {
+    if (tree->edit_count == tree->edit_capacity) {
+        tree->edit_capacity = (tree->edit_capacity ? tree->edit_capacity * 2 : 256);
+        tree->edits = (Undo_Edit*)realloc(tree->edits,
+                                          tree->edit_capacity * sizeof(Undo_Edit));
+    }
+    Undo_Edit* edit = tree->edits + tree->edit_count++;
+    edit->pos = pos;
+    edit->old_size = old_size;
+    edit->old_text = push_undo_string(tree, old_text, old_size);
+    edit->new_size = new_size;
+    edit->new_text = push_undo_string(tree, new_text, new_size);
 }
 
-CUSTOM_COMMAND_SIG(vim_search_next) {
-    View_Summary view = get_active_view(app, AccessAll);
-    buffer_search(app, state.last_search.text, view,
-                  state.last_search.direction);
+static int push_undo_node(Undo_Tree* tree, int parent, int64_t time) {
+    if (tree->node_count == tree->node_capacity) {
+        tree->node_capacity = (tree->node_capacity ? tree->node_capacity * 2 : 64);
+        tree->nodes = (Undo_Node*)realloc(tree->nodes,
+                                          tree->node_capacity * sizeof(Undo_Node));
+    }
+    int index = tree->node_count++;
+    Undo_Node* node = tree->nodes + index;
+    *node = {};
+    node->parent = parent;
+    node->seq = tree->next_seq++;
+    node->time = time;
+    node->first_edit = tree->edit_count;
+    return index;
 }
 
-CUSTOM_COMMAND_SIG(vim_search_prev) {
-    View_Summary view = get_active_view(app, AccessAll);
-    Search_Direction current_direction = state.last_search.direction;
-    buffer_search(app, state.last_search.text, view,
-                  (Search_Direction)(-current_direction));
-    // Preserve search direction
-    state.last_search.direction = current_direction;
+static void set_undo_linear(Undo_Tree* tree, int index, int node) {
+    if (index >= tree->linear_capacity) {
+        tree->linear_capacity = (index + 1) * 2;
+        tree->linear = (int*)realloc(tree->linear, tree->linear_capacity * sizeof(int));
+    }
+    tree->linear[index] = node;
+    tree->linear_count = index + 1;
 }
 
-CUSTOM_COMMAND_SIG(vim_delete_char) {
-    View_Summary view = get_active_view(app, AccessOpen);
-    if (!view.exists) { return; }
-    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
-    
-    char nextch[2];
-    int pos = view.cursor.pos;
-    buffer_read_range(app, &buffer, pos, pos + 1, nextch);
-    if (nextch[0] != '\n') {
-        if (0 < buffer.size && pos < buffer.size){
-            buffer_replace_range(app, &buffer,
-                                      pos, pos+1, 0, 0);
-            // TODO(chr): Going into register?
+// Hash a 4coder record, and copy its edits onto node if there is one.
+static uint64_t read_history_record(struct Application_Links* app,
+                                    Undo_Tree* tree, History_Record_Index index,
+                                    Undo_Node* node) {
+    uint64_t hash = 14695981039346656037ull;
+    Record_Info info = {};
+    if (!buffer_history_get_record_info(app, tree->buffer_id, index, &info) ||
+        info.error != RecordError_NoError) {
+        return hash;
+    }
+    int count = (info.kind == RecordKind_Group ? info.group.count : 1);
+    for (int i = 0; i < count; ++i) {
+        Record_Info single = info;
+        if (info.kind == RecordKind_Group &&
+            !buffer_history_get_group_sub_record(app, tree->buffer_id, index, i, &single)) {
+            continue;
+        }
+        String forward = single.single.string_forward;
+        String backward = single.single.string_backward;
+        hash = hash_bytes(hash, &single.single.first, sizeof(single.single.first));
+        hash = hash_bytes(hash, backward.str, backward.size);
+        hash = hash_bytes(hash, forward.str, forward.size);
+        if (node) {
+            push_undo_edit(tree, single.single.first, backward.str, backward.size,
+                           forward.str, forward.size);
+            ++node->edit_count;
         }
     }
+    return hash;
 }
 
-// TODO(chr): Measure the lister size?
-constexpr int HALF_PAGE = 5;
+static bool has_undo_log(Buffer_Summary* buffer);
+
+// Bring the tree up to date with 4coder's records for the buffer.
+static Undo_Tree* sync_undo_tree(struct Application_Links* app,
+                                 Buffer_Summary* buffer) {
+    if (!buffer->exists) { return 0; }
+    uint64_t generation = get_buffer_generation(app, buffer->buffer_id);
+    Undo_Tree* tree = 0;
+    bool is_new = false;
+    for (int i = 0; i < undo_tree_count; ++i) {
+        if (undo_trees[i].buffer_id == buffer->buffer_id) {
+            tree = undo_trees + i;
+            break;
+        }
+    }
+    if (tree && tree->generation != generation) {
+        // The buffer this was for is gone; its states mean nothing here
+        free(tree->nodes);
+        free(tree->edits);
+        free(tree->strings);
+        free(tree->linear);
+        is_new = true;
+    } else if (!tree) {
+        if (undo_tree_count == undo_tree_capacity) {
+            undo_tree_capacity = (undo_tree_capacity ? undo_tree_capacity * 2 : 16);
+            undo_trees = (Undo_Tree*)realloc(undo_trees,
+                                             undo_tree_capacity * sizeof(Undo_Tree));
+        }
+        tree = undo_trees + undo_tree_count++;
+        is_new = true;
+    }
+    if (is_new) {
+        *tree = {};
+        tree->buffer_id = buffer->buffer_id;
+        tree->generation = generation;
+        tree->next_seq = 1;
+        int root = push_undo_node(tree, -1, (int64_t)time(0));
+        set_undo_linear(tree, 0, root);
+        tree->current = root;
+        // Hashing a big file is slow, so only when there's a log it could
+        // be matched against
+        if (buffer->file_name_len > 0 &&
+            buffer_history_get_max_record_index(app, buffer->buffer_id) == 0 &&
+            has_undo_log(buffer)) {
+            tree->base_hash = hash_buffer_text(app, buffer);
+        }
+    }
 
-CUSTOM_COMMAND_SIG(lister__page_down) {
-    for (int i = 0; i < HALF_PAGE; ++i) {
-        lister__move_down(app);
+    // Records are only merged while an insert session is open
+    if (state.insert_session.active &&
+        state.insert_session.buffer_id == buffer->buffer_id) {
+        return tree;
     }
+
+    int count = buffer_history_get_max_record_index(app, buffer->buffer_id);
+    int current = buffer_history_get_current_state_index(app, buffer->buffer_id);
+    int known_count = tree->linear_count - 1;
+    if (count != known_count || current != tree->known_current) {
+        // Records up to the last known state can't have changed; past it,
+        // redoing keeps them and a new edit replaces them.
+        int same = (count < known_count ? count : known_count);
+        for (int k = tree->known_current + 1; k <= same; ++k) {
+            if (read_history_record(app, tree, k, 0) !=
+                tree->nodes[tree->linear[k]].hash) {
+                same = k - 1;
+                break;
+            }
+        }
+        tree->linear_count = same + 1;
+        int64_t now = (int64_t)time(0);
+        for (int k = same + 1; k <= count; ++k) {
+            int node = push_undo_node(tree, tree->linear[k - 1], now);
+            tree->nodes[node].hash = read_history_record(app, tree, k,
+                                                         tree->nodes + node);
+            set_undo_linear(tree, k, node);
+        }
+        tree->known_current = current;
+        tree->current = tree->linear[current];
+    }
+    return tree;
 }
 
-CUSTOM_COMMAND_SIG(lister__page_up) {
-    for (int i = 0; i < HALF_PAGE; ++i) {
-        lister__move_up(app);
+static void apply_undo_node(struct Application_Links* app, Undo_Tree* tree,
+                            Buffer_Summary* buffer, int index, bool forward,
+                            int* cursor) {
+    Undo_Node* node = tree->nodes + index;
+    for (int i = 0; i < node->edit_count; ++i) {
+        Undo_Edit* edit = tree->edits + node->first_edit +
+            (forward ? i : node->edit_count - 1 - i);
+        int remove = (forward ? edit->old_size : edit->new_size);
+        int text = (forward ? edit->new_text : edit->old_text);
+        int size = (forward ? edit->new_size : edit->old_size);
+        buffer_replace_range(app, buffer, edit->pos, edit->pos + remove,
+                             tree->strings + text, size);
+        *cursor = edit->pos;
     }
 }
 
-//=============================================================================
-// > Statusbar processing and commands <                             @statusbar
-// This is where the vim statusbar feature is created.
-//
-// Define a command with VIM_COMMAND_FUNC_SIG and then add it to the statusbar
-// library with define_command().
-//=============================================================================
+static int get_undo_depth(Undo_Tree* tree, int node) {
+    int depth = 0;
+    for (; tree->nodes[node].parent >= 0; node = tree->nodes[node].parent) { ++depth; }
+    return depth;
+}
 
-CUSTOM_COMMAND_SIG(status_command){
-    User_Input in;
-    Query_Bar bar;
+static void move_to_undo_node(struct Application_Links* app, Undo_Tree* tree,
+                              Buffer_Summary* buffer, int target) {
+    if (target == tree->current) { return; }
+    View_Summary view = get_active_view(app, AccessAll);
+    int cursor = view.cursor.pos;
 
-    set_current_keymap(app, mapid_normal);
+    int linear_index = -1;
+    for (int k = 0; k < tree->linear_count; ++k) {
+        if (tree->linear[k] == target) {
+            linear_index = k;
+            break;
+        }
+    }
+    if (linear_index >= 0) {
+        // Step through 4coder's records, the edit nearest the target last
+        int step = (linear_index < tree->known_current ? -1 : 1);
+        for (int k = tree->known_current; k != linear_index; k += step) {
+            int changed = (step < 0 ? k : k + 1);
+            Undo_Node* node = tree->nodes + tree->linear[changed];
+            if (node->edit_count > 0) { cursor = tree->edits[node->first_edit].pos; }
+        }
+        buffer_history_set_current_state_index(app, buffer->buffer_id, linear_index);
+        tree->known_current = linear_index;
+    } else {
+        buffer_history_set_current_state_index(app, buffer->buffer_id, 0);
+        buffer_history_clear_after_current_state(app, buffer->buffer_id);
+        *buffer = get_buffer(app, buffer->buffer_id, AccessAll);
+
+        // Walk up from the oldest state 4coder had to the common ancestor,
+        // then down to the target
+        int from = tree->linear[0];
+        int from_depth = get_undo_depth(tree, from);
+        int target_depth = get_undo_depth(tree, target);
+        int* down = (int*)malloc((target_depth + 1) * sizeof(int));
+        defer(free(down));
+        int down_count = 0;
+        int up = from;
+        int to = target;
+        while (target_depth > from_depth) {
+            down[down_count++] = to;
+            to = tree->nodes[to].parent;
+            --target_depth;
+        }
+        buffer_set_setting(app, buffer, BufferSetting_RecordsHistory, false);
+        while (from_depth > target_depth) {
+            apply_undo_node(app, tree, buffer, up, false, &cursor);
+            up = tree->nodes[up].parent;
+            --from_depth;
+        }
+        while (up != to) {
+            apply_undo_node(app, tree, buffer, up, false, &cursor);
+            up = tree->nodes[up].parent;
+            down[down_count++] = to;
+            to = tree->nodes[to].parent;
+        }
+        for (int i = down_count - 1; i >= 0; --i) {
+            apply_undo_node(app, tree, buffer, down[i], true, &cursor);
+        }
+        buffer_set_setting(app, buffer, BufferSetting_RecordsHistory, true);
+        set_undo_linear(tree, 0, target);
+        tree->known_current = 0;
+    }
+    tree->current = target;
+    if (view.buffer_id == buffer->buffer_id) {
+        view_set_cursor(app, &view, seek_pos(cursor), true);
+    }
+}
 
-    if (start_query_bar(app, &bar, 0) == 0) return;
-    defer(end_query_bar(app, &bar, 0));
+static bool get_undo_log_path(Buffer_Summary* buffer, String* out) {
+    if (!buffer->file_name || buffer->file_name_len <= 0) { return false; }
+    String file_name = make_string(buffer->file_name, buffer->file_name_len);
+    String name = front_of_directory(file_name);
+    out->size = 0;
+    append_checked_ss(out, path_of_directory(file_name));
+    append(out, ".");
+    append_checked_ss(out, name);
+    append(out, ".un~");
+    return terminate_with_null(out);
+}
 
-    char bar_string_space[256];
-    bar.string = make_fixed_width_string(bar_string_space);
+struct Undo_Log_Checkpoint {
+    uint32_t node;
+    uint32_t next_id;
+    uint64_t hash;
+};
 
-    bar.prompt = make_lit_string(":");
+static bool parse_undo_checkpoint(const uint8_t* at, Undo_Log_Checkpoint* out) {
+    if (at[0] != undolog_checkpoint || at[UNDO_CHECKPOINT_SIZE - 1] != undolog_checkpoint) {
+        return false;
+    }
+    memcpy(&out->node, at + 1, 4);
+    memcpy(&out->next_id, at + 5, 4);
+    memcpy(&out->hash, at + 9, 8);
+    return true;
+}
 
-    while (1){
-        in = get_user_input(app, EventOnAnyKey, EventOnEsc);
-        if (in.abort) break;
-        if (in.key.keycode == '\n'){
-            break;
-        }
-        else if (in.key.keycode == '\t') {
-            // Ignore it for now
-            // TODO(chronister): auto completion!
-        }
-        else if (in.key.character && key_is_unmodified(&in.key)){
-            append(&bar.string, (char)in.key.character);
+// The checkpoint at the end of the log, without reading the rest of it.
+static bool read_undo_log_tail(const char* path, Undo_Log_Checkpoint* out) {
+    FILE* file = fopen(path, "rb");
+    if (!file) { return false; }
+    defer(fclose(file));
+    uint8_t tail[UNDO_CHECKPOINT_SIZE];
+    return (fseek(file, -UNDO_CHECKPOINT_SIZE, SEEK_END) == 0 &&
+            fread(tail, 1, sizeof(tail), file) == sizeof(tail) &&
+            parse_undo_checkpoint(tail, out));
+}
+
+static bool has_undo_log(Buffer_Summary* buffer) {
+    char path_space[4096];
+    String path = make_fixed_width_string(path_space);
+    Undo_Log_Checkpoint tail;
+    return (get_undo_log_path(buffer, &path) && read_undo_log_tail(path.str, &tail));
+}
+
+// Graft the log's states onto the tree, above the state the buffer was
+// opened in. Only done once, the first time an undo runs out of states.
+static bool load_undo_log(struct Application_Links* app, Undo_Tree* tree,
+                          Buffer_Summary* buffer) {
+    if (tree->log_loaded) { return false; }
+    tree->log_loaded = true;
+    char path_space[4096];
+    String path = make_fixed_width_string(path_space);
+    if (!get_undo_log_path(buffer, &path)) { return false; }
+
+    size_t size = 0;
+    const char* text = map_entire_file(path.str, &size);
+    if (!text) { return false; }
+    defer(unmap_entire_file(text, size));
+    // The tree keeps text offsets as ints, and every id in the log is below
+    // the next_id of the checkpoint it ends on. A node record is at least 21
+    // bytes, which bounds next_id by the log's size.
+    Undo_Log_Checkpoint tail;
+    if (size < sizeof(UNDO_LOG_MAGIC) + 4 + UNDO_CHECKPOINT_SIZE ||
+        size > 0x3FFFFFFF ||
+        memcmp(text, UNDO_LOG_MAGIC, sizeof(UNDO_LOG_MAGIC)) != 0 ||
+        !parse_undo_checkpoint((const uint8_t*)text + size - UNDO_CHECKPOINT_SIZE, &tail) ||
+        tail.next_id == 0 || tail.next_id > size / 21 + 1) {
+        return false;
+    }
+
+    int root = -1;
+    for (int i = 0; i < tree->node_count; ++i) {
+        if (tree->nodes[i].parent < 0 && !tree->nodes[i].dead) { root = i; }
+    }
+    if (root < 0) { return false; }
+    // A write this session already tied the root to its logged state;
+    // otherwise it's the last checkpoint made with the file as it was opened
+    uint32_t root_id = tree->nodes[root].log_id;
+    if (root_id == 0 && tree->base_hash == 0) { return false; }
+
+    // Log ids map to tree nodes through this table. States written this
+    // session are in the log too, and are kept as they are.
+    int id_capacity = (int)tail.next_id;
+    int* node_for_id = (int*)malloc(id_capacity * sizeof(int));
+    defer(free(node_for_id));
+    for (int i = 0; i < id_capacity; ++i) { node_for_id[i] = -1; }
+    for (int i = 0; i < tree->node_count; ++i) {
+        uint32_t log_id = tree->nodes[i].log_id;
+        if (i != root && log_id != 0 && log_id < tail.next_id) {
+            node_for_id[log_id] = i;
         }
-        else if (in.key.keycode == key_back){
-            if (bar.string.size > 0){
-                --bar.string.size;
+    }
+    int first_loaded = tree->node_count;
+    int first_loaded_edit = tree->edit_count;
+    int first_loaded_string = tree->strings_size;
+    int first_loaded_seq = tree->next_seq;
+    // No state the log leads to can be bigger than this one plus all the
+    // text in the log
+    int64_t max_buffer_size = (int64_t)buffer->size + (int64_t)size;
+
+    bool damaged = false;
+    size_t at = sizeof(UNDO_LOG_MAGIC) + 4;
+    while (at < size && !damaged) {
+        const uint8_t* record = (const uint8_t*)text + at;
+        if (record[0] == undolog_checkpoint) {
+            Undo_Log_Checkpoint checkpoint;
+            if (at + UNDO_CHECKPOINT_SIZE > size || !parse_undo_checkpoint(record, &checkpoint) ||
+                checkpoint.node >= tail.next_id) {
+                damaged = true;
+                break;
+            }
+            if (tree->nodes[root].log_id == 0 && checkpoint.hash == tree->base_hash) {
+                root_id = checkpoint.node;
             }
+            at += UNDO_CHECKPOINT_SIZE;
+            continue;
         }
-
-        // TODO(chr): Make these hookable so users can make their own
-        // interactive stuff
-        if (match(bar.string, make_lit_string("e "))) {
-            exec_command(app, interactive_open);
-            return;
+        // node: type, id, parent id, time, edit count, then each edit as
+        // pos, old size, new size, old text, new text
+        if (record[0] != undolog_node || at + 21 > size) {
+            damaged = true;
+            break;
         }
-
-        if (match(bar.string, make_lit_string("b "))) {
-            exec_command(app, interactive_switch_buffer);
-            return;
+        uint32_t id, parent_id, edit_count;
+        int64_t node_time;
+        memcpy(&id, record + 1, 4);
+        memcpy(&parent_id, record + 5, 4);
+        memcpy(&node_time, record + 9, 8);
+        memcpy(&edit_count, record + 17, 4);
+        at += 21;
+        if (id == 0 || id >= tail.next_id || parent_id >= tail.next_id) {
+            damaged = true;
+            break;
         }
-
-        if (match(bar.string, make_lit_string("bw "))) {
-            exec_command(app, interactive_kill_buffer);
-            return;
+        int parent = node_for_id[parent_id];
+        int node = -1;
+        if (node_for_id[id] < 0) {
+            node = push_undo_node(tree, parent, node_time);
+            tree->nodes[node].log_id = id;
+            tree->nodes[node].seq = (int)id;
+            node_for_id[id] = node;
+        }
+        for (uint32_t i = 0; i < edit_count; ++i) {
+            int32_t pos;
+            uint32_t old_size, new_size;
+            if (at + 12 > size) {
+                damaged = true;
+                break;
+            }
+            memcpy(&pos, text + at, 4);
+            memcpy(&old_size, text + at + 4, 4);
+            memcpy(&new_size, text + at + 8, 4);
+            at += 12;
+            if (old_size > size - at || new_size > size - at - old_size ||
+                pos < 0 || pos + (int64_t)old_size > max_buffer_size ||
+                pos + (int64_t)new_size > max_buffer_size) {
+                damaged = true;
+                break;
+            }
+            if (node >= 0) {
+                push_undo_edit(tree, pos, text + at, old_size,
+                               text + at + old_size, new_size);
+                ++tree->nodes[node].edit_count;
+            }
+            at += old_size + new_size;
         }
     }
-    if (in.abort) return;
 
-    int command_offset = 0;
-    while (command_offset < bar.string.size && 
-           char_is_whitespace(bar.string.str[command_offset])) {
-        ++command_offset;
+    int match = ((int)root_id > 0 && root_id < tail.next_id ? node_for_id[root_id] : -1);
+    if (damaged || match < first_loaded) {
+        // Either the file changed since the log was written, or the log is
+        // corrupt; leave it alone
+        if (damaged) { fprintf(stderr, "Undo file %s is damaged, not loading it\n", path.str); }
+        tree->node_count = first_loaded;
+        tree->edit_count = first_loaded_edit;
+        tree->strings_size = first_loaded_string;
+        tree->next_seq = first_loaded_seq;
+        return false;
     }
 
-    int command_end = command_offset;
-    while (command_end < bar.string.size &&
-           !char_is_whitespace(bar.string.str[command_end])) {
-        ++command_end;
+    // The matching logged state is the root, so the root takes its place.
+    // States from this session go after the logged ones in g-/g+ order.
+    int id_count = 0;
+    for (int i = first_loaded; i < tree->node_count; ++i) {
+        if (tree->nodes[i].seq > id_count) { id_count = tree->nodes[i].seq; }
     }
-    
-    if (command_end == command_offset) { return; }
-    String command = substr(bar.string, command_offset, command_end - command_offset);
-    bool command_force = false;
-    if (command.str[command.size - 1] == '!') {
-        command.size -= 1;
-        command_force = true;
+    for (int i = 0; i < first_loaded; ++i) { tree->nodes[i].seq += id_count; }
+    tree->next_seq += id_count;
+
+    Undo_Node* root_node = tree->nodes + root;
+    Undo_Node* logged = tree->nodes + match;
+    root_node->parent = logged->parent;
+    root_node->seq = logged->seq;
+    root_node->time = logged->time;
+    root_node->first_edit = logged->first_edit;
+    root_node->edit_count = logged->edit_count;
+    root_node->log_id = logged->log_id;
+    logged->dead = true;
+    for (int i = 0; i < tree->node_count; ++i) {
+        if (tree->nodes[i].parent == match) { tree->nodes[i].parent = root; }
     }
 
-    bool command_is_numeric = true;
-    for (int command_ch = 0; command_ch < command.size; ++command_ch) {
-        if (!('0' <= command.str[command_ch] && command.str[command_ch] <= '9')) {
-            command_is_numeric = false;
-        }
+    // States from before the file was last changed outside the editor hang
+    // off their own roots, and there's no way to reach them from here
+    int top = root;
+    while (tree->nodes[top].parent >= 0) { top = tree->nodes[top].parent; }
+    for (int i = first_loaded; i < tree->node_count; ++i) {
+        int node_top = i;
+        while (tree->nodes[node_top].parent >= 0) { node_top = tree->nodes[node_top].parent; }
+        if (node_top != top) { tree->nodes[i].dead = true; }
     }
+    return true;
+}
+
+static void write_undo_bytes(FILE* file, const void* data, size_t size) {
+    fwrite(data, 1, size, file);
+}
 
-    if (command_is_numeric) {
-        int line = str_to_int(command);
-        active_view_to_line(app, line);
+// Append the states made since the last write, and a checkpoint tying the
+// current one to the file's contents.
+static void write_undo_log(struct Application_Links* app, Buffer_Summary* buffer) {
+    Undo_Tree* tree = sync_undo_tree(app, buffer);
+    if (!tree) { return; }
+    char path_space[4096];
+    String path = make_fixed_width_string(path_space);
+    if (!get_undo_log_path(buffer, &path)) { return; }
+
+    Undo_Log_Checkpoint tail = {};
+    bool has_log = read_undo_log_tail(path.str, &tail);
+    FILE* file = fopen(path.str, has_log ? "ab" : "wb");
+    if (!file) {
+        fprintf(stderr, "Couldn't write undo file %s\n", path.str);
         return;
     }
-
-    int arg_start = command_end;
-    while (arg_start < bar.string.size && 
-           char_is_whitespace(bar.string.str[arg_start])) {
-        ++arg_start;
+    defer(fclose(file));
+    uint32_t next_id = (has_log ? tail.next_id : 1);
+    if (!has_log) {
+        write_undo_bytes(file, UNDO_LOG_MAGIC, sizeof(UNDO_LOG_MAGIC));
+        write_undo_bytes(file, &UNDO_LOG_VERSION, 4);
     }
-    String argstr = substr(bar.string, arg_start, bar.string.size - arg_start);
 
-    for (int command_index = 0; command_index < defined_command_count; ++command_index) {
-        Vim_Command_Defn defn = defined_commands[command_index];
-        if (match_part(defn.command, command)) {
-            defn.func(app, command, argstr, command_force);
-            break;
+    // Nodes are made parents first, so one pass in order writes each
+    // parent before its children.
+    for (int i = 0; i < tree->node_count; ++i) {
+        Undo_Node* node = tree->nodes + i;
+        if (node->dead || node->log_id != 0) { continue; }
+        if (node->parent < 0 && has_log && tail.hash == tree->base_hash && !tree->log_loaded) {
+            // The state the file was opened in is the one the log ended on
+            node->log_id = tail.node;
+            continue;
+        }
+        node->log_id = next_id++;
+        uint32_t parent_id = (node->parent >= 0 ? tree->nodes[node->parent].log_id : 0);
+        uint32_t edit_count = node->edit_count;
+        uint8_t type = undolog_node;
+        write_undo_bytes(file, &type, 1);
+        write_undo_bytes(file, &node->log_id, 4);
+        write_undo_bytes(file, &parent_id, 4);
+        write_undo_bytes(file, &node->time, 8);
+        write_undo_bytes(file, &edit_count, 4);
+        for (int e = 0; e < node->edit_count; ++e) {
+            Undo_Edit* edit = tree->edits + node->first_edit + e;
+            int32_t pos = edit->pos;
+            uint32_t old_size = edit->old_size;
+            uint32_t new_size = edit->new_size;
+            write_undo_bytes(file, &pos, 4);
+            write_undo_bytes(file, &old_size, 4);
+            write_undo_bytes(file, &new_size, 4);
+            write_undo_bytes(file, tree->strings + edit->old_text, old_size);
+            write_undo_bytes(file, tree->strings + edit->new_text, new_size);
         }
     }
+
+    uint8_t checkpoint[UNDO_CHECKPOINT_SIZE];
+    uint64_t hash = hash_buffer_text(app, buffer);
+    checkpoint[0] = undolog_checkpoint;
+    memcpy(checkpoint + 1, &tree->nodes[tree->current].log_id, 4);
+    memcpy(checkpoint + 5, &next_id, 4);
+    memcpy(checkpoint + 9, &hash, 8);
+    checkpoint[UNDO_CHECKPOINT_SIZE - 1] = undolog_checkpoint;
+    write_undo_bytes(file, checkpoint, sizeof(checkpoint));
 }
 
-void define_command(String command, Vim_Command_Func func) {
-    Vim_Command_Defn* defn = defined_commands + defined_command_count++;
-    defn->command = command;
-    defn->func = func;
+// Node with the closest seq before (direction -1) or after (+1) seq.
+static int find_undo_node_by_seq(Undo_Tree* tree, int seq, int direction) {
+    int best = -1;
+    for (int i = 0; i < tree->node_count; ++i) {
+        Undo_Node* node = tree->nodes + i;
+        if (node->dead || (node->seq - seq) * direction <= 0) { continue; }
+        if (best < 0 || (node->seq - tree->nodes[best].seq) * direction < 0) { best = i; }
+    }
+    return best;
 }
 
-VIM_COMMAND_FUNC_SIG(write_file) {
-    View_Summary view = get_active_view(app, AccessProtected);
-    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessProtected);
-    if (argstr.str == NULL || argstr.size == 0) {
-        save_buffer(app, &buffer, buffer.file_name, buffer.file_name_len, 0);
+// Go count states back (-1) or forward (+1) in time, or by seconds when
+// seconds isn't 0.
+static void undo_tree_travel(struct Application_Links* app, int direction,
+                             int count, int64_t seconds) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    Undo_Tree* tree = sync_undo_tree(app, &buffer);
+    if (!tree) { return; }
+
+    int target = tree->current;
+    if (seconds != 0) {
+        int64_t goal = tree->nodes[target].time + direction * seconds;
+        for (;;) {
+            int next = find_undo_node_by_seq(tree, tree->nodes[target].seq, direction);
+            if (next < 0 && direction < 0 && load_undo_log(app, tree, &buffer)) { continue; }
+            if (next < 0) { break; }
+            if (direction < 0 ? tree->nodes[next].time < goal
+                              : tree->nodes[target].time >= goal) {
+                break;
+            }
+            target = next;
+        }
     } else {
-        save_buffer(app, &buffer, expand_str(argstr), 0);
+        for (int i = 0; i < count; ++i) {
+            int next = find_undo_node_by_seq(tree, tree->nodes[target].seq, direction);
+            if (next < 0 && direction < 0 && load_undo_log(app, tree, &buffer)) {
+                next = find_undo_node_by_seq(tree, tree->nodes[target].seq, direction);
+            }
+            if (next < 0) { break; }
+            target = next;
+        }
+    }
+    if (target == tree->current) {
+        fprintf(stderr, direction < 0 ? "Already at oldest change\n"
+                                      : "Already at newest change\n");
+        return;
     }
+    move_to_undo_node(app, tree, &buffer, target);
 }
 
-VIM_COMMAND_FUNC_SIG(edit_file) {
-    exec_command(app, interactive_open);
+CUSTOM_COMMAND_SIG(vim_undo) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    Undo_Tree* tree = sync_undo_tree(app, &buffer);
+    if (!tree) { return; }
+    int parent = tree->nodes[tree->current].parent;
+    if (parent < 0 && load_undo_log(app, tree, &buffer)) {
+        parent = tree->nodes[tree->current].parent;
+    }
+    if (parent < 0) {
+        fprintf(stderr, "Already at oldest change\n");
+        return;
+    }
+    move_to_undo_node(app, tree, &buffer, parent);
 }
 
-VIM_COMMAND_FUNC_SIG(new_file) {
-    View_Summary view = get_active_view(app, AccessAll);
-    View_Summary new_view = open_view(app, &view, ViewSplit_Top);
-    new_view_settings(app, &new_view);
-    set_active_view(app, &new_view);
-    if (compare(argstr, make_lit_string("")) == 0) {
-        exec_command(app, interactive_new);
+// Redo follows 4coder's records while there are any, then the newest branch.
+CUSTOM_COMMAND_SIG(vim_redo) {
+    View_Summary view = get_active_view(app, AccessOpen);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessOpen);
+    Undo_Tree* tree = sync_undo_tree(app, &buffer);
+    if (!tree) { return; }
+    int child = -1;
+    if (tree->known_current + 1 < tree->linear_count) {
+        child = tree->linear[tree->known_current + 1];
     } else {
-        Buffer_Summary buffer = create_buffer(app, argstr.str, argstr.size, 0);
-        if (buffer.exists){
-            view_set_buffer(app, &new_view, buffer.buffer_id, SetBuffer_KeepOriginalGUI);
+        for (int i = 0; i < tree->node_count; ++i) {
+            Undo_Node* node = tree->nodes + i;
+            if (!node->dead && node->parent == tree->current &&
+                (child < 0 || node->seq > tree->nodes[child].seq)) {
+                child = i;
+            }
         }
     }
+    if (child < 0) {
+        fprintf(stderr, "Already at newest change\n");
+        return;
+    }
+    move_to_undo_node(app, tree, &buffer, child);
 }
 
-VIM_COMMAND_FUNC_SIG(new_file_open_vertical) {
-    View_Summary view = get_active_view(app, AccessAll);
-    View_Summary new_view = open_view(app, &view, ViewSplit_Right);
-    new_view_settings(app, &new_view);
-    set_active_view(app, &new_view);
-    exec_command(app, interactive_new);
+template <Search_Direction direction>
+CUSTOM_COMMAND_SIG(vim_undo_travel) {
+    end_chord_bar(app);
+    enter_normal_mode(app, get_current_view_buffer_id(app, AccessAll));
+    undo_tree_travel(app, direction, 1, 0);
 }
 
-VIM_COMMAND_FUNC_SIG(colorscheme) {
-    if (argstr.str && argstr.size > 0) {
-        change_theme(app, expand_str(argstr));
-    }
-    // else set bar text (...) to current colorscheme
-    else {
-        exec_command(app, open_color_tweaker);
+#define vim_undo_earlier vim_undo_travel<search_backward>
+#define vim_undo_later vim_undo_travel<search_forward>
+
+// :earlier and :later take a count of states, or a time like 10s, 5m, 2h
+// or 1d.
+static void undo_travel_command(struct Application_Links* app,
+                                const String argstr, int direction) {
+    String arg = skip_chop_whitespace(argstr);
+    int count = 1;
+    int64_t seconds = 0;
+    if (arg.size > 0) {
+        int digits = 0;
+        while (digits < arg.size && char_is_numeric(arg.str[digits])) { ++digits; }
+        if (digits == 0) {
+            fprintf(stderr, "Invalid argument: %.*s\n", arg.size, arg.str);
+            return;
+        }
+        count = str_to_int(substr(arg, 0, digits));
+        if (digits < arg.size) {
+            switch (arg.str[digits]) {
+                case 's': seconds = count; break;
+                case 'm': seconds = count * 60; break;
+                case 'h': seconds = count * 60 * 60; break;
+                case 'd': seconds = (int64_t)count * 24 * 60 * 60; break;
+                default: {
+                    fprintf(stderr, "Invalid argument: %.*s\n", arg.size, arg.str);
+                    return;
+                }
+            }
+        }
     }
+    undo_tree_travel(app, direction, count, seconds);
 }
 
-VIM_COMMAND_FUNC_SIG(close_view) {
-    View_Summary view = get_view_first(app, AccessAll);
-    get_view_next(app, &view, AccessAll);
-    if (!view.exists) send_exit_signal(app);
-    else close_panel(app);
+VIM_COMMAND_FUNC_SIG(earlier) {
+    undo_travel_command(app, argstr, -1);
 }
 
-VIM_COMMAND_FUNC_SIG(close_all) {
-    send_exit_signal(app);
+VIM_COMMAND_FUNC_SIG(later) {
+    undo_travel_command(app, argstr, 1);
 }
 
-VIM_COMMAND_FUNC_SIG(write_file_and_close_all) {
-    write_file(app, command, argstr, force);
-    close_all(app, command, argstr, force);
-}
+// Session file:                                                     @viminfo
+// Registers, global marks and the : and / histories outlive 4coder in
+// ~/.4vim_session (in the starting directory where there's no home). It's
+// rewritten whole, through a rename, on exit and every so often in the
+// background while something in it has changed. On startup it's mapped
+// rather than read, and big registers are left pointing into the mapping,
+// so startup doesn't pay for a big yank history until it's pasted.
+//
+// The file is a header, "4VIMSESS" and a version, then entries of:
+//   u8 kind, u8 slot, u8 flags, u8 unused, i32 pos, u32 name size,
+//   u32 text size, name, text
+enum Session_Entry_Kind {
+    sessionentry_register = 1,
+    sessionentry_mark = 2,
+    sessionentry_search_history = 3,
+    sessionentry_command_history = 4,
+};
 
-VIM_COMMAND_FUNC_SIG(write_file_and_close_view) {
-    write_file(app, command, argstr, force);
-    close_view(app, command, argstr, force);
+constexpr char SESSION_FILE_MAGIC[8] = { '4', 'V', 'I', 'M', 'S', 'E', 'S', 'S' };
+constexpr uint32_t SESSION_FILE_VERSION = 1;
+constexpr int SESSION_ENTRY_HEADER_SIZE = 16;
+// Registers bigger than this stay in the mapping until they're used
+constexpr int SESSION_MAPPED_REGISTER_SIZE = 4096;
+// Seconds between background writes
+constexpr int SESSION_SAVE_INTERVAL = 60;
+
+struct Session_File {
+    char path[4096];
+    // Kept mapped while registers point into it
+    const char* text;
+    size_t size;
+    uint32_t saved_changes;
+    time_t saved_time;
+#if defined(VIM_HAS_THREADS)
+    bool writing;
+#endif
+};
+
+static Session_File session_file = {};
+
+struct Session_Writer {
+    char* data;
+    size_t size;
+    size_t capacity;
+};
+
+static void session_write(Session_Writer* out, const void* data, size_t size) {
+    if (out->size + size > out->capacity) {
+        out->capacity = (out->size + size) * 2 + 4096;
+        out->data = (char*)realloc(out->data, out->capacity);
+    }
+    if (size > 0) { memcpy(out->data + out->size, data, size); }
+    out->size += size;
 }
 
-VIM_COMMAND_FUNC_SIG(vertical_split) {
-    View_Summary view = get_active_view(app, AccessAll);
-    View_Summary new_view = open_view(app, &view, ViewSplit_Right);
-    view_set_buffer(app, &new_view, view.buffer_id, 0);
-    set_active_view(app, &view);
+static void session_write_entry(Session_Writer* out, Session_Entry_Kind kind,
+                                int slot, int flags, int32_t pos, String name,
+                                String text) {
+    uint8_t header[SESSION_ENTRY_HEADER_SIZE] = {};
+    uint32_t name_size = name.size;
+    uint32_t text_size = text.size;
+    header[0] = (uint8_t)kind;
+    header[1] = (uint8_t)slot;
+    header[2] = (uint8_t)flags;
+    memcpy(header + 4, &pos, 4);
+    memcpy(header + 8, &name_size, 4);
+    memcpy(header + 12, &text_size, 4);
+    session_write(out, header, sizeof(header));
+    session_write(out, name.str, name.size);
+    session_write(out, text.str, text.size);
 }
 
-VIM_COMMAND_FUNC_SIG(horizontal_split) {
-    View_Summary view = get_active_view(app, AccessAll);
-    View_Summary new_view = open_view(app, &view, ViewSplit_Right);
-    view_set_buffer(app, &new_view, view.buffer_id, 0);
-    set_active_view(app, &view);
+static bool get_session_file_path(struct Application_Links* app, String* out) {
+    out->size = 0;
+#if defined(IS_LINUX)
+    int32_t home_len = get_user_home_dir(0, 0);
+    if (home_len > 0 && home_len < out->memory_size) {
+        out->size = get_user_home_dir(out->str, out->memory_size);
+        append(out, "/");
+    }
+#endif
+    if (out->size == 0) {
+        out->size = directory_get_hot(app, out->str, out->memory_size);
+    }
+    append(out, ".4vim_session");
+    return terminate_with_null(out);
 }
 
-VIM_COMMAND_FUNC_SIG(exec_regex) {
-    fprintf(stderr, "%.*s", (int)argstr.size, argstr.str);
+static void serialize_session(Session_Writer* out) {
+    session_write(out, SESSION_FILE_MAGIC, sizeof(SESSION_FILE_MAGIC));
+    session_write(out, &SESSION_FILE_VERSION, 4);
+    for (int i = 0; i < ArrayCount(state.registers); ++i) {
+        Vim_Register* reg = state.registers + i;
+        if (i == reg_system_clipboard || reg->text.size == 0) { continue; }
+        session_write_entry(out, sessionentry_register, i, reg->is_line, 0,
+                            make_lit_string(""), reg->text);
+    }
+    for (int i = 0; i < ArrayCount(state.marks); ++i) {
+        Vim_Mark* mark = state.marks + i;
+        if (!mark->file_name.str) { continue; }
+        session_write_entry(out, sessionentry_mark, i, 0, mark->pos,
+                            mark->file_name, make_lit_string(""));
+    }
+    for (int i = 0; i < state.search_history.count; ++i) {
+        session_write_entry(out, sessionentry_search_history, 0, 0, 0,
+                            make_lit_string(""), state.search_history.entries[i]);
+    }
+    for (int i = 0; i < state.command_history.count; ++i) {
+        session_write_entry(out, sessionentry_command_history, 0, 0, 0,
+                            make_lit_string(""), state.command_history.entries[i]);
+    }
 }
 
-VIM_COMMAND_FUNC_SIG(change_directory) {
-    char dir[4096];
-    String dirstr = make_fixed_width_string(dir);
-    dirstr.size = directory_get_hot(app, dirstr.str, dirstr.memory_size);
-    assert(dirstr.size < 4096);
-    if (!directory_cd_expand_user(app, dirstr.str, &dirstr.size, dirstr.memory_size,
-                                  argstr.str, argstr.size)) {
-        fprintf(stderr, "Couldn't change directory to %.*s\n", argstr.size, argstr.str);
+// Called from the init hook.
+static void load_session_file(struct Application_Links* app) {
+    String path = make_fixed_width_string(session_file.path);
+    if (!get_session_file_path(app, &path)) {
+        session_file.path[0] = 0;
         return;
     }
-    fprintf(stderr, "%.*s\n", (int)dirstr.size, dirstr.str);
-    directory_set_hot(app, dirstr.str, dirstr.size);
+    session_file.saved_time = time(0);
+
+    size_t size = 0;
+    const char* text = map_entire_file(session_file.path, &size);
+    if (!text) { return; }
+    uint32_t version = 0;
+    if (size >= sizeof(SESSION_FILE_MAGIC) + 4) {
+        memcpy(&version, text + sizeof(SESSION_FILE_MAGIC), 4);
+    }
+    if (version != SESSION_FILE_VERSION ||
+        memcmp(text, SESSION_FILE_MAGIC, sizeof(SESSION_FILE_MAGIC)) != 0) {
+        fprintf(stderr, "Ignoring session file %s from another version\n",
+                session_file.path);
+        unmap_entire_file(text, size);
+        return;
+    }
+
+    bool keep_mapping = false;
+    size_t at = sizeof(SESSION_FILE_MAGIC) + 4;
+    while (at + SESSION_ENTRY_HEADER_SIZE <= size) {
+        const uint8_t* header = (const uint8_t*)text + at;
+        int32_t pos;
+        uint32_t name_size, text_size;
+        memcpy(&pos, header + 4, 4);
+        memcpy(&name_size, header + 8, 4);
+        memcpy(&text_size, header + 12, 4);
+        at += SESSION_ENTRY_HEADER_SIZE;
+        if (name_size > size - at || text_size > size - at - name_size) { break; }
+        String name = make_string((char*)text + at, name_size);
+        String body = make_string((char*)text + at + name_size, text_size);
+        at += name_size + text_size;
+
+        int slot = header[1];
+        switch (header[0]) {
+            case sessionentry_register: {
+                if (slot >= ArrayCount(state.registers) || slot == reg_system_clipboard) {
+                    break;
+                }
+                Vim_Register* reg = state.registers + slot;
+                reg->is_line = (header[2] & 1);
+                if (body.size > SESSION_MAPPED_REGISTER_SIZE) {
+                    free_register_text(reg);
+                    reg->text = body;
+                    reg->is_mapped = true;
+                    keep_mapping = true;
+                } else {
+                    set_register_text(app, reg, body.str, body.size);
+                }
+            } break;
+
+            case sessionentry_mark: {
+                if (slot >= ArrayCount(state.marks)) { break; }
+                Vim_Mark* mark = state.marks + slot;
+                free(mark->file_name.str);
+                mark->file_name = make_string((char*)malloc(name.size), name.size);
+                memcpy(mark->file_name.str, name.str, name.size);
+                mark->buffer_id = 0;
+                mark->pos = pos;
+            } break;
+
+            case sessionentry_search_history: {
+                push_history(&state.search_history, body);
+            } break;
+
+            case sessionentry_command_history: {
+                push_history(&state.command_history, body);
+            } break;
+        }
+    }
+
+    if (keep_mapping) {
+        session_file.text = text;
+        session_file.size = size;
+    } else {
+        unmap_entire_file(text, size);
+    }
+    session_file.saved_changes = state.session_changes;
+}
+
+#if defined(VIM_HAS_THREADS)
+static void* session_write_thread_proc(void* param) {
+    Session_Writer* out = (Session_Writer*)param;
+    if (!write_entire_file_atomic(session_file.path, out->data, out->size)) {
+        fprintf(stderr, "Couldn't write session file %s\n", session_file.path);
+    }
+    free(out->data);
+    free(out);
+    __atomic_store_n(&session_file.writing, false, __ATOMIC_RELEASE);
+    return 0;
+}
+#endif
+
+// The registers etc. are copied out on this thread; only the file writing
+// happens in the background.
+static void write_session_file(bool in_background) {
+    if (!session_file.path[0]) { return; }
+#if defined(VIM_HAS_THREADS)
+    if (__atomic_load_n(&session_file.writing, __ATOMIC_ACQUIRE)) {
+        // Don't let an older snapshot land after this one
+        if (in_background) { return; }
+        while (__atomic_load_n(&session_file.writing, __ATOMIC_ACQUIRE)) {
+            usleep(1000);
+        }
+    }
+#endif
+    Session_Writer* out = (Session_Writer*)calloc(1, sizeof(Session_Writer));
+    serialize_session(out);
+    session_file.saved_changes = state.session_changes;
+    session_file.saved_time = time(0);
+#if defined(VIM_HAS_THREADS)
+    if (in_background) {
+        __atomic_store_n(&session_file.writing, true, __ATOMIC_RELEASE);
+        pthread_t thread;
+        if (pthread_create(&thread, 0, session_write_thread_proc, out) == 0) {
+            pthread_detach(thread);
+            return;
+        }
+        __atomic_store_n(&session_file.writing, false, __ATOMIC_RELEASE);
+    }
+#endif
+    if (!write_entire_file_atomic(session_file.path, out->data, out->size)) {
+        fprintf(stderr, "Couldn't write session file %s\n", session_file.path);
+    }
+    free(out->data);
+    free(out);
+}
+
+// Called every frame; writes at most once per SESSION_SAVE_INTERVAL.
+static void update_session_file() {
+    if (state.session_changes == session_file.saved_changes) { return; }
+    if (time(0) - session_file.saved_time < SESSION_SAVE_INTERVAL) { return; }
+    write_session_file(true);
 }
 
 //=============================================================================
@@ -1711,43 +10628,98 @@ VIM_COMMAND_FUNC_SIG(change_directory) {
 // CALL ME
 // This function should be called from your 4coder custom init hook
 START_HOOK_SIG(vim_hook_init_func) {
-	// First file replaces scratch buffer
-	if (file_count > 0) {
-        View_Summary view = get_active_view(app, AccessAll);
-        Buffer_Summary buffer = create_buffer(app, files[0], strlen(files[0]), 0);
-        if (buffer.exists){
-            view_set_buffer(app, &view, buffer.buffer_id, 0);
-        }
-	}
-	// Rest of files open in splits
-	// TODO(chr): Emulate vim behavior here? IIRC vim will queue them up and
-	// edit them one by one.
-	for (int file_index = 1; file_index < file_count; ++file_index) {
-		new_file(app, lit("new"), make_string(files[file_index],
-				 strlen(files[file_index])), true);
-	}
+    load_session_file(app);
+    // Like vim, the files go in the argument list and only the first is
+    // opened now, in place of the scratch buffer.
+    set_arg_list(app, files, file_count);
+    if (file_count > 0) {
+        edit_arg(app, 0);
+    }
     return 0;
 }
 
+// CALL ME
+// This function should be called from your 4coder exit hook. It leaves '0
+// where the cursor is and writes the session file; the exit always goes
+// ahead.
+HOOK_SIG(vim_hook_exit_func) {
+    View_Summary view = get_active_view(app, AccessAll);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+    if (buffer.exists && buffer.file_name_len > 0) {
+        // '0 becomes '1 and so on, and '9 drops off the end
+        Vim_Mark* digits = state.marks + MARK_0;
+        free(digits[9].file_name.str);
+        memmove(digits + 1, digits, 9 * sizeof(Vim_Mark));
+        digits[0] = {};
+        set_global_mark(digits, &buffer, view.cursor.pos);
+    }
+    drain_write_jobs(app, true);
+    write_session_file(false);
+    return 1;
+}
+
 // CALL ME
 // This function should be called from your 4coder custom open file hook
 OPEN_FILE_HOOK_SIG(vim_hook_open_file_func) {
+    reset_buffer_options(buffer_id);
+    reset_local_marks(buffer_id);
     enter_normal_mode(app, buffer_id);
-    default_file_settings(app, buffer_id);
+    init_large_file_mode(app, buffer_id);
+    attach_global_marks(app, buffer_id);
     return 0;
 }
 
 // CALL ME
 // This function should be called from your 4coder custom new file hook
 OPEN_FILE_HOOK_SIG(vim_hook_new_file_func) {
+    reset_buffer_options(buffer_id);
+    reset_local_marks(buffer_id);
+    attach_global_marks(app, buffer_id);
     enter_normal_mode(app, buffer_id);
     return 0;
 }
 
+// CALL ME
+// This function should be called from your 4coder file edit range hook
+FILE_EDIT_RANGE_SIG(vim_hook_file_edit_range_func) {
+    bump_buffer_edit_version(app, buffer_id);
+    apply_edit_to_structure_caches(buffer_id, range, text.size);
+    apply_edit_to_word_index(buffer_id, range, text.size);
+    apply_edit_to_marks(buffer_id, range, text.size);
+    apply_edit_to_diff(buffer_id, range, text.size);
+    record_insert_session_edit(buffer_id, range, text);
+    if (buffer_id == make_state.buffer_id) {
+        parse_make_output(app, text);
+    }
+    return 0;
+}
+
+// CALL ME
+// Set this as your 4coder command caller, or do the same before running
+// commands in yours. Commands other than typing must see the typeahead in
+// the buffer before they run.
+COMMAND_CALLER_HOOK(vim_hook_command_caller) {
+    if (cmd.command != vim_write_character &&
+        cmd.command != vim_overwrite_character) {
+        flush_typeahead(app);
+    }
+    // Sync before too, so a buffer's tree starts from its state before the
+    // first command that edits it
+    View_Summary view = get_active_view(app, AccessAll);
+    Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
+    sync_undo_tree(app, &buffer);
+    exec_command(app, cmd);
+    buffer = get_buffer(app, buffer.buffer_id, AccessAll);
+    sync_undo_tree(app, &buffer);
+    return 0;
+}
+
 // CALL ME
 // This function should be called from your 4coder render caller to draw the
 // vim-related things on screen.
 RENDER_CALLER_SIG(vim_render_caller) {
+    // Put in whatever was typed this frame before anything looks at the buffer
+    flush_typeahead(app);
     // TODO(chr): Mostly copied from the default render caller. Customize for vim stuff.
     View_Summary view = get_view(app, view_id, AccessAll);
     Buffer_Summary buffer = get_buffer(app, view.buffer_id, AccessAll);
@@ -1760,9 +10732,18 @@ RENDER_CALLER_SIG(vim_render_caller) {
     }
     
     Partition *scratch = &global_part;
+
+    if (is_active_view) {
+        continue_search_count(app, &view);
+        drain_grep_results(app);
+        drain_write_jobs(app, false);
+        update_session_file();
+    }
     
+    bool is_large_file = buffer_is_large_file(buffer.buffer_id);
+
     // NOTE(allen): Scan for TODOs and NOTEs
-    {
+    if (!is_large_file) {
         Theme_Color colors[2];
         colors[0].tag = Stag_Text_Cycle_2;
         colors[1].tag = Stag_Text_Cycle_1;
@@ -1831,9 +10812,159 @@ RENDER_CALLER_SIG(vim_render_caller) {
         
         end_temp_memory(temp);
     }
-    
+
+    // NOTE(chr): hlsearch, every on-screen match of the last search
+    if (global_options.hlsearch && state.last_search.text.size > 0) {
+        String word = state.last_search.text;
+        Temp_Memory temp = begin_temp_memory(scratch);
+        // One extra byte on each side for the whole word checks
+        int32_t read_start = (on_screen_range.first > 0 ? on_screen_range.first - 1 : 0);
+        int32_t read_end = on_screen_range.one_past_last + word.size;
+        if (read_end > buffer.size) { read_end = buffer.size; }
+        char *text = push_array(scratch, char, read_end - read_start);
+        buffer_read_range(app, &buffer, read_start, read_end, text);
+        const char* at = text - read_start;
+
+        Marker *markers = push_array(scratch, Marker, 0);
+        int32_t last_start = buffer.size - word.size;
+        if (last_start > on_screen_range.one_past_last) {
+            last_start = on_screen_range.one_past_last;
+        }
+        for (int32_t i = on_screen_range.first; i <= last_start; ++i) {
+            if (is_search_match(at, i, read_end, word, state.last_search.whole_word,
+                                state.last_search.ignore_case)) {
+                Marker *pair = push_array(scratch, Marker, 2);
+                pair[0] = {};
+                pair[1] = {};
+                pair[0].pos = i;
+                pair[1].pos = i + word.size;
+                i += word.size - 1;
+            }
+        }
+        int32_t marker_count = (int32_t)(push_array(scratch, Marker, 0) - markers);
+        if (marker_count > 0) {
+            Managed_Object matches = alloc_buffer_markers_on_buffer(app, buffer.buffer_id, marker_count, &render_scope);
+            managed_object_store_data(app, matches, 0, marker_count, markers);
+
+            Theme_Color color = {};
+            color.tag = Stag_Highlight;
+            get_theme_colors(app, &color, 1);
+
+            Marker_Visual visual = create_marker_visual(app, matches);
+            marker_visual_set_effect(app, visual, VisualType_CharacterHighlightRanges,
+                                     color.color, 0, 0);
+            marker_visual_set_priority(app, visual, VisualPriority_Lowest);
+        }
+        end_temp_memory(temp);
+    }
+
+    // NOTE(chr): Diff highlight. Changed lines, lines only this side has,
+    // and the places where the other side has lines nothing here matches.
+    int diff_side = get_diff_side(buffer.buffer_id);
+    if (diff_side >= 0 && update_diff(app)) {
+        Diff_Side* side = diff_state.sides + diff_side;
+        Diff_Hunk_List* hunks = &diff_state.hunks;
+        int first_line = get_diff_line(side, on_screen_range.first);
+        int last_line = get_diff_line(side, on_screen_range.one_past_last);
+        int first_hunk = find_first_diff_hunk(diff_side, first_line);
+        int hunk_count = 0;
+        while (first_hunk + hunk_count < hunks->count &&
+               get_hunk_start(hunks->hunks + first_hunk + hunk_count, diff_side) <= last_line) {
+            ++hunk_count;
+        }
+
+        Temp_Memory temp = begin_temp_memory(scratch);
+        // Changed, added, deleted
+        Marker *markers[3];
+        int32_t marker_counts[3] = {};
+        for (int i = 0; i < 3; ++i) {
+            markers[i] = push_array(scratch, Marker, 2*hunk_count);
+        }
+        for (int i = 0; i < hunk_count; ++i) {
+            Diff_Hunk* hunk = hunks->hunks + first_hunk + i;
+            int start = get_hunk_start(hunk, diff_side);
+            int count = get_hunk_count(hunk, diff_side);
+            int kind = (count == 0 ? 2 : (get_hunk_count(hunk, 1 - diff_side) > 0 ? 0 : 1));
+            int32_t first_pos = side->line_starts[start];
+            int32_t last_pos = side->line_starts[start + count] - 1;
+            if (kind == 2) {
+                if (buffer.size == 0) { continue; }
+                if (first_pos >= buffer.size) { first_pos = buffer.size - 1; }
+                last_pos = first_pos + 1;
+            }
+            Marker *pair = markers[kind] + marker_counts[kind];
+            pair[0] = {};
+            pair[1] = {};
+            pair[0].pos = first_pos;
+            pair[1].pos = (last_pos > first_pos ? last_pos : first_pos);
+            marker_counts[kind] += 2;
+        }
+
+        Theme_Color colors[3];
+        colors[0].tag = Stag_Highlight_White;
+        colors[1].tag = Stag_Back_Cycle_2;
+        colors[2].tag = Stag_Highlight_Junk;
+        get_theme_colors(app, colors, 3);
+        for (int i = 0; i < 3; ++i) {
+            if (marker_counts[i] == 0) { continue; }
+            Managed_Object o = alloc_buffer_markers_on_buffer(app, buffer.buffer_id, marker_counts[i], &render_scope);
+            managed_object_store_data(app, o, 0, marker_counts[i], markers[i]);
+            Marker_Visual visual = create_marker_visual(app, o);
+            marker_visual_set_effect(app, visual,
+                                     (i == 2 ? VisualType_CharacterHighlightRanges :
+                                      VisualType_LineHighlightRanges),
+                                     colors[i].color, 0, 0);
+            marker_visual_set_priority(app, visual, VisualPriority_Lowest);
+        }
+        end_temp_memory(temp);
+    }
+
+    // NOTE(chr): Visual block highlight, one marker pair per on-screen line
+    // of the block, all drawn through a single take rule.
+    if (state.mode == mode_visual_block) {
+        if (is_active_view) {
+            Visual_Block block = get_visual_block(app, &buffer);
+            int first_line = buffer_get_line_number(app, &buffer, on_screen_range.first);
+            int last_line = buffer_get_line_number(app, &buffer, on_screen_range.one_past_last);
+            if (first_line < block.lines.start) { first_line = block.lines.start; }
+            if (last_line > block.lines.end) { last_line = block.lines.end; }
+            int32_t marker_count = 2*(last_line - first_line + 1);
+            if (marker_count > 0) {
+                Temp_Memory temp = begin_temp_memory(scratch);
+                Marker *markers = push_array(scratch, Marker, marker_count);
+                for (int line = first_line; line <= last_line; ++line) {
+                    Range segment = get_block_segment(
+                        block, buffer_get_line_start(app, &buffer, line),
+                        buffer_get_line_end(app, &buffer, line));
+                    Marker *pair = markers + 2*(line - first_line);
+                    pair[0] = {};
+                    pair[1] = {};
+                    pair[0].pos = segment.start;
+                    pair[1].pos = segment.end;
+                }
+                Managed_Object block_range = alloc_buffer_markers_on_buffer(app, buffer.buffer_id, marker_count, &render_scope);
+                managed_object_store_data(app, block_range, 0, marker_count, markers);
+
+                Theme_Color color = {};
+                color.tag = Stag_Highlight;
+                get_theme_colors(app, &color, 1);
+
+                Marker_Visual visual = create_marker_visual(app, block_range);
+                marker_visual_set_effect(app, visual, VisualType_CharacterHighlightRanges,
+                                         color.color, 0, 0);
+                Marker_Visual_Take_Rule take_rule = {};
+                take_rule.first_index = 0;
+                take_rule.take_count_per_step = 2;
+                take_rule.step_stride_in_marker_count = 2;
+                take_rule.maximum_number_of_markers = marker_count;
+                marker_visual_set_take_rule(app, visual, take_rule);
+                marker_visual_set_priority(app, visual, VisualPriority_Highest);
+                end_temp_memory(temp);
+            }
+        }
+    }
     // NOTE(chr): Visual range highlight
-    {
+    else {
         Managed_Object highlight_range = alloc_buffer_markers_on_buffer(app, buffer.buffer_id, 2, &render_scope);
         Marker cm_markers[2] = {};
         cm_markers[0].pos = state.selection_range.start;
@@ -1897,7 +11028,7 @@ RENDER_CALLER_SIG(vim_render_caller) {
     
     // NOTE(allen): Matching enclosure highlight setup
     static const int32_t color_count = 4;
-    if (do_matching_enclosure_highlight){
+    if (do_matching_enclosure_highlight && !is_large_file){
         Theme_Color theme_colors[color_count];
         int_color colors[color_count];
         for (int32_t i = 0; i < 4; i += 1){
@@ -1912,7 +11043,7 @@ RENDER_CALLER_SIG(vim_render_caller) {
                         VisualType_LineHighlightRanges,
                         colors, 0, color_count);
     }
-    if (do_matching_paren_highlight){
+    if (do_matching_paren_highlight && !is_large_file){
         Theme_Color theme_colors[color_count];
         int_color colors[color_count];
         for (int32_t i = 0; i < 4; i += 1){
@@ -1950,27 +11081,85 @@ void vim_get_bindings(Bind_Helper* context) {
 
     // SECTION: Vim commands
 
-    define_command(lit("s"), exec_regex);
-    define_command(lit("write"), write_file);
+    define_command(lit("s"), substitute);
+    define_command(lit("substitute"), substitute);
+    define_command(lit("d"), delete_lines);
+    define_command(lit("delete"), delete_lines);
+    define_command(lit("g"), global_command);
+    define_command(lit("global"), global_command);
+    define_command(lit("v"), inverse_global_command);
+    define_command(lit("vglobal"), inverse_global_command);
+    define_command(lit("sort"), sort_lines);
+    define_command(lit("vim"), vimgrep);
+    define_command(lit("vimgrep"), vimgrep);
+    define_command(lit("grep"), grep);
+    define_command(lit("cn"), quickfix_next);
+    define_command(lit("cnext"), quickfix_next);
+    define_command(lit("cp"), quickfix_previous);
+    define_command(lit("cprevious"), quickfix_previous);
+    define_command(lit("cN"), quickfix_previous);
+    define_command(lit("cNext"), quickfix_previous);
+    define_command(lit("cc"), quickfix_goto);
+    define_command(lit("copen"), quickfix_open);
+    define_command(lit("make"), make);
+    define_command(lit("tag"), tag);
+    define_command(lit("ta"), tag);
+    define_command(lit("tselect"), tag_select);
+    define_command(lit("ts"), tag_select);
+    define_command(lit("pop"), pop_tag);
+    define_command(lit("po"), pop_tag);
+    define_command(lit("write"), write_file, exarg_file);
+    define_command(lit("wall"), write_all);
+    define_command(lit("wa"), write_all);
     define_command(lit("quit"), close_view);
     define_command(lit("quitall"), close_all);
     define_command(lit("qa"), close_all);
-    define_command(lit("exit"), write_file_and_close_view);
-    define_command(lit("x"), write_file_and_close_view);
-    define_command(lit("wq"), write_file_and_close_view);
+    define_command(lit("exit"), write_file_and_close_view, exarg_file);
+    define_command(lit("x"), write_file_and_close_view, exarg_file);
+    define_command(lit("wq"), write_file_and_close_view, exarg_file);
     define_command(lit("exitall"), write_file_and_close_view);
     define_command(lit("xa"), write_file_and_close_all);
     define_command(lit("wqa"), write_file_and_close_all);
     define_command(lit("close"), close_view);
     define_command(lit("edit"), edit_file);
-    define_command(lit("new"), new_file);
+    define_command(lit("new"), new_file, exarg_file);
     define_command(lit("vnew"), new_file_open_vertical);
     define_command(lit("colorscheme"), colorscheme);
     define_command(lit("vs"), vertical_split);
     define_command(lit("vsplit"), vertical_split);
     define_command(lit("sp"), horizontal_split);
     define_command(lit("split"), horizontal_split);
-    define_command(lit("cd"), change_directory);
+    define_command(lit("cd"), change_directory, exarg_file);
+    define_command(lit("buffer"), switch_buffer, exarg_buffer);
+    define_command(lit("set"), set_options, exarg_option);
+    define_command(lit("se"), set_options, exarg_option);
+    define_command(lit("setlocal"), set_local_options, exarg_option);
+    define_command(lit("setl"), set_local_options, exarg_option);
+    define_command(lit("setglobal"), set_global_options, exarg_option);
+    define_command(lit("setg"), set_global_options, exarg_option);
+    define_command(lit("args"), argument_list, exarg_file);
+    define_command(lit("next"), next_arg);
+    define_command(lit("n"), next_arg);
+    define_command(lit("previous"), previous_arg);
+    define_command(lit("prev"), previous_arg);
+    define_command(lit("N"), previous_arg);
+    define_command(lit("Next"), previous_arg);
+    define_command(lit("first"), first_arg);
+    define_command(lit("rewind"), first_arg);
+    define_command(lit("last"), last_arg);
+    define_command(lit("argument"), goto_arg);
+    define_command(lit("argu"), goto_arg);
+    define_command(lit("diffthis"), diff_this);
+    define_command(lit("difft"), diff_this);
+    define_command(lit("diffsplit"), diff_split, exarg_file);
+    define_command(lit("diffs"), diff_split, exarg_file);
+    define_command(lit("diffoff"), diff_off);
+    define_command(lit("diffo"), diff_off);
+    define_command(lit("diffupdate"), diff_update);
+    define_command(lit("diffu"), diff_update);
+    // Last, so :e, :l and :la stay :edit and :last
+    define_command(lit("earlier"), earlier);
+    define_command(lit("later"), later);
 
     // SECTION: Vim keybindings
 
@@ -2001,12 +11190,16 @@ void vim_get_bindings(Bind_Helper* context) {
 
     bind(context, '$', MDFR_NONE, vim_move_end_of_line);
     bind(context, '0', MDFR_NONE, vim_move_beginning_of_line);
-    bind(context, '{', MDFR_NONE, vim_move_whitespace_up);
-    bind(context, '}', MDFR_NONE, vim_move_whitespace_down);
+    bind(context, '{', MDFR_NONE, vim_move_paragraph_up);
+    bind(context, '}', MDFR_NONE, vim_move_paragraph_down);
+    bind(context, '(', MDFR_NONE, vim_move_sentence_backward);
+    bind(context, ')', MDFR_NONE, vim_move_sentence_forward);
+    bind(context, '%', MDFR_NONE, vim_move_matching_bracket);
 
     bind(context, 'G', MDFR_NONE, vim_move_to_bottom);
 
     bind(context, '*', MDFR_NONE, search_under_cursor);
+    bind(context, '#', MDFR_NONE, search_under_cursor_reverse);
 
     bind(context, '/', MDFR_NONE, vim_search);
     bind(context, '?', MDFR_NONE, vim_search_reverse);
@@ -2028,6 +11221,7 @@ void vim_get_bindings(Bind_Helper* context) {
     inherit_map(context, mapid_movements);
 
     bind(context, 'J', MDFR_NONE, combine_with_next_line);
+    bind(context, '\n', MDFR_NONE, quickfix_jump_or_move_down);
 
     // TODO(chr): Hitting top/bottom of file if near them
     bind(context, 'u', MDFR_CTRL, page_up);
@@ -2038,8 +11232,8 @@ void vim_get_bindings(Bind_Helper* context) {
     bind(context, 'P', MDFR_NONE, paste_before_cursor_char);
     bind(context, 'p', MDFR_NONE, paste_after_cursor_char);
 
-    bind(context, 'u', MDFR_NONE, cmdid_undo);
-    bind(context, 'r', MDFR_CTRL, cmdid_redo);
+    bind(context, 'u', MDFR_NONE, vim_undo);
+    bind(context, 'r', MDFR_CTRL, vim_redo);
 
     bind(context, 'i', MDFR_NONE, insert_at);
     bind(context, 'a', MDFR_NONE, insert_after);
@@ -2050,10 +11244,16 @@ void vim_get_bindings(Bind_Helper* context) {
     bind(context, 'R', MDFR_NONE, enter_replace_mode);
     bind(context, 'v', MDFR_NONE, enter_visual_mode);
     bind(context, 'V', MDFR_NONE, enter_visual_line_mode);
+    bind(context, 'v', MDFR_CTRL, enter_visual_block_mode);
+
+    bind(context, 'm', MDFR_NONE, enter_chord_mark);
+    bind(context, '`', MDFR_NONE, enter_chord_mark_jump);
+    bind(context, '\'', MDFR_NONE, enter_chord_mark_jump_line);
 
-    // TODO(chr): Proper alphabetic marks
-    bind(context, 'm', MDFR_NONE, set_mark);
-    bind(context, '`', MDFR_NONE, cursor_mark_swap);
+    bind(context, ']', MDFR_NONE, enter_chord_bracket_forward);
+    bind(context, '[', MDFR_NONE, enter_chord_bracket_backward);
+    bind(context, ']', MDFR_CTRL, vim_jump_to_tag);
+    bind(context, 't', MDFR_CTRL, vim_pop_tag);
 
     bind(context, '"', MDFR_NONE, enter_chord_switch_registers);
 
@@ -2090,6 +11290,11 @@ void vim_get_bindings(Bind_Helper* context) {
     bind(context, '=', MDFR_NONE, visual_format);
     bind(context, '>', MDFR_NONE, visual_indent_right);
     bind(context, '<', MDFR_NONE, visual_indent_left);
+    bind(context, 'I', MDFR_NONE, visual_insert);
+    bind(context, 'A', MDFR_NONE, visual_append);
+    bind(context, 'g', MDFR_NONE, enter_chord_g);
+    bind(context, 'i', MDFR_NONE, enter_chord_text_object_inner);
+    bind(context, 'a', MDFR_NONE, enter_chord_text_object_around);
     end_map(context);
 
     // Insert mode
@@ -2098,10 +11303,11 @@ void vim_get_bindings(Bind_Helper* context) {
     begin_map(context, mapid_insert);
     inherit_map(context, mapid_nomap);
 
-    bind_vanilla_keys(context, write_character);
-    bind(context, ' ', MDFR_SHIFT, write_character);
+    bind_vanilla_keys(context, vim_write_character);
+    bind(context, ' ', MDFR_SHIFT, vim_write_character);
     bind(context, key_back, MDFR_NONE, backspace_char);
-    bind(context, 'n', MDFR_CTRL, word_complete);
+    bind(context, 'n', MDFR_CTRL, keyword_complete_next);
+    bind(context, 'p', MDFR_CTRL, keyword_complete_previous);
 
     bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
     bind(context, key_esc, MDFR_SHIFT, enter_normal_mode_on_current);
@@ -2116,10 +11322,11 @@ void vim_get_bindings(Bind_Helper* context) {
     begin_map(context, mapid_replace);
     inherit_map(context, mapid_nomap);
 
-    bind_vanilla_keys(context, replace_character);
-    bind(context, ' ', MDFR_SHIFT, write_character);
+    bind_vanilla_keys(context, vim_overwrite_character);
+    bind(context, ' ', MDFR_SHIFT, vim_overwrite_character);
     bind(context, key_back, MDFR_NONE, backspace_char);
-    bind(context, 'n', MDFR_CTRL, word_complete);
+    bind(context, 'n', MDFR_CTRL, keyword_complete_next);
+    bind(context, 'p', MDFR_CTRL, keyword_complete_previous);
 
     bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
 
@@ -2143,6 +11350,25 @@ void vim_get_bindings(Bind_Helper* context) {
     bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
     end_map(context);
 
+    // Setting and jumping to marks
+    begin_map(context, mapid_chord_mark);
+    inherit_map(context, mapid_nomap);
+    bind_vanilla_keys(context, set_vim_mark);
+    bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
+    end_map(context);
+
+    begin_map(context, mapid_chord_mark_jump);
+    inherit_map(context, mapid_nomap);
+    bind_vanilla_keys(context, jump_to_mark);
+    bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
+    end_map(context);
+
+    begin_map(context, mapid_chord_mark_jump_line);
+    inherit_map(context, mapid_nomap);
+    bind_vanilla_keys(context, jump_to_mark_line);
+    bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
+    end_map(context);
+
     // Move-find chords
     begin_map(context, mapid_chord_move_find);
     inherit_map(context, mapid_nomap);
@@ -2176,29 +11402,56 @@ void vim_get_bindings(Bind_Helper* context) {
     inherit_map(context, mapid_movements);
     bind(context, 'd', MDFR_NONE, move_line_exec_action);
     bind(context, 'c', MDFR_NONE, move_line_exec_action);
+    bind(context, 'o', MDFR_NONE, vim_diff_obtain);
+    bind(context, 'p', MDFR_NONE, vim_diff_put);
+    bind(context, 'i', MDFR_NONE, enter_chord_text_object_inner);
+    bind(context, 'a', MDFR_NONE, enter_chord_text_object_around);
     end_map(context);
 
     // yank+movement chords
     begin_map(context, mapid_chord_yank);
     inherit_map(context, mapid_movements);
     bind(context, 'y', MDFR_NONE, move_line_exec_action);
+    bind(context, 'i', MDFR_NONE, enter_chord_text_object_inner);
+    bind(context, 'a', MDFR_NONE, enter_chord_text_object_around);
     end_map(context);
 
     // indent+movement chords
     begin_map(context, mapid_chord_indent_left);
     inherit_map(context, mapid_movements);
     bind(context, '<', MDFR_NONE, move_line_exec_action);
+    bind(context, 'i', MDFR_NONE, enter_chord_text_object_inner);
+    bind(context, 'a', MDFR_NONE, enter_chord_text_object_around);
     end_map(context);
 
     begin_map(context, mapid_chord_indent_right);
     inherit_map(context, mapid_movements);
     bind(context, '>', MDFR_NONE, move_line_exec_action);
+    bind(context, 'i', MDFR_NONE, enter_chord_text_object_inner);
+    bind(context, 'a', MDFR_NONE, enter_chord_text_object_around);
     end_map(context);
 
     // format+movement chords
     begin_map(context, mapid_chord_format);
     inherit_map(context, mapid_movements);
     bind(context, '=', MDFR_NONE, move_line_exec_action);
+    bind(context, 'i', MDFR_NONE, enter_chord_text_object_inner);
+    bind(context, 'a', MDFR_NONE, enter_chord_text_object_around);
+    end_map(context);
+
+    // reflow+movement chords (gq)
+    begin_map(context, mapid_chord_reflow);
+    inherit_map(context, mapid_movements);
+    bind(context, 'q', MDFR_NONE, move_line_exec_action);
+    bind(context, 'i', MDFR_NONE, enter_chord_text_object_inner);
+    bind(context, 'a', MDFR_NONE, enter_chord_text_object_around);
+    end_map(context);
+
+    // Text object chords (the w in diw, the ( in ca()
+    begin_map(context, mapid_chord_move_in);
+    inherit_map(context, mapid_nomap);
+    bind_vanilla_keys(context, vim_select_text_object);
+    bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
     end_map(context);
 
     // Map for chords which start with the letter g
@@ -2207,12 +11460,30 @@ void vim_get_bindings(Bind_Helper* context) {
 
     bind(context, 'g', MDFR_NONE, vim_move_to_top);
     bind(context, 'f', MDFR_NONE, vim_open_file_in_quotes);
+    bind(context, 'q', MDFR_NONE, enter_chord_reflow);
+    bind(context, '*', MDFR_NONE, search_under_cursor_partial);
+    bind(context, '#', MDFR_NONE, search_under_cursor_partial_reverse);
+    bind(context, '-', MDFR_NONE, vim_undo_earlier);
+    bind(context, '+', MDFR_NONE, vim_undo_later);
 
     //TODO(chronister): Folds!
 
     bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
     end_map(context);
 
+    // Chords which start with ] or [
+    begin_map(context, mapid_chord_bracket_forward);
+    inherit_map(context, mapid_nomap);
+    bind(context, 'c', MDFR_NONE, vim_next_hunk);
+    bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
+    end_map(context);
+
+    begin_map(context, mapid_chord_bracket_backward);
+    inherit_map(context, mapid_nomap);
+    bind(context, 'c', MDFR_NONE, vim_prev_hunk);
+    bind(context, key_esc, MDFR_NONE, enter_normal_mode_on_current);
+    end_map(context);
+
     // Window navigation/manipulation chords
     begin_map(context, mapid_chord_window);
     inherit_map(context, mapid_nomap);